@@ -1,55 +1,92 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+
 #include "DSMR.h"
+#include "dsmr_internal.h"
 #include "common.h"
 #include "hash.h"
+#include "lineprotocol.h"
 
 #define DEBUG 0
 
+// Days of UTC offsets kept by convertTimestamp(), covers the 13 month history
+#define TIMESTAMP_CACHE_DAYS 512
+
+// Standard time of the meter in the embedded profile, Belgium is UTC+1
+#ifndef DSMR_UTC_OFFSET
+#define DSMR_UTC_OFFSET 3600
+#endif
+
+// Position of every OID in OIDMap and dsmr_telegram.values
+enum oid_index
+{
+    OID_TIMESTAMP,
+    OID_DEMAND_MONTH_TIMESTAMP,
+    OID_DEMAND_MONTH_VALUE,
+    OID_DELIVERED_TARIFF_1,
+    OID_DELIVERED_TARIFF_2,
+    OID_RECEIVED_TARIFF_1,
+    OID_RECEIVED_TARIFF_2,
+    OID_POWER_DELIVERED,
+    OID_POWER_RECEIVED,
+    OID_POWER_DELIVERED_L1,
+    OID_POWER_DELIVERED_L2,
+    OID_POWER_DELIVERED_L3,
+    OID_POWER_RECEIVED_L1,
+    OID_POWER_RECEIVED_L2,
+    OID_POWER_RECEIVED_L3,
+    OID_AVERAGE_DEMAND,
+    OID_DEMAND_HISTORY,
+    OID_EQUIPMENT_ID,
+    OID_COUNT,
+};
+
 struct hashkeyval OIDMap[] = {
-    {.hash = DATE_TIME_STAMP,
+    [OID_TIMESTAMP] = {.hash = DATE_TIME_STAMP,
      .name = "timestamp",
      .namelen = 9,
      .type = TIMESTAMP,
      .next = 0},
 
-    {.hash = MAXIMUM_DEMAND_RUNNING_MONTH,
+    [OID_DEMAND_MONTH_TIMESTAMP] = {.hash = MAXIMUM_DEMAND_RUNNING_MONTH,
      .name = "maximum_demand_running_month_timestamp",
      .namelen = 38,
      .type = TIMESTAMP,
-     .next = 2},
-    // WARN: Update the previous next value to this index if you're adding keys!
-    {.hash = 0, // do not care
+     .next = OID_DEMAND_MONTH_VALUE},
+    [OID_DEMAND_MONTH_VALUE] = {.hash = 0, // do not care
      .name = "maximum_demand_running_month_value",
      .namelen = 34,
      .type = DOUBLE_LONG,
      .next = 0},
 
-    {.hash = METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_1,
+    [OID_DELIVERED_TARIFF_1] = {.hash = METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_1,
      .name = "meter_electricity_delivered_to_client_tariff_1",
      .namelen = 46,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_2,
+    [OID_DELIVERED_TARIFF_2] = {.hash = METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_2,
      .name = "meter_electricity_delivered_to_client_tariff_2",
      .namelen = 46,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_1,
+    [OID_RECEIVED_TARIFF_1] = {.hash = METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_1,
      .name = "meter_electricity_delivered_by_client_tariff_1",
      .namelen = 46,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_2,
+    [OID_RECEIVED_TARIFF_2] = {.hash = METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_2,
      .name = "meter_electricity_delivered_by_client_tariff_2",
      .namelen = 46,
      .type = DOUBLE_LONG,
      .next = 0},
 
-    {.hash = ACTUAL_ELECTRICITY_POWER_DELIVERED,
+    [OID_POWER_DELIVERED] = {.hash = ACTUAL_ELECTRICITY_POWER_DELIVERED,
      .name = "actual_electricity_power_delivered",
      .namelen = 34,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = ACTUAL_ELECTRICITY_POWER_RECEIVED,
+    [OID_POWER_RECEIVED] = {.hash = ACTUAL_ELECTRICITY_POWER_RECEIVED,
      .name = "actual_electricity_power_received",
      .namelen = 33,
      .type = DOUBLE_LONG,
@@ -87,45 +124,282 @@ struct hashkeyval OIDMap[] = {
     //  .type = DOUBLE_LONG,
     //  .next = 0},
 
-    {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L1,
+    [OID_POWER_DELIVERED_L1] = {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L1,
      .name = "instantaneous_active_positive_power_L1",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L2,
+    [OID_POWER_DELIVERED_L2] = {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L2,
      .name = "instantaneous_active_positive_power_L2",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L3,
+    [OID_POWER_DELIVERED_L3] = {.hash = INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L3,
      .name = "instantaneous_active_positive_power_L3",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L1,
+    [OID_POWER_RECEIVED_L1] = {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L1,
      .name = "instantaneous_active_negative_power_L1",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L2,
+    [OID_POWER_RECEIVED_L2] = {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L2,
      .name = "instantaneous_active_negative_power_L2",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
-    {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L3,
+    [OID_POWER_RECEIVED_L3] = {.hash = INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L3,
      .name = "instantaneous_active_negative_power_L3",
      .namelen = 38,
      .type = DOUBLE_LONG,
      .next = 0},
 
+    [OID_AVERAGE_DEMAND] = {.hash = CURRENT_AVERAGE_DEMAND_ACTIVE_ENERGY_IMPORT,
+     .name = "current_average_demand_active_energy_import",
+     .namelen = 43,
+     .type = DOUBLE_LONG,
+     .next = 0},
+    // Decoded into dsmr_telegram.demandHistory, not a field
+    [OID_DEMAND_HISTORY] = {.hash = MAXIMUM_DEMAND_LAST_13_MONTHS,
+     .name = "maximum_demand_last_13_months",
+     .namelen = 29,
+     .type = DEMAND_HISTORY,
+     .next = 0},
+    // Decoded into dsmr_telegram.equipmentId, used as tag by the server
+    [OID_EQUIPMENT_ID] = {.hash = EQUIPMENT_IDENTIFIER,
+     .name = "equipment_id",
+     .namelen = 12,
+     .type = OCTET_STRING,
+     .next = 0},
 };
 
-void cpy(void *dst, void *src, int byte_count)
+#define OIDMapLen (int)(sizeof(OIDMap) / sizeof(struct hashkeyval))
+_Static_assert(OIDMapLen <= DSMR_MAX_VALUES, "OIDMap doesn't fit in dsmr_telegram");
+_Static_assert(OIDMapLen == OID_COUNT, "Every OID needs its place in OIDMap");
+
+/**
+ * OBIS keys per meter family, in the order the meter sends them:
+ * X(hash, OIDMap index or one of the OBIS_* below)
+ * Lines a family sends that OIDMap doesn't decode are OBIS_IGNORED, so
+ * its decoder drops them after a single switch. Keys missing here fall
+ * back to the generic lookup, a wrongly detected meter is only slower.
+ */
+#define OBIS_UNKNOWN -1       // Not in the table, use the generic lookup
+#define OBIS_IGNORED -2       // Sent, but nothing decodes it
+#define OBIS_GAS_NEXT_LINE -3 // 0-1:24.3.0, the gas reading is the next line
+
+#define DSMR22_KEYS(X)                                         \
+    X(EQUIPMENT_IDENTIFIER, OID_EQUIPMENT_ID)                  \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_1, OID_DELIVERED_TARIFF_1) \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_2, OID_DELIVERED_TARIFF_2) \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_1, OID_RECEIVED_TARIFF_1)  \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_2, OID_RECEIVED_TARIFF_2)  \
+    X(TARIFF_INDICATOR_ELECTRICITY, OBIS_IGNORED)              \
+    X(ACTUAL_ELECTRICITY_POWER_DELIVERED, OID_POWER_DELIVERED) \
+    X(ACTUAL_ELECTRICITY_POWER_RECEIVED, OID_POWER_RECEIVED)   \
+    X(LIMITER_THRESHOLD, OBIS_IGNORED)                         \
+    X(BREAKER_STATE, OBIS_IGNORED)                             \
+    X(TEXT_MESSAGE_CODES, OBIS_IGNORED)                        \
+    X(TEXT_MESSAGE_MAX_1024, OBIS_IGNORED)                     \
+    X(MBUS_EQUIPMENT_IDENTIFIER_DSMR22, OBIS_IGNORED)          \
+    X(MBUS_VALVE_POSITION, OBIS_IGNORED)                       \
+    X(GAS_READING_DSMR22, OBIS_GAS_NEXT_LINE)
+
+#define DSMR5_KEYS(X)                                          \
+    X(VERSION_INFORMATION, OBIS_IGNORED)                       \
+    X(DATE_TIME_STAMP, OID_TIMESTAMP)                          \
+    X(EQUIPMENT_IDENTIFIER, OID_EQUIPMENT_ID)                  \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_1, OID_DELIVERED_TARIFF_1) \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_2, OID_DELIVERED_TARIFF_2) \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_1, OID_RECEIVED_TARIFF_1)  \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_2, OID_RECEIVED_TARIFF_2)  \
+    X(TARIFF_INDICATOR_ELECTRICITY, OBIS_IGNORED)              \
+    X(ACTUAL_ELECTRICITY_POWER_DELIVERED, OID_POWER_DELIVERED) \
+    X(ACTUAL_ELECTRICITY_POWER_RECEIVED, OID_POWER_RECEIVED)   \
+    X(NUMBER_OF_POWER_FAILURES, OBIS_IGNORED)                  \
+    X(NUMBER_OF_LONG_POWER_FAILURES, OBIS_IGNORED)             \
+    X(POWER_FAILURE_EVENT_LOG, OBIS_IGNORED)                   \
+    X(VOLTAGE_SAGS_L1, OBIS_IGNORED)                           \
+    X(VOLTAGE_SAGS_L2, OBIS_IGNORED)                           \
+    X(VOLTAGE_SAGS_L3, OBIS_IGNORED)                           \
+    X(VOLTAGE_SWELLS_L1, OBIS_IGNORED)                         \
+    X(VOLTAGE_SWELLS_L2, OBIS_IGNORED)                         \
+    X(VOLTAGE_SWELLS_L3, OBIS_IGNORED)                         \
+    X(TEXT_MESSAGE_MAX_1024, OBIS_IGNORED)                     \
+    X(INSTANTANEOUS_VOLTAGE_L1, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_VOLTAGE_L2, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_VOLTAGE_L3, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L1, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L2, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L3, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L1, OID_POWER_DELIVERED_L1) \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L2, OID_POWER_DELIVERED_L2) \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L3, OID_POWER_DELIVERED_L3) \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L1, OID_POWER_RECEIVED_L1)  \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L2, OID_POWER_RECEIVED_L2)  \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L3, OID_POWER_RECEIVED_L3)  \
+    X(MBUS_EQUIPMENT_IDENTIFIER, OBIS_IGNORED)
+
+#define EMUCS_KEYS(X)                                          \
+    X(VERSION_INFORMATION_EMUCS, OBIS_IGNORED)                 \
+    X(EQUIPMENT_IDENTIFIER, OID_EQUIPMENT_ID)                  \
+    X(DATE_TIME_STAMP, OID_TIMESTAMP)                          \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_1, OID_DELIVERED_TARIFF_1) \
+    X(METER_READING_ELECTRICITY_DELIVERED_TO_CLIENT_TARIFF_2, OID_DELIVERED_TARIFF_2) \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_1, OID_RECEIVED_TARIFF_1)  \
+    X(METER_READING_ELECTRICITY_DELIVERED_BY_CLIENT_TARIFF_2, OID_RECEIVED_TARIFF_2)  \
+    X(TARIFF_INDICATOR_ELECTRICITY, OBIS_IGNORED)              \
+    X(CURRENT_AVERAGE_DEMAND_ACTIVE_ENERGY_IMPORT, OID_AVERAGE_DEMAND) \
+    X(MAXIMUM_DEMAND_RUNNING_MONTH, OID_DEMAND_MONTH_TIMESTAMP) \
+    X(MAXIMUM_DEMAND_LAST_13_MONTHS, OID_DEMAND_HISTORY)       \
+    X(ACTUAL_ELECTRICITY_POWER_DELIVERED, OID_POWER_DELIVERED) \
+    X(ACTUAL_ELECTRICITY_POWER_RECEIVED, OID_POWER_RECEIVED)   \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L1, OID_POWER_DELIVERED_L1) \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L2, OID_POWER_DELIVERED_L2) \
+    X(INSTANTANEOUS_ACTIVE_POSITIVE_POWER_L3, OID_POWER_DELIVERED_L3) \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L1, OID_POWER_RECEIVED_L1)  \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L2, OID_POWER_RECEIVED_L2)  \
+    X(INSTANTANEOUS_ACTIVE_NEGATIVE_POWER_L3, OID_POWER_RECEIVED_L3)  \
+    X(INSTANTANEOUS_VOLTAGE_L1, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_VOLTAGE_L2, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_VOLTAGE_L3, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L1, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L2, OBIS_IGNORED)                  \
+    X(INSTANTANEOUS_CURRENT_L3, OBIS_IGNORED)                  \
+    X(BREAKER_STATE, OBIS_IGNORED)                             \
+    X(LIMITER_THRESHOLD, OBIS_IGNORED)                         \
+    X(FUSE_SUPERVISION_THRESHOLD, OBIS_IGNORED)                \
+    X(TEXT_MESSAGE_MAX_1024, OBIS_IGNORED)                     \
+    X(MBUS_EQUIPMENT_IDENTIFIER, OBIS_IGNORED)                 \
+    X(MBUS_VALVE_POSITION, OBIS_IGNORED)
+
+#define OBIS_CASE(hash, index) \
+    case hash:                 \
+        return index;
+
+/**
+ * lookupVersion maps a key hash through the table of version, a switch
+ * per family so the compiler turns each into a jump table or a short
+ * compare tree
+ * @returns the OIDMap index or one of the OBIS_* markers
+ */
+static inline __attribute__((always_inline)) int lookupVersion(enum dsmr_version version, unsigned short hash)
 {
-    char *cdst = dst, *csrc = src;
+    switch (version)
+    {
+    case DSMR_VERSION_22:
+        switch (hash)
+        {
+            DSMR22_KEYS(OBIS_CASE)
+        }
+        break;
+    case DSMR_VERSION_5:
+        switch (hash)
+        {
+            DSMR5_KEYS(OBIS_CASE)
+        }
+        break;
+    case DSMR_VERSION_EMUCS:
+        switch (hash)
+        {
+            EMUCS_KEYS(OBIS_CASE)
+        }
+        break;
+    default:
+        break;
+    }
+    return OBIS_UNKNOWN;
+}
 
-    while (byte_count--)
-        *cdst++ = *csrc++;
+// Pre-rendered field keys, filled once by dsmr_init()
+static char keyArena[OIDMapLen * LP_KEY_SIZE];
+
+// Hashes of 0-n:24.1.0 and 0-n:24.2.x, [channel][0] is the device type,
+// computed by dsmr_init()
+static unsigned short mbusKeys[DSMR_MBUS_CHANNELS][1 + DSMR_MBUS_READINGS];
+
+// Stage hook of the profiling mode, a never taken branch when it's unset
+static dsmr_stage_hook stageHook;
+#define STAGE(stage, done)                           \
+    do                                               \
+    {                                                \
+        if (__builtin_expect(stageHook != NULL, 0))  \
+            stageHook(stage, done);                  \
+    } while (0)
+
+/**
+ * dsmr_set_stage_hook calls hook around every stage of decodeLine(),
+ * NULL removes it. Not thread safe, set it before decoding starts.
+ */
+void dsmr_set_stage_hook(dsmr_stage_hook hook)
+{
+    stageHook = hook;
+}
+
+// Fields written to the line protocol, one bit per OIDMap index
+static unsigned int selectedFields = ~0u;
+_Static_assert(DSMR_MAX_VALUES <= sizeof(selectedFields) * 8, "A selection bit per field");
+
+/**
+ * dsmr_select_fields limits the fields decodeLine() and dsmr_encode()
+ * write to the bits set in mask, the telegram still gets every value.
+ * Set it between telegrams.
+ */
+void dsmr_select_fields(unsigned int mask)
+{
+    selectedFields = mask;
+}
+
+/**
+ * dsmr_init renders the escaped line protocol key of every OID once
+ * @returns 1 on success, 0 if a key doesn't fit
+ */
+int dsmr_init(void)
+{
+    for (int i = 0; i < OIDMapLen; i++)
+    {
+        struct hashkeyval *kv = OIDMap + i;
+        kv->key = keyArena + i * LP_KEY_SIZE;
+
+        int length = lp_render_key(kv->key, LP_KEY_SIZE, (char *)kv->name, kv->namelen);
+        if (length == -1)
+        {
+            printError(__func__, "Key '%s' doesn't fit in %d bytes", kv->name, LP_KEY_SIZE);
+            return 0;
+        }
+        kv->keylen = length;
+    }
+
+    for (int channel = 0; channel < DSMR_MBUS_CHANNELS; channel++)
+    {
+        for (int reading = 0; reading <= DSMR_MBUS_READINGS; reading++)
+        {
+            char key[] = "0-1:24.1.0(";
+            key[2] = '1' + channel;
+            if (reading)
+            {
+                key[7] = '2';
+                key[9] = '0' + reading;
+            }
+
+            int end = -1;
+            unsigned short hash = 0;
+            decodeOBISHashKey(key, sizeof(key) - 1, &end, &hash);
+            int taken = findOBISOIDByHash(hash) != -1 || dsmr_mbus_key(hash) != -1;
+#ifndef DSMR_EMBEDDED
+            for (int version = 0; version < DSMR_VERSIONS; version++)
+                taken |= lookupVersion(version, hash) != OBIS_UNKNOWN;
+#endif
+            if (taken)
+            {
+                printError(__func__, "Hash of %.10s isn't unique", key);
+                return 0;
+            }
+            mbusKeys[channel][reading] = hash;
+        }
+    }
+    return 1;
 }
 
 /**
@@ -161,8 +435,6 @@ void decodeOBISHashKey(
  */
 int findOBISOIDByHash(unsigned short hash)
 {
-#define OIDMapLen sizeof(OIDMap) / sizeof(struct hashkeyval)
-
     for (int i = 0; i < OIDMapLen; i++)
     {
         if (OIDMap[i].hash == hash)
@@ -174,25 +446,80 @@ int findOBISOIDByHash(unsigned short hash)
 }
 
 /**
- * writeKey copies the key to dst with length length and appends =
- * @returns the offset index
+ * dsmr_field
+ * @returns the OIDMap entry of the value at index
+ */
+const struct hashkeyval *dsmr_field(int index)
+{
+    return OIDMap + index;
+}
+
+/**
+ * dsmr_field_count
+ * @returns the number of entries in OIDMap and dsmr_telegram.values used
+ */
+int dsmr_field_count(void)
+{
+    return OIDMapLen;
+}
+
+/**
+ * dsmr_field_index looks up a decoded value by its field name
+ * @returns the index into dsmr_telegram.values or -1
+ */
+int dsmr_field_index(const char *name)
+{
+    for (int i = 0; i < OIDMapLen; i++)
+    {
+        if (!strcmp((char *)OIDMap[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+/**
+ * dsmr_field_name
+ * @returns the field name of the value at index
+ */
+const char *dsmr_field_name(int index)
+{
+    return (const char *)OIDMap[index].name;
+}
+
+/**
+ * dsmr_milli scales a fixed point value to 3 decimals (kW -> W, kWh -> Wh)
  */
-int writeKey(char *dst, char *key, int length)
+long long dsmr_milli(struct dsmr_value *v)
 {
-    cpy(dst, key, length);
-    dst[length] = '=';
-    return length + 1;
+    long long value = v->value;
+    for (int d = v->decimals; d < 3; d++)
+        value *= 10;
+    for (int d = v->decimals; d > 3; d--)
+        value /= 10;
+    return value;
 }
 
 /**
- * writeValue copies the value to dst with length length and appends ,
- * @returns the offset index
+ * dsmr_telegram_reset marks every value as not present
  */
-int writeValue(char *dst, char *value, int length)
+void dsmr_telegram_reset(struct dsmr_telegram *telegram)
 {
-    cpy(dst, value, length);
-    dst[length] = ',';
-    return length + 1;
+    telegram->timestamp = 0;
+    telegram->demandHistoryCount = -1;
+    telegram->equipmentId[0] = 0;
+    telegram->equipmentIdLength = 0;
+    for (int i = 0; i < OIDMapLen; i++)
+        telegram->values[i].present = 0;
+    for (int i = 0; i < DSMR_MBUS_CHANNELS; i++)
+    {
+        struct dsmr_mbus *mbus = telegram->mbus + i;
+        mbus->deviceType = 0;
+        mbus->reading = 0;
+        mbus->captured = 0;
+        mbus->value.present = 0;
+        mbus->unit[0] = 0;
+    }
+    telegram->gasPending = 0;
 }
 
 /**
@@ -222,12 +549,278 @@ int fetchValue(COSEMType type, char *line, int lineLength, int *nextValue)
         *nextValue = characterOffset + 3;
         return characterOffset;
     }
-    if (type == BIT_STRING)
+    if (type == BIT_STRING || type == OCTET_STRING)
         return getByToken(line, lineLength, 0, ')');
 
     return 0;
 }
 
+/**
+ * dsmr_store_value converts the value digits to fixed point
+ * "000123.456" -> 123456 with 3 decimals, timestamps to Unix time
+ */
+void dsmr_store_value(struct dsmr_value *dst, COSEMType type, char *value, int length)
+{
+    if (type == TIMESTAMP)
+    {
+        dst->value = convertTimestamp(value);
+        dst->decimals = 0;
+        dst->present = 1;
+        return;
+    }
+
+    long long v = 0;
+    int decimals = -1;
+    for (int i = 0; i < length; i++)
+    {
+        if (value[i] == '.')
+            decimals = 0;
+        else if (value[i] >= '0' && value[i] <= '9')
+        {
+            v = v * 10 + (value[i] - '0');
+            if (decimals >= 0)
+                decimals++;
+        }
+    }
+    dst->value = value[0] == '-' ? -v : v;
+    dst->decimals = decimals < 0 ? 0 : decimals;
+    dst->present = 1;
+}
+
+/**
+ * storeOctetString decodes the hex encoded string, "3153" -> "1S"
+ */
+static void storeOctetString(struct dsmr_telegram *telegram, char *value, int length)
+{
+    int n = 0;
+    for (int i = 0; i + 1 < length && n < DSMR_EQUIPMENT_ID_SIZE - 1; i += 2)
+    {
+        int c = 0;
+        for (int j = 0; j < 2; j++)
+        {
+            char h = value[i + j];
+            c = c * 16 + (h >= 'A' ? (h | 0x20) - 'a' + 10 : h - '0');
+        }
+        // Only printable characters end up in a tag
+        if (c > ' ' && c < 0x7f)
+            telegram->equipmentId[n++] = c;
+    }
+    telegram->equipmentId[n] = 0;
+    telegram->equipmentIdLength = n;
+}
+
+/**
+ * dsmr_mbus_key looks up an M-Bus key by its hash, keys that aren't in
+ * OIDMap are tried here
+ * @returns channel * 16 + x for 0-n:24.2.x (x = 0 for 0-n:24.1.0) with
+ *  channel 0 for 0-1, or -1
+ */
+int dsmr_mbus_key(unsigned short hash)
+{
+    for (int channel = 0; channel < DSMR_MBUS_CHANNELS; channel++)
+    {
+        for (int reading = 0; reading <= DSMR_MBUS_READINGS; reading++)
+        {
+            if (mbusKeys[channel][reading] == hash)
+                return channel * 16 + reading;
+        }
+    }
+    return -1;
+}
+
+/**
+ * dsmr_store_mbus stores group number group of an M-Bus line, the
+ * contents between its parentheses
+ * @returns 1 when another group follows
+ */
+int dsmr_store_mbus(struct dsmr_telegram *telegram, int key, int group, char *value, int length)
+{
+    struct dsmr_mbus *mbus = telegram->mbus + key / 16;
+    int reading = key % 16;
+
+    if (reading == 0)
+    {
+        // 0-n:24.1.0(003)
+        int deviceType = 0;
+        for (int i = 0; i < length && value[i] >= '0' && value[i] <= '9'; i++)
+            deviceType = deviceType * 10 + (value[i] - '0');
+        mbus->deviceType = deviceType;
+        return 0;
+    }
+    if (group == 0)
+    {
+        // (TST), an unread channel sends (000101000000W) or ()
+        mbus->captured = length >= 12 ? convertTimestamp(value) : 0;
+        return mbus->captured > 0;
+    }
+
+    // (00123.456*m3)
+    int digits = getByToken(value, length, 0, '*');
+    dsmr_store_value(&mbus->value, DOUBLE_LONG, value, digits);
+    int unit = length - digits - 1;
+    if (unit < 0)
+        unit = 0;
+    if (unit > DSMR_MBUS_UNIT_SIZE - 1)
+        unit = DSMR_MBUS_UNIT_SIZE - 1;
+    memcpy(mbus->unit, value + digits + 1, unit);
+    mbus->unit[unit] = 0;
+    mbus->reading = reading;
+    return 0;
+}
+
+/**
+ * dsmr_mbus_medium names the M-Bus device type of 0-n:24.1.0 (EN 13757-3)
+ * @returns "gas", "water", ... or "mbus" for anything else
+ */
+const char *dsmr_mbus_medium(int deviceType)
+{
+    switch (deviceType)
+    {
+    case 3:
+        return "gas";
+    case 4:
+    case 12:
+        return "heat";
+    case 6:
+        return "hot_water";
+    case 7:
+        return "water";
+    case 10:
+    case 11:
+        return "cooling";
+    default:
+        return "mbus";
+    }
+}
+
+/**
+ * nextGroup finds the next (...) group starting at offset
+ * @returns the offset of the first character inside the group or -1
+ *  and sets *length to the length of its contents
+ */
+static int nextGroup(char *line, int lineLength, int offset, int *length)
+{
+    int open = getByToken(line, lineLength, offset, '(');
+    int close = getByToken(line, lineLength, open, ')');
+    if (close >= lineLength)
+        return -1;
+    *length = close - open - 1;
+    return open + 1;
+}
+
+/**
+ * decodeDemandHistory decodes the 0-0:98.1.0 buffer
+ * (n)(1-0:1.6.0)(1-0:1.6.0)(TST)(TST)(F5(3,3)*kW) ... n times
+ * @returns the number of months decoded
+ */
+static int decodeDemandHistory(struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    int length;
+    int offset = nextGroup(line, lineLength, 0, &length);
+    if (offset == -1)
+        return 0;
+
+    int count = 0;
+    for (int i = 0; i < length; i++)
+        count = count * 10 + (line[offset + i] - '0');
+    if (count > DSMR_DEMAND_HISTORY_SIZE)
+        count = DSMR_DEMAND_HISTORY_SIZE;
+
+    // Skip the two captured object definitions
+    for (int i = 0; i < 2 && offset != -1; i++)
+        offset = nextGroup(line, lineLength, offset + length, &length);
+
+    int months = 0;
+    for (; months < count && offset != -1; months++)
+    {
+        struct dsmr_demand_month *month = telegram->demandHistory + months;
+        struct dsmr_value value;
+
+        offset = nextGroup(line, lineLength, offset + length, &length);
+        if (offset == -1 || length < 12)
+            break;
+        month->period = convertTimestamp(line + offset);
+
+        offset = nextGroup(line, lineLength, offset + length, &length);
+        if (offset == -1 || length < 12)
+            break;
+        month->peak = convertTimestamp(line + offset);
+
+        offset = nextGroup(line, lineLength, offset + length, &length);
+        if (offset == -1)
+            break;
+        dsmr_store_value(&value, DOUBLE_LONG, line + offset, getByToken(line + offset, length, 0, '*'));
+        // Always 3 decimals, but scale to be sure
+        for (int d = value.decimals; d < 3; d++)
+            value.value *= 10;
+        month->value = value.value;
+    }
+
+    telegram->demandHistoryCount = months;
+    return months;
+}
+
+/**
+ * decodeMBus decodes the groups of an M-Bus line into telegram->mbus
+ * @returns 1 when the line held a value
+ */
+static int decodeMBus(struct dsmr_telegram *telegram, int key, char *line, int lineLength)
+{
+    int length = 0;
+    int offset = nextGroup(line, lineLength, 0, &length);
+    for (int group = 0; offset != -1; group++)
+    {
+        if (!dsmr_store_mbus(telegram, key, group, line + offset, length))
+            break;
+        offset = nextGroup(line, lineLength, offset + length, &length);
+    }
+    return telegram->mbus[key / 16].reading == key % 16 && key % 16 != 0;
+}
+
+/**
+ * decodeGasCapture takes 0-1:24.3.0 of DSMR 2.2 and 3
+ * (TST)(00)(60)(1)(0-1:24.2.1)(m3), the reading follows on the next line
+ */
+static void decodeGasCapture(struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    struct dsmr_mbus *mbus = telegram->mbus;
+    int length = 0;
+    int offset = nextGroup(line, lineLength, 0, &length);
+    if (offset == -1)
+        return;
+    mbus->captured = length >= 12 ? convertTimestamp(line + offset) : 0;
+
+    // The unit is the last group
+    for (int group = 1; group < 6 && offset != -1; group++)
+        offset = nextGroup(line, lineLength, offset + length, &length);
+    if (offset == -1)
+        return;
+    if (length > DSMR_MBUS_UNIT_SIZE - 1)
+        length = DSMR_MBUS_UNIT_SIZE - 1;
+    memcpy(mbus->unit, line + offset, length);
+    mbus->unit[length] = 0;
+
+    // 0-1:24.3.0 only exists for gas
+    mbus->deviceType = 3;
+    telegram->gasPending = mbus->captured > 0;
+}
+
+/**
+ * decodeGasValue takes the (00123.456) line after 0-1:24.3.0
+ * @returns 1 when it held a value
+ */
+static int decodeGasValue(struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    int length = 0;
+    int offset = nextGroup(line, lineLength, 0, &length);
+    if (offset == -1 || length == 0)
+        return 0;
+    struct dsmr_mbus *mbus = telegram->mbus;
+    dsmr_store_value(&mbus->value, DOUBLE_LONG, line + offset, length);
+    mbus->reading = 1;
+    return 1;
+}
+
 /**
  * processLine parses a given line from DSMR Serial TTY and fills the
  * given DSMR_T
@@ -243,13 +836,31 @@ int fetchValue(COSEMType type, char *line, int lineLength, int *nextValue)
  *  in the data message from / to ! using polynomial,
  *  computed with least significant bit first,
  *  result is a 4 hexadecimal character (MSB first)
- * @returns offset of dstLineBuffer
+ *
+ * Values are stored as fixed point in telegram and, when enc isn't NULL,
+ * appended as fields to enc. The telegram timestamp (0-0:1.0.0) is only
+ * stored in telegram->timestamp.
+ *
+ * Inlined once per meter family with version a constant, so each copy
+ * only has its own table and branches.
+ * @returns the number of values decoded
  */
-int decodeLine(char *dstLineBuffer, char *line, int lineLength)
+static inline __attribute__((always_inline)) int decodeWith(
+    enum dsmr_version version, struct lp_encoder *enc, struct dsmr_telegram *telegram,
+    char *line, int lineLength)
 {
+    if (version == DSMR_VERSION_22 && telegram->gasPending)
+    {
+        telegram->gasPending = 0;
+        if (line[0] == '(')
+            return decodeGasValue(telegram, line, lineLength);
+    }
+
     int OIDLength = -1;
     unsigned short keyHash = 0;
+    STAGE(DSMR_STAGE_KEY, 0);
     decodeOBISHashKey(line, lineLength, &OIDLength, &keyHash);
+    STAGE(DSMR_STAGE_KEY, 1);
     if (OIDLength == -1)
     {
 #if DEBUG
@@ -267,17 +878,44 @@ int decodeLine(char *dstLineBuffer, char *line, int lineLength)
 #endif
 
     // Index in hashMap
-    int kvIndex = findOBISOIDByHash(keyHash);
-    if (kvIndex == -1)
+    STAGE(DSMR_STAGE_LOOKUP, 0);
+    int kvIndex = lookupVersion(version, keyHash);
+    if (kvIndex == OBIS_UNKNOWN)
+        kvIndex = findOBISOIDByHash(keyHash);
+    int mbusKey = kvIndex == OBIS_UNKNOWN ? dsmr_mbus_key(keyHash) : -1;
+    STAGE(DSMR_STAGE_LOOKUP, 1);
+    if (version == DSMR_VERSION_22 && kvIndex == OBIS_GAS_NEXT_LINE)
     {
+        STAGE(DSMR_STAGE_VALUE, 0);
+        decodeGasCapture(telegram, line + OIDLength + 1, lineLength - OIDLength - 1);
+        STAGE(DSMR_STAGE_VALUE, 1);
         return 0;
     }
+    if (mbusKey != -1)
+    {
+        STAGE(DSMR_STAGE_VALUE, 0);
+        int decoded = decodeMBus(telegram, mbusKey, line + OIDLength + 1, lineLength - OIDLength - 1);
+        STAGE(DSMR_STAGE_VALUE, 1);
+        return decoded;
+    }
+    if (kvIndex < 0)
+    {
+        return 0;
+    }
+
+    if (OIDMap[kvIndex].type == DEMAND_HISTORY)
+    {
+        STAGE(DSMR_STAGE_VALUE, 0);
+        int months = decodeDemandHistory(telegram, line + OIDLength + 1, lineLength - OIDLength - 1);
+        STAGE(DSMR_STAGE_VALUE, 1);
+        return months;
+    }
 
     // Pointer moved across the line
     char *remainingLine = line;
 
-    // outputOffset is the offset on 'dstLinebuffer'
-    int outputOffset = 0;
+    // Number of values decoded
+    int fields = 0;
 
     // valueLength is the string length of the value
     int valueLength = 0;
@@ -297,24 +935,325 @@ int decodeLine(char *dstLineBuffer, char *line, int lineLength)
         remainingLine += nextValueOffset;
 
         // the value
+        STAGE(DSMR_STAGE_VALUE, 0);
         valueLength = fetchValue(
-            kv->type,                     // can get changed when there's a second value
-            remainingLine,                // Pointer to first character of value
-            lineLength - nextValueOffset, // Calculate remaining length based on pointer offset
+            kv->type,                              // can get changed when there's a second value
+            remainingLine,                         // Pointer to first character of value
+            lineLength - (remainingLine - line),   // Remaining length based on pointer offset
             &nextValueOffset);
         if (valueLength == 0)
         {
+            STAGE(DSMR_STAGE_VALUE, 1);
             break;
         }
-        outputOffset += writeKey(dstLineBuffer + outputOffset, kv->name, kv->namelen);
-        outputOffset += writeValue(dstLineBuffer + outputOffset, remainingLine, valueLength);
+
+        int isField = 0;
+        if (kv->hash == DATE_TIME_STAMP)
+        {
+            telegram->timestamp = convertTimestamp(remainingLine);
+        }
+        else if (kv->type == OCTET_STRING)
+        {
+            storeOctetString(telegram, remainingLine, valueLength);
+        }
+        else
+        {
+            dsmr_store_value(telegram->values + kvIndex, kv->type, remainingLine, valueLength);
+            isField = 1;
+            fields++;
+        }
+        STAGE(DSMR_STAGE_VALUE, 1);
+
+        if (isField && enc != NULL && (selectedFields >> kvIndex & 1))
+        {
+            STAGE(DSMR_STAGE_ENCODE, 0);
+            lp_field(enc, kv->key, kv->keylen, remainingLine, valueLength);
+            STAGE(DSMR_STAGE_ENCODE, 1);
+        }
 
         if (!kv->next)
             break;
 
         // Point to the next one to decode that value
         kvIndex = kv->next;
-    } while (nextValueOffset < lineLength);
+    } while (remainingLine - line + nextValueOffset < lineLength);
+
+    return fields;
+}
+
+/**
+ * decodeLine decodes a line of any meter, see dsmr_decoder_for() for
+ * the specialised ones
+ */
+int decodeLine(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    return decodeWith(DSMR_VERSION_GENERIC, enc, telegram, line, lineLength);
+}
+
+#ifndef DSMR_EMBEDDED
+// One copy per family, the embedded profile keeps only the generic one
+static int decodeLineDSMR22(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    return decodeWith(DSMR_VERSION_22, enc, telegram, line, lineLength);
+}
+
+static int decodeLineDSMR5(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    return decodeWith(DSMR_VERSION_5, enc, telegram, line, lineLength);
+}
+
+static int decodeLineEMUCS(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength)
+{
+    return decodeWith(DSMR_VERSION_EMUCS, enc, telegram, line, lineLength);
+}
+#endif
+
+/**
+ * dsmr_detect_version tells the meter family from the identification
+ * line, /XXX5... with XXX the manufacturer. Only DSMR 2.2 and 3 talk at
+ * 9600 baud; every Fluvius meter identifies as /FLU.
+ * @param slowLink when the port had to be set to 9600 7E1
+ * @returns the family or DSMR_VERSION_GENERIC when header isn't one
+ */
+enum dsmr_version dsmr_detect_version(const char *header, int length, int slowLink)
+{
+    if (length < 5 || header[0] != '/' || header[4] < '0' || header[4] > '9')
+        return DSMR_VERSION_GENERIC;
+    if (slowLink)
+        return DSMR_VERSION_22;
+    if (!memcmp(header + 1, "FLU", 3))
+        return DSMR_VERSION_EMUCS;
+    return DSMR_VERSION_5;
+}
+
+/**
+ * dsmr_decoder_for
+ * @returns the decodeLine() specialised for version
+ */
+dsmr_decoder dsmr_decoder_for(enum dsmr_version version)
+{
+    switch (version)
+    {
+#ifndef DSMR_EMBEDDED
+    case DSMR_VERSION_22:
+        return decodeLineDSMR22;
+    case DSMR_VERSION_5:
+        return decodeLineDSMR5;
+    case DSMR_VERSION_EMUCS:
+        return decodeLineEMUCS;
+#endif
+    default:
+        return decodeLine;
+    }
+}
+
+const char *dsmr_version_name(enum dsmr_version version)
+{
+    switch (version)
+    {
+    case DSMR_VERSION_22:
+        return "DSMR 2.2/3";
+    case DSMR_VERSION_5:
+        return "DSMR 4/5";
+    case DSMR_VERSION_EMUCS:
+        return "e-MUCS";
+    default:
+        return "generic";
+    }
+}
 
-    return outputOffset;
+/**
+ * renderTimestamp writes Unix time t back as the meter's YYMMDDhhmmss
+ * digits, the way decodeLine() passes timestamps on
+ */
+static void renderTimestamp(char *dst, time_t t)
+{
+    struct tm tm;
+#ifdef DSMR_EMBEDDED
+    // No zone database and no gmtime_r(): winter time, the inverse of
+    // daysFromCivil() for the date
+    t += DSMR_UTC_OFFSET;
+    long z = t / 86400 + 719468; // Days since 0000-03-01, never negative
+    long seconds = t % 86400;
+    long era = z / 146097;
+    int doe = z - era * 146097;
+    int yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    int doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    int mp = (5 * doy + 2) / 153;
+    tm.tm_mday = doy - (153 * mp + 2) / 5 + 1;
+    tm.tm_mon = (mp < 10 ? mp + 3 : mp - 9) - 1;
+    tm.tm_year = yoe + era * 400 + (tm.tm_mon < 2) - 1900;
+    tm.tm_hour = seconds / 3600;
+    tm.tm_min = seconds / 60 % 60;
+    tm.tm_sec = seconds % 60;
+#else
+    localtime_r(&t, &tm);
+#endif
+    int parts[6] = {tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec};
+    for (int i = 0; i < 6; i++)
+    {
+        dst[i * 2] = '0' + parts[i] / 10;
+        dst[i * 2 + 1] = '0' + parts[i] % 10;
+    }
 }
+
+/**
+ * dsmr_encode appends every value present in telegram as a field to enc,
+ * for when the telegram is decoded before the line can be started.
+ * Fields come out like decodeLine() writes them, timestamps included.
+ * @returns the number of fields written
+ */
+int dsmr_encode(struct lp_encoder *enc, struct dsmr_telegram *telegram)
+{
+    int fields = 0;
+    for (int i = 0; i < OIDMapLen; i++)
+    {
+        struct hashkeyval *kv = OIDMap + i;
+        struct dsmr_value *v = telegram->values + i;
+        if (!v->present || kv->type == DEMAND_HISTORY || kv->type == OCTET_STRING ||
+            !(selectedFields >> i & 1))
+            continue;
+
+        if (kv->type == TIMESTAMP)
+        {
+            char digits[12];
+            renderTimestamp(digits, v->value);
+            if (!lp_field(enc, kv->key, kv->keylen, digits, sizeof(digits)))
+                break;
+        }
+        else if (!lp_field_fixed(enc, kv->key, kv->keylen, v->value, v->decimals))
+            break;
+        fields++;
+    }
+    return fields;
+}
+
+/**
+ * twoDigits converts two ASCII digits to their value
+ */
+static inline int twoDigits(const char *s)
+{
+    return (s[0] - '0') * 10 + (s[1] - '0');
+}
+
+/**
+ * timestampDigits checks that YYMMDDhhmmss are all digits, a corrupted
+ * line must not turn into a negative date
+ */
+static inline int timestampDigits(const char *ts)
+{
+    for (int i = 0; i < 12; i++)
+    {
+        if (ts[i] < '0' || ts[i] > '9')
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * daysFromCivil
+ * @returns the number of days between 1970-01-01 and the given date
+ */
+static long daysFromCivil(int year, int month, int day)
+{
+    year -= month <= 2;
+    long era = year / 400; // Years are 2000..2099, never negative
+    int yoe = year - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+#ifdef DSMR_EMBEDDED
+/**
+ * Converts meter timestamp YYMMDDhhmmssX to Unix timestamp without a zone
+ * database: the meter tells summer (S) or winter (W) time itself
+ */
+time_t convertTimestamp(char *ts)
+{
+    if (!timestampDigits(ts))
+        return 0;
+    int month = twoDigits(ts + 2);
+    int day = twoDigits(ts + 4);
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return 0;
+
+    long offset = DSMR_UTC_OFFSET + (ts[12] == 'S' ? 3600 : 0);
+    return daysFromCivil(twoDigits(ts) + 2000, month, day) * 86400 +
+           twoDigits(ts + 6) * 3600 + twoDigits(ts + 8) * 60 + twoDigits(ts + 10) - offset;
+}
+#else
+/**
+ * localOffset finds the UTC offset mktime() applies on the given day
+ * @returns the offset in seconds or TIMESTAMP_ZONE_CHANGE on a day the
+ *  offset changes
+ */
+#define TIMESTAMP_ZONE_CHANGE LONG_MIN
+static long localOffset(struct tm *t)
+{
+    struct tm midnight = *t, late = *t;
+    midnight.tm_hour = 0;
+    midnight.tm_min = midnight.tm_sec = 0;
+    late.tm_hour = 23;
+    late.tm_min = late.tm_sec = 0;
+    late.tm_isdst = midnight.tm_isdst = t->tm_isdst;
+
+    long day = daysFromCivil(t->tm_year + 1900, t->tm_mon + 1, t->tm_mday) * 86400;
+    long start = day - mktime(&midnight);
+    long end = day + 23 * 3600 - mktime(&late);
+    return start == end ? start : TIMESTAMP_ZONE_CHANGE;
+}
+
+/**
+ * Converts meter timestamp YYMMDDhhmmssX to Unix timestamp
+ * ts points to the first digit of the year. X tells summer (S) or winter
+ * (W) time, like the embedded profile; it settles the hour that repeats
+ * when the clocks go back. Without it mktime() guesses.
+ * //250914143330S
+ * //25Y 09M 14d 14h 33m 30s
+ */
+time_t convertTimestamp(char *ts)
+{
+    if (!timestampDigits(ts))
+        return 0;
+
+    struct tm t = {
+        .tm_year = twoDigits(ts) + 2000 - 1900, // Convert year to 2000s
+        .tm_mon = twoDigits(ts + 2) - 1,
+        .tm_mday = twoDigits(ts + 4),
+        .tm_hour = twoDigits(ts + 6),
+        .tm_min = twoDigits(ts + 8),
+        .tm_sec = twoDigits(ts + 10),
+        .tm_isdst = ts[12] == 'S' ? 1 : ts[12] == 'W' ? 0 : -1,
+    };
+#if DEBUG
+    printLog(__func__, "Year %d\tMonth %d\tDay %d\n", t.tm_year, t.tm_mon, t.tm_mday);
+    printLog(__func__, "Hour %d\tMinute %d\tSecond %d\n", t.tm_hour, t.tm_min, t.tm_sec);
+#endif
+
+    // mktime() locks and rereads the zone rules on every call. A telegram
+    // has ~30 timestamps, so resolve each day's offset once per thread.
+    static __thread struct
+    {
+        long day; // Days since 1970 + 1, 0 when empty
+        int isdst;
+        long offset;
+    } days[TIMESTAMP_CACHE_DAYS];
+
+    long day = daysFromCivil(t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
+    if (t.tm_mon < 0 || t.tm_mon > 11 || t.tm_mday < 1 || t.tm_mday > 31)
+        return mktime(&t);
+
+    typeof(days[0]) *entry = days + (unsigned long)day % TIMESTAMP_CACHE_DAYS;
+    if (entry->day != day + 1 || entry->isdst != t.tm_isdst)
+    {
+        entry->day = day + 1;
+        entry->isdst = t.tm_isdst;
+        entry->offset = localOffset(&t);
+    }
+    if (entry->offset == TIMESTAMP_ZONE_CHANGE)
+        return mktime(&t);
+
+    return day * 86400 + t.tm_hour * 3600 + t.tm_min * 60 + t.tm_sec - entry->offset;
+}
+#endif
@@ -55,9 +55,11 @@ typedef enum
 {
     BIT_STRING = 4,
     DOUBLE_LONG = 5,
+    OCTET_STRING = 9, // Hex encoded, decoded into the telegram only
     BIT_STRING_DOUBLE = 25,
     TIMESTAMP = 26,
     TIMESTAMP_DOUBLE = 27,
+    DEMAND_HISTORY = 28, // (n)(OBIS)(OBIS) followed by n times (TST)(TST)(F5(3,3))
 } COSEMType;
 
 /**
@@ -91,6 +93,25 @@ typedef enum
     MAXIMUM_DEMAND_RUNNING_MONTH = 22336,                           // "1-0:1.6.0"  // (TST)(F5(3,3)) Unit kW
     MAXIMUM_DEMAND_LAST_13_MONTHS = 9914,                           // "0-0:98.1.0" // (TST)(F5(3,3)) Unit kW
     TEXT_MESSAGE_MAX_1024 = 27394,                                  // "0-0:96.13.0"// Sn (n=0..2048)
+    TEXT_MESSAGE_CODES = 27395,                                     // "0-0:96.13.1" // Sn (DSMR 2.2 and 3)
+    VERSION_INFORMATION = 15384,                                    // "1-3:0.2.8" // S2 (DSMR 4 and 5)
+    VERSION_INFORMATION_EMUCS = 3870,                               // "0-0:96.1.4" // S5 (e-MUCS)
+    BREAKER_STATE = 25474,                                          // "0-0:96.3.10" // I1
+    LIMITER_THRESHOLD = 62242,                                      // "0-0:17.0.0" // F4(1,1) Unit kW
+    FUSE_SUPERVISION_THRESHOLD = 44482,                             // "1-0:31.4.0" // F3(0,0) Unit A
+    NUMBER_OF_POWER_FAILURES = 22585,                               // "0-0:96.7.21" // F5(0,0)
+    NUMBER_OF_LONG_POWER_FAILURES = 4307,                           // "0-0:96.7.9" // F5(0,0)
+    POWER_FAILURE_EVENT_LOG = 21130,                                // "1-0:99.97.0" // Buffer
+    VOLTAGE_SAGS_L1 = 50376,                                        // "1-0:32.32.0" // F5(0,0)
+    VOLTAGE_SAGS_L2 = 25096,                                        // "1-0:52.32.0" // F5(0,0)
+    VOLTAGE_SAGS_L3 = 65352,                                        // "1-0:72.32.0" // F5(0,0)
+    VOLTAGE_SWELLS_L1 = 50736,                                      // "1-0:32.36.0" // F5(0,0)
+    VOLTAGE_SWELLS_L2 = 25456,                                      // "1-0:52.36.0" // F5(0,0)
+    VOLTAGE_SWELLS_L3 = 176,                                        // "1-0:72.36.0" // F5(0,0)
+    MBUS_EQUIPMENT_IDENTIFIER = 19035,                              // "0-1:96.1.1" // Sn (n=0..96)
+    MBUS_EQUIPMENT_IDENTIFIER_DSMR22 = 19034,                       // "0-1:96.1.0" // Sn (n=0..96)
+    MBUS_VALVE_POSITION = 53506,                                    // "0-1:24.4.0" // I1
+    GAS_READING_DSMR22 = 53434,                                     // "0-1:24.3.0" // (TST)(..)(..)(..)(OBIS)(unit) and the value on the next line
 } OIDHashes;
 
 /**
@@ -103,6 +124,10 @@ typedef struct hashkeyval
     unsigned char *name;
     unsigned int namelen;
 
+    // Escaped "name=" rendered once by dsmr_init()
+    char *key;
+    unsigned char keylen;
+
     COSEMType type;
     // unsigned char digitWidth; // Total number of digits
     // unsigned char digitPoint; // number of digits after decimal point
@@ -111,6 +136,101 @@ typedef struct hashkeyval
     // void (*handler)(char *line, int lineLength);
 } hashkeyval_t;
 
-int decodeLine(char *, char *, int);
+#include <time.h>
+#include "lineprotocol.h"
+
+#define DSMR_MAX_VALUES 32
+#define DSMR_DEMAND_HISTORY_SIZE 13
+#define DSMR_EQUIPMENT_ID_SIZE 49 // 96 hex digits decode to 48 characters
+#define DSMR_MBUS_CHANNELS 4       // M-Bus channels 0-1 .. 0-4
+#define DSMR_MBUS_READINGS 9       // x of 0-n:24.2.x
+#define DSMR_MBUS_UNIT_SIZE 4
+
+/**
+ * Decoded value in fixed point: value / 10^decimals
+ * Timestamps are stored as Unix time with 0 decimals
+ */
+struct dsmr_value
+{
+    long long value;
+    unsigned char decimals;
+    unsigned char present; // Set when decoded in the current telegram
+};
+
+/**
+ * One month of 0-0:98.1.0, the maximum demand of the last 13 months
+ */
+struct dsmr_demand_month
+{
+    time_t period; // Start of the month the peak belongs to
+    time_t peak;   // When the 15 minute peak occurred
+    long long value; // kW with 3 decimals
+};
+
+/**
+ * Sub-meter on an M-Bus channel (gas, water, heat)
+ * 0-n:24.1.0(003)
+ * 0-n:24.2.x(TST)(00123.456*m3)
+ * The meter reads it every few minutes, captured tells when: the value
+ * only changes when captured does.
+ */
+struct dsmr_mbus
+{
+    unsigned char deviceType; // 0-n:24.1.0, 0 when absent
+    unsigned char reading;    // x of 0-n:24.2.x, 0 when absent
+    time_t captured;          // Capture time of value
+    struct dsmr_value value;
+    char unit[DSMR_MBUS_UNIT_SIZE]; // "m3", "GJ", empty when absent
+};
+
+/**
+ * Typed telegram, values are indexed like OIDMap
+ * Use dsmr_field_index() to find a value by its field name
+ */
+struct dsmr_telegram
+{
+    time_t timestamp; // 0-0:1.0.0
+    struct dsmr_value values[DSMR_MAX_VALUES];
+
+    char equipmentId[DSMR_EQUIPMENT_ID_SIZE]; // 0-0:96.1.1, empty when absent
+    int equipmentIdLength;
+
+    int demandHistoryCount; // -1 when 0-0:98.1.0 wasn't in the telegram
+    struct dsmr_demand_month demandHistory[DSMR_DEMAND_HISTORY_SIZE];
+
+    struct dsmr_mbus mbus[DSMR_MBUS_CHANNELS]; // Channel n at n - 1
+    int gasPending; // 0-1:24.3.0 seen, its value is the next line (DSMR 2.2)
+};
+
+/**
+ * Meter families, each with its own decoder, see dsmr_detect_version()
+ */
+enum dsmr_version
+{
+    DSMR_VERSION_GENERIC, // Anything, decodeLine()
+    DSMR_VERSION_22,      // DSMR 2.2 and 3, 9600 7E1
+    DSMR_VERSION_5,       // DSMR 4 and 5 (Netherlands), 115200 8N1
+    DSMR_VERSION_EMUCS,   // Fluvius e-MUCS (Belgium), 115200 8N1
+    DSMR_VERSIONS,
+};
+typedef int (*dsmr_decoder)(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength);
+
+int dsmr_init(void);
+void dsmr_select_fields(unsigned int mask);
+void decodeOBISHashKey(char *line, int lineLength, int *OIDIndexEnd, unsigned short *OIDKeyHash);
+int findOBISOIDByHash(unsigned short hash);
+const struct hashkeyval *dsmr_field(int index);
+int dsmr_field_count(void);
+int dsmr_field_index(const char *name);
+const char *dsmr_field_name(int index);
+long long dsmr_milli(struct dsmr_value *v);
+void dsmr_telegram_reset(struct dsmr_telegram *telegram);
+const char *dsmr_mbus_medium(int deviceType);
+int decodeLine(struct lp_encoder *enc, struct dsmr_telegram *telegram, char *line, int lineLength);
+enum dsmr_version dsmr_detect_version(const char *header, int length, int slowLink);
+dsmr_decoder dsmr_decoder_for(enum dsmr_version version);
+const char *dsmr_version_name(enum dsmr_version version);
+int dsmr_encode(struct lp_encoder *enc, struct dsmr_telegram *telegram);
+time_t convertTimestamp(char *ts);
 
 #endif
\ No newline at end of file
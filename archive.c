@@ -0,0 +1,609 @@
+/**
+ * archive.c - Append-only archive of the raw telegrams, see archive.h
+ *
+ * Blocks are committed with one pwrite() and one fdatasync() of the
+ * segment, then their index entry is appended and synced: a block is
+ * either complete and indexed or cut off at startup, the index never
+ * points past the data. An SD card sees two small syncs per
+ * ARCHIVE_COMMIT_SECONDS instead of a write per telegram. On io_uring the
+ * four are one linked chain that goes out with the next serial read, the
+ * loop doesn't wait for the card.
+ */
+#define _GNU_SOURCE // memrchr
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef DSMR_ZLIB
+#include <zlib.h>
+#endif
+
+#include "common.h"
+#include "crc16.h"
+#include "archive.h"
+#include "ioloop.h"
+
+#define ARCHIVE_HEADER 16 // Block header
+#define ARCHIVE_RECORD 12 // Record header
+#define ARCHIVE_ENTRY 24  // Index entry
+#define ARCHIVE_ZLIB 1    // Block flag
+
+static void put32(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static void put64(unsigned char *p, int64_t v)
+{
+    for (int i = 0; i < 8; i++)
+        p[i] = (uint64_t)v >> (8 * i);
+}
+
+static uint32_t get32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int64_t get64(const unsigned char *p)
+{
+    return get32(p) | (uint64_t)get32(p + 4) << 32;
+}
+
+/**
+ * validCRC checks the CRC16 of a complete raw telegram
+ * DSMR 2.2 meters send a bare '!', those telegrams are accepted
+ */
+static int validCRC(const char *telegram, int length)
+{
+    if (length < 3 || telegram[0] != '/')
+        return 0;
+    // The '!' line is the last one
+    const char *bang = memrchr(telegram, '!', length);
+    if (bang == NULL)
+        return 0;
+
+    const char *end = telegram + length;
+    int digits = 0;
+    unsigned int sent = 0;
+    for (const char *p = bang + 1; p < end && *p != '\r' && *p != '\n'; p++, digits++)
+    {
+        char c = *p | 0x20;
+        if (c >= '0' && c <= '9')
+            sent = sent << 4 | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            sent = sent << 4 | (c - 'a' + 10);
+        else
+            return 0;
+    }
+    if (digits == 0)
+        return 1;
+    return digits == 4 && sent == crc16(0, telegram, bang + 1 - telegram);
+}
+
+/**
+ * dayOf
+ * @returns the local day of timestamp as yyyymmdd
+ */
+static int dayOf(time_t timestamp)
+{
+    struct tm tm;
+    localtime_r(&timestamp, &tm);
+    return (tm.tm_year + 1900) * 10000 + (tm.tm_mon + 1) * 100 + tm.tm_mday;
+}
+
+static int openFile(const char *dir, int day, const char *extension, int flags)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%04d-%02d-%02d.%s", dir, day / 10000, day / 100 % 100, day % 100,
+             extension);
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd == -1 && (errno != ENOENT || (flags & O_CREAT)))
+        printErrno(__func__, "Can't open %s", path);
+    return fd;
+}
+
+/**
+ * recoverSegment cuts off what a crash left behind: a torn index entry or
+ * a block that never got its index entry
+ * @returns the size of the segment or -1 on error
+ */
+static int64_t recoverSegment(int segment, int index)
+{
+    struct stat segmentStat, indexStat;
+    if (fstat(segment, &segmentStat) == -1 || fstat(index, &indexStat) == -1)
+        return -1;
+
+    int64_t entries = indexStat.st_size / ARCHIVE_ENTRY;
+    int64_t end = 0;
+    while (entries > 0)
+    {
+        unsigned char entry[ARCHIVE_ENTRY];
+        if (pread(index, entry, sizeof(entry), (entries - 1) * ARCHIVE_ENTRY) != sizeof(entry))
+            return -1;
+        end = get64(entry + 8) + get32(entry + 16);
+        if (end <= segmentStat.st_size)
+            break;
+        end = 0;
+        entries--;
+    }
+
+    if (entries * ARCHIVE_ENTRY != indexStat.st_size || end != segmentStat.st_size)
+    {
+        printWarning(__func__, "Cutting off %lld bytes of an interrupted commit",
+                     (long long)(segmentStat.st_size - end));
+        if (ftruncate(index, entries * ARCHIVE_ENTRY) == -1 || ftruncate(segment, end) == -1)
+            return -1;
+    }
+    return end;
+}
+
+/**
+ * openSegment switches to the files of day, creating them when needed
+ * @returns 1 on success, 0 on error (telegrams of the day are dropped)
+ */
+static int openSegment(struct archive_config *archive, int day)
+{
+    if (archive->segment != -1)
+    {
+        io_forget(archive->segment);
+        close(archive->segment);
+    }
+    if (archive->index != -1)
+    {
+        io_forget(archive->index);
+        close(archive->index);
+    }
+    archive->day = day;
+    archive->commitFailed = 0;
+    archive->index = -1;
+
+    archive->segment = openFile(archive->dir, day, "p1", O_RDWR | O_CREAT);
+    if (archive->segment == -1)
+        return 0;
+    archive->index = openFile(archive->dir, day, "idx", O_RDWR | O_CREAT | O_APPEND);
+    if (archive->index != -1)
+        archive->segmentSize = recoverSegment(archive->segment, archive->index);
+    if (archive->index == -1 || archive->segmentSize == -1)
+    {
+        printErrno(__func__, "Archive segment of %d unusable", day);
+        close(archive->segment);
+        archive->segment = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * archive_init prepares archiving into dir, which is created when missing
+ * @returns 1 on success, 0 when archiving is disabled or failed
+ */
+int archive_init(struct archive_config *archive, const char *dir, int compress)
+{
+    memset(archive, 0, sizeof(*archive));
+    archive->segment = -1;
+    archive->index = -1;
+    if (dir == NULL || !*dir)
+        return 0;
+
+#ifndef DSMR_ZLIB
+    if (compress)
+    {
+        printWarning(__func__, "Built without zlib, archiving uncompressed");
+        compress = 0;
+    }
+#endif
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        printErrno(__func__, "Can't create %s", dir);
+        return 0;
+    }
+
+    archive->block = malloc(ARCHIVE_HEADER + ARCHIVE_BLOCK_SIZE);
+#ifdef DSMR_ZLIB
+    if (compress)
+        archive->compressed = malloc(ARCHIVE_HEADER + compressBound(ARCHIVE_BLOCK_SIZE));
+#endif
+    archive->dir = strdup(dir);
+    if (archive->block == NULL || archive->dir == NULL || (compress && archive->compressed == NULL))
+    {
+        printError(__func__, "Out of memory");
+        free(archive->block);
+        free(archive->compressed);
+        free(archive->dir);
+        archive->dir = NULL;
+        return 0;
+    }
+    archive->compress = compress;
+    printLog(__func__, "Archiving raw telegrams into %s%s", dir, compress ? ", compressed" : "");
+    return 1;
+}
+
+/**
+ * archive_line adds one line of the telegram being received, as
+ * readTTY() returns it: without its "\r\n"
+ */
+void archive_line(struct archive_config *archive, const char *line, int length)
+{
+    if (archive->dir == NULL)
+        return;
+
+    if (length > 0 && line[0] == '/')
+    {
+        archive->length = 0;
+        archive->overflow = 0;
+    }
+    else if (archive->length == 0)
+    {
+        return; // Joined in the middle of a telegram
+    }
+
+    if (archive->overflow)
+        return;
+    if (archive->length + length + 2 > ARCHIVE_TELEGRAM_SIZE)
+    {
+        printWarning(__func__, "Telegram bigger than %d bytes, not archived", ARCHIVE_TELEGRAM_SIZE);
+        archive->overflow = 1;
+        return;
+    }
+    memcpy(archive->telegram + archive->length, line, length);
+    memcpy(archive->telegram + archive->length + length, "\r\n", 2);
+    archive->length += length + 2;
+}
+
+/**
+ * committed learns how the writes of archive_commit() went
+ */
+static void committed(void *context, int ok)
+{
+    struct archive_config *archive = context;
+    if (ok)
+        return;
+    printErrno(__func__, "Writing a block failed, dropping %d telegrams", archive->committing);
+    archive->commitFailed = 1;
+}
+
+/**
+ * archive_commit writes the open block and its index entry
+ * @returns 1 when it was written or queued, 0 when the block was lost
+ */
+int archive_commit(struct archive_config *archive)
+{
+    if (archive->dir == NULL || archive->blockRecords == 0)
+        return 1;
+
+    // Keep the index and the segment in line after a failed commit
+    if (archive->segment != -1)
+    {
+        io_drain(archive->segment);
+        io_drain(archive->index);
+    }
+    if (archive->commitFailed)
+        openSegment(archive, archive->day);
+
+    unsigned char *data = (unsigned char *)archive->block;
+    uint32_t stored = archive->blockLength;
+    int flags = 0;
+#ifdef DSMR_ZLIB
+    uLongf length = compressBound(ARCHIVE_BLOCK_SIZE);
+    if (archive->compress &&
+        compress2((Bytef *)archive->compressed + ARCHIVE_HEADER, &length,
+                  (Bytef *)archive->block + ARCHIVE_HEADER, archive->blockLength,
+                  Z_DEFAULT_COMPRESSION) == Z_OK &&
+        length < stored)
+    {
+        data = (unsigned char *)archive->compressed;
+        stored = length;
+        flags = ARCHIVE_ZLIB;
+    }
+#endif
+    memcpy(data, "P1A", 3);
+    data[3] = flags;
+    put32(data + 4, stored);
+    put32(data + 8, archive->blockLength);
+    put32(data + 12, archive->blockRecords);
+
+    unsigned char entry[ARCHIVE_ENTRY];
+    put64(entry, archive->blockFirst);
+    put64(entry + 8, archive->segmentSize);
+    put32(entry + 16, ARCHIVE_HEADER + stored);
+    put32(entry + 20, archive->blockRecords);
+
+    int ret = 0;
+    if (archive->segment == -1)
+    {
+        printError(__func__, "No segment, dropping %d telegrams", archive->blockRecords);
+        if (archive->index != -1)
+            openSegment(archive, archive->day);
+    }
+    else
+    {
+        // The block, then its entry, each synced; the index only follows a written block
+        struct io_write writes[2] = {
+            {.fd = archive->segment, .data = data, .length = ARCHIVE_HEADER + stored,
+             .offset = archive->segmentSize},
+            {.fd = archive->index, .data = entry, .length = sizeof(entry), .offset = -1},
+        };
+        archive->committing = archive->blockRecords;
+        archive->segmentSize += ARCHIVE_HEADER + stored;
+        ret = io_append(writes, 2, committed, archive);
+    }
+
+    archive->blockLength = 0;
+    archive->blockRecords = 0;
+    return ret;
+}
+
+/**
+ * archive_end files the telegram received with archive_line() under
+ * timestamp, its 0-0:1.0.0, when its CRC is valid
+ * @returns 1 when it was archived
+ */
+int archive_end(struct archive_config *archive, time_t timestamp)
+{
+    if (archive->dir == NULL)
+        return 0;
+
+    int length = archive->length;
+    archive->length = 0;
+    if (length == 0 || archive->overflow)
+        return 0;
+    if (!validCRC(archive->telegram, length))
+    {
+        printWarning(__func__, "CRC mismatch, telegram not archived");
+        return 0;
+    }
+
+    time_t now = time(NULL);
+    if (timestamp == 0)
+        timestamp = now;
+
+    int day = dayOf(timestamp);
+    if (day != archive->day)
+    {
+        archive_commit(archive);
+        openSegment(archive, day);
+    }
+    if (archive->blockLength + ARCHIVE_RECORD + length > ARCHIVE_BLOCK_SIZE)
+        archive_commit(archive);
+
+    unsigned char *record = (unsigned char *)archive->block + ARCHIVE_HEADER + archive->blockLength;
+    put64(record, timestamp);
+    put32(record + 8, length);
+    memcpy(record + ARCHIVE_RECORD, archive->telegram, length);
+    archive->blockLength += ARCHIVE_RECORD + length;
+    if (archive->blockRecords++ == 0)
+    {
+        archive->blockFirst = timestamp;
+        archive->blockOpened = now;
+    }
+
+    archive_tick(archive, now);
+    return 1;
+}
+
+/**
+ * archive_tick commits the open block once it's ARCHIVE_COMMIT_SECONDS
+ * old, also when no telegram comes along: call it on read timeouts
+ * @returns what archive_commit() returns, 1 when there was nothing to do
+ */
+int archive_tick(struct archive_config *archive, time_t now)
+{
+    if (archive->dir == NULL || archive->blockRecords == 0 ||
+        now - archive->blockOpened < ARCHIVE_COMMIT_SECONDS)
+        return 1;
+    return archive_commit(archive);
+}
+
+/**
+ * archive_close commits the open block and closes the day's files
+ */
+void archive_close(struct archive_config *archive)
+{
+    if (archive->dir == NULL)
+        return;
+    archive_commit(archive);
+
+    if (archive->segment != -1)
+    {
+        io_forget(archive->segment);
+        close(archive->segment);
+    }
+    if (archive->index != -1)
+    {
+        io_forget(archive->index);
+        close(archive->index);
+    }
+    archive->segment = -1;
+    archive->index = -1;
+
+    free(archive->block);
+    free(archive->compressed);
+    free(archive->dir);
+    archive->block = NULL;
+    archive->compressed = NULL;
+    archive->dir = NULL;
+}
+
+/**
+ * findBlock searches the index of a day for the last block that starts
+ * at or before timestamp
+ * @returns its entry number or -1
+ */
+static int64_t findBlock(const unsigned char *index, int64_t entries, time_t timestamp)
+{
+    int64_t low = 0, high = entries - 1, found = -1;
+    while (low <= high)
+    {
+        int64_t middle = low + (high - low) / 2;
+        if (get64(index + middle * ARCHIVE_ENTRY) <= timestamp)
+        {
+            found = middle;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+/**
+ * fetchDay reads the last telegram at or before *timestamp from the files
+ * of day into buffer and sets *timestamp to its own
+ * @returns its length, 0 when the day has none or -1 when it doesn't fit
+ *  or it's damaged
+ */
+static int fetchDay(const char *dir, int day, time_t *timestamp, char *buffer, int size)
+{
+    int index = openFile(dir, day, "idx", O_RDONLY);
+    if (index == -1)
+        return errno == ENOENT ? 0 : -1;
+    int segment = openFile(dir, day, "p1", O_RDONLY);
+    if (segment == -1)
+    {
+        close(index);
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    int ret = -1;
+    unsigned char *entries = MAP_FAILED;
+    unsigned char *block = NULL;
+    unsigned char *raw = NULL;
+
+    struct stat indexStat;
+    if (fstat(index, &indexStat) == -1 || indexStat.st_size < ARCHIVE_ENTRY)
+        goto notFound;
+    entries = mmap(NULL, indexStat.st_size, PROT_READ, MAP_SHARED, index, 0);
+    if (entries == MAP_FAILED)
+    {
+        printErrno(__func__, "Can't map the index");
+        goto cleanup;
+    }
+    int64_t found = findBlock(entries, indexStat.st_size / ARCHIVE_ENTRY, *timestamp);
+    if (found == -1)
+        goto notFound;
+
+    const unsigned char *entry = entries + found * ARCHIVE_ENTRY;
+    uint32_t length = get32(entry + 16);
+    block = malloc(length);
+    if (block == NULL || length < ARCHIVE_HEADER ||
+        pread(segment, block, length, get64(entry + 8)) != length ||
+        memcmp(block, "P1A", 3) || get32(block + 4) + ARCHIVE_HEADER != length)
+    {
+        printError(__func__, "Block at %lld is damaged", (long long)get64(entry + 8));
+        goto cleanup;
+    }
+
+    uint32_t rawLength = get32(block + 8);
+    uint32_t records = get32(block + 12);
+    raw = block + ARCHIVE_HEADER;
+    if (block[3] & ARCHIVE_ZLIB)
+    {
+#ifdef DSMR_ZLIB
+        uLongf inflated = rawLength;
+        raw = malloc(rawLength);
+        if (raw == NULL ||
+            uncompress(raw, &inflated, block + ARCHIVE_HEADER, length - ARCHIVE_HEADER) != Z_OK ||
+            inflated != rawLength)
+        {
+            printError(__func__, "Block at %lld doesn't decompress", (long long)get64(entry + 8));
+            goto cleanup;
+        }
+#else
+        printError(__func__, "Built without zlib, can't read compressed blocks");
+        raw = NULL;
+        goto cleanup;
+#endif
+    }
+
+    // Records are in the order they arrived
+    const unsigned char *best = NULL;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i < records && offset + ARCHIVE_RECORD <= rawLength; i++)
+    {
+        const unsigned char *record = raw + offset;
+        offset += ARCHIVE_RECORD + get32(record + 8);
+        if (offset > rawLength || get64(record) > *timestamp)
+            break;
+        best = record;
+    }
+    if (best == NULL)
+        goto notFound;
+
+    int telegramLength = get32(best + 8);
+    if (telegramLength > size)
+    {
+        printError(__func__, "Telegram of %d bytes doesn't fit", telegramLength);
+        goto cleanup;
+    }
+    memcpy(buffer, best + ARCHIVE_RECORD, telegramLength);
+    if (!validCRC(buffer, telegramLength))
+    {
+        printError(__func__, "Archived telegram fails its CRC");
+        goto cleanup;
+    }
+    *timestamp = get64(best);
+    ret = telegramLength;
+    goto cleanup;
+
+notFound:
+    ret = 0;
+
+cleanup:
+    if (raw != NULL && raw != block + ARCHIVE_HEADER)
+        free(raw);
+    free(block);
+    if (entries != MAP_FAILED)
+        munmap(entries, indexStat.st_size);
+    close(segment);
+    close(index);
+    return ret;
+}
+
+/**
+ * dayBefore
+ * @returns a time on the local day before the one of t
+ */
+static time_t dayBefore(time_t t)
+{
+    // Noon stays on its day across a DST change
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_mday--;
+    tm.tm_hour = 12;
+    tm.tm_min = 0;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return mktime(&tm);
+}
+
+/**
+ * archive_fetch reads the last archived telegram at or before *timestamp
+ * into buffer and sets *timestamp to its own. Days without one, or with
+ * only later ones, are passed back to ARCHIVE_FETCH_DAYS days.
+ * @returns its length or -1 when there's none, it doesn't fit or it's
+ *  damaged
+ */
+int archive_fetch(const char *dir, time_t *timestamp, char *buffer, int size)
+{
+    time_t day = *timestamp;
+    for (int i = 0; i <= ARCHIVE_FETCH_DAYS; i++, day = dayBefore(day))
+    {
+        int ret = fetchDay(dir, dayOf(day), timestamp, buffer, size);
+        if (ret != 0)
+            return ret;
+    }
+
+    errno = ENOENT;
+    printError(__func__, "No telegram archived in the %d days up to that time", ARCHIVE_FETCH_DAYS + 1);
+    return -1;
+}
@@ -0,0 +1,80 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Largest raw telegram the P1 companion standards allow, with line endings:
+// up to 64 lines of at most a 96 digit equipment id, the 13 months of
+// "(TST)(TST)(F5(3,3)*kW)" in 0-0:98.1.0 and a 0-0:96.13.0 message of 1024
+// characters as 2048 hex digits
+#define ARCHIVE_LINE_SIZE 128
+#define ARCHIVE_HISTORY_SIZE (38 + 13 * 41)
+#define ARCHIVE_MESSAGE_SIZE (12 + 2048 + 3)
+#define ARCHIVE_TELEGRAM_SIZE (64 * ARCHIVE_LINE_SIZE + ARCHIVE_HISTORY_SIZE + ARCHIVE_MESSAGE_SIZE)
+#define ARCHIVE_BLOCK_SIZE 65536   // Raw bytes per block before it's committed
+#define ARCHIVE_COMMIT_SECONDS 60  // Longest a telegram waits for its block to be committed
+#define ARCHIVE_FETCH_DAYS 31      // Days archive_fetch() goes back for an earlier telegram
+
+/**
+ * Append-only archive of the raw telegrams, byte for byte as the meter
+ * sent them, for disputes with the grid operator
+ *
+ * DSMR_ARCHIVE="/var/lib/DSMR/archive" enables it. Every telegram with a
+ * valid CRC goes into a block, a block is written with a single write
+ * once it's full or ARCHIVE_COMMIT_SECONDS old, zlib compressed when
+ * DSMR_ARCHIVE_COMPRESS="1". A crash loses at most the open block.
+ *
+ * Every local day of telegram timestamps has two files:
+ * YYYY-MM-DD.p1   blocks: header, then the records, compressed or not
+ *                 header: "P1A", flags (1 = zlib), uint32 stored length,
+ *                 uint32 raw length, uint32 records
+ *                 record: int64 timestamp, uint32 length, raw telegram
+ * YYYY-MM-DD.idx  per block: int64 first timestamp, int64 offset,
+ *                 uint32 length with header, uint32 records
+ * Everything is little endian. archive_fetch() finds the block in the
+ * index with a binary search and reads it with one pread().
+ *
+ * Usage:
+ * struct archive_config archive;
+ * archive_init(&archive, "/var/lib/DSMR/archive", 1);
+ * archive_line(&archive, line, length); // Every line, '/' starts a telegram
+ * archive_end(&archive, telegram.timestamp); // After the '!' line
+ * archive_tick(&archive, time(NULL)); // When the read timed out
+ */
+struct archive_config
+{
+    char *dir; // NULL when archiving is disabled
+    int compress;
+
+    // Telegram being received, with its line endings restored
+    char telegram[ARCHIVE_TELEGRAM_SIZE];
+    int length;
+    int overflow;
+
+    // Segment of the day of the open block
+    int day; // yyyymmdd
+    int segment;
+    int index;
+    int64_t segmentSize;
+    int committing;   // Telegrams of the commit in flight
+    int commitFailed; // Resynced with the files before the next commit
+
+    // Open block, the header is filled in on commit
+    char *block;
+    int blockLength;
+    int blockRecords;
+    int64_t blockFirst;
+    time_t blockOpened;
+    char *compressed;
+};
+
+int archive_init(struct archive_config *archive, const char *dir, int compress);
+void archive_line(struct archive_config *archive, const char *line, int length);
+int archive_end(struct archive_config *archive, time_t timestamp);
+int archive_commit(struct archive_config *archive);
+int archive_tick(struct archive_config *archive, time_t now);
+void archive_close(struct archive_config *archive);
+int archive_fetch(const char *dir, time_t *timestamp, char *buffer, int size);
+
+#endif
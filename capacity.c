@@ -0,0 +1,258 @@
+/**
+ * capacity.c - Belgian capacity tariff (capaciteitstarief) tracking
+ *
+ * Fluvius bills the monthly peak of the 15 minute average import. The
+ * meter reports the running average (1-0:1.4.0), the peak of the running
+ * month (1-0:1.6.0) and the peaks of the last 13 months (0-0:98.1.0).
+ * From every telegram this keeps the running quarter average, projects it
+ * to the end of the quarter and tracks the month-to-date peak, so no
+ * queries are needed to know where the month is heading.
+ *
+ * Usage:
+ * struct capacity_state state;
+ * capacity_init(&state, "capacity", tags, 60);
+ * if (capacity_update(&state, &telegram))
+ *     influx_enqueue(iconfig, state.encoder.buffer, state.encoder.length);
+ */
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "lineprotocol.h"
+#include "capacity.h"
+
+#define CAPACITY_BUFFER_SIZE 2048
+
+enum capacityKey
+{
+    KEY_QUARTER_AVERAGE,
+    KEY_QUARTER_PROJECTED,
+    KEY_QUARTER_FINAL,
+    KEY_MONTH_PEAK,
+    KEY_MONTH_PEAK_TIMESTAMP,
+    KEY_ROLLING_AVERAGE_PEAK,
+    KEY_HISTORY_PEAK,
+    KEY_HISTORY_PEAK_TIMESTAMP,
+    KEY_COUNT,
+};
+
+static const char *keyNames[KEY_COUNT] = {
+    "quarter_average",
+    "quarter_projected",
+    "quarter_final",
+    "month_peak",
+    "month_peak_timestamp",
+    "rolling_average_peak",
+    "history_peak",
+    "history_peak_timestamp",
+};
+
+// Rendered once by capacity_init()
+static char keys[KEY_COUNT][LP_KEY_SIZE];
+static int keyLengths[KEY_COUNT];
+
+/**
+ * monthOf
+ * @returns year * 12 + month in local (meter) time
+ */
+static int monthOf(time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm.tm_year * 12 + tm.tm_mon;
+}
+
+static int field(struct capacity_state *state, enum capacityKey key, long long value, int decimals)
+{
+    return lp_field_fixed(&state->encoder, keys[key], keyLengths[key], value, decimals);
+}
+
+/**
+ * rollingAverage averages the current month peak with the 11 most
+ * recent months of the history, every month at least CAPACITY_MINIMUM
+ */
+static long long rollingAverage(struct capacity_state *state)
+{
+    long long sum = state->monthPeak > CAPACITY_MINIMUM ? state->monthPeak : CAPACITY_MINIMUM;
+    int months = 1;
+
+    // History is ordered oldest first, take the newest 11
+    for (int i = state->historyCount - 1; i >= 0 && months < 12; i--)
+    {
+        long long peak = state->history[i].value;
+        sum += peak > CAPACITY_MINIMUM ? peak : CAPACITY_MINIMUM;
+        months++;
+    }
+    return sum / months;
+}
+
+/**
+ * capacity_init resolves the needed values and renders the keys once
+ * @returns 1 on success, 0 on error
+ */
+int capacity_init(struct capacity_state *state, const char *measurement, const char *tags,
+                  int interval)
+{
+    memset(state, 0, sizeof(*state));
+    state->interval = interval;
+    state->energyStart = -1;
+
+    for (int i = 0; i < KEY_COUNT; i++)
+    {
+        keyLengths[i] = lp_render_key(keys[i], LP_KEY_SIZE, keyNames[i], strlen(keyNames[i]));
+        if (keyLengths[i] == -1)
+            return 0;
+    }
+
+    state->average = dsmr_field_index("current_average_demand_active_energy_import");
+    state->power = dsmr_field_index("actual_electricity_power_delivered");
+    state->tariff1 = dsmr_field_index("meter_electricity_delivered_to_client_tariff_1");
+    state->tariff2 = dsmr_field_index("meter_electricity_delivered_to_client_tariff_2");
+    state->peakValue = dsmr_field_index("maximum_demand_running_month_value");
+    state->peakTimestamp = dsmr_field_index("maximum_demand_running_month_timestamp");
+    if (state->power == -1 || state->tariff1 == -1 || state->tariff2 == -1)
+    {
+        printError(__func__, "Import power and energy aren't decoded");
+        return 0;
+    }
+
+    return lp_init(&state->encoder, measurement, tags, CAPACITY_BUFFER_SIZE);
+}
+
+/**
+ * closeQuarter finalises the quarter that just ended
+ */
+static void closeQuarter(struct capacity_state *state)
+{
+    long long final = state->quarterAverage;
+
+    int month = monthOf(state->quarterStart);
+    if (month != state->month)
+    {
+        state->month = month;
+        state->monthPeak = 0;
+        state->monthPeakTime = 0;
+    }
+    if (final > state->monthPeak)
+    {
+        state->monthPeak = final;
+        state->monthPeakTime = state->quarterStart;
+    }
+
+    lp_begin(&state->encoder);
+    field(state, KEY_QUARTER_FINAL, final, 3);
+    lp_end(&state->encoder, state->quarterStart);
+}
+
+/**
+ * capacity_update feeds one decoded telegram
+ * @returns 1 when lines were rendered into state->encoder, they stay
+ *  there until the next call
+ */
+int capacity_update(struct capacity_state *state, struct dsmr_telegram *telegram)
+{
+    time_t now = telegram->timestamp;
+    struct dsmr_value *values = telegram->values;
+    lp_reset(&state->encoder);
+
+    if (now == 0 || !values[state->tariff1].present || !values[state->tariff2].present)
+        return 0;
+
+    long long energy = dsmr_milli(values + state->tariff1) + dsmr_milli(values + state->tariff2);
+    time_t quarter = now - now % CAPACITY_QUARTER;
+    int closed = 0;
+
+    if (state->quarterStart == 0)
+    {
+        // First telegram: a partial quarter has no usable energy start
+        state->quarterStart = quarter;
+        state->month = monthOf(quarter);
+        state->energyStart = now == quarter ? energy : -1;
+    }
+    else if (quarter != state->quarterStart)
+    {
+        if (state->quarterAverage || state->energyStart != -1)
+            closeQuarter(state);
+        closed = 1;
+
+        state->quarterStart = quarter;
+        state->energyStart = energy;
+        state->quarterAverage = 0;
+
+        // The first quarter of a month starts a new peak
+        int month = monthOf(quarter);
+        if (month != state->month)
+        {
+            state->month = month;
+            state->monthPeak = 0;
+            state->monthPeakTime = 0;
+        }
+    }
+
+    // Running average: the meter's own if it sends one, else from the registers
+    long long elapsed = now - state->quarterStart;
+    if (state->average != -1 && values[state->average].present)
+        state->quarterAverage = dsmr_milli(values + state->average);
+    else if (state->energyStart != -1 && elapsed > 0)
+        state->quarterAverage = (energy - state->energyStart) * 3600 / elapsed;
+
+    // Projection: what's averaged so far plus the current power for the rest
+    long long power = values[state->power].present ? dsmr_milli(values + state->power) : 0;
+    state->quarterProjected = (state->quarterAverage * elapsed +
+                               power * (CAPACITY_QUARTER - elapsed)) /
+                              CAPACITY_QUARTER;
+
+    // The meter knows peaks from before we started
+    if (state->peakValue != -1 && values[state->peakValue].present)
+    {
+        long long peak = dsmr_milli(values + state->peakValue);
+        time_t peakTime = values[state->peakTimestamp].present ? values[state->peakTimestamp].value : 0;
+        if (peak > state->monthPeak && monthOf(peakTime) == state->month)
+        {
+            state->monthPeak = peak;
+            state->monthPeakTime = peakTime;
+        }
+    }
+
+    if (telegram->demandHistoryCount >= 0 &&
+        (telegram->demandHistoryCount != state->historyCount ||
+         memcmp(state->history, telegram->demandHistory,
+                telegram->demandHistoryCount * sizeof(struct dsmr_demand_month))))
+    {
+        state->historyCount = telegram->demandHistoryCount;
+        memcpy(state->history, telegram->demandHistory,
+               state->historyCount * sizeof(struct dsmr_demand_month));
+        state->historyChanged = 1;
+    }
+
+    // Low rate: every interval and right after a quarter closed
+    if (closed || now - state->lastEmit >= state->interval)
+    {
+        state->lastEmit = now;
+
+        lp_begin(&state->encoder);
+        field(state, KEY_QUARTER_AVERAGE, state->quarterAverage, 3);
+        field(state, KEY_QUARTER_PROJECTED, state->quarterProjected, 3);
+        field(state, KEY_MONTH_PEAK, state->monthPeak, 3);
+        if (state->monthPeakTime)
+            field(state, KEY_MONTH_PEAK_TIMESTAMP, state->monthPeakTime, 0);
+        field(state, KEY_ROLLING_AVERAGE_PEAK, rollingAverage(state), 3);
+        lp_end(&state->encoder, now);
+    }
+
+    if (state->historyChanged)
+    {
+        state->historyChanged = 0;
+        for (int i = 0; i < state->historyCount; i++)
+        {
+            lp_begin(&state->encoder);
+            field(state, KEY_HISTORY_PEAK, state->history[i].value, 3);
+            field(state, KEY_HISTORY_PEAK_TIMESTAMP, state->history[i].peak, 0);
+            lp_end(&state->encoder, state->history[i].period);
+        }
+    }
+
+    return state->encoder.length > 0;
+}
@@ -0,0 +1,47 @@
+#ifndef CAPACITY_H
+#define CAPACITY_H
+
+#include <time.h>
+
+#include "DSMR.h"
+#include "lineprotocol.h"
+
+#define CAPACITY_QUARTER 900 // Seconds in a demand period
+#define CAPACITY_MINIMUM 2500 // Fluvius bills at least 2.5kW per month (W)
+
+/**
+ * Incremental Belgian capacity tariff state, all power in W
+ *
+ * The tariff bills the average of the monthly peaks of 15 minute average
+ * import over the last 12 months. Everything is derived per telegram;
+ * results are rendered as their own series into encoder.
+ */
+struct capacity_state
+{
+    struct lp_encoder encoder;
+    int interval; // Seconds between projections
+
+    // Indices into dsmr_telegram.values
+    int average, power, tariff1, tariff2, peakValue, peakTimestamp;
+
+    time_t quarterStart;   // Start of the current quarter, 0 before the first telegram
+    long long energyStart; // Imported Wh at quarter start, -1 if the start was missed
+    long long quarterAverage;   // Running average of the current quarter
+    long long quarterProjected; // Expected average at the end of the quarter
+
+    int month; // year * 12 + month of the current quarter
+    long long monthPeak;
+    time_t monthPeakTime;
+
+    int historyCount;
+    struct dsmr_demand_month history[DSMR_DEMAND_HISTORY_SIZE];
+    int historyChanged;
+
+    time_t lastEmit;
+};
+
+int capacity_init(struct capacity_state *state, const char *measurement, const char *tags,
+                  int interval);
+int capacity_update(struct capacity_state *state, struct dsmr_telegram *telegram);
+
+#endif
@@ -1,49 +1,423 @@
 /**
  * common.c - Commonly used functions that can be used anywhere
+ *
+ * Logging never blocks the caller: messages are formatted into a fixed
+ * slot of a lock-free ring and written to stdout/stderr (or journald)
+ * by a background thread, which sleeps on a futex while the ring is empty.
+ * Under systemd stdout is a pipe to journald, a stalled journal would
+ * otherwise block the serial loop.
+ * The embedded profile (DSMR_EMBEDDED) logs synchronously through the
+ * platform layer instead.
  */
 #include <stdio.h>  // For printf
 #include <stdlib.h> // For exit
 #include <stdarg.h>
 #include <string.h>
-#include <locale.h>
+#include <strings.h>
 #include <errno.h>
+#include <time.h>
+
+#include "common.h"
+
+#define LOG_MESSAGE_SIZE 480 // Bytes per message, longer ones are truncated
+
+// Per call site: at most LOG_RATE_BURST messages per second
+#define LOG_RATE_BURST 5
+
+static const char *levelNames[] = {"error", "warning", "info", "debug"};
+
+static long monotonicSeconds(void);
 
 /**
- * setupLogs sets up the locale of the user terminal
+ * rateLimited updates the call site and tells if the message is dropped
+ * @returns the number of suppressed messages to report (>= 0), -1 to drop
  */
-void setupLogs(void)
+static int rateLimited(struct log_site *site)
 {
-    setlocale(LC_ALL, "");
+    long now = monotonicSeconds();
+    if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != now)
+    {
+        __atomic_store_n(&site->window, now, __ATOMIC_RELAXED);
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= LOG_RATE_BURST)
+    {
+        __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
 }
 
+#ifdef DSMR_EMBEDDED
+#include "platform.h"
+
 /**
- * printErrno prints the given prefix and format followed by
- * the error number and errno string meaning
+ * Embedded profile: no threads, no stdio streams. Messages are formatted
+ * on the stack and handed to platform_log() right away.
  */
-void printErrno(const char *prefix, const char *format, ...)
+static enum log_level maxLevel = LOG_LEVEL_INFO;
+
+static long monotonicSeconds(void)
+{
+    return time(NULL);
+}
+
+void setupLogs(void)
+{
+    const char *level = platform_setting("DSMR_LOG_LEVEL");
+    for (int i = 0; level != NULL && i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (!strcasecmp(level, levelNames[i]))
+            maxLevel = i;
+    }
+}
+
+void flushLogs(void)
+{
+}
+
+void _printLog(struct log_site *site, enum log_level level, int withErrno,
+               const char *prefix, const char *format, ...)
 {
-    // Fetch errno value
     int errsv = errno;
+    if (level > maxLevel)
+        return;
+
+    int suppressed = rateLimited(site);
+    if (suppressed == -1)
+        return;
+
+    char message[LOG_MESSAGE_SIZE];
     va_list va;
     va_start(va, format);
-    fprintf(stderr, "%s:\t", prefix);
-    vfprintf(stderr, format, va);
-    fprintf(stderr, "\n\terrno %d: %s\n\n", errsv, strerror(errsv));
+    int length = vsnprintf(message, LOG_MESSAGE_SIZE, format, va);
     va_end(va);
+    if (length >= LOG_MESSAGE_SIZE)
+        length = LOG_MESSAGE_SIZE - 1;
+
+    // No strerror(), its table is big; the number is enough
+    if (withErrno && length < LOG_MESSAGE_SIZE - 1)
+        length += snprintf(message + length, LOG_MESSAGE_SIZE - length, " (errno %d)", errsv);
+    if (suppressed && length < LOG_MESSAGE_SIZE - 1)
+        length += snprintf(message + length, LOG_MESSAGE_SIZE - length,
+                           " (%d similar messages suppressed)", suppressed);
+    if (length >= LOG_MESSAGE_SIZE)
+        length = LOG_MESSAGE_SIZE - 1;
+
+    platform_log(level, prefix, message, length);
 }
+#else
+#include <locale.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define LOG_RING_SIZE 256 // Slots, power of two
+#define LOG_PREFIX_SIZE 32
+
+#define JOURNAL_SOCKET "/run/systemd/journal/socket"
+
+struct log_entry
+{
+    unsigned int sequence; // Slot is readable when sequence == position + 1
+    enum log_level level;
+    char prefix[LOG_PREFIX_SIZE];
+    char message[LOG_MESSAGE_SIZE];
+};
+
+/**
+ * Bounded multi-producer single-consumer ring
+ * A producer claims a position with a CAS, fills the slot and publishes it
+ * by bumping the slot sequence. Full ring -> message is dropped and counted.
+ */
+static struct
+{
+    struct log_entry entries[LOG_RING_SIZE];
+    unsigned int head; // Next position to claim (producers)
+    unsigned int tail; // Next position to write (writer thread)
+    unsigned int dropped;
+    unsigned int sleeping; // Futex, 1 while the writer waits for an entry
+
+    enum log_level maxLevel;
+    int running;
+    int stop;
+    int journalfd; // -1 when writing to stdout/stderr
+    pthread_t writer;
+} logRing = {
+    .maxLevel = LOG_LEVEL_INFO,
+    .journalfd = -1,
+};
+
+static long monotonicSeconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts); // vDSO, no syscall
+    return ts.tv_sec;
+}
+
+/**
+ * writeJournal sends one entry with native journald fields
+ * MESSAGE uses the binary form so newlines survive
+ * @returns 1 on success
+ */
+static int writeJournal(struct log_entry *entry, int length)
+{
+    // syslog priorities: err=3 warning=4 info=6 debug=7
+    static const char *priorities[] = {"PRIORITY=3\n", "PRIORITY=4\n", "PRIORITY=6\n", "PRIORITY=7\n"};
+
+    char codeFunc[LOG_PREFIX_SIZE + 16];
+    int codeFuncLength = snprintf(codeFunc, sizeof(codeFunc), "CODE_FUNC=%s\n", entry->prefix);
+
+    unsigned long long size = length;
+    unsigned char sizeLE[8];
+    for (int i = 0; i < 8; i++)
+        sizeLE[i] = size >> (8 * i);
+
+    struct iovec iov[] = {
+        {.iov_base = "SYSLOG_IDENTIFIER=DSMR\n", .iov_len = 23},
+        {.iov_base = (char *)priorities[entry->level], .iov_len = 11},
+        {.iov_base = codeFunc, .iov_len = codeFuncLength},
+        {.iov_base = "MESSAGE\n", .iov_len = 8},
+        {.iov_base = sizeLE, .iov_len = 8},
+        {.iov_base = entry->message, .iov_len = length},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = sizeof(iov) / sizeof(iov[0])};
+    return sendmsg(logRing.journalfd, &msg, MSG_NOSIGNAL) != -1;
+}
+
+/**
+ * writeEntry writes one message to its destination
+ */
+static void writeEntry(struct log_entry *entry)
+{
+    int length = strnlen(entry->message, LOG_MESSAGE_SIZE);
+    if (logRing.journalfd != -1 && writeJournal(entry, length))
+        return;
+
+    FILE *f = entry->level <= LOG_LEVEL_WARNING ? stderr : stdout;
+    fprintf(f, "%s:\t%.*s\n", entry->prefix, length, entry->message);
+}
+
 /**
- * printLog prints the given prefix and format using variable arguments
+ * drainRing writes every published entry
+ * @returns the number of entries written
  */
-void _printLog(FILE *f, const char *prefix, const char *format, ...)
+static int drainRing(void)
 {
+    int written = 0;
+    for (;;)
+    {
+        struct log_entry *entry = logRing.entries + (logRing.tail & (LOG_RING_SIZE - 1));
+        if (__atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE) != logRing.tail + 1)
+            break;
+
+        writeEntry(entry);
+        // Free the slot for the producer one lap ahead
+        __atomic_store_n(&entry->sequence, logRing.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+        logRing.tail++;
+        written++;
+    }
+
+    unsigned int dropped = __atomic_exchange_n(&logRing.dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+        fprintf(stderr, "%s:\tLog ring full, dropped %u messages\n", __func__, dropped);
+
+    if (written)
+    {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+/**
+ * wakeWriter wakes the writer if it waits for the ring to fill
+ * A producer only makes the syscall for the first entry after it fell
+ * asleep, the flag is cleared by whoever wakes it.
+ */
+static void wakeWriter(void)
+{
+    if (__atomic_load_n(&logRing.sleeping, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&logRing.sleeping, 0, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &logRing.sleeping, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void *logWriter(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&logRing.stop, __ATOMIC_SEQ_CST))
+    {
+        if (drainRing())
+            continue;
+
+        // Announce the wait, then look once more: an entry published
+        // before the flag was visible is written instead of waited for
+        __atomic_store_n(&logRing.sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!drainRing() && !__atomic_load_n(&logRing.stop, __ATOMIC_SEQ_CST))
+            syscall(SYS_futex, &logRing.sleeping, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+        __atomic_store_n(&logRing.sleeping, 0, __ATOMIC_RELAXED);
+    }
+    drainRing();
+    return NULL;
+}
+
+/**
+ * openJournal connects to the native journald socket
+ * @returns the socket or -1
+ */
+static int openJournal(void)
+{
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        return -1;
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strncpy(addr.sun_path, JOURNAL_SOCKET, sizeof(addr.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * setupLogs sets up the locale of the user terminal and starts the
+ * background log writer
+ *
+ * DSMR_LOG_LEVEL: error, warning, info (default) or debug
+ * DSMR_LOG_JOURNAL: 1 to send structured entries to journald directly
+ */
+void setupLogs(void)
+{
+    setlocale(LC_ALL, "");
+
+    for (int i = 0; i < LOG_RING_SIZE; i++)
+        logRing.entries[i].sequence = i;
+
+    char *level = getenv("DSMR_LOG_LEVEL");
+    for (int i = 0; level != NULL && i <= LOG_LEVEL_DEBUG; i++)
+    {
+        if (!strcasecmp(level, levelNames[i]))
+            logRing.maxLevel = i;
+    }
+
+    char *journal = getenv("DSMR_LOG_JOURNAL");
+    if (journal != NULL && !strcmp(journal, "1"))
+    {
+        logRing.journalfd = openJournal();
+        if (logRing.journalfd == -1)
+            fprintf(stderr, "%s:\tCouldn't connect to journald, using stdout\n", __func__);
+    }
+
+    // Without the writer every message is written synchronously
+    if (pthread_create(&logRing.writer, NULL, logWriter, NULL) == 0)
+    {
+        logRing.running = 1;
+        atexit(flushLogs);
+    }
+}
+
+/**
+ * flushLogs stops the writer after it wrote every queued message
+ */
+void flushLogs(void)
+{
+    if (!logRing.running)
+        return;
+    __atomic_store_n(&logRing.stop, 1, __ATOMIC_SEQ_CST);
+    wakeWriter();
+    pthread_join(logRing.writer, NULL);
+    logRing.running = 0;
+}
+
+/**
+ * _printLog formats the message into a free ring slot; the hot path is a
+ * bounded vsnprintf and the store that publishes it, without locks. Only
+ * the first entry after the writer fell asleep wakes it. Use the print*
+ * macros.
+ * withErrno appends the error number and errno string meaning
+ */
+void _printLog(struct log_site *site, enum log_level level, int withErrno,
+               const char *prefix, const char *format, ...)
+{
+    // Fetch errno value
+    int errsv = errno;
+
+    if (level > logRing.maxLevel)
+        return;
+
+    int suppressed = rateLimited(site);
+    if (suppressed == -1)
+        return;
+
+    struct log_entry local, *entry = &local;
+    unsigned int position = 0;
+    if (logRing.running)
+    {
+        // Claim a slot
+        position = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+        for (;;)
+        {
+            entry = logRing.entries + (position & (LOG_RING_SIZE - 1));
+            unsigned int sequence = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+            int diff = (int)(sequence - position);
+            if (diff == 0)
+            {
+                if (__atomic_compare_exchange_n(&logRing.head, &position, position + 1, 1,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                // Full, the writer is behind
+                __atomic_fetch_add(&logRing.dropped, 1, __ATOMIC_RELAXED);
+                return;
+            }
+            else
+            {
+                position = __atomic_load_n(&logRing.head, __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    entry->level = level;
+    strncpy(entry->prefix, prefix, LOG_PREFIX_SIZE - 1);
+    entry->prefix[LOG_PREFIX_SIZE - 1] = 0;
+
     va_list va;
     va_start(va, format);
-    fprintf(f, "%s:\t", prefix);
-    vfprintf(f, format, va);
-    fprintf(f, "\n");
+    int length = vsnprintf(entry->message, LOG_MESSAGE_SIZE, format, va);
     va_end(va);
+    if (length >= LOG_MESSAGE_SIZE)
+        length = LOG_MESSAGE_SIZE - 1;
+
+    if (withErrno && length < LOG_MESSAGE_SIZE - 1)
+        length += snprintf(entry->message + length, LOG_MESSAGE_SIZE - length,
+                           "\n\terrno %d: %s", errsv, strerror(errsv));
+    if (suppressed && length < LOG_MESSAGE_SIZE - 1)
+        snprintf(entry->message + length, LOG_MESSAGE_SIZE - length,
+                 " (%d similar messages suppressed)", suppressed);
+
+    if (entry == &local)
+        writeEntry(entry);
+    else
+    {
+        // Ordered against the writer announcing its wait
+        __atomic_store_n(&entry->sequence, position + 1, __ATOMIC_SEQ_CST);
+        wakeWriter();
+    }
 }
 
+#endif
+
 int getByToken(char *line, int lineLength, int offset, char token)
 {
     for (int i = offset; i < lineLength; i++)
@@ -52,4 +426,31 @@ int getByToken(char *line, int lineLength, int offset, char token)
             return i;
     }
     return lineLength;
-}
\ No newline at end of file
+}
+
+/**
+ * splitHostPort splits "host:port" or "[address]:port" in place, the port
+ * is optional. A bare IPv6 address has no port.
+ * @returns the port or defaultPort
+ */
+unsigned short splitHostPort(char *hostport, unsigned short defaultPort)
+{
+    if (hostport[0] == '[')
+    {
+        char *close = strchr(hostport, ']');
+        if (close != NULL)
+        {
+            unsigned short port = close[1] == ':' ? atoi(close + 2) : defaultPort;
+            size_t length = close - hostport - 1;
+            memmove(hostport, hostport + 1, length);
+            hostport[length] = 0;
+            return port;
+        }
+    }
+
+    char *colon = strrchr(hostport, ':');
+    if (colon == NULL || strchr(hostport, ':') != colon)
+        return defaultPort;
+    *colon = 0;
+    return atoi(colon + 1);
+}
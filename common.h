@@ -1,15 +1,55 @@
 #ifndef COMMON_H
 #define COMMON_H
 
+/**
+ * Log levels, DSMR_LOG_LEVEL selects the most verbose one that's written
+ */
+enum log_level
+{
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG,
+};
+
+/**
+ * Per call site rate limit state, every print macro owns a static one
+ */
+struct log_site
+{
+    long window;    // Second in which count started
+    int count;      // Messages logged in window
+    int suppressed; // Messages dropped since the last one logged
+};
+
 void setupLogs(void);
-void printErrno(const char *prefix, const char *format, ...);
+void flushLogs(void);
+
+#define LOG_AT(level, ...)                          \
+    do                                              \
+    {                                               \
+        static struct log_site _site;               \
+        _printLog(&_site, level, 0, __VA_ARGS__);   \
+    } while (0)
+
+#define printError(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define printWarning(...) LOG_AT(LOG_LEVEL_WARNING, __VA_ARGS__)
+#define printLog(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define printDebug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-#define printError(...) _printLog(stderr, __VA_ARGS__)
-#define printLog(...) _printLog(stdout, __VA_ARGS__)
+// Appends the errno number and meaning
+#define printErrno(...)                                      \
+    do                                                       \
+    {                                                        \
+        static struct log_site _site;                        \
+        _printLog(&_site, LOG_LEVEL_ERROR, 1, __VA_ARGS__);  \
+    } while (0)
 
-#include <stdio.h>
-void _printLog(FILE *f, const char *prefix, const char *format, ...);
+void _printLog(struct log_site *site, enum log_level level, int withErrno,
+               const char *prefix, const char *format, ...)
+    __attribute__((format(printf, 5, 6)));
 
 int getByToken(char *line, int lineLength, int offset, char token);
+unsigned short splitHostPort(char *hostport, unsigned short defaultPort);
 
-#endif
\ No newline at end of file
+#endif
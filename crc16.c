@@ -0,0 +1,63 @@
+/**
+ * crc16.c - CRC16 used by DSMR P1 telegrams
+ *
+ * Usage:
+ * unsigned short crc = crc16(0, telegram, bang - telegram + 1);
+ * sprintf(hex, "%04X", crc);
+ *
+ * Slicing by 8: crcTables[k][b] is the CRC of byte b followed by k zero
+ * bytes, so eight independent lookups replace eight dependent ones.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "crc16.h"
+
+#define CRC16_POLYNOMIAL 0xa001 // 0x8005 reflected
+
+static unsigned short crcTables[8][256];
+
+__attribute__((constructor)) static void buildTables(void)
+{
+    for (int b = 0; b < 256; b++)
+    {
+        unsigned short crc = b;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ CRC16_POLYNOMIAL : crc >> 1;
+        crcTables[0][b] = crc;
+    }
+    for (int k = 1; k < 8; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            unsigned short crc = crcTables[k - 1][b];
+            crcTables[k][b] = (crc >> 8) ^ crcTables[0][crc & 0xff];
+        }
+    }
+}
+
+/**
+ * crc16 continues crc over length bytes of data, start with 0
+ * @returns the updated crc
+ */
+unsigned short crc16(unsigned short crc, const char *data, size_t length)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length >= 8; length -= 8, p += 8)
+    {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        x ^= crc;
+        crc = crcTables[7][x & 0xff] ^ crcTables[6][(x >> 8) & 0xff] ^
+              crcTables[5][(x >> 16) & 0xff] ^ crcTables[4][(x >> 24) & 0xff] ^
+              crcTables[3][(x >> 32) & 0xff] ^ crcTables[2][(x >> 40) & 0xff] ^
+              crcTables[1][(x >> 48) & 0xff] ^ crcTables[0][x >> 56];
+    }
+#endif
+
+    for (; length; length--)
+        crc = (crc >> 8) ^ crcTables[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
@@ -0,0 +1,14 @@
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stddef.h>
+
+/**
+ * CRC16 of a P1 telegram: polynomial x^16 + x^15 + x^2 + 1 (0x8005),
+ * least significant bit first, initial value 0 (CRC-16/ARC).
+ * It covers everything from '/' up to and including '!' and is sent
+ * as 4 hexadecimal characters, most significant first.
+ */
+unsigned short crc16(unsigned short crc, const char *data, size_t length);
+
+#endif
@@ -0,0 +1,538 @@
+/**
+ * derived.c - Metrics computed from every decoded telegram
+ *
+ * Expressions are read at startup and on every SIGHUP from DSMR_DERIVED
+ * (default /etc/DSMR/derived.conf), one per line:
+ *
+ *  net_power = actual_electricity_power_delivered - actual_electricity_power_received
+ *  import_l1 = instantaneous_active_positive_power_L1 - instantaneous_active_negative_power_L1
+ *  imbalance = max(import_l1, import_l2, import_l3) - min(import_l1, import_l2, import_l3)
+ *  energy_estimate = integral(actual_electricity_power_delivered, meter_electricity_delivered_to_client_tariff_1)
+ *
+ * Operands are field names, earlier metrics and decimal constants, with
+ * + - * / and parentheses. Functions: abs(x), min(a, ...), max(a, ...),
+ * integral(power) and integral(power, register).
+ *
+ * integral() sums the power (kW) between telegrams with the trapezoid
+ * rule into kWh. With a register it restarts from the register at every
+ * update of it, so it fills in the energy the register hasn't counted
+ * yet without drifting away from it.
+ *
+ * Each line is compiled into a small stack program over the fixed point
+ * values of dsmr_milli(); per telegram there is no parsing and no
+ * floating point. Results are appended to the telegram's line as
+ * ordinary fields with 3 decimals. A metric whose operands weren't all
+ * in the telegram, or that divides by zero, is left out.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "lineprotocol.h"
+#include "derived.h"
+
+static struct derived_metric metrics[DERIVED_METRICS];
+static int metricCount;
+
+static struct derived_integral integrals[DERIVED_INTEGRALS];
+static int integralCount;
+
+/**
+ * Compiler state of one expression
+ */
+struct compiler
+{
+    const char *p;
+    struct derived_metric *metric;
+    int depth; // Stack depth when the program so far runs
+    int error;
+};
+
+static void skipSpace(struct compiler *c)
+{
+    while (*c->p == ' ' || *c->p == '\t')
+        c->p++;
+}
+
+/**
+ * emit appends one instruction and tracks the stack depth
+ * @param pops values it takes from the stack, it pushes one
+ */
+static void emit(struct compiler *c, int code, int count, long long operand, int pops)
+{
+    struct derived_metric *m = c->metric;
+    if (m->length == DERIVED_PROGRAM_SIZE)
+    {
+        c->error = 1;
+        return;
+    }
+    m->program[m->length++] = (struct derived_op){
+        .code = code,
+        .count = count,
+        .operand = operand,
+    };
+    c->depth += 1 - pops;
+    if (c->depth > DERIVED_STACK_SIZE)
+        c->error = 1;
+}
+
+/**
+ * identifier copies [A-Za-z_][A-Za-z0-9_]* at c->p into name
+ * @returns its length, 0 when there is none or it doesn't fit
+ */
+static int identifier(struct compiler *c, char *name, int size)
+{
+    const char *start = c->p;
+    if (!isalpha((unsigned char)*c->p) && *c->p != '_')
+        return 0;
+    while (isalnum((unsigned char)*c->p) || *c->p == '_')
+        c->p++;
+    int length = c->p - start;
+    if (length >= size)
+        return 0;
+    memcpy(name, start, length);
+    name[length] = 0;
+    return length;
+}
+
+static int findMetric(const char *name)
+{
+    for (int i = 0; i < metricCount; i++)
+    {
+        if (!strcmp(metrics[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+static void expression(struct compiler *c);
+
+/**
+ * call compiles the arguments of a function up to its ')'
+ * @returns the number of arguments
+ */
+static int call(struct compiler *c)
+{
+    int count = 0;
+    skipSpace(c);
+    if (*c->p == ')')
+    {
+        c->p++;
+        return 0;
+    }
+    for (;;)
+    {
+        expression(c);
+        count++;
+        skipSpace(c);
+        if (*c->p == ')')
+        {
+            c->p++;
+            return count;
+        }
+        if (*c->p != ',' || c->error)
+        {
+            c->error = 1;
+            return count;
+        }
+        c->p++;
+    }
+}
+
+/**
+ * primary := number | name | function '(' arguments ')' | '(' expression ')'
+ */
+static void primary(struct compiler *c)
+{
+    skipSpace(c);
+    if (*c->p == '(')
+    {
+        c->p++;
+        expression(c);
+        skipSpace(c);
+        if (*c->p == ')')
+            c->p++;
+        else
+            c->error = 1;
+        return;
+    }
+    if (isdigit((unsigned char)*c->p) || *c->p == '.')
+    {
+        char *end;
+        double d = strtod(c->p, &end);
+        c->p = end;
+        emit(c, DERIVED_CONST, 0, (long long)(d * 1000 + 0.5), 0);
+        return;
+    }
+
+    char name[DERIVED_NAME_SIZE];
+    if (!identifier(c, name, sizeof(name)))
+    {
+        c->error = 1;
+        return;
+    }
+    skipSpace(c);
+    if (*c->p == '(')
+    {
+        c->p++;
+        int count = call(c);
+        if (!strcmp(name, "abs") && count == 1)
+            emit(c, DERIVED_ABS, 1, 0, 1);
+        else if (!strcmp(name, "min") && count >= 1)
+            emit(c, DERIVED_MIN, count, 0, count);
+        else if (!strcmp(name, "max") && count >= 1)
+            emit(c, DERIVED_MAX, count, 0, count);
+        else if (!strcmp(name, "integral") && (count == 1 || count == 2) &&
+                 integralCount < DERIVED_INTEGRALS)
+        {
+            emit(c, DERIVED_INTEGRAL, count, 0, count);
+            c->metric->program[c->metric->length - 1].slot = integralCount++;
+        }
+        else
+        {
+            printError(__func__, "Metric '%s': unknown function %s() or wrong arguments",
+                       c->metric->name, name);
+            c->error = 1;
+        }
+        return;
+    }
+
+    int index = dsmr_field_index(name);
+    if (index != -1)
+    {
+        emit(c, DERIVED_FIELD, 0, index, 0);
+        return;
+    }
+    index = findMetric(name);
+    if (index != -1)
+    {
+        emit(c, DERIVED_METRIC, 0, index, 0);
+        return;
+    }
+    printError(__func__, "Metric '%s': unknown field '%s'", c->metric->name, name);
+    c->error = 1;
+}
+
+/**
+ * unary := '-' unary | primary
+ */
+static void unary(struct compiler *c)
+{
+    skipSpace(c);
+    if (*c->p == '-')
+    {
+        c->p++;
+        unary(c);
+        emit(c, DERIVED_NEG, 0, 0, 1);
+        return;
+    }
+    primary(c);
+}
+
+/**
+ * term := unary (('*' | '/') unary)*
+ */
+static void term(struct compiler *c)
+{
+    unary(c);
+    for (;;)
+    {
+        skipSpace(c);
+        char op = *c->p;
+        if ((op != '*' && op != '/') || c->error)
+            return;
+        c->p++;
+        unary(c);
+        emit(c, op == '*' ? DERIVED_MUL : DERIVED_DIV, 0, 0, 2);
+    }
+}
+
+/**
+ * expression := term (('+' | '-') term)*
+ */
+static void expression(struct compiler *c)
+{
+    term(c);
+    for (;;)
+    {
+        skipSpace(c);
+        char op = *c->p;
+        if ((op != '+' && op != '-') || c->error)
+            return;
+        c->p++;
+        term(c);
+        emit(c, op == '+' ? DERIVED_ADD : DERIVED_SUB, 0, 0, 2);
+    }
+}
+
+/**
+ * compileMetric parses one "name = expression" line into m
+ * @returns 1 on success
+ */
+static int compileMetric(char *line, struct derived_metric *m)
+{
+    memset(m, 0, sizeof(*m));
+
+    struct compiler c = {.p = line, .metric = m};
+    if (!identifier(&c, m->name, sizeof(m->name)))
+        return 0;
+    skipSpace(&c);
+    if (*c.p++ != '=')
+        return 0;
+
+    // The results share the line with the telegram's own fields
+    if (dsmr_field_index(m->name) != -1 || findMetric(m->name) != -1)
+    {
+        printError(__func__, "Metric '%s': name already in use", m->name);
+        return 0;
+    }
+
+    int integralsBefore = integralCount;
+    expression(&c);
+    skipSpace(&c);
+    if (c.error || *c.p || c.depth != 1)
+    {
+        integralCount = integralsBefore;
+        return 0;
+    }
+
+    m->keyLength = lp_render_key(m->key, LP_KEY_SIZE, m->name, strlen(m->name));
+    return m->keyLength != -1;
+}
+
+/**
+ * sameMetric compares the compiled form of two metrics, so a reload that
+ * only touched comments or spacing counts as unchanged
+ */
+static int sameMetric(const struct derived_metric *a, const struct derived_metric *b)
+{
+    // compileMetric() zeroes the padding, memcmp() is exact
+    return !strcmp(a->name, b->name) && a->length == b->length &&
+           !memcmp(a->program, b->program, a->length * sizeof(*a->program));
+}
+
+/**
+ * derived_load compiles the metrics file in place of the loaded ones
+ * A missing file means no metrics, an unreadable one keeps them. The
+ * integrals start over unless the metrics compile the same as before.
+ * @returns the number of metrics loaded, -1 on error
+ */
+int derived_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL && errno != ENOENT)
+        return -1;
+
+    struct derived_integral running[DERIVED_INTEGRALS];
+    memcpy(running, integrals, sizeof(running));
+    int previousCount = metricCount;
+    int unchanged = 1;
+
+    metricCount = 0;
+    integralCount = 0;
+    memset(integrals, 0, sizeof(integrals));
+
+    char line[512];
+    int lineNumber = 0;
+    struct derived_metric previous;
+    int saved = -1; // Index of the metric in previous
+    while (f != NULL && fgets(line, sizeof(line), f) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        char *start = line + strspn(line, " \t");
+        if (*start == 0 || *start == '#')
+            continue;
+
+        if (metricCount == DERIVED_METRICS)
+        {
+            printError(__func__, "%s: only %d metrics are supported", path, DERIVED_METRICS);
+            break;
+        }
+        // An invalid line is compiled over the same slot as the next one
+        if (saved != metricCount)
+        {
+            previous = metrics[metricCount];
+            saved = metricCount;
+        }
+        if (!compileMetric(start, metrics + metricCount))
+        {
+            printError(__func__, "%s:%d: invalid metric, ignored", path, lineNumber);
+            continue;
+        }
+        unchanged &= metricCount < previousCount && sameMetric(&previous, metrics + metricCount);
+        metricCount++;
+    }
+    if (f != NULL)
+        fclose(f);
+
+    if (unchanged && metricCount == previousCount)
+    {
+        memcpy(integrals, running, sizeof(integrals));
+        return metricCount;
+    }
+
+    if (metricCount > 0)
+        printLog(__func__, "Loaded %d metrics from %s", metricCount, path);
+    return metricCount;
+}
+
+int derived_count(void)
+{
+    return metricCount;
+}
+
+/**
+ * integrate adds the power since the previous telegram
+ * @param power in W (kW milli)
+ * @param registerPresent when register (Wh) anchors the result
+ * @returns the energy in Wh (kWh milli)
+ */
+static long long integrate(struct derived_integral *s, time_t timestamp, long long power,
+                           int registerPresent, long long reg)
+{
+    if (registerPresent && (reg != s->anchor || !s->last))
+    {
+        // The register moved: it has counted everything up to now
+        if (s->last && reg > s->anchor)
+            s->step = reg - s->anchor;
+        s->anchor = reg;
+        s->sum = 0;
+    }
+    else if (s->last && timestamp > s->last && timestamp - s->last <= DERIVED_MAX_GAP)
+    {
+        s->sum += (s->previous + power) * (timestamp - s->last);
+    }
+    if (timestamp > s->last)
+        s->last = timestamp;
+    s->previous = power;
+
+    // W * s * 2 -> Wh
+    long long energy = s->sum / 7200;
+    // Never past where the register's next update will be
+    if (registerPresent && s->step > 0 && energy >= s->step)
+        energy = s->step - 1;
+    return s->anchor + energy;
+}
+
+/**
+ * run executes the program of m against the telegram
+ * @returns 1 when m->value is set
+ */
+static int run(struct derived_metric *m, struct dsmr_telegram *telegram)
+{
+    long long stack[DERIVED_STACK_SIZE];
+    unsigned char present[DERIVED_STACK_SIZE];
+    int top = 0;
+
+    for (int i = 0; i < m->length; i++)
+    {
+        const struct derived_op *op = m->program + i;
+        switch (op->code)
+        {
+        case DERIVED_FIELD:
+        {
+            struct dsmr_value *v = telegram->values + op->operand;
+            present[top] = v->present;
+            stack[top++] = v->present ? dsmr_milli(v) : 0;
+            continue;
+        }
+        case DERIVED_METRIC:
+            present[top] = metrics[op->operand].present;
+            stack[top++] = metrics[op->operand].value;
+            continue;
+        case DERIVED_CONST:
+            present[top] = 1;
+            stack[top++] = op->operand;
+            continue;
+        case DERIVED_NEG:
+            stack[top - 1] = -stack[top - 1];
+            continue;
+        case DERIVED_ABS:
+            if (stack[top - 1] < 0)
+                stack[top - 1] = -stack[top - 1];
+            continue;
+        case DERIVED_MIN:
+        case DERIVED_MAX:
+        {
+            int first = top - op->count;
+            for (int j = first + 1; j < top; j++)
+            {
+                present[first] &= present[j];
+                if (op->code == DERIVED_MIN ? stack[j] < stack[first] : stack[j] > stack[first])
+                    stack[first] = stack[j];
+            }
+            top = first + 1;
+            continue;
+        }
+        case DERIVED_INTEGRAL:
+        {
+            // The power is below the register, if there is one
+            int first = top - op->count;
+            int registerPresent = op->count == 2 && present[top - 1];
+            if (!present[first] || (op->count == 2 && !registerPresent) || !telegram->timestamp)
+            {
+                present[first] = 0;
+            }
+            else
+            {
+                stack[first] = integrate(integrals + op->slot, telegram->timestamp,
+                                         stack[first], registerPresent, stack[top - 1]);
+                present[first] = 1;
+            }
+            top = first + 1;
+            continue;
+        }
+        default:
+            break;
+        }
+
+        // Binary operators
+        long long b = stack[--top];
+        long long a = stack[top - 1];
+        present[top - 1] &= present[top];
+        switch (op->code)
+        {
+        case DERIVED_ADD:
+            stack[top - 1] = a + b;
+            break;
+        case DERIVED_SUB:
+            stack[top - 1] = a - b;
+            break;
+        case DERIVED_MUL:
+            stack[top - 1] = a * b / 1000;
+            break;
+        case DERIVED_DIV:
+            if (b == 0)
+                present[top - 1] = 0;
+            else
+                stack[top - 1] = a * 1000 / b;
+            break;
+        }
+    }
+
+    m->value = stack[0];
+    m->present = present[0];
+    return m->present;
+}
+
+/**
+ * derived_evaluate computes every metric and appends the present ones
+ * to the telegram's line, call it before lp_end()
+ * @returns the number of fields appended
+ */
+int derived_evaluate(struct lp_encoder *enc, struct dsmr_telegram *telegram)
+{
+    int fields = 0;
+    for (int i = 0; i < metricCount; i++)
+    {
+        struct derived_metric *m = metrics + i;
+        if (run(m, telegram) && lp_field_fixed(enc, m->key, m->keyLength, m->value, 3))
+            fields++;
+    }
+    return fields;
+}
@@ -0,0 +1,72 @@
+#ifndef DERIVED_H
+#define DERIVED_H
+
+#include <time.h>
+
+#include "DSMR.h"
+#include "lineprotocol.h"
+
+#define DERIVED_METRICS 32
+#define DERIVED_NAME_SIZE 48
+#define DERIVED_PROGRAM_SIZE 48 // Instructions per expression
+#define DERIVED_STACK_SIZE 16
+#define DERIVED_INTEGRALS 16 // integral() calls over all expressions
+#define DERIVED_MAX_GAP 60   // Seconds between telegrams an integral bridges
+
+enum derived_opcode
+{
+    DERIVED_FIELD,    // Push telegram value operand
+    DERIVED_METRIC,   // Push the result of an earlier expression
+    DERIVED_CONST,    // Push operand
+    DERIVED_ADD,
+    DERIVED_SUB,
+    DERIVED_MUL,
+    DERIVED_DIV,
+    DERIVED_NEG,
+    DERIVED_ABS,
+    DERIVED_MIN,      // Of the top count values
+    DERIVED_MAX,
+    DERIVED_INTEGRAL, // Of the power, below a register when count is 2
+};
+
+struct derived_op
+{
+    unsigned char code;
+    unsigned char count; // Arguments of MIN, MAX and INTEGRAL
+    unsigned char slot;  // Integral state of INTEGRAL
+    long long operand;   // Value of CONST, index of FIELD and METRIC
+};
+
+/**
+ * Running integral in milli units times seconds, trapezoidal
+ */
+struct derived_integral
+{
+    time_t last;        // Timestamp of previous, 0 before the first sample
+    long long previous; // Last sample
+    long long sum;      // Twice the area since anchor
+    long long anchor;   // Register value the area adds to, 0 without one
+    long long step;     // Smallest register increment, 0 without a register
+};
+
+/**
+ * Compiled expression, results are milli units like dsmr_milli()
+ */
+struct derived_metric
+{
+    char name[DERIVED_NAME_SIZE];
+    char key[LP_KEY_SIZE];
+    int keyLength;
+
+    struct derived_op program[DERIVED_PROGRAM_SIZE];
+    int length;
+
+    long long value;
+    int present; // Every value it needs was in the telegram
+};
+
+int derived_load(const char *path);
+int derived_evaluate(struct lp_encoder *enc, struct dsmr_telegram *telegram);
+int derived_count(void);
+
+#endif
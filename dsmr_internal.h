@@ -0,0 +1,36 @@
+#ifndef DSMR_INTERNAL_H
+#define DSMR_INTERNAL_H
+
+/**
+ * Internals shared by the sources of libdsmr and the daemon, neither
+ * installed nor exported by libdsmr.so: the stage hook of the profiler,
+ * the value stores p1parser.c shares with decodeLine() and the encoder
+ * setup that allocates its arena.
+ */
+#include "DSMR.h"
+#include "lineprotocol.h"
+
+/**
+ * Stages of decodeLine(), see dsmr_set_stage_hook()
+ */
+enum dsmr_stage
+{
+    DSMR_STAGE_KEY,    // decodeOBISHashKey()
+    DSMR_STAGE_LOOKUP, // findOBISOIDByHash()
+    DSMR_STAGE_VALUE,  // fetchValue() and the fixed point conversion
+    DSMR_STAGE_ENCODE, // lp_field()
+    DSMR_STAGES,
+};
+typedef void (*dsmr_stage_hook)(enum dsmr_stage stage, int done);
+
+void dsmr_set_stage_hook(dsmr_stage_hook hook);
+void dsmr_store_value(struct dsmr_value *dst, COSEMType type, char *value, int length);
+int dsmr_mbus_key(unsigned short hash);
+int dsmr_store_mbus(struct dsmr_telegram *telegram, int key, int group, char *value, int length);
+
+#ifndef DSMR_EMBEDDED
+int lp_init(struct lp_encoder *enc, const char *measurement, const char *tags, int capacity);
+void lp_free(struct lp_encoder *enc);
+#endif
+
+#endif
@@ -0,0 +1,171 @@
+#ifndef DSMR_SHM_H
+#define DSMR_SHM_H
+
+/**
+ * dsmr_shm.h - Latest decoded telegram in shared memory
+ *
+ * Header-only reader for local consumers (display panel, load controller).
+ * The daemon publishes every decoded telegram into /dev/shm/dsmr; readers
+ * map it read-only and copy a consistent snapshot without any syscall.
+ *
+ * Usage:
+ * struct dsmr_shm_reader reader;
+ * if (dsmr_shm_open(&reader, DSMR_SHM_NAME) == 0)
+ * {
+ *     struct dsmr_shm_values v;
+ *     if (dsmr_shm_read(&reader, &v) == 1 && (v.present & DSMR_SHM_POWER_DELIVERED))
+ *         printf("%lld W\n", (long long)v.power_delivered);
+ *     dsmr_shm_close(&reader);
+ * }
+ *
+ * Consistency is guaranteed with a seqlock: the writer makes the sequence
+ * odd, updates the values and makes it even again. A reader retries when
+ * the sequence was odd or changed while copying, DSMR_SHM_READ_RETRIES
+ * times at most in case the writer died halfway. Readers only ever read,
+ * so they can never block or corrupt the writer.
+ *
+ * Layout (version 1, little endian as on the host, 8 byte aligned):
+ * | Offset | Type     | Field                                          |
+ * |   0    | uint32_t | magic 0x52534d44 "DSMR"                        |
+ * |   4    | uint32_t | version                                        |
+ * |   8    | uint32_t | size of struct dsmr_shm_values                 |
+ * |  12    | uint32_t | reserved                                       |
+ * |  16    | uint64_t | sequence, odd while the writer is updating     |
+ * |  24    | struct dsmr_shm_values                                    |
+ *
+ * Energy in Wh, power in W, timestamps in Unix seconds.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define DSMR_SHM_NAME "/dsmr"
+#define DSMR_SHM_MAGIC 0x52534d44
+#define DSMR_SHM_VERSION 1
+#define DSMR_SHM_READ_RETRIES 100000 // The writer holds the lock for well under a microsecond
+
+/**
+ * Bits in dsmr_shm_values.present
+ */
+enum dsmr_shm_present
+{
+    DSMR_SHM_ENERGY_DELIVERED_TARIFF_1 = 1 << 0, // 1-0:1.8.1
+    DSMR_SHM_ENERGY_DELIVERED_TARIFF_2 = 1 << 1, // 1-0:1.8.2
+    DSMR_SHM_ENERGY_RECEIVED_TARIFF_1 = 1 << 2,  // 1-0:2.8.1
+    DSMR_SHM_ENERGY_RECEIVED_TARIFF_2 = 1 << 3,  // 1-0:2.8.2
+    DSMR_SHM_POWER_DELIVERED = 1 << 4,           // 1-0:1.7.0
+    DSMR_SHM_POWER_RECEIVED = 1 << 5,            // 1-0:2.7.0
+    DSMR_SHM_POWER_DELIVERED_L1 = 1 << 6,        // 1-0:21.7.0
+    DSMR_SHM_POWER_DELIVERED_L2 = 1 << 7,        // 1-0:41.7.0
+    DSMR_SHM_POWER_DELIVERED_L3 = 1 << 8,        // 1-0:61.7.0
+    DSMR_SHM_POWER_RECEIVED_L1 = 1 << 9,         // 1-0:22.7.0
+    DSMR_SHM_POWER_RECEIVED_L2 = 1 << 10,        // 1-0:42.7.0
+    DSMR_SHM_POWER_RECEIVED_L3 = 1 << 11,        // 1-0:62.7.0
+    DSMR_SHM_MAX_DEMAND_MONTH = 1 << 12,         // 1-0:1.6.0
+};
+
+struct dsmr_shm_values
+{
+    int64_t timestamp;  // 0-0:1.0.0, Unix time of the telegram
+    uint64_t telegrams; // Number of telegrams published since the daemon started
+    uint32_t present;   // enum dsmr_shm_present bits valid in this telegram
+    uint32_t reserved;
+
+    int64_t energy_delivered_tariff_1;
+    int64_t energy_delivered_tariff_2;
+    int64_t energy_received_tariff_1;
+    int64_t energy_received_tariff_2;
+
+    int64_t power_delivered;
+    int64_t power_received;
+    int64_t power_delivered_l1;
+    int64_t power_delivered_l2;
+    int64_t power_delivered_l3;
+    int64_t power_received_l1;
+    int64_t power_received_l2;
+    int64_t power_received_l3;
+
+    int64_t max_demand_month;
+    int64_t max_demand_month_timestamp;
+};
+
+struct dsmr_shm
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t reserved;
+    uint64_t sequence;
+    struct dsmr_shm_values values;
+};
+
+struct dsmr_shm_reader
+{
+    const struct dsmr_shm *shm;
+};
+
+/**
+ * dsmr_shm_open maps the segment read-only and checks its layout
+ * @returns 0 on success, -1 if it doesn't exist or has another version
+ */
+static inline int dsmr_shm_open(struct dsmr_shm_reader *reader, const char *name)
+{
+    reader->shm = NULL;
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd == -1)
+        return -1;
+
+    void *map = mmap(NULL, sizeof(struct dsmr_shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct dsmr_shm *shm = (const struct dsmr_shm *)map;
+    if (shm->magic != DSMR_SHM_MAGIC || shm->version != DSMR_SHM_VERSION ||
+        shm->size != sizeof(struct dsmr_shm_values))
+    {
+        munmap(map, sizeof(struct dsmr_shm));
+        return -1;
+    }
+
+    reader->shm = shm;
+    return 0;
+}
+
+static inline void dsmr_shm_close(struct dsmr_shm_reader *reader)
+{
+    if (reader->shm != NULL)
+        munmap((void *)reader->shm, sizeof(struct dsmr_shm));
+    reader->shm = NULL;
+}
+
+/**
+ * dsmr_shm_read copies a consistent snapshot of the latest values
+ * @returns 1 on success, 0 if nothing was published yet, -1 when no
+ *  consistent snapshot came through, the writer died while updating
+ */
+static inline int dsmr_shm_read(const struct dsmr_shm_reader *reader, struct dsmr_shm_values *out)
+{
+    const struct dsmr_shm *shm = reader->shm;
+    uint64_t before, after;
+
+    for (int i = 0; i < DSMR_SHM_READ_RETRIES; i++)
+    {
+        before = __atomic_load_n(&shm->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue; // Writer is busy, it never holds this for long
+
+        memcpy(out, (const void *)&shm->values, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&shm->sequence, __ATOMIC_RELAXED);
+        if (before == after)
+            return before != 0;
+    }
+    return -1;
+}
+
+#endif
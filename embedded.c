@@ -0,0 +1,149 @@
+/**
+ * embedded.c - The daemon of the embedded profile
+ *
+ * Everything is sized at compile time and lives in static storage: the
+ * P1 parser, the line protocol arena, the telegram and the Influx write
+ * queue. The build of the profile fails when any of its
+ * objects references malloc(), see footprint.cmake. The outside world is
+ * only reached through platform.h.
+ *
+ * Bytes from the P1 port go straight into the incremental parser, no line
+ * is buffered. Fields are encoded as soon as their ')' arrives and a
+ * telegram is only queued for Influx when its CRC matches.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "embedded.h"
+#include "http.h"
+#include "influx.h"
+#include "lineprotocol.h"
+#include "p1parser.h"
+#include "platform.h"
+
+static char arena[EMBEDDED_ARENA_SIZE];
+static struct lp_encoder encoder;
+static struct dsmr_telegram telegram;
+static struct influx_config influx;
+static struct p1_parser p1;
+
+/**
+ * setting
+ * @returns the setting or fallback when it's missing or empty
+ */
+static const char *setting(const char *name, const char *fallback)
+{
+    const char *value = platform_setting(name);
+    return value != NULL && *value ? value : fallback;
+}
+
+/**
+ * onP1 turns the events of the P1 parser into line protocol
+ */
+static void onP1(struct p1_parser *parser, enum p1_event event, int index,
+                 const char *value, int length)
+{
+    switch (event)
+    {
+    case P1_TELEGRAM:
+        // Start of a new telegram, drop any partial one
+        lp_reset(&encoder);
+        lp_begin(&encoder);
+        break;
+    case P1_FIELD:
+    {
+        const struct hashkeyval *kv = dsmr_field(index);
+        lp_field(&encoder, kv->key, kv->keylen, value, length);
+        break;
+    }
+    case P1_END:
+        if (!lp_end(&encoder, telegram.timestamp))
+            printError(__func__, "Dropping telegram, nothing decoded or arena full");
+        else if (!influx_enqueue(&influx, encoder.buffer, encoder.length))
+            printError(__func__, "Queueing %d bytes for InfluxDB failed", encoder.length);
+        break;
+    case P1_CRC_ERROR:
+        printError(__func__, "Dropping telegram, CRC mismatch (sent %04X, computed %04X)",
+                   parser->sentCRC, parser->crc);
+        break;
+    }
+}
+
+/**
+ * embedded_init sets up the encoder and the Influx connection
+ * An Influx that's down at startup is retried by influx_pump().
+ * @returns 1 on success, 0 on error
+ */
+int embedded_init(void)
+{
+    setupLogs();
+    if (!dsmr_init())
+        return 0;
+
+    if (!lp_init_buffer(&encoder, setting("INFLUX_MEASUREMENT", "meter"),
+                        setting("INFLUX_TAGS", NULL), arena, sizeof(arena)))
+        return 0;
+
+    // influx_init() keeps these pointers, settings are never freed
+    char *host = (char *)setting("INFLUX_HOST", NULL);
+    char *token = (char *)setting("INFLUX_TOKEN", NULL);
+    char *organisation = (char *)setting("INFLUX_ORG", NULL);
+    char *bucket = (char *)setting("INFLUX_BUCKET", NULL);
+    if (host == NULL || token == NULL || organisation == NULL || bucket == NULL)
+    {
+        printError(__func__, "INFLUX_HOST, INFLUX_TOKEN, INFLUX_ORG and INFLUX_BUCKET are needed");
+        return 0;
+    }
+
+    struct http_config hconfig = http_init(host, atoi(setting("INFLUX_PORT", "8086")));
+    influx = influx_init(&hconfig, organisation, bucket, token);
+    influx_set_window(&influx, atoi(setting("INFLUX_WINDOW", "1")));
+
+    if (!influx_connect(&influx))
+        printError(__func__, "Couldn't connect to Influx, retrying in the background");
+    else if (!influx_authenticate(&influx))
+        printError(__func__, "Couldn't authenticate Influx connection");
+
+    p1_init(&p1, &telegram, onP1, NULL);
+    return 1;
+}
+
+/**
+ * embedded_feed takes bytes from the P1 port, any amount at a time
+ */
+void embedded_feed(const char *data, int length)
+{
+    while (length > 0)
+    {
+        int used = p1_feed(&p1, data, length);
+        data += used;
+        length -= used;
+    }
+}
+
+/**
+ * embedded_run feeds the P1 input and keeps the Influx queue moving
+ */
+void embedded_run(void)
+{
+    char buffer[EMBEDDED_READ_SIZE];
+    for (;;)
+    {
+        int n = platform_serial_read(buffer, sizeof(buffer), EMBEDDED_POLL_MS);
+        if (n < 0)
+        {
+            printError(__func__, "P1 input closed");
+            break;
+        }
+        if (n > 0)
+            embedded_feed(buffer, n);
+        influx_pump(&influx);
+    }
+
+    // Give Influx a moment for what is still queued
+    int queued = influx_flush(&influx, INFLUX_REQUEST_TIMEOUT);
+    if (queued > 0)
+        printError(__func__, "%d batches didn't make it to InfluxDB", queued);
+}
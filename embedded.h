@@ -0,0 +1,18 @@
+#ifndef EMBEDDED_H
+#define EMBEDDED_H
+
+#define EMBEDDED_ARENA_SIZE 2048 // Line protocol of one telegram
+#define EMBEDDED_READ_SIZE 256   // Bytes taken from the serial port at once
+#define EMBEDDED_POLL_MS 100
+
+/**
+ * Daemon of the embedded profile (DSMR_EMBEDDED)
+ *
+ * Settings come from platform_setting() with the names of config.env.
+ * embedded_run() only returns when the P1 input is gone.
+ */
+int embedded_init(void);
+void embedded_feed(const char *data, int length);
+void embedded_run(void);
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * fetch.c - Prints a telegram from the raw telegram archive
+ *
+ * Usage:
+ * dsmr-fetch [-d dir] time
+ *  -d    archive directory (DSMR_ARCHIVE)
+ *  time  Unix time or local "YYYY-MM-DD HH:MM:SS"
+ *
+ * Writes the last telegram at or before time to stdout, byte
+ * for byte as the meter sent it, and its timestamp to stderr. The CRC is
+ * checked before anything is printed.
+ */
+#define _GNU_SOURCE // strptime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "archive.h"
+
+/**
+ * parseTime
+ * @returns Unix time or -1 when time is neither format
+ */
+static time_t parseTime(const char *time)
+{
+    char *end;
+    long long seconds = strtoll(time, &end, 10);
+    if (*time && !*end)
+        return seconds;
+
+    struct tm tm = {.tm_isdst = -1};
+    end = strptime(time, "%Y-%m-%d %H:%M:%S", &tm);
+    if (end == NULL || *end)
+        return -1;
+    return mktime(&tm);
+}
+
+int main(int argc, char *argv[])
+{
+    setupLogs();
+
+    const char *dir = getenv("DSMR_ARCHIVE");
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-d"))
+    {
+        dir = argv[2];
+        first = 3;
+    }
+    time_t timestamp = first < argc ? parseTime(argv[first]) : -1;
+    if (first + 1 != argc || timestamp == -1 || dir == NULL || !*dir)
+    {
+        fprintf(stderr, "Usage: %s [-d dir] unixtime|\"YYYY-MM-DD HH:MM:SS\"\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    static char telegram[ARCHIVE_TELEGRAM_SIZE];
+    int length = archive_fetch(dir, &timestamp, telegram, sizeof(telegram));
+    if (length == -1)
+        return EXIT_FAILURE;
+
+    char when[32];
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&timestamp, &tm));
+    fprintf(stderr, "%s (%lld), CRC ok\n", when, (long long)timestamp);
+    fwrite(telegram, 1, length, stdout);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,51 @@
+# footprint.cmake - RAM/ROM report of a build, run after linking
+#
+# cmake -DFILE=<binary or static library> -DSIZE=<size> [-DNM=<nm> -DFORBIDDEN=<a;b>] -P footprint.cmake
+#
+# ROM is text + data (initial values are stored in flash), RAM is data + bss.
+# With FORBIDDEN the build fails when an object references one of those
+# symbols, that's how the embedded profile proves it never touches the heap.
+
+if(SIZE)
+    execute_process(COMMAND ${SIZE} -t ${FILE} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    if(result EQUAL 0)
+        # Last line holds the totals: text data bss dec hex name
+        string(STRIP "${output}" output)
+        string(REGEX MATCH "[^\n]*$" totals "${output}")
+        string(REGEX MATCHALL "[0-9]+" numbers "${totals}")
+        list(GET numbers 0 text)
+        list(GET numbers 1 data)
+        list(GET numbers 2 bss)
+        math(EXPR rom "${text} + ${data}")
+        math(EXPR ram "${data} + ${bss}")
+        get_filename_component(name ${FILE} NAME)
+        message(STATUS "Footprint of ${name}: ROM ${rom} bytes (text ${text}, data ${data}), RAM ${ram} bytes (data ${data}, bss ${bss})")
+    endif()
+endif()
+
+if(FORBIDDEN)
+    execute_process(COMMAND ${NM} -u ${FILE} OUTPUT_VARIABLE output RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "${NM} failed on ${FILE}")
+    endif()
+
+    string(REPLACE "\n" ";" lines "${output}")
+    set(object "")
+    set(offenders "")
+    foreach(line IN LISTS lines)
+        if(line MATCHES "^(.+):$")
+            set(object ${CMAKE_MATCH_1})
+        elseif(line MATCHES "U ([A-Za-z_0-9]+)$")
+            list(FIND FORBIDDEN ${CMAKE_MATCH_1} index)
+            if(NOT index EQUAL -1)
+                list(APPEND offenders "${object}: ${CMAKE_MATCH_1}")
+            endif()
+        endif()
+    endforeach()
+
+    if(offenders)
+        string(REPLACE ";" "\n  " offenders "${offenders}")
+        message(FATAL_ERROR "Not allowed in the embedded profile:\n  ${offenders}")
+    endif()
+    message(STATUS "No heap or hosted-only symbols in ${FILE}")
+endif()
@@ -0,0 +1,665 @@
+/**
+ * generator.c - Synthetic e-MUCS (DSMR 5) telegrams for stress testing
+ *
+ * Usage:
+ * dsmr-generate [-r rate] [-m meters] [-n count] [-o output]
+ *  -r  telegrams per second over all meters, 0 for as fast as possible (1)
+ *  -m  number of simulated meters, each with its own identifiers (1)
+ *  -n  stop after count telegrams, 0 runs forever (0)
+ *  -o  where telegrams go (-):
+ *      -               stdout
+ *      file:path       a file
+ *      pty             a pseudo terminal, its name is logged, use it as TTY
+ *      tcp:host:port   one connection per meter, like the ingest server expects
+ *
+ * The meters share a simulated clock that advances one second after every
+ * meter sent a telegram, so -r equal to -m is real time at 1 Hz and higher
+ * rates fast forward. Every meter has its own household: noisy per phase
+ * consumption with appliances switching, solar export during the day, day
+ * and night tariff, a gas reading every 5 minutes and now and then a long
+ * 0-0:96.13.0 message. All telegrams carry a valid CRC16.
+ *
+ * Progress goes to stderr so stdout can carry the telegrams.
+ */
+#define _GNU_SOURCE // posix_openpt flags
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "crc16.h"
+
+#define GENERATOR_TELEGRAM_SIZE 4096
+#define GENERATOR_BUFFER_SIZE (256 * 1024) // Telegrams gathered per write
+#define GENERATOR_MESSAGE_CHANCE 3600       // One in n telegrams has a text message
+#define GENERATOR_MESSAGE_SIZE 1024         // Longest message in characters
+#define GENERATOR_GAS_INTERVAL 300
+#define GENERATOR_HISTORY_MONTHS 13
+#define GENERATOR_HISTORY_SIZE 640 // 24 + 13 * 40
+
+/**
+ * Simulated second, shared by all meters
+ * Timestamps are rendered once per tick, localtime() isn't cheap
+ */
+struct gen_tick
+{
+    time_t now;
+    struct tm tm;
+    int month; // year * 12 + month
+    char timestamp[16];
+    time_t gasTime;
+    char gasTimestamp[16];
+};
+
+/**
+ * Simulated household behind one meter
+ * Energy in mWh, power in W
+ */
+struct gen_meter
+{
+    unsigned int rng;
+    char id[64];    // Hex encoded equipment identifier
+    char gasId[64]; // Hex encoded gas meter identifier
+
+    long long imported[2]; // Per tariff
+    long long exported[2];
+    int load[3];   // Consumption per phase
+    int solarPeak; // Installed solar power, 0 without panels
+
+    long long quarterEnergy; // Imported in the running quarter
+    int maxDemand;           // Highest quarter average this month
+    time_t maxDemandTime;
+    char maxDemandTimestamp[16];
+    int history[GENERATOR_HISTORY_MONTHS]; // Monthly peaks
+
+    // 0-0:98.1.0 values, rendered again when the month changes
+    char historyLine[GENERATOR_HISTORY_SIZE];
+    int historyLength;
+    int historyMonth;
+
+    long long gas; // dm3
+
+    int fd; // Own connection in tcp mode, -1 otherwise
+};
+
+static struct gen_meter *meters;
+static int meterCount = 1;
+
+static int outputfd = -1; // Shared output for stdout, file and pty
+static char *outputBuffer;
+static int outputLength;
+
+static volatile sig_atomic_t stop;
+
+static unsigned int nextRandom(struct gen_meter *meter)
+{
+    // xorshift32, plenty for noise
+    unsigned int x = meter->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return meter->rng = x;
+}
+
+/**
+ * randomBetween
+ * @returns a number in [low, high]
+ */
+static int randomBetween(struct gen_meter *meter, int low, int high)
+{
+    return low + (int)(nextRandom(meter) % (unsigned int)(high - low + 1));
+}
+
+/**
+ * putDigits writes value zero padded to width digits
+ * @returns the position behind the digits
+ */
+static char *putDigits(char *p, long long value, int width)
+{
+    for (int i = width - 1; i >= 0; i--)
+    {
+        p[i] = '0' + value % 10;
+        value /= 10;
+    }
+    return p + width;
+}
+
+/**
+ * putFixed writes value / 10^decimals as Fn(decimals,decimals)
+ * with integer digits before the point, e.g. (1234, 3, 3) -> 001.234
+ */
+static char *putFixed(char *p, long long value, int integer, int decimals)
+{
+    long long scale = 1;
+    for (int i = 0; i < decimals; i++)
+        scale *= 10;
+    p = putDigits(p, value / scale, integer);
+    if (decimals)
+    {
+        *p++ = '.';
+        p = putDigits(p, value % scale, decimals);
+    }
+    return p;
+}
+
+static char *putString(char *p, const char *s)
+{
+    size_t length = strlen(s);
+    memcpy(p, s, length);
+    return p + length;
+}
+
+static char *putHex(char *p, const char *s, int length)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    for (int i = 0; i < length; i++)
+    {
+        *p++ = hex[(unsigned char)s[i] >> 4];
+        *p++ = hex[(unsigned char)s[i] & 0xf];
+    }
+    return p;
+}
+
+/**
+ * putTimestamp writes YYMMDDhhmmssX in local time, X is S in summer
+ */
+static char *putTimestamp(char *p, time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    p = putDigits(p, tm.tm_year % 100, 2);
+    p = putDigits(p, tm.tm_mon + 1, 2);
+    p = putDigits(p, tm.tm_mday, 2);
+    p = putDigits(p, tm.tm_hour, 2);
+    p = putDigits(p, tm.tm_min, 2);
+    p = putDigits(p, tm.tm_sec, 2);
+    *p++ = tm.tm_isdst > 0 ? 'S' : 'W';
+    return p;
+}
+
+static void initMeter(struct gen_meter *meter, int index)
+{
+    memset(meter, 0, sizeof(*meter));
+    meter->rng = (2463534242u ^ (index * 2654435761u)) | 1; // xorshift never leaves 0
+    meter->fd = -1;
+
+    char id[32];
+    int length = snprintf(id, sizeof(id), "1SAG%010d", index);
+    *putHex(meter->id, id, length) = 0;
+    length = snprintf(id, sizeof(id), "7FLO%010d", index);
+    *putHex(meter->gasId, id, length) = 0;
+
+    // A few years worth of registers, every household a bit different
+    for (int t = 0; t < 2; t++)
+    {
+        meter->imported[t] = randomBetween(meter, 1000, 20000) * 1000000LL;
+        meter->exported[t] = randomBetween(meter, 0, 8000) * 1000000LL;
+    }
+    for (int i = 0; i < 3; i++)
+        meter->load[i] = randomBetween(meter, 50, 400);
+    meter->solarPeak = randomBetween(meter, 0, 2) ? randomBetween(meter, 2000, 8000) : 0;
+    for (int i = 0; i < GENERATOR_HISTORY_MONTHS; i++)
+        meter->history[i] = randomBetween(meter, 2500, 9000);
+    meter->gas = randomBetween(meter, 1000, 9000) * 1000LL;
+}
+
+/**
+ * step advances the household by one second of simulated time
+ * net receives the power per phase, negative when exporting
+ */
+static void step(struct gen_meter *meter, const struct tm *tm, int tariff, int net[3])
+{
+    double hour = tm->tm_hour + tm->tm_min / 60.0;
+
+    // Solar: a sine from 6h to 20h
+    int solar = 0;
+    if (meter->solarPeak && hour > 6 && hour < 20)
+        solar = meter->solarPeak * sin(M_PI * (hour - 6) / 14);
+
+    long long imported = 0, exported = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        // Noise and now and then an appliance switching
+        meter->load[i] += randomBetween(meter, -25, 25);
+        if (randomBetween(meter, 0, 599) == 0)
+            meter->load[i] += randomBetween(meter, 0, 1) ? 2000 : -2000;
+        if (meter->load[i] < 40)
+            meter->load[i] = 40;
+        if (meter->load[i] > 7000)
+            meter->load[i] = 7000;
+
+        net[i] = meter->load[i] - solar / 3 + randomBetween(meter, -5, 5);
+        if (net[i] > 0)
+            imported += net[i];
+        else
+            exported -= net[i];
+    }
+
+    // W for one second is 1000/3600 mWh
+    meter->imported[tariff] += imported * 1000 / 3600;
+    meter->exported[tariff] += exported * 1000 / 3600;
+    meter->quarterEnergy += imported * 1000 / 3600;
+
+    // Gas heating, mostly in the morning and evening
+    if (hour < 9 || hour > 17)
+        meter->gas += randomBetween(meter, 0, 3) == 0;
+}
+
+/**
+ * renderHistory renders the monthly peaks of the 13 months before tick
+ */
+static void renderHistory(struct gen_meter *meter, const struct gen_tick *tick)
+{
+    char *p = meter->historyLine;
+    p = putDigits(p, GENERATOR_HISTORY_MONTHS, 2);
+    p = putString(p, ")(1-0:1.6.0)(1-0:1.6.0)");
+
+    // Oldest first
+    for (int i = 0; i < GENERATOR_HISTORY_MONTHS; i++)
+    {
+        struct tm start = {
+            .tm_year = tick->tm.tm_year,
+            .tm_mon = tick->tm.tm_mon - (GENERATOR_HISTORY_MONTHS - i),
+            .tm_mday = 1,
+            .tm_isdst = -1,
+        };
+        time_t period = mktime(&start);
+        *p++ = '(';
+        p = putTimestamp(p, period);
+        p = putString(p, ")(");
+        p = putTimestamp(p, period + 86400 * (i % 27) + 900 * (meter->history[i] % 80));
+        p = putString(p, ")(");
+        p = putFixed(p, meter->history[i], 2, 3);
+        p = putString(p, "*kW)");
+    }
+    meter->historyLength = p - meter->historyLine;
+    meter->historyMonth = tick->month;
+}
+
+/**
+ * render writes one complete telegram with CRC
+ * @returns its length
+ */
+static int render(struct gen_meter *meter, char *buffer, const struct gen_tick *tick)
+{
+    const struct tm *tm = &tick->tm;
+    time_t now = tick->now;
+
+    // Day tariff on weekdays from 7 to 22
+    int tariff = tm->tm_wday > 0 && tm->tm_wday < 6 && tm->tm_hour >= 7 && tm->tm_hour < 22 ? 0 : 1;
+    int net[3];
+    step(meter, tm, tariff, net);
+
+    // Quarter hour demand
+    int elapsed = now % 900 + 1;
+    int average = meter->quarterEnergy * 3600 / 1000 / elapsed;
+    if (elapsed == 900 || meter->maxDemandTime == 0)
+    {
+        if (tm->tm_mday == 1 && tm->tm_hour == 0 && tm->tm_min < 15)
+            meter->maxDemand = 0; // New month
+        if (average > meter->maxDemand || meter->maxDemandTime == 0)
+        {
+            meter->maxDemand = average;
+            meter->maxDemandTime = now - now % 900;
+            *putTimestamp(meter->maxDemandTimestamp, meter->maxDemandTime) = 0;
+        }
+        if (elapsed == 900)
+            meter->quarterEnergy = 0;
+    }
+    if (meter->historyMonth != tick->month)
+        renderHistory(meter, tick);
+
+    char *p = buffer;
+    p = putString(p, "/FLU5\\253769484_A\r\n\r\n0-0:96.1.4(50217)\r\n0-0:96.1.1(");
+    p = putString(p, meter->id);
+    p = putString(p, ")\r\n0-0:1.0.0(");
+    p = putString(p, tick->timestamp);
+
+    static const char *registers[4] = {"1-0:1.8.1(", "1-0:1.8.2(", "1-0:2.8.1(", "1-0:2.8.2("};
+    long long values[4] = {meter->imported[0], meter->imported[1],
+                           meter->exported[0], meter->exported[1]};
+    for (int i = 0; i < 4; i++)
+    {
+        p = putString(p, ")\r\n");
+        p = putString(p, registers[i]);
+        p = putFixed(p, values[i] / 1000, 6, 3);
+        p = putString(p, "*kWh");
+    }
+
+    p = putString(p, ")\r\n0-0:96.14.0(");
+    p = putDigits(p, tariff + 1, 4);
+    p = putString(p, ")\r\n1-0:1.4.0(");
+    p = putFixed(p, average, 2, 3);
+    p = putString(p, "*kW)\r\n1-0:1.6.0(");
+    p = putString(p, meter->maxDemandTimestamp);
+    p = putString(p, ")(");
+    p = putFixed(p, meter->maxDemand, 2, 3);
+    p = putString(p, "*kW)\r\n0-0:98.1.0(");
+    memcpy(p, meter->historyLine, meter->historyLength);
+    p += meter->historyLength;
+
+    int imported = 0, exported = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        imported += net[i] > 0 ? net[i] : 0;
+        exported += net[i] < 0 ? -net[i] : 0;
+    }
+    p = putString(p, "\r\n1-0:1.7.0(");
+    p = putFixed(p, imported, 2, 3);
+    p = putString(p, "*kW)\r\n1-0:2.7.0(");
+    p = putFixed(p, exported, 2, 3);
+
+    static const char *phases[2][3] = {{"1-0:21.7.0(", "1-0:41.7.0(", "1-0:61.7.0("},
+                                       {"1-0:22.7.0(", "1-0:42.7.0(", "1-0:62.7.0("}};
+    for (int direction = 0; direction < 2; direction++)
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            int power = direction ? -net[i] : net[i];
+            p = putString(p, "*kW)\r\n");
+            p = putString(p, phases[direction][i]);
+            p = putFixed(p, power > 0 ? power : 0, 2, 3);
+        }
+    }
+    p = putString(p, "*kW");
+
+    static const char *voltages[3] = {"1-0:32.7.0(", "1-0:52.7.0(", "1-0:72.7.0("};
+    static const char *currents[3] = {"1-0:31.7.0(", "1-0:51.7.0(", "1-0:71.7.0("};
+    int voltage[3];
+    for (int i = 0; i < 3; i++)
+    {
+        voltage[i] = randomBetween(meter, 2260, 2380); // 0.1V
+        p = putString(p, ")\r\n");
+        p = putString(p, voltages[i]);
+        p = putFixed(p, voltage[i], 3, 1);
+        p = putString(p, "*V");
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        int current = abs(net[i]) * 1000 / voltage[i]; // 0.01A
+        p = putString(p, ")\r\n");
+        p = putString(p, currents[i]);
+        p = putFixed(p, current, 3, 2);
+        p = putString(p, "*A");
+    }
+
+    p = putString(p, ")\r\n0-0:96.3.10(1)\r\n0-0:17.0.0(999.9*kW)\r\n1-0:31.4.0(999*A)\r\n0-0:96.13.0(");
+    if (randomBetween(meter, 1, GENERATOR_MESSAGE_CHANCE) == 1)
+    {
+        static const char text[] = "Planned maintenance of the distribution grid. ";
+        int length = randomBetween(meter, 1, GENERATOR_MESSAGE_SIZE);
+        for (int i = 0; i < length; i += sizeof(text) - 1)
+        {
+            int n = length - i < (int)sizeof(text) - 1 ? length - i : (int)sizeof(text) - 1;
+            p = putHex(p, text, n);
+        }
+    }
+
+    p = putString(p, ")\r\n0-1:24.1.0(003)\r\n0-1:96.1.1(");
+    p = putString(p, meter->gasId);
+    p = putString(p, ")\r\n0-1:24.4.0(1)\r\n0-1:24.2.3(");
+    p = putString(p, tick->gasTimestamp);
+    p = putString(p, ")(");
+    p = putFixed(p, meter->gas, 5, 3);
+    p = putString(p, "*m3)\r\n!");
+
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned short crc = crc16(0, buffer, p - buffer);
+    for (int shift = 12; shift >= 0; shift -= 4)
+        *p++ = hex[(crc >> shift) & 0xf];
+    *p++ = '\r';
+    *p++ = '\n';
+    return p - buffer;
+}
+
+/**
+ * writeAll writes everything, waiting when the reader is slow
+ * @returns 1 on success, 0 when the other side is gone
+ */
+static int writeAll(int fd, const char *data, int length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(fd, data, length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printErrno(__func__, "write failed");
+            return 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+static int flushOutput(void)
+{
+    int ret = writeAll(outputfd, outputBuffer, outputLength);
+    outputLength = 0;
+    return ret;
+}
+
+static int connectMeter(struct gen_meter *meter, struct addrinfo *address)
+{
+    meter->fd = socket(address->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (meter->fd == -1 || connect(meter->fd, address->ai_addr, address->ai_addrlen) == -1)
+    {
+        printErrno(__func__, "Couldn't connect");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * openOutput sets up where the telegrams go
+ * @returns 1 on success, 0 on error
+ */
+static int openOutput(const char *output)
+{
+    if (!strcmp(output, "-"))
+    {
+        outputfd = STDOUT_FILENO;
+    }
+    else if (!strncmp(output, "file:", 5))
+    {
+        outputfd = open(output + 5, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (outputfd == -1)
+        {
+            printErrno(__func__, "Couldn't create '%s'", output + 5);
+            return 0;
+        }
+    }
+    else if (!strcmp(output, "pty"))
+    {
+        outputfd = posix_openpt(O_RDWR | O_NOCTTY);
+        if (outputfd == -1 || grantpt(outputfd) == -1 || unlockpt(outputfd) == -1)
+        {
+            printErrno(__func__, "Couldn't create a pseudo terminal");
+            return 0;
+        }
+        fprintf(stderr, "Telegrams are written to %s\n", ptsname(outputfd));
+    }
+    else if (!strncmp(output, "tcp:", 4))
+    {
+        char host[256];
+        const char *port = strrchr(output + 4, ':');
+        if (port == NULL || port - output - 4 >= (int)sizeof(host))
+        {
+            printError(__func__, "Expected tcp:host:port, got '%s'", output);
+            return 0;
+        }
+        memcpy(host, output + 4, port - output - 4);
+        host[port - output - 4] = 0;
+
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+        struct addrinfo *res;
+        int ret = getaddrinfo(host, port + 1, &hints, &res);
+        if (ret != 0)
+        {
+            printError(__func__, "Couldn't resolve '%s': %s", host, gai_strerror(ret));
+            return 0;
+        }
+        for (int i = 0; i < meterCount; i++)
+        {
+            if (!connectMeter(meters + i, res))
+            {
+                freeaddrinfo(res);
+                return 0;
+            }
+        }
+        freeaddrinfo(res);
+        fprintf(stderr, "Connected %d meters to %s\n", meterCount, output + 4);
+    }
+    else
+    {
+        printError(__func__, "Unknown output '%s'", output);
+        return 0;
+    }
+    return 1;
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void onSignal(int signal)
+{
+    (void)signal;
+    stop = 1;
+}
+
+int main(int argc, char *argv[])
+{
+    setupLogs();
+
+    double rate = 1;
+    long long count = 0;
+    const char *output = "-";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:m:n:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            meterCount = atoi(optarg);
+            break;
+        case 'n':
+            count = atoll(optarg);
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-r rate] [-m meters] [-n count] [-o -|file:path|pty|tcp:host:port]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (meterCount < 1)
+        meterCount = 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onSignal);
+    signal(SIGTERM, onSignal);
+
+    meters = malloc(meterCount * sizeof(struct gen_meter));
+    outputBuffer = malloc(GENERATOR_BUFFER_SIZE);
+    if (meters == NULL || outputBuffer == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate %d meters", meterCount);
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < meterCount; i++)
+        initMeter(meters + i, i);
+
+    if (!openOutput(output))
+        return EXIT_FAILURE;
+
+    struct gen_tick tick = {.now = time(NULL)};
+    char telegram[GENERATOR_TELEGRAM_SIZE];
+    long long sent = 0;
+    double start = seconds();
+    double lastReport = start;
+
+    while (!stop && (count == 0 || sent < count))
+    {
+        int index = sent % meterCount;
+        if (index == 0)
+        {
+            // Every meter had its turn: next simulated second
+            tick.now++;
+            localtime_r(&tick.now, &tick.tm);
+            tick.month = tick.tm.tm_year * 12 + tick.tm.tm_mon;
+            *putTimestamp(tick.timestamp, tick.now) = 0;
+            if (tick.now - tick.gasTime >= GENERATOR_GAS_INTERVAL)
+            {
+                tick.gasTime = tick.now - tick.now % GENERATOR_GAS_INTERVAL;
+                *putTimestamp(tick.gasTimestamp, tick.gasTime) = 0;
+            }
+        }
+
+        struct gen_meter *meter = meters + index;
+        int length = render(meter, telegram, &tick);
+        if (meter->fd != -1)
+        {
+            if (!writeAll(meter->fd, telegram, length))
+                break;
+        }
+        else
+        {
+            if (outputLength + length > GENERATOR_BUFFER_SIZE && !flushOutput())
+                break;
+            memcpy(outputBuffer + outputLength, telegram, length);
+            outputLength += length;
+        }
+        sent++;
+
+        // Pace against the wall clock, never build up a burst after a stall
+        if (rate > 0)
+        {
+            double ahead = sent / rate - (seconds() - start);
+            if (ahead > 0.001)
+            {
+                if (outputLength && !flushOutput())
+                    break;
+                usleep(ahead * 1e6);
+            }
+            else if (ahead < -1)
+            {
+                start = seconds() - sent / rate;
+            }
+        }
+
+        double t = seconds();
+        if (t - lastReport >= 5)
+        {
+            fprintf(stderr, "%lld telegrams, %.0f telegrams/s\n", sent, sent / (t - start));
+            lastReport = t;
+        }
+    }
+
+    if (outputLength)
+        flushOutput();
+
+    double elapsed = seconds() - start;
+    fprintf(stderr, "Sent %lld telegrams in %.2fs, %.0f telegrams/s\n", sent, elapsed, sent / elapsed);
+    return EXIT_SUCCESS;
+}
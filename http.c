@@ -6,28 +6,24 @@
  * int ret = http_connect(&config);
  *
  */
+#define _GNU_SOURCE // memmem
 #include <stdio.h>
 #include <string.h>
+#include <strings.h> // strncasecmp
 #include <stdlib.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h> // getaddrinfo()
-#include <arpa/inet.h>
-#include <unistd.h> // for write close and read
-
-#include <sys/select.h>
-#include <time.h> // select
+#include <time.h>
 
 #include "common.h"
 #include "http.h"
+#include "platform.h"
 
 #define HTTP_TIMEOUT 1
-#define MAXHEADERSIZE 512
-#define MAXBODYSIZE 2048
+#define HTTP_CONNECT_TIMEOUT 1
 
-int checkHTTPCode(char *__restrict__ s);
-int sread(int fd, void *buf, size_t nbytes, int timeout);
+// Room for the Content-Length digits, any size_t fits
+#define CONTENT_LENGTH_DIGITS 20
+
+int checkHTTPCode(char *__restrict__ s, int length);
 
 struct http_config http_init(char *host, unsigned short port)
 {
@@ -44,180 +40,323 @@ struct http_config http_init(char *host, unsigned short port)
 }
 
 /**
- * influxConnect connects with the first possible socket to InfluxDB
- * @returns the socket fd of the connection
+ * http_connect connects to the configured host through the platform layer
+ * @returns the handle of the connection or -1
  */
 int http_connect(struct http_config *config)
 {
-    // Find suitable socket
-    char service[6];
-    sprintf(service, "%d", config->remote_port); // I hate this
+    int sockfd = platform_connect(config->remote_host, config->remote_port, HTTP_CONNECT_TIMEOUT);
+    if (sockfd == -1)
+        return -1;
+
+    config->sockfd = sockfd;
+    config->responseLength = 0;
+    config->discard = 0;
 
-    struct addrinfo hints = {
-                        .ai_family = AF_UNSPEC, // IPv4 or IPv6, whatever
-                        .ai_socktype = SOCK_STREAM},
-                    *servinfo, *sip;
+    return sockfd;
+}
+
+/**
+ * http_request_init renders the request head once, token may be NULL
+ * POST and PUT requests end in "Content-Length: ", http_send() writes the
+ * length and the blank line behind it per request.
+ * @returns 1 on success, 0 if the head doesn't fit
+ */
+int http_request_init(struct http_request *request, struct http_config *config,
+                      char *method, char *uri, char *query, char *token)
+{
+    int hasBody = !strcmp(method, "POST") || !strcmp(method, "PUT");
 
-    int ret;
-    if ((ret = getaddrinfo(config->remote_host, service, &hints, &servinfo)) == -1)
+    int n = snprintf(request->header, HTTP_HEADER_SIZE,
+                     "%s %s%s%s HTTP/1.1\r\n"
+                     "Host: %s:%d\r\n"
+                     "Connection: keep-alive\r\n"
+                     "%s%s%s"
+                     "%s",
+                     method, uri, query ? "?" : "", query ? query : "",
+                     config->remote_host, config->remote_port,
+                     token ? "Authorization: Token " : "", token ? token : "", token ? "\r\n" : "",
+                     hasBody ? "Content-Length: " : "\r\n");
+    if (n < 0 || n >= HTTP_HEADER_SIZE)
+        goto toolong;
+
+    request->contentLengthOffset = -1;
+    if (hasBody)
     {
-        printErrno(__func__, "getaddrinfo failed");
-        return -1;
+        if (n + CONTENT_LENGTH_DIGITS + 4 >= HTTP_HEADER_SIZE)
+            goto toolong;
+
+        request->contentLengthOffset = n;
     }
 
-    // Fetch first possible socket from servinfo
-    int sockfd = -1;
-    for (sip = servinfo; sip != NULL; sip = sip->ai_next)
+    request->headerLength = n;
+    return 1;
+
+toolong:
+    printError(__func__, "Request head for %s doesn't fit in %d bytes", uri, HTTP_HEADER_SIZE);
+    request->headerLength = 0;
+    return 0;
+}
+
+/**
+ * chunkedLength walks a chunked body (RFC 9112 7.1) in the buffer
+ * @returns its size up to the end of the trailer, 0 if it isn't complete
+ *  yet, -1 if it's malformed
+ */
+static int chunkedLength(const char *body, int length)
+{
+    for (int offset = 0;;)
     {
-        if ((sockfd = socket(sip->ai_family, sip->ai_socktype, sip->ai_protocol)) == -1)
+        const char *line = body + offset;
+        const char *eol = memmem(line, length - offset, "\r\n", 2);
+        if (eol == NULL)
+            return 0;
+
+        // Size in hex, chunk extensions after ';' are ignored
+        char *end;
+        unsigned long size = strtoul(line, &end, 16);
+        if (end == line || size > HTTP_RESPONSE_SIZE)
+            return -1;
+        offset = eol - body + 2;
+
+        if (size == 0)
         {
-            sockfd = -1;
-            continue;
+            // Trailer fields up to an empty line
+            for (;;)
+            {
+                eol = memmem(body + offset, length - offset, "\r\n", 2);
+                if (eol == NULL)
+                    return 0;
+                int empty = eol == body + offset;
+                offset = eol - body + 2;
+                if (empty)
+                    return offset;
+            }
         }
 
-        // Now try to connect
-        if (connect(sockfd, sip->ai_addr, sip->ai_addrlen) == -1)
-        {
-            // Convert for debug
-            char ip[INET6_ADDRSTRLEN];
-            struct sockaddr_in *adr4 = (struct sockaddr_in *)sip->ai_addr;
-            void *adr = &(adr4->sin_addr);
-            inet_ntop(sip->ai_family, adr, ip, INET6_ADDRSTRLEN);
-
-            printErrno(__func__, "Connection failed to %s:%d\n", ip, ntohs(adr4->sin_port));
-            close(sockfd);
-            sockfd = -1;
-            continue;
-        }
-        break;
+        if (offset + (int)size + 2 > length)
+            return 0;
+        if (memcmp(body + offset + size, "\r\n", 2))
+            return -1;
+        offset += size + 2;
     }
+}
 
-    freeaddrinfo(servinfo);
+/**
+ * parseResponse checks if a complete response head is buffered
+ * Bodies are framed by Content-Length, or have to be buffered completely
+ * when chunked. A body that runs until the server closes the connection
+ * can't be told apart from the next response.
+ * @returns the status code and sets *consumed to the full response size,
+ *  0 if it is incomplete, -1 if it isn't HTTP or can't be framed
+ */
+static int parseResponse(char *buf, int length, size_t *consumed)
+{
+    char *end = memmem(buf, length, "\r\n\r\n", 4);
+    if (end == NULL)
+        return 0;
 
-    if (sockfd == -1)
-    {
-        printErrno(__func__, "couldn't connect to server");
+    // HTTP/1.1 401 Unauthorized or HTTP/1.1 200 OK
+    int headLength = end - buf + 4;
+    int httpcode = checkHTTPCode(buf, headLength);
+    if (!httpcode)
         return -1;
+
+    long contentLength = -1;
+    int chunked = 0;
+    for (char *line = buf; line < end;)
+    {
+        char *eol = memchr(line, '\n', end - line);
+        if (!strncasecmp(line, "Content-Length:", 15))
+            contentLength = strtol(line + 15, NULL, 10);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18))
+            chunked = memmem(line, (eol != NULL ? eol : end) - line, "chunked", 7) != NULL;
+        if (eol == NULL)
+            break;
+        line = eol + 1;
     }
 
-    config->sockfd = sockfd;
+    if (chunked)
+    {
+        int bodyLength = chunkedLength(buf + headLength, length - headLength);
+        if (bodyLength <= 0)
+        {
+            if (bodyLength == -1)
+                printError(__func__, "Malformed chunked body");
+            return bodyLength;
+        }
+        contentLength = bodyLength;
+    }
+    else if (contentLength == -1)
+    {
+        // 1xx, 204 No Content and 304 Not Modified never have a body
+        if (httpcode >= 200 && httpcode != 204 && httpcode != 304)
+        {
+            printError(__func__, "HTTP %d without Content-Length, its body runs until the connection closes",
+                       httpcode);
+            return -1;
+        }
+        contentLength = 0;
+    }
 
-    return sockfd;
+    *consumed = headLength + contentLength;
+    return httpcode;
 }
 
 /**
- * @returns int status code; 0 (false) on error
+ * http_poll_response returns the status of the next response on the
+ * connection. Responses arrive in the order the requests were sent.
+ * Waits at most timeout seconds for data, 0 doesn't wait.
+ * @returns the HTTP status code, 0 if no complete response is available
+ *  yet or -1 when the connection failed or was closed
  */
-int http_get(struct http_config *config, char *uri, char *token)
+int http_poll_response(struct http_config *config, int timeout)
 {
-    char *headers = calloc(MAXHEADERSIZE, 1);
-    if (headers == NULL)
-        return 0;
+    for (;;)
+    {
+        // First a complete response that is already buffered
+        size_t consumed;
+        int httpcode = parseResponse(config->response, config->responseLength, &consumed);
+        if (httpcode == -1)
+            return -1; // Not HTTP or no framing, only a new connection gets back in step
+        if (httpcode)
+        {
+            if (consumed <= (size_t)config->responseLength)
+            {
+                config->responseLength -= consumed;
+                memmove(config->response, config->response + consumed, config->responseLength);
+            }
+            else
+            {
+                // Body is still (partially) on the wire, skip it while reading
+                config->discard = consumed - config->responseLength;
+                config->responseLength = 0;
+            }
+            return httpcode;
+        }
 
-    // Construct the headers
-    sprintf(headers, "GET %s HTTP/1.1\r\n"
-                     "Host: %s:%d\r\n"
-                     "Connection: keep-alive\r\n"
-                     "Authorization: Token %s\r\n\r\n",
-            uri, config->remote_host, config->remote_port, token);
+        if (config->responseLength == HTTP_RESPONSE_SIZE)
+        {
+            printError(__func__, "Response head or chunked body bigger than %d bytes", HTTP_RESPONSE_SIZE);
+            return -1;
+        }
 
-    // Write
-    int nsent = write(config->sockfd, headers, strlen(headers));
-    if (nsent <= 0)
-        return 0; // error or closed connection
+        int nread = sread(config->sockfd, config->response + config->responseLength,
+                          HTTP_RESPONSE_SIZE - config->responseLength, timeout);
+        if (nread == 0)
+            return 0;
+        if (nread < 0)
+            return -1;
 
-    free(headers);
-    char *response = calloc(MAXBODYSIZE, 1);
-    if (response == NULL)
-        return 0;
+        // Drop the remainder of a previous body
+        if (config->discard)
+        {
+            size_t skip = config->discard < (size_t)nread ? config->discard : (size_t)nread;
+            memmove(config->response + config->responseLength,
+                    config->response + config->responseLength + skip, nread - skip);
+            config->discard -= skip;
+            nread -= skip;
+        }
+        config->responseLength += nread;
+        timeout = 0;
+    }
+}
 
-    // read response
-    int read_len = 0;
+/**
+ * readResponse waits up to HTTP_TIMEOUT for the next response
+ * @returns the HTTP status code; 0 (false) on error
+ */
+static int readResponse(struct http_config *config)
+{
+    time_t deadline = time(NULL) + HTTP_TIMEOUT;
+    int httpcode;
     do
     {
-        read_len = sread(config->sockfd, response + read_len, MAXBODYSIZE, HTTP_TIMEOUT);
-        printLog(__func__, "read %d bytes from HTTP", read_len);
-
-        // If response is bigger than buffer
-        if (read_len == MAXBODYSIZE)
-            response = realloc(response, MAXBODYSIZE * 2); // I dont care about this
-    } while (read_len >= MAXBODYSIZE);
-
-    if (read_len <= 0)
-        return 0;
+        httpcode = http_poll_response(config, HTTP_TIMEOUT);
+        if (httpcode)
+            return httpcode == -1 ? 0 : httpcode;
+    } while (time(NULL) <= deadline);
 
-    int status_code = checkHTTPCode(response);
-
-    free(response);
-    return status_code;
+    printError(__func__, "Timeout!");
+    return 0;
 }
 
 /**
  * @returns int status code; 0 (false) on error
  */
-int http_post(
-    struct http_config *config, char *uri, char *query, char *token,
-    char *post_data, int post_length)
+int http_get(struct http_config *config, char *uri, char *token)
 {
-    char *body = malloc(MAXBODYSIZE);
-    if (body == NULL)
+    struct http_request request;
+    if (!http_request_init(&request, config, "GET", uri, NULL, token))
         return 0;
 
-    // Construct the headers
-    sprintf(body, "POST %s?%s HTTP/1.1\r\n"
-                  "Host: %s:%d\r\n"
-                  "Connection: keep-alive\r\n"
-                  "Content-Length: %d\r\n"
-                  "Authorization: Token %s\r\n\r\n",
-            uri, query, config->remote_host,
-            config->remote_port, strlen(post_data), token);
-
-    int body_offset = strlen(body);
-    // copy post_data at body_offset
-    strncpy(body + body_offset, post_data, post_length);
-
-    // Write
-    int nsent = write(config->sockfd, body, body_offset + post_length);
-    if (nsent <= 0)
+    if (!platform_send(config->sockfd, request.header, request.headerLength, NULL, 0))
         return 0; // error or closed connection
 
-    // Clear response
-    memset(body, 0, MAXBODYSIZE);
+    return readResponse(config);
+}
 
-    // read response
-    int read_len = 0;
-    do
-    {
-        read_len = sread(config->sockfd, body + read_len, MAXBODYSIZE, HTTP_TIMEOUT);
+/**
+ * http_send completes the pre-rendered request with the Content-Length and
+ * sends the head and the body in one go without waiting for the
+ * response, so several requests can be in flight on the connection.
+ * The body size is unlimited.
+ * @returns 1 on success, 0 on error or closed connection
+ */
+int http_send(struct http_config *config, struct http_request *request,
+              char *post_data, size_t post_length)
+{
+    if (request->headerLength == 0 || request->contentLengthOffset == -1)
+        return 0;
 
-        // If response is bigger than buffer
-        if (read_len == MAXBODYSIZE)
-            body = realloc(body, MAXBODYSIZE * 2); // I dont care about this
-    } while (read_len >= MAXBODYSIZE);
+    // http_request_init() kept room for every digit and the blank line
+    int n = request->contentLengthOffset;
+    n += snprintf(request->header + n, HTTP_HEADER_SIZE - n, "%zu\r\n\r\n", post_length);
+    request->headerLength = n;
 
-    if (read_len <= 0)
-        return 0;
+    return platform_send(config->sockfd, request->header, request->headerLength,
+                         post_data, post_length);
+}
 
-    int status_code = checkHTTPCode(body);
+/**
+ * http_post sends the request and waits for its response
+ * @returns int status code; 0 (false) on error
+ */
+int http_post(struct http_config *config, struct http_request *request,
+              char *post_data, size_t post_length)
+{
+    if (!http_send(config, request, post_data, post_length))
+        return 0; // error or closed connection
 
-    free(body);
-    return status_code;
+    return readResponse(config);
 }
 
 /**
- * checkHTTPCode parses the given HTTP response string and extracts the HTTP code
- * @returns HTTP code
+ * http_close closes the connection and drops any buffered response
  */
-int checkHTTPCode(char *__restrict__ s)
+void http_close(struct http_config *config)
+{
+    platform_close(config->sockfd);
+    config->sockfd = -1;
+    config->responseLength = 0;
+    config->discard = 0;
+}
+
+/**
+ * checkHTTPCode parses the given HTTP response head and extracts the HTTP code
+ * @returns HTTP code or 0 if it isn't a HTTP response
+ */
+int checkHTTPCode(char *__restrict__ s, int length)
 {
     // HTTP/1.1 401 Unauthorized or HTTP/1.1 200 OK
-    int httpcode;
-    char *token;
-    token = strtok(s, " ");
-    token = strtok(NULL, " ");
-    httpcode = atoi(token);
+    if (length < 12 || strncmp(s, "HTTP/", 5))
+        return 0;
 
-    return httpcode;
+    char *code = memchr(s, ' ', length);
+    if (code == NULL || code + 4 > s + length)
+        return 0;
+
+    return atoi(code + 1);
 }
 
 /// @brief Block reads from fd for timeout seconds
@@ -225,27 +364,8 @@ int checkHTTPCode(char *__restrict__ s)
 /// @param buf
 /// @param nbytes
 /// @param timeout
-/// @return bytes read
+/// @return bytes read, 0 on timeout, -1 on error or closed connection
 int sread(int fd, void *buf, size_t nbytes, int timeout)
 {
-    fd_set set;
-    FD_ZERO(&set);
-    FD_SET(fd, &set);
-    struct timeval tv = {.tv_sec = timeout};
-
-    int ret = select(fd + 1, &set, NULL, NULL, &tv);
-    if (ret == -1)
-    {
-        printErrno(__func__, "select error");
-        return -1;
-    }
-    if (ret == 0)
-    {
-        printError(__func__, "Timeout!");
-        return 0;
-    }
-
-    // Read the reply
-    int nread = read(fd, buf, nbytes);
-    return nread;
+    return platform_recv(fd, buf, nbytes, timeout);
 }
@@ -1,11 +1,31 @@
 #ifndef HTTP_H
 #define HTTP_H
 
+#include <stddef.h>
+
+#define HTTP_HEADER_SIZE 512
+#define HTTP_RESPONSE_SIZE 2048
+
 struct http_config
 {
     int sockfd;
     char *remote_host;
     unsigned short remote_port;
+
+    char response[HTTP_RESPONSE_SIZE]; // Reused for every response
+    int responseLength;                // Bytes of unparsed responses buffered
+    size_t discard;                    // Body bytes still to skip on the wire
+};
+
+/**
+ * Request head rendered once; only the Content-Length digits are
+ * appended per request and the body is sent behind it with writev()
+ */
+struct http_request
+{
+    char header[HTTP_HEADER_SIZE];
+    int headerLength;
+    int contentLengthOffset; // Where the Content-Length digits go, -1 without body
 };
 
 struct http_response
@@ -18,8 +38,15 @@ struct http_response
 
 struct http_config http_init(char *host, unsigned short port);
 int http_connect(struct http_config *config);
+int http_request_init(struct http_request *request, struct http_config *config,
+                      char *method, char *uri, char *query, char *token);
 int http_get(struct http_config *config, char *uri, char *token);
-int http_post(struct http_config *config, char *uri, char *query, char *token,
-              char *post_data, int post_length);
+int http_post(struct http_config *config, struct http_request *request,
+              char *post_data, size_t post_length);
+int http_send(struct http_config *config, struct http_request *request,
+              char *post_data, size_t post_length);
+int http_poll_response(struct http_config *config, int timeout);
+void http_close(struct http_config *config);
+int sread(int fd, void *buf, size_t nbytes, int timeout);
 
 #endif
\ No newline at end of file
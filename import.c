@@ -0,0 +1,496 @@
+/**
+ * import.c - Bulk import of archived raw P1 captures
+ *
+ * Usage:
+ * dsmr-import capture.log ...          // Into Influx, configured like the daemon
+ * dsmr-import -o lines.lp capture.log  // Line protocol into a file
+ *
+ * Every file is mapped and cut into chunks that start at a telegram
+ * header. Chunks are decoded in parallel with the decoder each header
+ * selects, exactly like the daemon renders them, and written in file
+ * order: a worker never runs further ahead of the writer than
+ * IMPORT_WINDOW chunks per thread. Captures may hold anything between
+ * telegrams (logger noise, partial telegrams at the start or end); only
+ * '/' ... '!' is decoded, and dropped when its CRC doesn't match.
+ * DSMR_TTY_MODE="9600" marks captures of DSMR 2.2 and 3 meters, as it
+ * does for the daemon.
+ */
+#define _GNU_SOURCE // memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "crc16.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "http.h"
+#include "influx.h"
+#include "lineprotocol.h"
+
+#define IMPORT_CHUNK_SIZE (4 * 1024 * 1024) // Raw bytes decoded per task
+#define IMPORT_WINDOW 2                     // Chunks in memory per thread
+#define IMPORT_PROGRESS_INTERVAL 5
+#define IMPORT_LINE_SIZE (16 * 1024) // Room kept for the line of one telegram
+#define IMPORT_INFLUX_TIMEOUT 60      // Seconds Influx may go without taking a batch
+
+struct import_chunk
+{
+    char *start;
+    size_t length;
+
+    struct lp_encoder encoder; // Decoded lines, only while in the window
+    unsigned long telegrams;
+    unsigned long dropped;
+    int done;
+};
+
+static struct import_chunk *chunks;
+static int chunkCount;
+static int window;
+
+static int nextChunk;   // Next chunk to decode
+static int nextWritten; // Next chunk to write, in order
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t decoded = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t written = PTHREAD_COND_INITIALIZER;
+
+static const char *measurement;
+static const char *tags;
+static int slowLink; // DSMR_TTY_MODE="9600", the meters of the captures are DSMR 2.2 or 3
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * addChunks maps a capture and splits it at telegram headers
+ * @returns 1 on success, 0 on error
+ */
+static int addChunks(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        printErrno(__func__, "Couldn't open '%s'", path);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        printErrno(__func__, "Couldn't stat '%s'", path);
+        close(fd);
+        return 0;
+    }
+    if (st.st_size == 0)
+    {
+        close(fd);
+        return 1;
+    }
+
+    // Private and writable: the decoders take char *, nothing is written back
+    char *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printErrno(__func__, "Couldn't map '%s'", path);
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    size_t size = st.st_size;
+    size_t offset = 0;
+    while (offset < size)
+    {
+        // Cut behind the nominal size at the next header on a new line
+        size_t end = offset + IMPORT_CHUNK_SIZE;
+        if (end >= size)
+        {
+            end = size;
+        }
+        else
+        {
+            char *header = memmem(map + end, size - end, "\n/", 2);
+            end = header != NULL ? (size_t)(header - map) + 1 : size;
+        }
+
+        struct import_chunk *grown = realloc(chunks, (chunkCount + 1) * sizeof(struct import_chunk));
+        if (grown == NULL)
+        {
+            printErrno(__func__, "Couldn't allocate chunk list");
+            return 0;
+        }
+        chunks = grown;
+        chunks[chunkCount++] = (struct import_chunk){
+            .start = map + offset,
+            .length = end - offset,
+        };
+        offset = end;
+    }
+    return 1;
+}
+
+/**
+ * validCRC checks the CRC16 behind the '!' of the telegram from header
+ * DSMR 2.2 meters send a bare '!', those telegrams are accepted
+ */
+static int validCRC(const char *header, const char *bang, int digits)
+{
+    if (digits == 0)
+        return 1;
+    if (digits != 4)
+        return 0;
+
+    unsigned int sent = 0;
+    for (int i = 1; i <= 4; i++)
+    {
+        char c = bang[i] | 0x20;
+        if (c >= '0' && c <= '9')
+            sent = sent << 4 | (c - '0');
+        else if (c >= 'a' && c <= 'f')
+            sent = sent << 4 | (c - 'a' + 10);
+        else
+            return 0;
+    }
+    return sent == crc16(0, header, bang + 1 - header);
+}
+
+/**
+ * decodeChunk renders every complete telegram of the chunk
+ */
+static void decodeChunk(struct import_chunk *chunk)
+{
+    // Usually shorter than the raw telegrams, grown below when it isn't
+    if (!lp_init(&chunk->encoder, measurement, tags, chunk->length + IMPORT_LINE_SIZE))
+        return;
+
+    struct lp_encoder *enc = &chunk->encoder;
+    struct dsmr_telegram telegram;
+    dsmr_decoder decode = decodeLine;
+    char *header = NULL; // Of the telegram being decoded, NULL outside one
+
+    char *line = chunk->start;
+    char *end = chunk->start + chunk->length;
+    while (line < end)
+    {
+        char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+            newline = end;
+
+        int length = newline - line;
+        if (length && line[length - 1] == '\r')
+            length--;
+
+        if (length && line[0] == '/')
+        {
+            // Only between lines: the encoder keeps offsets, not pointers
+            if (enc->capacity - enc->length < IMPORT_LINE_SIZE)
+            {
+                char *grown = realloc(enc->buffer, enc->capacity * 2);
+                if (grown != NULL)
+                {
+                    enc->buffer = grown;
+                    enc->capacity *= 2;
+                }
+            }
+
+            // Identification header: start of a new telegram, drop any partial one
+            dsmr_telegram_reset(&telegram);
+            lp_begin(enc);
+            header = line;
+            decode = dsmr_decoder_for(dsmr_detect_version(line, length, slowLink));
+        }
+        else if (length && header != NULL)
+        {
+            decode(enc, &telegram, line, length);
+            if (line[0] == '!')
+            {
+                // A damaged telegram's line is left unfinished, the next
+                // lp_begin() drops it
+                if (validCRC(header, line, length - 1) && lp_end(enc, telegram.timestamp))
+                    chunk->telegrams++;
+                else
+                    chunk->dropped++;
+                header = NULL;
+            }
+        }
+
+        line = newline + 1;
+    }
+}
+
+static void *workerMain(void *arg)
+{
+    (void)arg;
+
+    pthread_mutex_lock(&lock);
+    while (nextChunk < chunkCount)
+    {
+        int index = nextChunk++;
+
+        // Don't run ahead of the writer
+        while (index >= nextWritten + window)
+            pthread_cond_wait(&written, &lock);
+        pthread_mutex_unlock(&lock);
+
+        decodeChunk(chunks + index);
+
+        pthread_mutex_lock(&lock);
+        chunks[index].done = 1;
+        pthread_cond_broadcast(&decoded);
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+/**
+ * waitInflux pumps until no more than queued batches are left, with 0
+ * until the batch being filled went out too
+ * @returns 1 on success, 0 when Influx took nothing for IMPORT_INFLUX_TIMEOUT
+ */
+static int waitInflux(struct influx_config *config, int queued)
+{
+    int left = influx_pump(config);
+    double progress = seconds();
+    while (left > queued || (queued == 0 && config->filling != -1))
+    {
+        if (seconds() - progress > IMPORT_INFLUX_TIMEOUT)
+        {
+            printError(__func__, "InfluxDB took nothing in %ds, %d batches left",
+                       IMPORT_INFLUX_TIMEOUT, left);
+            return 0;
+        }
+        usleep(1000);
+
+        int now = influx_pump(config);
+        if (now < left)
+            progress = seconds();
+        left = now;
+    }
+    return 1;
+}
+
+/**
+ * writeInflux queues lines in batch sized pieces, waiting for room
+ * instead of letting influx_enqueue() drop old batches. A line that is
+ * bigger than a batch on its own is dropped.
+ * @returns 1 on success, 0 when Influx stopped taking batches
+ */
+static int writeInflux(struct influx_config *config, char *data, int length, unsigned long *dropped)
+{
+    while (length > 0)
+    {
+        int size = length;
+        if (size > INFLUX_BATCH_SIZE)
+        {
+            size = INFLUX_BATCH_SIZE;
+            while (size > 0 && data[size - 1] != '\n')
+                size--;
+        }
+        if (size == 0)
+        {
+            char *newline = memchr(data, '\n', length);
+            size = newline != NULL ? newline - data + 1 : length;
+            printError(__func__, "Dropping a line of %d bytes, bigger than a batch", size);
+            (*dropped)++;
+            data += size;
+            length -= size;
+            continue;
+        }
+
+        if (!waitInflux(config, INFLUX_QUEUE_SIZE - 2))
+            return 0;
+        if (!influx_enqueue(config, data, size))
+            config->dropped++;
+
+        data += size;
+        length -= size;
+    }
+    return 1;
+}
+
+/**
+ * connectInflux sets up the connection from the daemon's environment
+ * @returns 1 on success, 0 on error
+ */
+static int connectInflux(struct influx_config *config)
+{
+    char *host = getenv("INFLUX_HOST");
+    char *token = getenv("INFLUX_TOKEN");
+    char *organisation = getenv("INFLUX_ORG");
+    char *bucket = getenv("INFLUX_BUCKET");
+    if (host == NULL || token == NULL || organisation == NULL || bucket == NULL)
+    {
+        printError(__func__, "INFLUX_HOST, INFLUX_TOKEN, INFLUX_ORG and INFLUX_BUCKET are needed");
+        return 0;
+    }
+
+    char *port = getenv("INFLUX_PORT");
+    struct http_config hconfig = http_init(host, port != NULL && *port ? atoi(port) : 8086);
+    *config = influx_init(&hconfig, organisation, bucket, token);
+
+    // Deep pipeline, the import only waits for Influx
+    char *window = getenv("INFLUX_WINDOW");
+    influx_set_window(config, window != NULL && *window ? atoi(window) : INFLUX_MAX_WINDOW);
+
+    if (!influx_connect(config))
+    {
+        printError(__func__, "Couldn't connect to server");
+        return 0;
+    }
+    if (!influx_authenticate(config))
+    {
+        printError(__func__, "Couldn't authenticate Influx connection");
+        return 0;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    setupLogs();
+
+    const char *outputPath = NULL;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-o"))
+    {
+        outputPath = argv[2];
+        first = 3;
+    }
+    if (first >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-o output.lp] capture...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (!dsmr_init())
+        return EXIT_FAILURE;
+
+    measurement = getenv("INFLUX_MEASUREMENT");
+    if (measurement == NULL || !*measurement)
+        measurement = "meter";
+    tags = getenv("INFLUX_TAGS");
+    char *ttyMode = getenv("DSMR_TTY_MODE");
+    slowLink = ttyMode != NULL && !strcmp(ttyMode, "9600");
+
+    FILE *output = NULL;
+    struct influx_config iconfig;
+    if (outputPath != NULL)
+    {
+        output = fopen(outputPath, "w");
+        if (output == NULL)
+        {
+            printErrno(__func__, "Couldn't create '%s'", outputPath);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (!connectInflux(&iconfig))
+    {
+        return EXIT_FAILURE;
+    }
+
+    size_t total = 0;
+    for (int i = first; i < argc; i++)
+    {
+        if (!addChunks(argv[i]))
+            return EXIT_FAILURE;
+    }
+    for (int i = 0; i < chunkCount; i++)
+        total += chunks[i].length;
+
+    char *env = getenv("DSMR_IMPORT_THREADS");
+    int threads = env != NULL && *env ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1)
+        threads = 1;
+    window = threads * IMPORT_WINDOW;
+
+    printLog(__func__, "Importing %zu MB in %d chunks with %d threads",
+             total >> 20, chunkCount, threads);
+
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(workers + i, NULL, workerMain, NULL) != 0)
+        {
+            printError(__func__, "Couldn't start worker %d", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    double start = seconds();
+    double lastProgress = start;
+    unsigned long telegrams = 0, dropped = 0;
+
+    // Write in file order as chunks complete
+    for (int i = 0; i < chunkCount; i++)
+    {
+        struct import_chunk *chunk = chunks + i;
+        pthread_mutex_lock(&lock);
+        while (!chunk->done)
+            pthread_cond_wait(&decoded, &lock);
+        pthread_mutex_unlock(&lock);
+
+        if (output != NULL)
+            fwrite(chunk->encoder.buffer, 1, chunk->encoder.length, output);
+        else if (!writeInflux(&iconfig, chunk->encoder.buffer, chunk->encoder.length, &dropped))
+        {
+            // The workers are blocked on the window, exiting ends them
+            printError(__func__, "Giving up after %d/%d chunks", i, chunkCount);
+            return EXIT_FAILURE;
+        }
+
+        telegrams += chunk->telegrams;
+        dropped += chunk->dropped;
+        lp_free(&chunk->encoder);
+
+        pthread_mutex_lock(&lock);
+        nextWritten = i + 1;
+        pthread_cond_broadcast(&written);
+        pthread_mutex_unlock(&lock);
+
+        double now = seconds();
+        if (now - lastProgress >= IMPORT_PROGRESS_INTERVAL)
+        {
+            printLog(__func__, "%d/%d chunks, %lu telegrams, %.0f telegrams/s",
+                     i + 1, chunkCount, telegrams, telegrams / (now - start));
+            lastProgress = now;
+        }
+    }
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(workers[i], NULL);
+
+    // Wait until Influx acknowledged everything
+    if (output == NULL)
+    {
+        if (!waitInflux(&iconfig, 0))
+            return EXIT_FAILURE;
+    }
+    else
+    {
+        fclose(output);
+    }
+
+    double elapsed = seconds() - start;
+    printLog(__func__, "Imported %lu telegrams (%lu dropped) in %.2fs, %.0f telegrams/s, %.0f MB/s",
+             telegrams, dropped, elapsed, telegrams / elapsed, total / elapsed / (1 << 20));
+
+    // Decoding drops damaged telegrams, that's the capture; lost batches aren't
+    if (output == NULL && iconfig.dropped > 0)
+    {
+        printError(__func__, "%lu batches didn't make it into InfluxDB", iconfig.dropped);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -5,36 +5,63 @@
  * Consists of connecting to Influx
  *
  * Note: Basic HTTP implementation
- * Note: This wouldn't be implemented on microcontrollers.
+ * Note: The embedded profile (DSMR_EMBEDDED) uses it too, with static batches
  */
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netdb.h> // getaddrinfo()
-#include <arpa/inet.h>
-#include <unistd.h> // for write close and read
-
-#include <sys/select.h>
-#include <time.h> // select
+#include <time.h>
 
 #include "common.h"
 #include "influx.h"
 #include "http.h"
+#ifndef DSMR_EMBEDDED
+#include "udp.h"
+#endif
+
+#ifdef DSMR_EMBEDDED
+// A single connection, its batches are a static pool instead of malloc()
+static char batchPool[INFLUX_QUEUE_SIZE][INFLUX_BATCH_SIZE];
+#endif
 
 struct influx_config influx_init(
     struct http_config *hconfig,
     char *organization, char *bucket, char *token)
 {
-    return (struct influx_config){
+    struct influx_config config = {
         .httpConfig = *hconfig,
         .organization = organization,
         .bucket = bucket,
         .token = token,
+        .filling = -1,
+        .window = INFLUX_DEFAULT_WINDOW,
     };
+
+    // The write query never changes, render it once
+    snprintf(config.query, INFLUX_QUERY_SIZE, "bucket=%s&org=%s&precision=s",
+             bucket, organization);
+    http_request_init(&config.writeRequest, &config.httpConfig, "POST", "/api/v2/write",
+                      config.query, token);
+    return config;
 }
 
+#ifndef DSMR_EMBEDDED
+/**
+ * influx_init_udp sends through udp instead of the HTTP write queue
+ * The v1 UDP listener has no buckets or tokens, its database is configured
+ * on the listener.
+ */
+struct influx_config influx_init_udp(struct udp_config *udp)
+{
+    struct influx_config config = {
+        .httpConfig = {.sockfd = -1, .remote_host = udp->host, .remote_port = udp->port},
+        .filling = -1,
+        .udp = udp,
+    };
+    return config;
+}
+#endif
+
 /**
  * Connects to InfluxDB
  * @returns 1 (true) in case we successfulyl connected or else 0
@@ -56,86 +83,451 @@ int influx_authenticate(struct influx_config *config)
 }
 
 /**
- * Performs HTTP POST Query with token and Line protocol data
- * @returns 0 if unsuccessfull HTTP response or malloc error; or the HTTP statuscode
+ * Batches are filled with complete lines, sealed and sent pipelined on the
+ * keep-alive connection with up to config->window requests in flight.
+ * Responses come back in request order and are matched against the
+ * in-flight FIFO. Only batches that failed are sent again.
+ *
+ *  FREE -> FILLING -> READY -> INFLIGHT -> FREE
+ *                       ^----------'  (429, 5xx or a broken connection)
  */
-int influx_write_DSMR(influx_config_t *config, char *line, int lineLength)
+
+/**
+ * influx_set_window sets the number of outstanding write requests
+ */
+void influx_set_window(struct influx_config *config, int window)
 {
-    // Prepary URIQuery
-    char *query = calloc(128, 1);
-    if (query == NULL)
-        return 0;
+    if (window < 1)
+        window = 1;
+    if (window > INFLUX_MAX_WINDOW)
+        window = INFLUX_MAX_WINDOW;
+    config->window = window;
+}
+
+/**
+ * findOldest returns the index of the oldest batch in the given state or -1
+ */
+static int findOldest(struct influx_config *config, enum influx_batch_state state)
+{
+    int oldest = -1;
+    for (int i = 0; i < INFLUX_QUEUE_SIZE; i++)
+    {
+        struct influx_batch *batch = config->batches + i;
+        if (batch->state != state)
+            continue;
+        // Sequence numbers wrap, compare the distance
+        if (oldest == -1 || (int)(batch->sequence - config->batches[oldest].sequence) < 0)
+            oldest = i;
+    }
+    return oldest;
+}
+
+/**
+ * sealBatch moves the batch being filled to READY
+ */
+static void sealBatch(struct influx_config *config)
+{
+    if (config->filling == -1)
+        return;
+
+    struct influx_batch *batch = config->batches + config->filling;
+    batch->state = BATCH_READY;
+    batch->sequence = config->sequence++;
+    config->filling = -1;
+}
 
-    sprintf(query, "bucket=%s&org=%s&precision=s",
-            config->bucket, config->organization);
+/**
+ * influx_has_room tells whether influx_enqueue() takes length bytes
+ * without pushing a queued batch out
+ */
+int influx_has_room(struct influx_config *config, int length)
+{
+#ifndef DSMR_EMBEDDED
+    if (config->udp != NULL)
+        return 1;
+#endif
+    if (config->filling != -1 &&
+        config->batches[config->filling].length + length <= INFLUX_BATCH_SIZE)
+        return 1;
+    return findOldest(config, BATCH_FREE) != -1;
+}
 
-    char *measurement = "meter";
-    time_t t = convertTimestamp(line);
+/**
+ * influx_drained tells whether Influx has answered for everything that was
+ * enqueued, nothing is waiting, in flight or being filled
+ */
+int influx_drained(struct influx_config *config)
+{
+#ifndef DSMR_EMBEDDED
+    if (config->udp != NULL)
+        return 1;
+#endif
+    if (config->filling != -1 && config->batches[config->filling].length > 0)
+        return 0;
+    for (int i = 0; i < INFLUX_QUEUE_SIZE; i++)
+    {
+        if (config->batches[i].state == BATCH_READY || config->batches[i].state == BATCH_INFLIGHT)
+            return 0;
+    }
+    return 1;
+}
 
-    // Prepare Influx body
-    char *body = calloc(lineLength * 2, 1); // Allocate enough space
-    if (body == NULL)
+/**
+ * influx_enqueue copies complete lines into the batch being filled
+ * When the queue is full the oldest batch that isn't in flight is dropped.
+ * @returns 1 on success, 0 if the lines were dropped
+ */
+int influx_enqueue(struct influx_config *config, char *lines, int length)
+{
+#ifndef DSMR_EMBEDDED
+    if (config->udp != NULL)
+        return udp_enqueue(config->udp, lines, length);
+#endif
+
+    if (length > INFLUX_BATCH_SIZE)
+    {
+        printError(__func__, "Dropping %d bytes, bigger than a batch", length);
         return 0;
+    }
+
+    if (config->filling != -1 &&
+        config->batches[config->filling].length + length > INFLUX_BATCH_SIZE)
+        sealBatch(config);
 
-    // +23 to remove the timestamp=,
-    sprintf(body, "%s %s %ld", measurement, line + 23, t);
-    int body_len = strlen(body);
+    if (config->filling == -1)
+    {
+        int index = findOldest(config, BATCH_FREE);
+        if (index == -1)
+        {
+            index = findOldest(config, BATCH_READY);
+            if (index == -1)
+                return 0; // All batches in flight
 
-#if DEBUG
-    printLog(__func__, "body_length: %db\n", body_len);
+            printError(__func__, "Write queue full, dropping oldest batch (%d bytes)",
+                       config->batches[index].length);
+            config->dropped++;
+        }
+
+        struct influx_batch *batch = config->batches + index;
+        if (batch->data == NULL)
+        {
+#ifdef DSMR_EMBEDDED
+            batch->data = batchPool[index];
+#else
+            // Allocated once on first use, reused afterwards
+            batch->data = malloc(INFLUX_BATCH_SIZE);
+            if (batch->data == NULL)
+            {
+                printErrno(__func__, "Couldn't allocate batch");
+                return 0;
+            }
 #endif
-    int ret = http_post(&(config->httpConfig), "/api/v2/write", query, config->token,
-                        body, body_len);
-
-    free(query);
-    free(body);
-
-    return ret;
-}
-/**
- * Converts meter timestamp=YYMMDDhhmmssX to Unix timestamp
- * Assuming the first element is timestamp
- * //250914143330S
- * //25Y 09M 14d 14h 33m 30s
- */
-time_t convertTimestamp(char *line)
-{
-    struct tm t;
-
-    char year[3], month[3], day[3], hour[3], minute[3], second[3];
-
-    // Extract components from the timestamp
-    char *ts = line + 10;
-    strncpy(year, ts, 2);
-    year[2] = '\0';
-    strncpy(month, ts + 2, 2);
-    month[2] = '\0';
-    strncpy(day, ts + 4, 2);
-    day[2] = '\0';
-    strncpy(hour, ts + 6, 2);
-    hour[2] = '\0';
-    strncpy(minute, ts + 8, 2);
-    minute[2] = '\0';
-    strncpy(second, ts + 10, 2);
-    second[2] = '\0';
-
-    // Convert year to 2000s
-    int yearInt = atoi(year) + 2000 - 1900;
-
-    // Fill timestruct
-    t.tm_year = yearInt;
-    t.tm_mon = atoi(month) - 1;
-    t.tm_mday = atoi(day);
-    t.tm_hour = atoi(hour);
-    t.tm_min = atoi(minute);
-    t.tm_sec = atoi(second);
-    t.tm_isdst = 1; // timestamps from meter are never DST
-#if DEBUG
-    printLog(__func__, "Year %d\tMonth %d\tDay %d\n", t.tm_year, t.tm_mon, t.tm_mday);
-    printLog(__func__, "Hour %d\tMinute %d\tSecond %d\n", t.tm_hour, t.tm_min, t.tm_sec);
-
-    printLog(__func__, "time(NULL)=%ld\n", time(NULL));
-    printLog(__func__, "mktime(&t)=%ld\n", mktime(&t));
+        }
+        batch->length = 0;
+        batch->state = BATCH_FILLING;
+        config->filling = index;
+    }
+
+    struct influx_batch *batch = config->batches + config->filling;
+    memcpy(batch->data + batch->length, lines, length);
+    batch->length += length;
+    return 1;
+}
+
+/**
+ * disconnect closes the connection and puts everything in flight back
+ * to READY, the requests behind a broken one never got an answer
+ */
+static void disconnect(struct influx_config *config, time_t now)
+{
+    http_close(&(config->httpConfig));
+
+    for (; config->inflightCount; config->inflightCount--)
+    {
+        config->batches[config->inflight[config->inflightHead]].state = BATCH_READY;
+        config->inflightHead = (config->inflightHead + 1) % INFLUX_MAX_WINDOW;
+    }
+    config->reconnectAt = now + INFLUX_RECONNECT_DELAY;
+}
+
+/**
+ * completeOldest handles the response of the oldest in-flight request
+ */
+static void completeOldest(struct influx_config *config, int httpcode, time_t now)
+{
+    int index = config->inflight[config->inflightHead];
+    config->inflightHead = (config->inflightHead + 1) % INFLUX_MAX_WINDOW;
+    config->inflightCount--;
+    config->inflightSince = now;
+
+    struct influx_batch *batch = config->batches + index;
+    if (httpcode >= 200 && httpcode < 300)
+    {
+        batch->state = BATCH_FREE;
+        return;
+    }
+
+    if (httpcode == 429 || httpcode >= 500)
+    {
+        // Temporary, retry this batch only and give the server a moment
+        printError(__func__, "InfluxDB answered %d, retrying batch (%d bytes)",
+                   httpcode, batch->length);
+        batch->state = BATCH_READY;
+        config->retryAt = now + INFLUX_RETRY_DELAY;
+        return;
+    }
+
+    // Permanent: the data itself is rejected, sending it again won't help
+    printError(__func__, "InfluxDB rejected batch with %d, dropping (%d bytes): '%.*s'",
+               httpcode, batch->length, batch->length < 256 ? batch->length : 256, batch->data);
+    batch->state = BATCH_FREE;
+    config->dropped++;
+}
+
+/**
+ * pump matches responses, reconnects when needed and sends READY batches
+ * while the window has room
+ * @param wait seconds to wait for a response when requests are in flight
+ * @returns the number of batches still queued
+ */
+static int pump(struct influx_config *config, int wait)
+{
+#ifndef DSMR_EMBEDDED
+    // Fire and forget, nothing stays queued
+    if (config->udp != NULL)
+    {
+        udp_flush(config->udp);
+        return 0;
+    }
 #endif
-    return mktime(&t);
+
+    struct http_config *hconfig = &(config->httpConfig);
+    time_t now = time(NULL);
+
+    if (hconfig->sockfd == -1)
+    {
+        if (now < config->reconnectAt)
+            goto queued;
+        printLog(__func__, "Reconnecting to InfluxDB");
+        if (http_connect(hconfig) == -1)
+        {
+            config->reconnectAt = now + INFLUX_RECONNECT_DELAY;
+            goto queued;
+        }
+    }
+
+    // Responses, in request order
+    for (; config->inflightCount; wait = 0)
+    {
+        int httpcode = http_poll_response(hconfig, wait);
+        if (httpcode == 0)
+            break;
+        if (httpcode == -1)
+        {
+            printError(__func__, "InfluxDB connection lost, %d requests in flight",
+                       config->inflightCount);
+            disconnect(config, now);
+            goto queued;
+        }
+        completeOldest(config, httpcode, now);
+    }
+
+    if (config->inflightCount && now - config->inflightSince > INFLUX_REQUEST_TIMEOUT)
+    {
+        printError(__func__, "InfluxDB didn't answer in %ds", INFLUX_REQUEST_TIMEOUT);
+        disconnect(config, now);
+        goto queued;
+    }
+
+    // Fill the window
+    while (config->inflightCount < config->window && now >= config->retryAt)
+    {
+        int index = findOldest(config, BATCH_READY);
+        if (index == -1)
+        {
+            // Nothing waiting: send what's being filled right away
+            if (config->filling == -1 || config->batches[config->filling].length == 0)
+                break;
+            index = config->filling;
+            sealBatch(config);
+        }
+
+        struct influx_batch *batch = config->batches + index;
+        if (!http_send(hconfig, &(config->writeRequest), batch->data, batch->length))
+        {
+            printError(__func__, "Sending batch failed, reconnecting");
+            disconnect(config, now);
+            goto queued;
+        }
+
+        batch->state = BATCH_INFLIGHT;
+        if (config->inflightCount == 0)
+            config->inflightSince = now;
+        config->inflight[(config->inflightHead + config->inflightCount) % INFLUX_MAX_WINDOW] = index;
+        config->inflightCount++;
+    }
+
+queued:;
+    int queued = 0;
+    for (int i = 0; i < INFLUX_QUEUE_SIZE; i++)
+        queued += config->batches[i].state == BATCH_READY ||
+                  config->batches[i].state == BATCH_INFLIGHT;
+    return queued;
+}
+
+/**
+ * influx_pump matches available responses, reconnects when needed and
+ * sends READY batches while the window has room. Never waits for a response.
+ * @returns the number of batches still queued
+ */
+int influx_pump(struct influx_config *config)
+{
+    return pump(config, 0);
 }
+
+/**
+ * influx_flush sends what is queued and blocks on the connection for the
+ * responses, for at most timeout seconds. It gives up early when nothing
+ * is in flight, a reconnect or a retry would wait longer.
+ * @returns the number of batches still queued
+ */
+int influx_flush(struct influx_config *config, int timeout)
+{
+    time_t deadline = time(NULL) + timeout;
+    int queued = pump(config, 0);
+    while (queued > 0 && config->inflightCount > 0 && time(NULL) < deadline)
+        queued = pump(config, 1);
+    return queued;
+}
+
+#ifndef DSMR_EMBEDDED
+/**
+ * requeue enqueues the lines of a handed over batch, swapping the series
+ * prefix of the first rename that matches each line
+ * @param line room for the longest rewritten line, NULL to copy as is
+ */
+static void requeue(struct influx_config *to, char *data, int length,
+                    const struct influx_rename *renames, int count, char *line)
+{
+    if (line == NULL)
+    {
+        if (!influx_enqueue(to, data, length))
+            printError(__func__, "Dropping a batch of %d bytes", length);
+        return;
+    }
+
+    for (char *end = data + length, *next; data < end; data = next)
+    {
+        char *newline = memchr(data, '\n', end - data);
+        next = newline != NULL ? newline + 1 : end;
+        int lineLength = next - data;
+        char *out = data;
+        int outLength = lineLength;
+
+        for (int i = 0; i < count; i++)
+        {
+            const struct influx_rename *r = renames + i;
+            if (lineLength <= r->fromLength || memcmp(data, r->from, r->fromLength) ||
+                (data[r->fromLength] != ' ' && data[r->fromLength] != ','))
+                continue;
+            memcpy(line, r->to, r->toLength);
+            memcpy(line + r->toLength, data + r->fromLength, lineLength - r->fromLength);
+            out = line;
+            outLength = r->toLength + lineLength - r->fromLength;
+            break;
+        }
+        if (!influx_enqueue(to, out, outLength))
+            printError(__func__, "Dropping a line of %d bytes", outLength);
+    }
+}
+
+/**
+ * influx_handover queues everything from hasn't delivered into to, oldest
+ * first, when the Influx target or the series change. A line whose series
+ * key starts with the from of a rename gets its to, the point keeps its
+ * timestamp and fields under the new tags.
+ *
+ * With from != to the connection of from is given up, its batches in
+ * flight are sent again: Influx keeps one point per series and timestamp,
+ * a repeated write changes nothing. With from == to the queued batches
+ * are rewritten and what's in flight stays as it was sent.
+ * @returns the number of batches handed over
+ */
+int influx_handover(struct influx_config *from, struct influx_config *to,
+                    const struct influx_rename *renames, int count)
+{
+    if (from->udp != NULL)
+        return 0;
+
+    // Room for a rewritten line and, in place, a copy of the batch
+    int longest = 0;
+    for (int i = 0; i < count; i++)
+        longest = renames[i].toLength > longest ? renames[i].toLength : longest;
+    char *line = count > 0 ? malloc(INFLUX_BATCH_SIZE + longest) : NULL;
+    char *copy = from == to ? malloc(INFLUX_BATCH_SIZE) : NULL;
+    if ((count > 0 && line == NULL) || (from == to && copy == NULL))
+    {
+        printErrno(__func__, "Couldn't allocate the rewrite buffers, lines keep their tags");
+        free(line);
+        free(copy);
+        if (from == to)
+            return 0;
+        line = NULL;
+    }
+
+    if (from != to)
+        disconnect(from, time(NULL));
+    sealBatch(from);
+
+    // Taken out of the queue first, requeueing in place seals new batches
+    // that must not come around again. INFLIGHT keeps influx_enqueue() off
+    // them, nothing is sent before this returns.
+    int order[INFLUX_QUEUE_SIZE];
+    int batches = 0;
+    int index;
+    while ((index = findOldest(from, BATCH_READY)) != -1)
+    {
+        from->batches[index].state = BATCH_INFLIGHT;
+        order[batches++] = index;
+    }
+
+    for (int i = 0; i < batches; i++)
+    {
+        struct influx_batch *batch = from->batches + order[i];
+        char *data = batch->data;
+        if (copy != NULL)
+            data = memcpy(copy, batch->data, batch->length);
+        batch->state = BATCH_FREE;
+        requeue(to, data, batch->length, renames, count, line);
+    }
+    free(line);
+    free(copy);
+
+    if (batches > 0 && from != to)
+        printLog(__func__, "Handed %d batches over to %s:%u", batches,
+                 to->httpConfig.remote_host, to->httpConfig.remote_port);
+    return batches;
+}
+
+/**
+ * influx_close closes the connection and frees the batches
+ */
+void influx_close(struct influx_config *config)
+{
+    if (config->udp != NULL)
+    {
+        udp_close(config->udp);
+        return;
+    }
+
+    http_close(&(config->httpConfig));
+    for (int i = 0; i < INFLUX_QUEUE_SIZE; i++)
+    {
+        free(config->batches[i].data);
+        config->batches[i].data = NULL;
+        config->batches[i].state = BATCH_FREE;
+    }
+    config->filling = -1;
+    config->inflightCount = 0;
+}
+#endif
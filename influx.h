@@ -3,6 +3,41 @@
 
 #include "http.h"
 
+#include <time.h>
+
+#define INFLUX_QUERY_SIZE 256
+
+// The embedded profile shrinks the queue, see CMakeLists.txt
+#ifndef INFLUX_BATCH_SIZE
+#define INFLUX_BATCH_SIZE (64 * 1024) // Bytes of line protocol per write request
+#endif
+#ifndef INFLUX_QUEUE_SIZE
+#define INFLUX_QUEUE_SIZE 64 // Batches kept while Influx is unreachable
+#endif
+#define INFLUX_DEFAULT_WINDOW 4       // Outstanding write requests
+#define INFLUX_MAX_WINDOW 32
+#define INFLUX_REQUEST_TIMEOUT 5 // Seconds without a response before reconnecting
+#define INFLUX_RECONNECT_DELAY 5
+#define INFLUX_RETRY_DELAY 1
+
+struct udp_config;
+
+enum influx_batch_state
+{
+    BATCH_FREE,
+    BATCH_FILLING,
+    BATCH_READY,
+    BATCH_INFLIGHT,
+};
+
+struct influx_batch
+{
+    char *data; // Allocated once on first use
+    int length;
+    enum influx_batch_state state;
+    unsigned int sequence; // Order in which the batch was sealed
+};
+
 typedef struct influx_config
 {
     struct http_config httpConfig;
@@ -11,15 +46,53 @@ typedef struct influx_config
     char *organization;
     char *token;
 
+    char query[INFLUX_QUERY_SIZE];   // Pre-rendered write query
+    struct http_request writeRequest; // Pre-rendered write request head
+
+    // Write queue
+    struct influx_batch batches[INFLUX_QUEUE_SIZE];
+    int filling;                       // Batch being filled or -1
+    int inflight[INFLUX_MAX_WINDOW];   // FIFO of batches in request order
+    int inflightHead, inflightCount;
+    int window;
+    unsigned int sequence;
+    time_t inflightSince; // Last progress on the in-flight requests
+    time_t reconnectAt;
+    time_t retryAt;
+    unsigned long dropped; // Batches rejected by Influx or pushed out of a full queue
+
+    struct udp_config *udp; // Set by influx_init_udp(), NULL for HTTP
 } influx_config_t;
 
+/**
+ * Series key influx_handover() rewrites, "measurement,tags" without the
+ * space the line protocol encoder ends its prefix with. It matches the
+ * start of a line up to a space or the ',' of a further tag.
+ */
+struct influx_rename
+{
+    const char *from;
+    int fromLength;
+    const char *to;
+    int toLength;
+};
+
 struct influx_config influx_init(
     struct http_config *hconfig,
     char *organization, char *bucket, char *token);
+struct influx_config influx_init_udp(struct udp_config *udp);
 
 int influx_connect(struct influx_config *config);
 int influx_authenticate(struct influx_config *config);
-int influx_write_DSMR(influx_config_t *config, char *line, int lineLength);
-
-time_t convertTimestamp(char *line);
+void influx_set_window(struct influx_config *config, int window);
+int influx_has_room(struct influx_config *config, int length);
+int influx_drained(struct influx_config *config);
+int influx_enqueue(struct influx_config *config, char *lines, int length);
+int influx_pump(struct influx_config *config);
+int influx_flush(struct influx_config *config, int timeout);
+#ifndef DSMR_EMBEDDED
+int influx_handover(struct influx_config *from, struct influx_config *to,
+                    const struct influx_rename *renames, int count);
+void influx_close(struct influx_config *config);
+#endif
 #endif
\ No newline at end of file
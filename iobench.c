@@ -0,0 +1,478 @@
+/**
+ * iobench.c - Syscalls and CPU per telegram of the serial loop, per I/O backend
+ *
+ * Usage:
+ * dsmr-iobench [-b uring|epoll|both] [-n telegrams] [-r rate] [-f capture] [-a dir]
+ *  -b  backends to measure (both)
+ *  -n  telegrams per backend (2000)
+ *  -r  telegrams per second, 0 for as fast as possible (0)
+ *  -f  replay the telegrams of a raw capture instead of the built in one
+ *  -a  archive directory, a fresh one under /tmp by default
+ *
+ * Runs the loop of the daemon in-process: readTTY() on a pseudo terminal,
+ * decoding, the archive and one Influx write per telegram to a stand-in
+ * that answers 204 right away. The meter and the stand-in are a child
+ * process, so the CPU time is the loop's own, io_uring workers included.
+ * Syscalls are counted by the I/O layer, which every read, wait, send and
+ * write of the loop goes through; the clock reads are vDSO calls.
+ */
+#define _GNU_SOURCE // posix_openpt flags
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "crc16.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "lineprotocol.h"
+#include "tty.h"
+#include "http.h"
+#include "influx.h"
+#include "archive.h"
+#include "ioloop.h"
+
+#define IOBENCH_TELEGRAM_SIZE 4096
+#define IOBENCH_DRAIN_TIMEOUT 5 // Seconds for the last writes after the measurement
+
+static const char builtinTelegram[] =
+    "/FLU5\\253769484_A\r\n"
+    "\r\n"
+    "0-0:96.1.4(50217)\r\n"
+    "0-0:96.1.1(3153414733313031303231363035)\r\n"
+    "0-0:1.0.0(240101000000W)\r\n"
+    "1-0:1.8.1(000123.456*kWh)\r\n"
+    "1-0:1.8.2(000234.567*kWh)\r\n"
+    "1-0:2.8.1(000012.345*kWh)\r\n"
+    "1-0:2.8.2(000023.456*kWh)\r\n"
+    "0-0:96.14.0(0001)\r\n"
+    "1-0:1.4.0(00.123*kW)\r\n"
+    "1-0:1.6.0(231211154500W)(03.456*kW)\r\n"
+    "1-0:1.7.0(01.234*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "1-0:21.7.0(00.500*kW)\r\n"
+    "1-0:41.7.0(00.400*kW)\r\n"
+    "1-0:61.7.0(00.334*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "1-0:32.7.0(230.1*V)\r\n"
+    "1-0:52.7.0(231.2*V)\r\n"
+    "1-0:72.7.0(229.8*V)\r\n"
+    "1-0:31.7.0(002.15*A)\r\n"
+    "1-0:51.7.0(001.80*A)\r\n"
+    "1-0:71.7.0(001.50*A)\r\n"
+    "0-0:96.3.10(1)\r\n"
+    "0-0:17.0.0(999.9*kW)\r\n"
+    "1-0:31.4.0(999*A)\r\n"
+    "0-0:96.13.0()\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.1(37464C4F32313139303333373333)\r\n"
+    "0-1:24.4.0(1)\r\n"
+    "0-1:24.2.3(231231234500W)(00123.456*m3)\r\n"
+    "!0000\r\n";
+
+/**
+ * Telegrams the meter side replays, with their CRC
+ */
+static char **telegrams;
+static int *telegramLengths;
+static int telegramCount;
+
+/**
+ * addTelegram keeps a telegram and renders its CRC
+ */
+static int addTelegram(const char *telegram, int length)
+{
+    const char *bang = memchr(telegram, '!', length);
+    if (telegram[0] != '/' || bang == NULL)
+        return 1;
+
+    char **grown = realloc(telegrams, (telegramCount + 1) * sizeof(char *));
+    int *lengths = realloc(telegramLengths, (telegramCount + 1) * sizeof(int));
+    char *data = malloc(bang - telegram + 7);
+    if (grown != NULL)
+        telegrams = grown;
+    if (lengths != NULL)
+        telegramLengths = lengths;
+    if (grown == NULL || lengths == NULL || data == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate telegram");
+        return 0;
+    }
+
+    int crcOffset = bang - telegram;
+    memcpy(data, telegram, crcOffset + 1);
+    snprintf(data + crcOffset + 1, 7, "%04X\r\n", crc16(0, data, crcOffset + 1));
+    telegrams[telegramCount] = data;
+    telegramLengths[telegramCount++] = crcOffset + 7;
+    return 1;
+}
+
+/**
+ * loadCapture takes every complete telegram of a raw capture
+ * @returns 1 on success, 0 on error
+ */
+static int loadCapture(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printErrno(__func__, "Couldn't open '%s'", path);
+        return 0;
+    }
+
+    char telegram[IOBENCH_TELEGRAM_SIZE];
+    int length = 0;
+    char line[IOBENCH_TELEGRAM_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        int lineLength = strlen(line);
+        if (line[0] == '/')
+            length = 0;
+        if (length + lineLength > IOBENCH_TELEGRAM_SIZE)
+        {
+            length = 0;
+            continue;
+        }
+        memcpy(telegram + length, line, lineLength);
+        length += lineLength;
+        if (line[0] == '!' && !addTelegram(telegram, length))
+            break;
+    }
+    fclose(file);
+
+    if (telegramCount == 0)
+        printError(__func__, "No telegrams in '%s'", path);
+    return telegramCount > 0;
+}
+
+static int sendAll(int fd, const char *data, int length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+/**
+ * serveConnection answers every complete request with 204, in order
+ */
+static void *serveConnection(void *arg)
+{
+    int fd = (int)(long)arg;
+    int capacity = 256 * 1024;
+    int length = 0;
+    char *buffer = malloc(capacity);
+
+    while (buffer != NULL)
+    {
+        ssize_t n = read(fd, buffer + length, capacity - length);
+        if (n <= 0)
+            break;
+        length += n;
+
+        int offset = 0;
+        for (;;)
+        {
+            char *end = memmem(buffer + offset, length - offset, "\r\n\r\n", 4);
+            if (end == NULL)
+                break;
+            char *contentLength = memmem(buffer + offset, end - buffer - offset, "Content-Length:", 15);
+            int request = end + 4 - buffer - offset + (contentLength ? atoi(contentLength + 15) : 0);
+            if (offset + request > length)
+                break;
+            offset += request;
+            if (!sendAll(fd, "HTTP/1.1 204 No Content\r\n\r\n", 27))
+                goto closed;
+        }
+        length -= offset;
+        memmove(buffer, buffer + offset, length);
+        if (length == capacity)
+            break;
+    }
+closed:
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+static void *acceptConnections(void *arg)
+{
+    int listenfd = (int)(long)arg;
+    for (;;)
+    {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd == -1)
+            continue;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveConnection, (void *)(long)fd) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/**
+ * runMeter is the child: the stand-in Influx and the meter writing count
+ * telegrams into the pseudo terminal, then it waits to be killed
+ */
+static void runMeter(int listenfd, int ptyfd, long count, double rate)
+{
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, acceptConnections, (void *)(long)listenfd) != 0)
+        _exit(EXIT_FAILURE);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < count; i++)
+    {
+        if (rate > 0)
+        {
+            // Paced from the start, not from the previous write
+            double due = i / rate;
+            struct timespec at = {.tv_sec = start.tv_sec + (time_t)due,
+                                  .tv_nsec = start.tv_nsec + (long)((due - (time_t)due) * 1e9)};
+            if (at.tv_nsec >= 1000000000)
+            {
+                at.tv_sec++;
+                at.tv_nsec -= 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+        }
+        int t = i % telegramCount;
+        const char *data = telegrams[t];
+        int length = telegramLengths[t];
+        while (length > 0)
+        {
+            ssize_t n = write(ptyfd, data, length);
+            if (n <= 0)
+                _exit(n == 0 || errno == EIO ? EXIT_SUCCESS : EXIT_FAILURE);
+            data += n;
+            length -= n;
+        }
+    }
+    for (;;)
+        pause();
+}
+
+static int listenLocal(unsigned short *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(fd, 4) == -1 || getsockname(fd, (struct sockaddr *)&address, &addressLength) == -1)
+    {
+        printErrno(__func__, "Couldn't listen on 127.0.0.1");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+static double cpuSeconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * benchmark runs count telegrams through the loop on backend
+ * @returns 1 when every telegram came through, 0 on error
+ */
+static int benchmark(enum io_backend wanted, long count, double rate, const char *archiveDir)
+{
+    unsigned short port;
+    int listenfd = listenLocal(&port);
+    int ptyfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (listenfd == -1 || ptyfd == -1 || grantpt(ptyfd) == -1 || unlockpt(ptyfd) == -1)
+    {
+        printErrno(__func__, "Couldn't set up the meter side");
+        return 0;
+    }
+    int ttyfd = open(ptsname(ptyfd), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (ttyfd == -1 || (ttyfd = setupTTY(ttyfd)) == -1)
+        return 0;
+
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        printErrno(__func__, "fork failed");
+        return 0;
+    }
+    if (pid == 0)
+    {
+        close(ttyfd);
+        runMeter(listenfd, ptyfd, count, rate);
+    }
+    close(listenfd);
+    close(ptyfd);
+
+    enum io_backend backend = io_init(wanted);
+    struct http_config hconfig = http_init("127.0.0.1", port);
+    struct influx_config iconfig = influx_init(&hconfig, "bench", "bench", "bench");
+    struct lp_encoder encoder;
+    struct archive_config archive;
+    int ok = influx_connect(&iconfig) && lp_init(&encoder, "meter", NULL, 2048) &&
+             archive_init(&archive, archiveDir, 0);
+
+    struct dsmr_telegram telegram;
+    dsmr_telegram_reset(&telegram);
+    lp_begin(&encoder);
+
+    char line[IOBENCH_TELEGRAM_SIZE];
+    long done = 0;
+    struct io_stats before, after;
+    io_get_stats(&before);
+    double cpu = cpuSeconds();
+    double start = seconds();
+    while (ok && done < count)
+    {
+        int n = readTTY(ttyfd, line, sizeof(line));
+        if (n < 0)
+        {
+            printErrno(__func__, "Reading the pseudo terminal failed");
+            ok = 0;
+            break;
+        }
+        influx_pump(&iconfig);
+        if (n == 0)
+            continue;
+
+        archive_line(&archive, line, strnlen(line, n));
+        if (line[0] == '/')
+        {
+            dsmr_telegram_reset(&telegram);
+            lp_begin(&encoder);
+            continue;
+        }
+        decodeLine(&encoder, &telegram, line, n);
+        if (line[0] == '!')
+        {
+            archive_end(&archive, telegram.timestamp);
+            if (lp_end(&encoder, telegram.timestamp))
+                influx_enqueue(&iconfig, encoder.buffer, encoder.length);
+            influx_pump(&iconfig);
+            lp_reset(&encoder);
+            lp_begin(&encoder);
+            done++;
+        }
+    }
+    double wall = seconds() - start;
+    cpu = cpuSeconds() - cpu;
+    io_get_stats(&after);
+
+    // The last writes, not measured
+    double deadline = seconds() + IOBENCH_DRAIN_TIMEOUT;
+    while (ok && influx_pump(&iconfig) > 0 && seconds() < deadline)
+        io_read(ttyfd, line, sizeof(line), 10);
+    archive_commit(&archive);
+
+    if (done > 0)
+        printf("%-9s %6ld telegrams %7.1f syscalls %7.1f operations %8.1f us CPU per telegram, %.2fs\n",
+               io_backend_name(backend), done,
+               (double)(after.syscalls - before.syscalls) / done,
+               (double)(after.operations - before.operations) / done,
+               cpu * 1e6 / done, wall);
+
+    http_close(&iconfig.httpConfig);
+    closeTTY(ttyfd);
+    io_shutdown();
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return ok && done == count;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *backends = "both";
+    const char *capture = NULL;
+    const char *archiveDir = NULL;
+    long count = 2000;
+    double rate = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:r:f:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            backends = optarg;
+            break;
+        case 'n':
+            count = atol(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'f':
+            capture = optarg;
+            break;
+        case 'a':
+            archiveDir = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-b uring|epoll|both] [-n telegrams] [-r rate] [-f capture] [-a dir]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    setupLogs();
+    signal(SIGPIPE, SIG_IGN);
+    if (!dsmr_init())
+        return EXIT_FAILURE;
+    if (capture != NULL ? !loadCapture(capture) : !addTelegram(builtinTelegram, sizeof(builtinTelegram) - 1))
+        return EXIT_FAILURE;
+
+    char tmp[] = "/tmp/dsmr-iobench-XXXXXX";
+    if (archiveDir == NULL && (archiveDir = mkdtemp(tmp)) == NULL)
+    {
+        printErrno(__func__, "Couldn't create an archive directory");
+        return EXIT_FAILURE;
+    }
+
+    int ok = 1;
+    if (strcmp(backends, "epoll"))
+        ok &= benchmark(IO_BACKEND_URING, count, rate, archiveDir);
+    if (strcmp(backends, "uring"))
+        ok &= benchmark(IO_BACKEND_EPOLL, count, rate, archiveDir);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,877 @@
+/**
+ * ioloop.c - io_uring event loop with an epoll fallback, see ioloop.h
+ *
+ * The ring is driven with the raw syscalls, no liburing: io_uring_setup(),
+ * the mmap()s of the rings and one IORING_REGISTER_BUFFERS for the read
+ * slots and the append staging. There's no SQPOLL, the kernel only looks
+ * at the submission queue in io_uring_enter(), so an SQE can still be
+ * linked to the next one until then.
+ */
+#define _GNU_SOURCE // syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h> // _NSIG
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/time_types.h>
+#include <linux/io_uring.h>
+
+#include "common.h"
+#include "ioloop.h"
+
+#define IO_WRITES 16 // Writes and syncs of the append chain in flight
+#define IO_EOF 1     // Read result at the end of the file, errors are -errno
+
+enum io_kind
+{
+    IO_KIND_READ = 1,
+    IO_KIND_SEND,
+    IO_KIND_WRITE,
+    IO_KIND_CANCEL,
+};
+
+#define IO_USER_DATA(kind, index) ((unsigned long long)(kind) << 32 | (unsigned)(index))
+
+/**
+ * Descriptor the loop reads from or sends to
+ */
+struct io_slot
+{
+    int fd;      // -1 when free, -2 when forgotten with an operation still in flight
+    int epollfd; // Epoll backend, -1 until the first wait
+
+    char *buffer;       // IO_READ_SIZE, registered
+    int length, offset; // Read and not handed out yet
+    int reading;        // A read is in flight
+    int result;         // IO_EOF or -errno of the last read, 0 when fine
+
+    int sending;                   // Sends in flight
+    struct io_uring_sqe *lastSend; // Not submitted yet, the next send links to it
+    int failed;                    // errno of a failed send
+};
+
+struct io_sendop
+{
+    int slot; // -1 when free
+    size_t length;
+    struct msghdr msg;
+    struct iovec iov[2];
+    char head[IO_HEAD_SIZE];
+};
+
+struct io_writeop
+{
+    int fd;        // -1 when free
+    size_t length; // Expected result, 0 for a sync
+    void (*done)(void *context, int ok);
+    void *context;
+};
+
+static struct
+{
+    int fd;
+    int registered; // Fixed buffers, otherwise plain reads and writes
+
+    void *sqRing, *cqRing;
+    size_t sqRingSize, cqRingSize;
+    struct io_uring_sqe *sqes;
+    size_t sqesSize;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray, sqEntries;
+    unsigned *cqHead, *cqTail, *cqMask;
+    struct io_uring_cqe *cqes;
+    unsigned pending; // Queued since the last io_uring_enter()
+
+    char *arena; // Read slots, then the staging
+    char *staging;
+    int writing;    // Writes and syncs in flight
+    int writeError; // First errno of the chain in flight
+} ring = {.fd = -1};
+
+static enum io_backend backend = IO_BACKEND_EPOLL;
+static int initialized;
+static pthread_t owner;
+
+static struct io_slot slots[IO_SLOTS];
+static struct io_sendop sends[IO_SENDS];
+static struct io_writeop writes[IO_WRITES];
+
+static __thread struct io_stats stats;
+
+static long long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * isOwner tells whether the caller may use the slots
+ */
+static int isOwner(void)
+{
+    return initialized && pthread_equal(owner, pthread_self());
+}
+
+static int onRing(void)
+{
+    return backend == IO_BACKEND_URING && isOwner();
+}
+
+/**
+ * findSlot looks up the slot of fd, taking a free one when create is set
+ * @returns the slot or NULL
+ */
+static struct io_slot *findSlot(int fd, int create)
+{
+    struct io_slot *free = NULL;
+    for (int i = 0; i < IO_SLOTS; i++)
+    {
+        struct io_slot *slot = slots + i;
+        if (slot->fd == fd)
+            return slot;
+        if (slot->fd == -2 && !slot->reading && !slot->sending)
+            slot->fd = -1;
+        if (slot->fd == -1 && free == NULL)
+            free = slot;
+    }
+    if (!create || free == NULL)
+        return NULL;
+
+    char *buffer = free->buffer;
+    memset(free, 0, sizeof(*free));
+    free->fd = fd;
+    free->epollfd = -1;
+    free->buffer = buffer;
+    return free;
+}
+
+/**
+ * enter submits the queued SQEs and, with wait, waits up to timeoutMs
+ * (-1 forever) for a completion
+ * @returns what io_uring_enter() returns
+ */
+static int enter(int wait, long long timeoutMs)
+{
+    struct __kernel_timespec ts = {.tv_sec = timeoutMs / 1000, .tv_nsec = timeoutMs % 1000 * 1000000};
+    struct io_uring_getevents_arg arg = {
+        .sigmask_sz = _NSIG / 8,
+        .ts = timeoutMs >= 0 ? (unsigned long long)(unsigned long)&ts : 0,
+    };
+    int ret = syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait ? 1 : 0,
+                      wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0,
+                      wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    stats.syscalls++;
+    if (ret > 0)
+    {
+        // Submitted, nothing can be linked to those anymore
+        ring.pending -= (unsigned)ret < ring.pending ? (unsigned)ret : ring.pending;
+        for (int i = 0; i < IO_SLOTS; i++)
+            slots[i].lastSend = NULL;
+    }
+    return ret;
+}
+
+/**
+ * reserve submits what's queued when fewer than count SQEs are free
+ */
+static void reserve(unsigned count)
+{
+    unsigned head = __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+    if (ring.sqEntries - (*ring.sqTail - head) < count)
+        enter(0, 0);
+}
+
+/**
+ * getSqe queues a zeroed SQE, call reserve() first
+ */
+static struct io_uring_sqe *getSqe(void)
+{
+    unsigned tail = *ring.sqTail;
+    unsigned index = tail & *ring.sqMask;
+    struct io_uring_sqe *sqe = ring.sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sqArray[index] = index;
+    __atomic_store_n(ring.sqTail, tail + 1, __ATOMIC_RELEASE);
+    ring.pending++;
+    return sqe;
+}
+
+static void complete(unsigned long long data, int res)
+{
+    unsigned index = (unsigned)data;
+    switch (data >> 32)
+    {
+    case IO_KIND_READ:
+    {
+        struct io_slot *slot = slots + index;
+        slot->reading = 0;
+        if (res > 0)
+        {
+            slot->length = res;
+            slot->offset = 0;
+            stats.operations++;
+        }
+        else
+            slot->result = res == 0 ? IO_EOF : res;
+        break;
+    }
+    case IO_KIND_SEND:
+    {
+        struct io_sendop *op = sends + index;
+        struct io_slot *slot = slots + op->slot;
+        op->slot = -1;
+        slot->sending--;
+        stats.operations++;
+        if (res != (int)op->length && !slot->failed)
+        {
+            // Surfaces as a failed read, the caller reconnects
+            slot->failed = res < 0 ? -res : EPIPE;
+            if (res != -ECANCELED)
+            {
+                errno = slot->failed;
+                printErrno(__func__, "Send of %zu bytes failed", op->length);
+            }
+        }
+        break;
+    }
+    case IO_KIND_WRITE:
+    {
+        struct io_writeop *op = writes + index;
+        if (op->length)
+            stats.operations++;
+        if (!ring.writeError && res < 0 && res != -ECANCELED)
+            ring.writeError = -res;
+        else if (!ring.writeError && op->length && res >= 0 && (size_t)res != op->length)
+            ring.writeError = EIO;
+
+        void (*done)(void *, int) = op->done;
+        void *context = op->context;
+        op->fd = -1;
+        ring.writing--;
+        if (done != NULL)
+        {
+            // The last sync of the chain reports for all of it
+            int error = ring.writeError;
+            ring.writeError = 0;
+            errno = error;
+            done(context, !error);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * reap handles every completion that's there, without a syscall
+ */
+static void reap(void)
+{
+    for (;;)
+    {
+        unsigned head = *ring.cqHead;
+        if (head == __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE))
+            return;
+        struct io_uring_cqe *cqe = ring.cqes + (head & *ring.cqMask);
+        unsigned long long data = cqe->user_data;
+        int res = cqe->res;
+
+        // Released before the handler, which may wait for completions itself
+        __atomic_store_n(ring.cqHead, head + 1, __ATOMIC_RELEASE);
+        complete(data, res);
+    }
+}
+
+/**
+ * waitUntil submits and handles completions until done(arg) holds
+ * @returns 1 when it holds, 0 after timeoutMs (-1 waits forever)
+ */
+static int waitUntil(int (*done)(const void *arg), const void *arg, int timeoutMs)
+{
+    long long deadline = nowMs() + timeoutMs;
+    for (;;)
+    {
+        reap();
+        if (done(arg))
+            return 1;
+        long long remaining = deadline - nowMs();
+        if (timeoutMs >= 0 && remaining <= 0)
+            return 0;
+        enter(1, timeoutMs >= 0 ? remaining : -1);
+    }
+}
+
+static int sendsDone(const void *arg)
+{
+    return ((const struct io_slot *)arg)->sending == 0;
+}
+
+static int sendFree(const void *arg)
+{
+    (void)arg;
+    for (int i = 0; i < IO_SENDS; i++)
+        if (sends[i].slot == -1)
+            return 1;
+    return 0;
+}
+
+static int writesDone(const void *arg)
+{
+    const int *fd = arg;
+    if (fd == NULL)
+        return ring.writing == 0;
+    for (int i = 0; i < IO_WRITES; i++)
+        if (writes[i].fd == *fd)
+            return 0;
+    return 1;
+}
+
+static int slotIdle(const void *arg)
+{
+    const struct io_slot *slot = arg;
+    return !slot->reading && !slot->sending;
+}
+
+/**
+ * teardownRing unmaps and closes whatever setupRing() got to
+ */
+static void teardownRing(void)
+{
+    if (ring.arena != NULL)
+        munmap(ring.arena, IO_SLOTS * IO_READ_SIZE + IO_STAGING_SIZE);
+    if (ring.sqes != NULL)
+        munmap(ring.sqes, ring.sqesSize);
+    if (ring.cqRing != NULL && ring.cqRing != ring.sqRing)
+        munmap(ring.cqRing, ring.cqRingSize);
+    if (ring.sqRing != NULL)
+        munmap(ring.sqRing, ring.sqRingSize);
+    if (ring.fd != -1)
+        close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+    for (int i = 0; i < IO_SLOTS; i++)
+        slots[i].buffer = NULL;
+}
+
+/**
+ * setupRing creates the ring and registers the buffers
+ * @returns 1 on success, 0 when io_uring can't be used
+ */
+static int setupRing(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (ring.fd == -1)
+    {
+        printWarning(__func__, "io_uring unavailable (%s)", strerror(errno));
+        ring.fd = -1;
+        return 0;
+    }
+    // Waits with a timeout, 5.11
+    if (!(params.features & IORING_FEAT_EXT_ARG))
+    {
+        printWarning(__func__, "Kernel too old for io_uring waits with a timeout");
+        teardownRing();
+        return 0;
+    }
+
+    ring.sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    int single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && ring.cqRingSize > ring.sqRingSize)
+        ring.sqRingSize = ring.cqRingSize;
+    ring.sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    void *sq = mmap(NULL, ring.sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring.fd, IORING_OFF_SQ_RING);
+    void *cq = single ? sq
+                      : mmap(NULL, ring.cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring.fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, ring.sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_SQES);
+    void *arena = mmap(NULL, IO_SLOTS * IO_READ_SIZE + IO_STAGING_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.sqRing = sq != MAP_FAILED ? sq : NULL;
+    ring.cqRing = cq != MAP_FAILED ? cq : NULL;
+    ring.sqes = sqes != MAP_FAILED ? sqes : NULL;
+    ring.arena = arena != MAP_FAILED ? arena : NULL;
+    if (ring.sqRing == NULL || ring.cqRing == NULL || ring.sqes == NULL || ring.arena == NULL)
+    {
+        printErrno(__func__, "Couldn't map the io_uring rings");
+        teardownRing();
+        return 0;
+    }
+
+    char *sqRing = ring.sqRing, *cqRing = ring.cqRing;
+    ring.sqHead = (unsigned *)(sqRing + params.sq_off.head);
+    ring.sqTail = (unsigned *)(sqRing + params.sq_off.tail);
+    ring.sqMask = (unsigned *)(sqRing + params.sq_off.ring_mask);
+    ring.sqArray = (unsigned *)(sqRing + params.sq_off.array);
+    ring.sqEntries = params.sq_entries;
+    ring.cqHead = (unsigned *)(cqRing + params.cq_off.head);
+    ring.cqTail = (unsigned *)(cqRing + params.cq_off.tail);
+    ring.cqMask = (unsigned *)(cqRing + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cqRing + params.cq_off.cqes);
+
+    // One buffer per slot and the staging, buf_index is the slot or IO_SLOTS
+    struct iovec buffers[IO_SLOTS + 1];
+    for (int i = 0; i < IO_SLOTS; i++)
+    {
+        slots[i].buffer = ring.arena + i * IO_READ_SIZE;
+        buffers[i] = (struct iovec){.iov_base = slots[i].buffer, .iov_len = IO_READ_SIZE};
+    }
+    ring.staging = ring.arena + IO_SLOTS * IO_READ_SIZE;
+    buffers[IO_SLOTS] = (struct iovec){.iov_base = ring.staging, .iov_len = IO_STAGING_SIZE};
+
+    // RLIMIT_MEMLOCK may be too small for them on older kernels
+    ring.registered = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS,
+                              buffers, IO_SLOTS + 1) == 0;
+    if (!ring.registered)
+        printWarning(__func__, "Buffers not registered (%s), using plain reads and writes",
+                     strerror(errno));
+    return 1;
+}
+
+/**
+ * io_init picks the backend of the calling thread, io_uring falls back to
+ * epoll when the kernel doesn't have it
+ * @returns the backend in use
+ */
+enum io_backend io_init(enum io_backend preferred)
+{
+    owner = pthread_self();
+    initialized = 1;
+    backend = IO_BACKEND_EPOLL;
+    for (int i = 0; i < IO_SLOTS; i++)
+    {
+        slots[i].fd = -1;
+        slots[i].epollfd = -1;
+    }
+    for (int i = 0; i < IO_SENDS; i++)
+        sends[i].slot = -1;
+    for (int i = 0; i < IO_WRITES; i++)
+        writes[i].fd = -1;
+
+    if (preferred == IO_BACKEND_URING && setupRing())
+        backend = IO_BACKEND_URING;
+
+    if (backend == IO_BACKEND_URING)
+        printLog(__func__, "I/O through io_uring, %d entries%s", ring.sqEntries,
+                 ring.registered ? ", registered buffers" : "");
+    else
+        printLog(__func__, "I/O through epoll");
+    return backend;
+}
+
+/**
+ * io_shutdown cancels what's in flight and releases the ring
+ */
+void io_shutdown(void)
+{
+    if (!isOwner())
+        return;
+    for (int i = 0; i < IO_SLOTS; i++)
+        if (slots[i].fd >= 0)
+            io_forget(slots[i].fd);
+    if (backend == IO_BACKEND_URING)
+    {
+        waitUntil(writesDone, NULL, -1);
+        teardownRing();
+    }
+    backend = IO_BACKEND_EPOLL;
+    initialized = 0;
+}
+
+enum io_backend io_get_backend(void)
+{
+    return backend;
+}
+
+const char *io_backend_name(enum io_backend backend)
+{
+    return backend == IO_BACKEND_URING ? "io_uring" : "epoll";
+}
+
+/**
+ * readNow reads what's there after a wait said it's readable
+ * @returns bytes read or -1, errno 0 at the end of the file
+ */
+static int readNow(int fd, char *buffer, size_t size)
+{
+    int n = read(fd, buffer, size);
+    stats.syscalls++;
+    if (n == 0)
+    {
+        errno = 0;
+        return -1;
+    }
+    if (n > 0)
+        stats.operations++;
+    return n;
+}
+
+static int pollRead(int fd, char *buffer, size_t size, int timeoutMs)
+{
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    int ret = poll(&pfd, 1, timeoutMs);
+    stats.syscalls++;
+    if (ret <= 0)
+        return ret == -1 && errno != EINTR ? -1 : 0;
+    return readNow(fd, buffer, size);
+}
+
+static int epollRead(struct io_slot *slot, char *buffer, size_t size, int timeoutMs)
+{
+    if (slot->epollfd == -1)
+    {
+        // Registered once, not rebuilt per wait like a select() set
+        struct epoll_event event = {.events = EPOLLIN};
+        slot->epollfd = epoll_create1(EPOLL_CLOEXEC);
+        stats.syscalls += 2;
+        if (slot->epollfd == -1 || epoll_ctl(slot->epollfd, EPOLL_CTL_ADD, slot->fd, &event) == -1)
+        {
+            if (slot->epollfd != -1)
+                close(slot->epollfd);
+            slot->epollfd = -1;
+            return pollRead(slot->fd, buffer, size, timeoutMs);
+        }
+    }
+
+    struct epoll_event event;
+    int ret = epoll_wait(slot->epollfd, &event, 1, timeoutMs);
+    stats.syscalls++;
+    if (ret <= 0)
+        return ret == -1 && errno != EINTR ? -1 : 0;
+    return readNow(slot->fd, buffer, size);
+}
+
+static int ringRead(struct io_slot *slot, char *buffer, size_t size, int timeoutMs)
+{
+    long long deadline = nowMs() + timeoutMs;
+    int flushed = 0;
+    for (;;)
+    {
+        reap();
+        if (slot->offset < slot->length)
+        {
+            int n = slot->length - slot->offset;
+            if ((size_t)n > size)
+                n = size;
+            memcpy(buffer, slot->buffer + slot->offset, n);
+            slot->offset += n;
+            return n;
+        }
+        if (slot->result)
+        {
+            int result = slot->result;
+            slot->result = 0;
+            errno = result == IO_EOF ? 0 : -result;
+            return -1;
+        }
+        if (slot->failed)
+        {
+            errno = slot->failed;
+            return -1;
+        }
+
+        if (!slot->reading)
+        {
+            reserve(1);
+            struct io_uring_sqe *sqe = getSqe();
+            sqe->opcode = ring.registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+            sqe->fd = slot->fd;
+            sqe->addr = (unsigned long)slot->buffer;
+            sqe->len = IO_READ_SIZE;
+            sqe->off = (unsigned long long)-1; // Current position, TTYs and sockets have none
+            sqe->buf_index = slot - slots;
+            sqe->user_data = IO_USER_DATA(IO_KIND_READ, slot - slots);
+            slot->length = slot->offset = 0;
+            slot->reading = 1;
+        }
+
+        long long remaining = deadline - nowMs();
+        if (remaining <= 0)
+        {
+            // Not waiting, but what's queued mustn't sit in the ring
+            if (ring.pending && !flushed)
+            {
+                enter(0, 0);
+                flushed = 1;
+                continue;
+            }
+            return 0;
+        }
+        // Completions of the other operations wake it up too
+        if (enter(1, remaining) == -1 && errno == EINTR)
+            return 0;
+    }
+}
+
+/**
+ * io_read waits up to timeoutMs for data on fd
+ * @returns bytes read, 0 on timeout or signal, -1 on error or at the end
+ *  of the file (errno 0)
+ */
+int io_read(int fd, char *buffer, size_t size, int timeoutMs)
+{
+    struct io_slot *slot = isOwner() ? findSlot(fd, 1) : NULL;
+    if (slot == NULL)
+        return pollRead(fd, buffer, size, timeoutMs);
+    if (backend == IO_BACKEND_URING)
+        return ringRead(slot, buffer, size, timeoutMs);
+    return epollRead(slot, buffer, size, timeoutMs);
+}
+
+/**
+ * sendNow writes the head and the body, continuing after short writes
+ * @returns 1 on success, 0 on error or closed connection
+ */
+static int sendNow(int fd, const char *head, size_t headLength, const char *body, size_t bodyLength)
+{
+    struct iovec vectors[2] = {
+        {.iov_base = (char *)head, .iov_len = headLength},
+        {.iov_base = (char *)body, .iov_len = bodyLength},
+    };
+    struct iovec *iov = vectors;
+    int iovcnt = bodyLength ? 2 : 1;
+
+    while (iovcnt > 0)
+    {
+        ssize_t nsent = writev(fd, iov, iovcnt);
+        stats.syscalls++;
+        if (nsent == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printErrno(__func__, "writev failed");
+            return 0;
+        }
+        if (nsent == 0)
+            return 0;
+
+        // Skip what was completely written, advance into the partial one
+        while (iovcnt > 0 && (size_t)nsent >= iov->iov_len)
+        {
+            nsent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + nsent;
+            iov->iov_len -= nsent;
+        }
+    }
+    stats.operations++;
+    return 1;
+}
+
+/**
+ * io_send sends the head and the body. On the ring it's only queued, the
+ * head is copied but the body must stay put until the response arrived or
+ * io_forget(). A failure then shows up as an io_read() error on fd.
+ * @returns 1 on success, 0 on error
+ */
+int io_send(int fd, const char *head, size_t headLength, const char *body, size_t bodyLength)
+{
+    struct io_slot *slot = onRing() ? findSlot(fd, 1) : NULL;
+    if (slot == NULL)
+        return sendNow(fd, head, headLength, body, bodyLength);
+    if (slot->failed)
+    {
+        errno = slot->failed;
+        return 0;
+    }
+
+    reserve(1);
+    // Submitted sends run on their own, a new one could overtake them
+    if (slot->sending && slot->lastSend == NULL && !waitUntil(sendsDone, slot, IO_SEND_TIMEOUT))
+    {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+    if (headLength > IO_HEAD_SIZE)
+        return sendNow(fd, head, headLength, body, bodyLength);
+    if (!sendFree(NULL) && !waitUntil(sendFree, NULL, IO_SEND_TIMEOUT))
+    {
+        errno = ETIMEDOUT;
+        return 0;
+    }
+    reserve(1);
+
+    int index = 0;
+    while (sends[index].slot != -1)
+        index++;
+    struct io_sendop *op = sends + index;
+    memcpy(op->head, head, headLength);
+    op->slot = slot - slots;
+    op->length = headLength + bodyLength;
+    op->iov[0] = (struct iovec){.iov_base = op->head, .iov_len = headLength};
+    op->iov[1] = (struct iovec){.iov_base = (char *)body, .iov_len = bodyLength};
+    op->msg = (struct msghdr){.msg_iov = op->iov, .msg_iovlen = bodyLength ? 2 : 1};
+
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)&op->msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = IO_USER_DATA(IO_KIND_SEND, index);
+
+    // Requests on a connection go out in order
+    if (slot->lastSend != NULL)
+        slot->lastSend->flags |= IOSQE_IO_LINK;
+    slot->lastSend = sqe;
+    slot->sending++;
+    return 1;
+}
+
+/**
+ * appendNow writes and syncs one after the other, stopping at a failure
+ */
+static int appendNow(const struct io_write *list, int count,
+                     void (*done)(void *context, int ok), void *context)
+{
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++)
+    {
+        const struct io_write *w = list + i;
+        ssize_t n = w->offset < 0 ? write(w->fd, w->data, w->length)
+                                  : pwrite(w->fd, w->data, w->length, w->offset);
+        stats.syscalls++;
+        if (n >= 0 && (size_t)n != w->length)
+            errno = EIO;
+        ok = (size_t)n == w->length && fdatasync(w->fd) == 0;
+        stats.syscalls += n >= 0;
+        stats.operations++;
+    }
+    if (done != NULL)
+        done(context, ok);
+    return ok;
+}
+
+/**
+ * io_append writes count buffers in order, each followed by an
+ * fdatasync(), and stops at the first failure. On the ring the data is
+ * copied into the staging and the chain is submitted with the next wait;
+ * done gets the outcome either way, with errno set on failure.
+ * @returns 1 when written or queued, 0 on failure
+ */
+int io_append(const struct io_write *list, int count,
+              void (*done)(void *context, int ok), void *context)
+{
+    size_t total = 0;
+    for (int i = 0; i < count; i++)
+        total += list[i].length;
+    if (!onRing() || 2 * count > IO_WRITES || total > IO_STAGING_SIZE)
+        return appendNow(list, count, done, context);
+
+    // One chain at a time, it has the staging to itself
+    waitUntil(writesDone, NULL, -1);
+    reserve(2 * count);
+
+    char *staged = ring.staging;
+    for (int i = 0; i < count; i++)
+    {
+        const struct io_write *w = list + i;
+        memcpy(staged, w->data, w->length);
+
+        struct io_uring_sqe *sqe = getSqe();
+        sqe->opcode = ring.registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        sqe->fd = w->fd;
+        sqe->addr = (unsigned long)staged;
+        sqe->len = w->length;
+        sqe->off = w->offset < 0 ? (unsigned long long)-1 : (unsigned long long)w->offset;
+        sqe->buf_index = IO_SLOTS;
+        sqe->flags = IOSQE_IO_LINK;
+        sqe->user_data = IO_USER_DATA(IO_KIND_WRITE, 2 * i);
+        writes[2 * i] = (struct io_writeop){.fd = w->fd, .length = w->length};
+
+        sqe = getSqe();
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fd = w->fd;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        sqe->flags = i < count - 1 ? IOSQE_IO_LINK : 0;
+        sqe->user_data = IO_USER_DATA(IO_KIND_WRITE, 2 * i + 1);
+        writes[2 * i + 1] = (struct io_writeop){.fd = w->fd};
+        staged += w->length;
+    }
+    writes[2 * count - 1].done = done;
+    writes[2 * count - 1].context = context;
+    ring.writing += 2 * count;
+    return 1;
+}
+
+/**
+ * io_drain waits until the appends to fd are on disk
+ */
+void io_drain(int fd)
+{
+    if (onRing())
+        waitUntil(writesDone, &fd, -1);
+}
+
+static void cancel(unsigned long long target)
+{
+    struct io_uring_sqe *sqe = getSqe();
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = IO_USER_DATA(IO_KIND_CANCEL, 0);
+}
+
+/**
+ * io_forget cancels the reads and sends of fd and waits for its appends,
+ * call it before close() so a reused descriptor starts afresh
+ */
+void io_forget(int fd)
+{
+    if (!isOwner())
+        return;
+    struct io_slot *slot = findSlot(fd, 0);
+    if (backend == IO_BACKEND_URING)
+    {
+        io_drain(fd);
+        if (slot != NULL && !slotIdle(slot))
+        {
+            reserve(1 + IO_SENDS);
+            if (slot->reading)
+                cancel(IO_USER_DATA(IO_KIND_READ, slot - slots));
+            for (int i = 0; i < IO_SENDS; i++)
+                if (sends[i].slot == slot - slots)
+                    cancel(IO_USER_DATA(IO_KIND_SEND, i));
+            if (!waitUntil(slotIdle, slot, IO_SEND_TIMEOUT))
+            {
+                // Its buffer may still be written, keep it out of use
+                printWarning(__func__, "Operations on %d outlive it", fd);
+                slot->fd = -2;
+                slot = NULL;
+            }
+        }
+    }
+    if (slot == NULL)
+        return;
+    if (slot->epollfd != -1)
+        close(slot->epollfd);
+    slot->epollfd = -1;
+    slot->fd = -1;
+}
+
+/**
+ * io_get_stats copies the counters of the calling thread
+ */
+void io_get_stats(struct io_stats *out)
+{
+    *out = stats;
+}
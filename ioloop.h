@@ -0,0 +1,73 @@
+#ifndef IOLOOP_H
+#define IOLOOP_H
+
+#include <stddef.h>
+
+#define IO_RING_ENTRIES 64
+#define IO_SLOTS 8                   // Descriptors with a read in flight
+#define IO_READ_SIZE 4096            // Registered read buffer per slot, a P1 line fits
+#define IO_SENDS 16                  // Sends in flight
+#define IO_HEAD_SIZE 512             // Head copied per send, the body is not
+#define IO_STAGING_SIZE (128 * 1024) // Registered buffer of the appends in flight
+#define IO_SEND_TIMEOUT 2000         // Milliseconds a send waits for the one before it
+
+enum io_backend
+{
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING,
+};
+
+/**
+ * Syscalls issued by the I/O layer on the calling thread
+ */
+struct io_stats
+{
+    unsigned long long syscalls;
+    unsigned long long operations; // Reads, sends and writes done
+};
+
+/**
+ * Write of io_append(), offset -1 appends at the end of the file
+ */
+struct io_write
+{
+    int fd;
+    const void *data;
+    size_t length;
+    long long offset;
+};
+
+/**
+ * I/O of the serial loop: TTY reads, Influx sends and receives and
+ * archive appends
+ *
+ * With io_uring, io_read() submits everything queued since the last call
+ * and waits for the line in the same io_uring_enter(): the HTTP requests,
+ * the reads of their responses and the archive writes ride along with
+ * the serial read, which is one syscall per P1 line. Reads land in
+ * registered buffers, appends are staged in one and synced behind their
+ * write. Without io_uring (old kernel, seccomp, io_uring_disabled) every
+ * call is a plain syscall after epoll_wait().
+ *
+ * The ring belongs to the thread that called io_init() and the loop must
+ * keep calling io_read(), other threads get the plain syscalls.
+ * Usage:
+ * io_init(IO_BACKEND_URING);
+ * io_read(ttyfd, line, sizeof(line), 2000); // Submits and waits
+ * io_send(sockfd, head, headLength, body, bodyLength); // Queued
+ * io_forget(sockfd); // Before close()
+ */
+enum io_backend io_init(enum io_backend preferred);
+void io_shutdown(void);
+enum io_backend io_get_backend(void);
+const char *io_backend_name(enum io_backend backend);
+
+int io_read(int fd, char *buffer, size_t size, int timeoutMs);
+int io_send(int fd, const char *head, size_t headLength, const char *body, size_t bodyLength);
+int io_append(const struct io_write *writes, int count,
+              void (*done)(void *context, int ok), void *context);
+void io_drain(int fd);
+void io_forget(int fd);
+void io_get_stats(struct io_stats *stats);
+
+#endif
@@ -0,0 +1,65 @@
+/**
+ * libdsmr.c - Entry points of libdsmr, see libdsmr.h
+ */
+#include <string.h>
+
+#include "libdsmr.h"
+
+/**
+ * onEvent records how the telegram ended, the parser already filled it
+ */
+static void onEvent(struct p1_parser *parser, enum p1_event event, int index,
+                    const char *value, int length)
+{
+    (void)index;
+    (void)value;
+    (void)length;
+
+    struct dsmr_reader *reader = parser->context;
+    if (event == P1_END)
+        reader->status = DSMR_TELEGRAM;
+    else if (event == P1_CRC_ERROR)
+        reader->status = DSMR_BAD_CRC;
+}
+
+void dsmr_reader_init(struct dsmr_reader *reader)
+{
+    memset(reader, 0, sizeof(*reader));
+    dsmr_telegram_reset(&reader->telegram);
+    p1_init(&reader->parser, &reader->telegram, onEvent, reader);
+    reader->status = DSMR_MORE;
+}
+
+/**
+ * dsmr_read decodes bytes of the P1 stream into reader->telegram, any
+ * amount at a time. It stops behind the line that ends a telegram and
+ * sets reader->status, the rest of data is for the next call.
+ * @returns the number of bytes used
+ */
+size_t dsmr_read(struct dsmr_reader *reader, const char *data, size_t length)
+{
+    reader->status = DSMR_MORE;
+    return p1_feed(&reader->parser, data, length);
+}
+
+/**
+ * dsmr_format renders telegram as one line of line protocol into buffer,
+ * timestamps and values like dsmr_encode(). The measurement and tags are
+ * escaped on every call, keep an lp_encoder and call dsmr_encode() when
+ * they never change.
+ * @returns the length of the line including its '\n' or -1 when it
+ *  doesn't fit or the telegram holds no values
+ */
+int dsmr_format(struct dsmr_telegram *telegram, const char *measurement, const char *tags,
+                char *buffer, int size)
+{
+    struct lp_encoder enc;
+    if (!lp_init_buffer(&enc, measurement, tags, buffer, size))
+        return -1;
+
+    lp_begin(&enc);
+    dsmr_encode(&enc, telegram);
+    if (!lp_end(&enc, telegram->timestamp))
+        return -1;
+    return enc.length;
+}
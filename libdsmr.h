@@ -0,0 +1,58 @@
+#ifndef LIBDSMR_H
+#define LIBDSMR_H
+
+/**
+ * libdsmr - P1 decoding and line protocol encoding without the daemon
+ *
+ * Built as libdsmr.a and libdsmr.so from the same sources as DSMR: the
+ * OBIS decoder (DSMR.h), the incremental parser (p1parser.h), the CRC16
+ * (crc16.h), timestamp conversion (convertTimestamp()) and the line
+ * protocol encoder (lineprotocol.h). Only those and the functions below
+ * are exported by the shared library.
+ *
+ * Nothing allocates: readers, telegrams and output buffers belong to the
+ * caller, several readers can be used from different threads. Call
+ * dsmr_init() once before anything else.
+ *
+ * Usage:
+ * struct dsmr_reader reader;
+ * dsmr_reader_init(&reader);
+ * while (length > 0)
+ * {
+ *     size_t used = dsmr_read(&reader, data, length);
+ *     data += used;
+ *     length -= used;
+ *     if (reader.status == DSMR_TELEGRAM)
+ *         n = dsmr_format(&reader.telegram, "meter", NULL, out, sizeof(out));
+ * }
+ */
+#include <stddef.h>
+
+#include "crc16.h"
+#include "DSMR.h"
+#include "lineprotocol.h"
+#include "p1parser.h"
+
+enum dsmr_status
+{
+    DSMR_MORE,     // No telegram completed yet, feed more bytes
+    DSMR_TELEGRAM, // reader.telegram holds a complete telegram, CRC checked
+    DSMR_BAD_CRC,  // A telegram completed but its CRC didn't match
+};
+
+/**
+ * Telegram reader, reader.telegram stays valid until the next dsmr_read()
+ */
+struct dsmr_reader
+{
+    struct p1_parser parser;
+    struct dsmr_telegram telegram;
+    enum dsmr_status status;
+};
+
+void dsmr_reader_init(struct dsmr_reader *reader);
+size_t dsmr_read(struct dsmr_reader *reader, const char *data, size_t length);
+int dsmr_format(struct dsmr_telegram *telegram, const char *measurement, const char *tags,
+                char *buffer, int size);
+
+#endif
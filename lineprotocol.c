@@ -0,0 +1,324 @@
+/**
+ * lineprotocol.c - Encodes decoded telegrams into InfluxDB line protocol
+ *
+ * Usage:
+ * struct lp_encoder enc;
+ * lp_init(&enc, "meter", "location=home", 2048);
+ * lp_begin(&enc);
+ * lp_field(&enc, key, keyLength, value, valueLength);
+ * lp_end(&enc, timestamp);
+ * ... send enc.buffer with length enc.length ...
+ * lp_reset(&enc);
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "lineprotocol.h"
+#include "dsmr_internal.h"
+
+// Characters that need a backslash per line protocol element
+#define LP_ESCAPE_MEASUREMENT ", "
+#define LP_ESCAPE_KEY ",= "
+
+/**
+ * lp_escape copies src to dst and escapes the special characters
+ * @returns the length written or -1 if dst is too small
+ */
+static int lp_escape(char *dst, int size, const char *src, int length, const char *special)
+{
+    int offset = 0;
+    for (int i = 0; i < length; i++)
+    {
+        if (strchr(special, src[i]) != NULL)
+        {
+            if (offset >= size)
+                return -1;
+            dst[offset++] = '\\';
+        }
+        if (offset >= size)
+            return -1;
+        dst[offset++] = src[i];
+    }
+    return offset;
+}
+
+/**
+ * lp_render_key renders the escaped field key followed by '=' into dst
+ * @returns the length of the rendered key or -1 if dst is too small
+ */
+int lp_render_key(char *dst, int size, const char *key, int keyLength)
+{
+    int length = lp_escape(dst, size - 1, key, keyLength, LP_ESCAPE_KEY);
+    if (length == -1)
+        return -1;
+    dst[length++] = '=';
+    return length;
+}
+
+/**
+ * lp_init_buffer pre-renders the measurement and tag set, the arena is
+ * the caller's (static) buffer
+ * tags is a comma separated list of key=value pairs and may be NULL
+ * @returns 1 on success, 0 on error
+ */
+int lp_init_buffer(struct lp_encoder *enc, const char *measurement, const char *tags,
+                   char *buffer, int capacity)
+{
+    memset(enc, 0, sizeof(*enc));
+
+    int offset = lp_escape(enc->prefix, LP_PREFIX_SIZE, measurement, strlen(measurement),
+                           LP_ESCAPE_MEASUREMENT);
+    if (offset == -1)
+        goto toolong;
+
+    // Tag set: ,key=value for every pair
+    while (tags != NULL && *tags)
+    {
+        const char *end = strchr(tags, ',');
+        if (end == NULL)
+            end = tags + strlen(tags);
+
+        const char *equals = memchr(tags, '=', end - tags);
+        if (equals == NULL || equals == tags || equals + 1 == end)
+        {
+            printError(__func__, "Ignoring malformed tag '%.*s'", (int)(end - tags), tags);
+        }
+        else
+        {
+            if (offset + 2 > LP_PREFIX_SIZE)
+                goto toolong;
+            enc->prefix[offset++] = ',';
+
+            int n = lp_escape(enc->prefix + offset, LP_PREFIX_SIZE - offset - 1,
+                              tags, equals - tags, LP_ESCAPE_KEY);
+            if (n == -1)
+                goto toolong;
+            offset += n;
+            enc->prefix[offset++] = '=';
+
+            n = lp_escape(enc->prefix + offset, LP_PREFIX_SIZE - offset,
+                          equals + 1, end - equals - 1, LP_ESCAPE_KEY);
+            if (n == -1)
+                goto toolong;
+            offset += n;
+        }
+
+        tags = *end ? end + 1 : end;
+    }
+
+    if (offset + 1 > LP_PREFIX_SIZE)
+        goto toolong;
+    enc->prefix[offset++] = ' ';
+    enc->prefixLength = offset;
+
+    enc->buffer = buffer;
+    enc->capacity = capacity;
+    return 1;
+
+toolong:
+    printError(__func__, "Measurement and tags don't fit in %d bytes", LP_PREFIX_SIZE);
+    return 0;
+}
+
+#ifndef DSMR_EMBEDDED
+/**
+ * lp_init is lp_init_buffer() with an allocated arena
+ * @returns 1 on success, 0 on error
+ */
+int lp_init(struct lp_encoder *enc, const char *measurement, const char *tags, int capacity)
+{
+    char *buffer = malloc(capacity);
+    if (buffer == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate line protocol arena");
+        return 0;
+    }
+    if (!lp_init_buffer(enc, measurement, tags, buffer, capacity))
+    {
+        free(buffer);
+        return 0;
+    }
+    return 1;
+}
+
+void lp_free(struct lp_encoder *enc)
+{
+    free(enc->buffer);
+    enc->buffer = NULL;
+    enc->capacity = 0;
+}
+#endif
+
+/**
+ * lp_begin starts a new line behind the complete lines in the arena
+ */
+void lp_begin(struct lp_encoder *enc)
+{
+    enc->cursor = enc->length + enc->prefixLength;
+    enc->fields = 0;
+    enc->overflow = enc->cursor > enc->capacity;
+    if (!enc->overflow)
+        memcpy(enc->buffer + enc->length, enc->prefix, enc->prefixLength);
+}
+
+/**
+ * lp_begin_tag starts a new line like lp_begin() with one more tag behind
+ * the pre-rendered ones. key is rendered by lp_render_key(), value is
+ * escaped here and must not be empty.
+ */
+void lp_begin_tag(struct lp_encoder *enc, const char *key, int keyLength,
+                  const char *value, int valueLength)
+{
+    lp_begin(enc);
+    if (enc->overflow)
+        return;
+
+    // Overwrite the space that ends the prefix
+    int offset = enc->cursor - 1;
+    if (offset + 1 + keyLength > enc->capacity)
+    {
+        enc->overflow = 1;
+        return;
+    }
+    enc->buffer[offset++] = ',';
+    memcpy(enc->buffer + offset, key, keyLength);
+    offset += keyLength;
+
+    int n = lp_escape(enc->buffer + offset, enc->capacity - offset - 1,
+                      value, valueLength, LP_ESCAPE_KEY);
+    if (n == -1)
+    {
+        enc->overflow = 1;
+        return;
+    }
+    offset += n;
+    enc->buffer[offset++] = ' ';
+    enc->cursor = offset;
+}
+
+/**
+ * lp_field appends a pre-rendered key (including '=') and the value digits
+ * @returns 1 on success, 0 when the arena is full
+ */
+int lp_field(struct lp_encoder *enc, const char *key, int keyLength,
+             const char *value, int valueLength)
+{
+    if (enc->overflow)
+        return 0;
+
+    int needed = (enc->fields ? 1 : 0) + keyLength + valueLength;
+    if (enc->cursor + needed > enc->capacity)
+    {
+        enc->overflow = 1;
+        return 0;
+    }
+
+    char *dst = enc->buffer + enc->cursor;
+    if (enc->fields)
+        *dst++ = ',';
+    memcpy(dst, key, keyLength);
+    dst += keyLength;
+    memcpy(dst, value, valueLength);
+    dst += valueLength;
+
+    enc->fields++;
+    enc->cursor = dst - enc->buffer;
+    return 1;
+}
+
+/**
+ * lp_render_fixed renders a fixed point value as value / 10^decimals,
+ * e.g. (1234, 3) -> 1.234, into dst of at least LP_FIXED_SIZE bytes
+ * @returns the length, dst isn't terminated
+ */
+int lp_render_fixed(char *dst, long long value, int decimals)
+{
+    // Render the digits backwards: sign, at least one integer digit, point
+    char digits[LP_FIXED_SIZE];
+    int n = 0;
+    unsigned long long v = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+        if (n == decimals)
+            digits[n++] = '.';
+    } while (v || n <= decimals + (decimals > 0));
+
+    int length = 0;
+    if (value < 0)
+        dst[length++] = '-';
+    while (n)
+        dst[length++] = digits[--n];
+    return length;
+}
+
+/**
+ * lp_field_fixed appends a pre-rendered key and a fixed point value
+ * rendered by lp_render_fixed()
+ * @returns 1 on success, 0 when the arena is full
+ */
+int lp_field_fixed(struct lp_encoder *enc, const char *key, int keyLength,
+                   long long value, int decimals)
+{
+    char rendered[LP_FIXED_SIZE];
+    int length = lp_render_fixed(rendered, value, decimals);
+    return lp_field(enc, key, keyLength, rendered, length);
+}
+
+/**
+ * lp_end terminates the current line with the integer timestamp
+ * A timestamp of 0 leaves it to the server. A line without fields
+ * or one that didn't fit is dropped.
+ * @returns 1 if the line was committed, 0 if it was dropped
+ */
+int lp_end(struct lp_encoder *enc, long timestamp)
+{
+    if (enc->overflow || enc->fields == 0)
+        return 0;
+
+    // Render the digits backwards, at most 20 for a 64 bit long
+    char digits[24];
+    int n = 0;
+    if (timestamp > 0)
+    {
+        unsigned long t = timestamp;
+        do
+        {
+            digits[n++] = '0' + t % 10;
+            t /= 10;
+        } while (t);
+    }
+
+    if (enc->cursor + 1 + n + 1 > enc->capacity)
+    {
+        enc->overflow = 1;
+        return 0;
+    }
+
+    char *dst = enc->buffer + enc->cursor;
+    if (n)
+    {
+        *dst++ = ' ';
+        while (n)
+            *dst++ = digits[--n];
+    }
+    *dst++ = '\n';
+
+    enc->length = dst - enc->buffer;
+    enc->cursor = enc->length;
+    enc->fields = 0;
+    return 1;
+}
+
+/**
+ * lp_reset discards everything in the arena without touching its contents
+ */
+void lp_reset(struct lp_encoder *enc)
+{
+    enc->length = 0;
+    enc->cursor = 0;
+    enc->fields = 0;
+    enc->overflow = 0;
+}
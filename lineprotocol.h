@@ -0,0 +1,48 @@
+#ifndef LINEPROTOCOL_H
+#define LINEPROTOCOL_H
+
+#define LP_PREFIX_SIZE 256
+#define LP_KEY_SIZE 64
+#define LP_FIXED_SIZE 32 // Longest fixed point value with sign and point
+
+/**
+ * Line protocol encoder working in a reusable arena
+ *
+ *  <measurement>[,<tag>=<value>...] <field>=<value>[,...] [<timestamp>]\n
+ *
+ * The measurement and tag set are escaped and rendered once by lp_init().
+ * Field keys are rendered once (escaped, including the '=') by lp_render_key().
+ * Per telegram only the value digits and the integer timestamp are written.
+ * The arena is handed in to lp_init_buffer() (inside the daemon lp_init()
+ * allocates it once); nothing is allocated after that.
+ */
+struct lp_encoder
+{
+    char *buffer;  // Arena, allocated once or static
+    int capacity;  // Size of the arena
+    int length;    // Length of the complete lines inside the arena
+    int cursor;    // Write offset inside the line being built
+    int fields;    // Number of fields written in the current line
+    int overflow;  // Set when the current line did not fit
+
+    char prefix[LP_PREFIX_SIZE]; // Pre-rendered "measurement,tags "
+    int prefixLength;
+};
+
+int lp_init_buffer(struct lp_encoder *enc, const char *measurement, const char *tags,
+                   char *buffer, int capacity);
+
+int lp_render_key(char *dst, int size, const char *key, int keyLength);
+int lp_render_fixed(char *dst, long long value, int decimals);
+
+void lp_begin(struct lp_encoder *enc);
+void lp_begin_tag(struct lp_encoder *enc, const char *key, int keyLength,
+                  const char *value, int valueLength);
+int lp_field(struct lp_encoder *enc, const char *key, int keyLength,
+             const char *value, int valueLength);
+int lp_field_fixed(struct lp_encoder *enc, const char *key, int keyLength,
+                   long long value, int decimals);
+int lp_end(struct lp_encoder *enc, long timestamp);
+void lp_reset(struct lp_encoder *enc);
+
+#endif
@@ -0,0 +1,989 @@
+/**
+ * loadtest.c - End-to-end load test of the daemon against a stand-in Influx
+ *
+ * Usage:
+ * dsmr-loadtest [-d daemon] [-i tcp|pty] [-m meters] [-r rate] [-t seconds]
+ *               [-f capture] [-l latency] [-e errors] [-x drops] [-L log]
+ *  -d  daemon executable (./DSMR)
+ *  -i  how telegrams reach the daemon (tcp):
+ *      tcp  the ingest server, one connection per meter
+ *      pty  a pseudo terminal used as DSMR_TTY, a single meter
+ *  -m  meters, tcp only (100)
+ *  -r  telegrams per second over all meters, 0 for as fast as possible (1000)
+ *  -t  seconds of load (30)
+ *  -f  replay the telegrams of a raw capture instead of the built in one
+ *  -l  milliseconds the stand-in takes to answer a write (0)
+ *  -e  percentage of writes answered with 429 or 503 (0)
+ *  -x  percentage of writes that lose the connection (0)
+ *  -L  file that gets the daemon's log (/dev/null)
+ *
+ * The stand-in Influx listens on 127.0.0.1 and answers /api/v2/buckets and
+ * /api/v2/write. Pipelined writes are answered in order, each one latency
+ * after it arrived. A dropped write closes the connection, half of the time
+ * after its lines were stored (the answer got lost, the retry duplicates
+ * them) and half of the time before.
+ *
+ * Every telegram gets its own 0-0:1.0.0 timestamp, one second after the
+ * previous one, and a fresh CRC. The timestamp of a stored line tells which
+ * telegram it came from, which gives latency, loss and duplicates without
+ * any help of the daemon. Everything runs in UTC, a clock without DST gaps.
+ * The daemon's other environment (INFLUX_WINDOW, DSMR_SERVER_THREADS,
+ * DSMR_LOG_LEVEL) is passed on as is.
+ *
+ * Exits with failure when telegrams were lost.
+ */
+#define _GNU_SOURCE // posix_openpt flags
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "crc16.h"
+#include "DSMR.h"
+
+#define LOADTEST_MEASUREMENT "loadtest"
+#define LOADTEST_MAX_TELEGRAMS (4 * 1024 * 1024) // Slots for -r 0
+#define LOADTEST_TELEGRAM_SIZE 4096
+#define LOADTEST_START_TIMEOUT 10 // Seconds for the daemon to reach Influx
+#define LOADTEST_DRAIN_TIMEOUT 15 // Seconds without progress, covers a reconnect
+#define LOADTEST_PROGRESS_INTERVAL 5
+#define LOADTEST_EPOCH 1704067200 // 2024-01-01 00:00:00 UTC, timestamp of telegram 0
+
+/**
+ * Telegram that gets a new timestamp, equipment identifier and CRC per send
+ */
+struct lt_template
+{
+    char *data;
+    int length;
+    int timestampOffset; // First digit of 0-0:1.0.0
+    int idOffset;        // First hex digit of 0-0:96.1.1, -1 without
+    int idLength;
+    int crcOffset; // The '!'
+};
+
+/**
+ * Request waiting for its answer on a stand-in connection
+ */
+struct lt_request
+{
+    struct lt_request *next;
+    double due;
+    int write; // 0 for anything but /api/v2/write
+    int fate;
+    char *body;
+    int length;
+};
+
+enum lt_fate
+{
+    FATE_STORE,
+    FATE_ERROR,
+    FATE_DROP_BEFORE, // Connection lost before the lines were stored
+    FATE_DROP_AFTER,  // Stored, the answer got lost
+};
+
+static const char builtinTelegram[] =
+    "/FLU5\\253769484_A\r\n"
+    "\r\n"
+    "0-0:96.1.4(50217)\r\n"
+    "0-0:96.1.1(3153414733313031303231363035)\r\n"
+    "0-0:1.0.0(240101000000W)\r\n"
+    "1-0:1.8.1(000123.456*kWh)\r\n"
+    "1-0:1.8.2(000234.567*kWh)\r\n"
+    "1-0:2.8.1(000012.345*kWh)\r\n"
+    "1-0:2.8.2(000023.456*kWh)\r\n"
+    "0-0:96.14.0(0001)\r\n"
+    "1-0:1.4.0(00.123*kW)\r\n"
+    "1-0:1.6.0(231211154500W)(03.456*kW)\r\n"
+    "0-0:98.1.0(2)(1-0:1.6.0)(1-0:1.6.0)(231101000000W)(231017224500S)(04.329*kW)"
+    "(231201000000W)(231108200000W)(02.890*kW)\r\n"
+    "1-0:1.7.0(01.234*kW)\r\n"
+    "1-0:2.7.0(00.000*kW)\r\n"
+    "1-0:21.7.0(00.500*kW)\r\n"
+    "1-0:41.7.0(00.400*kW)\r\n"
+    "1-0:61.7.0(00.334*kW)\r\n"
+    "1-0:22.7.0(00.000*kW)\r\n"
+    "1-0:42.7.0(00.000*kW)\r\n"
+    "1-0:62.7.0(00.000*kW)\r\n"
+    "1-0:32.7.0(230.1*V)\r\n"
+    "1-0:52.7.0(231.2*V)\r\n"
+    "1-0:72.7.0(229.8*V)\r\n"
+    "1-0:31.7.0(002.15*A)\r\n"
+    "1-0:51.7.0(001.80*A)\r\n"
+    "1-0:71.7.0(001.50*A)\r\n"
+    "0-0:96.3.10(1)\r\n"
+    "0-0:17.0.0(999.9*kW)\r\n"
+    "1-0:31.4.0(999*A)\r\n"
+    "0-0:96.13.0()\r\n"
+    "0-1:24.1.0(003)\r\n"
+    "0-1:96.1.1(37464C4F32313139303333373333)\r\n"
+    "0-1:24.4.0(1)\r\n"
+    "0-1:24.2.3(231231234500W)(00123.456*m3)\r\n"
+    "!0000\r\n";
+
+static struct lt_template *templates;
+static int templateCount;
+
+// Per telegram, indexed by sequence number
+static double *sentAt;
+static float *latency; // Seconds from write to stored
+static unsigned char *stored;
+static long slots;
+static time_t firstTimestamp; // Line timestamp of telegram 0
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static long sent, received, duplicates, foreign;
+static double lastReceived;
+static long writes, errorsInjected, dropsInjected, connections;
+static volatile int ready; // The daemon asked for /api/v2/buckets
+
+static double latencyMs;
+static double errorPercent;
+static double dropPercent;
+
+static double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * addTemplate keeps a telegram that has a 0-0:1.0.0 timestamp
+ */
+static int addTemplate(const char *telegram, int length)
+{
+    const char *bang = memchr(telegram, '!', length);
+    const char *timestamp = memmem(telegram, length, "\n0-0:1.0.0(", 11);
+    if (bang == NULL || timestamp == NULL || timestamp + 11 + 13 > bang)
+        return 1; // Not a telegram we can number, skip it
+
+    struct lt_template *grown = realloc(templates, (templateCount + 1) * sizeof(struct lt_template));
+    char *data = malloc(bang - telegram + 7);
+    if (grown == NULL || data == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate telegram");
+        return 0;
+    }
+    templates = grown;
+
+    // Up to the '!', the CRC and line end are rendered
+    int crcOffset = bang - telegram;
+    memcpy(data, telegram, crcOffset + 1);
+    memcpy(data + crcOffset + 1, "0000\r\n", 6);
+
+    struct lt_template *template = templates + templateCount++;
+    *template = (struct lt_template){
+        .data = data,
+        .length = crcOffset + 7,
+        .timestampOffset = timestamp + 11 - telegram,
+        .idOffset = -1,
+        .crcOffset = crcOffset,
+    };
+
+    const char *id = memmem(telegram, crcOffset, "\n0-0:96.1.1(", 12);
+    if (id != NULL)
+    {
+        const char *end = memchr(id + 12, ')', bang - id - 12);
+        if (end != NULL && end - id - 12 >= 12)
+        {
+            template->idOffset = id + 12 - telegram;
+            template->idLength = end - id - 12;
+        }
+    }
+    return 1;
+}
+
+/**
+ * loadCapture takes every complete telegram of a raw capture
+ * @returns 1 on success, 0 on error
+ */
+static int loadCapture(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        printErrno(__func__, "Couldn't open '%s'", path);
+        return 0;
+    }
+
+    char telegram[LOADTEST_TELEGRAM_SIZE];
+    int length = -1; // Outside a telegram
+    char line[LOADTEST_TELEGRAM_SIZE];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        int lineLength = strlen(line);
+        if (line[0] == '/')
+            length = 0;
+        if (length == -1)
+            continue;
+        if (length + lineLength > (int)sizeof(telegram))
+        {
+            length = -1; // Too long for a telegram, wait for the next header
+            continue;
+        }
+        memcpy(telegram + length, line, lineLength);
+        length += lineLength;
+
+        if (line[0] == '!')
+        {
+            if (!addTemplate(telegram, length))
+            {
+                fclose(file);
+                return 0;
+            }
+            length = -1;
+        }
+    }
+    fclose(file);
+
+    if (templateCount == 0)
+    {
+        printError(__func__, "No telegrams with a 0-0:1.0.0 timestamp in '%s'", path);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * putTimestamp writes the YYMMDDhhmmssW timestamp of a telegram
+ */
+static void putTimestamp(char *p, long sequence)
+{
+    time_t t = LOADTEST_EPOCH + sequence;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+
+    // Two digits each, the fields of a gmtime_r() result all fit
+    int parts[6] = {tm.tm_year % 100, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec};
+    for (int i = 0; i < 6; i++)
+    {
+        p[i * 2] = '0' + parts[i] / 10;
+        p[i * 2 + 1] = '0' + parts[i] % 10;
+    }
+    p[12] = 'W';
+}
+
+/**
+ * render numbers the telegram and gives it the identifier of its meter
+ * @returns the length
+ */
+static int render(char *buffer, long sequence, int meter)
+{
+    struct lt_template *template = templates + sequence % templateCount;
+    memcpy(buffer, template->data, template->length);
+    putTimestamp(buffer + template->timestampOffset, sequence);
+
+    // Last 6 characters of the hex encoded identifier become the meter number
+    if (template->idOffset != -1)
+    {
+        char *p = buffer + template->idOffset + template->idLength - 12;
+        for (int i = 5, n = meter; i >= 0; i--, n /= 10)
+        {
+            p[i * 2] = '3';
+            p[i * 2 + 1] = '0' + n % 10;
+        }
+    }
+
+    static const char hex[] = "0123456789ABCDEF";
+    unsigned short crc = crc16(0, buffer, template->crcOffset + 1);
+    char *p = buffer + template->crcOffset + 1;
+    for (int shift = 12; shift >= 0; shift -= 4)
+        *p++ = hex[(crc >> shift) & 0xf];
+    return template->length;
+}
+
+/**
+ * storeLines accounts the lines of an accepted write
+ */
+static void storeLines(const char *body, int length)
+{
+    double now = seconds();
+    const char *end = body + length;
+
+    pthread_mutex_lock(&lock);
+    while (body < end)
+    {
+        const char *newline = memchr(body, '\n', end - body);
+        if (newline == NULL)
+            newline = end;
+
+        int measurementLength = sizeof(LOADTEST_MEASUREMENT) - 1;
+        const char *space = newline;
+        while (space > body && space[-1] != ' ')
+            space--;
+
+        if (newline - body > measurementLength &&
+            !memcmp(body, LOADTEST_MEASUREMENT, measurementLength) &&
+            (body[measurementLength] == ',' || body[measurementLength] == ' ') &&
+            space > body)
+        {
+            long sequence = strtoll(space, NULL, 10) - firstTimestamp;
+            if (sequence < 0 || sequence >= slots || sentAt[sequence] == 0)
+                foreign++;
+            else if (stored[sequence]++)
+                duplicates++;
+            else
+            {
+                latency[sequence] = now - sentAt[sequence];
+                received++;
+                lastReceived = now;
+            }
+        }
+        else if (newline > body)
+        {
+            foreign++;
+        }
+        body = newline + 1;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+static int sendAll(int fd, const char *data, int length)
+{
+    while (length > 0)
+    {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+/**
+ * answer handles a request whose time has come
+ * @returns 1 when the connection stays open, 0 when it's closed
+ */
+static int answer(int fd, struct lt_request *request)
+{
+    static const char buckets[] = "{\"buckets\":[{\"name\":\"" LOADTEST_MEASUREMENT "\"}]}";
+    static const char busy[] = "{\"code\":\"unavailable\",\"message\":\"injected\"}";
+    char head[256];
+    int length;
+
+    if (!request->write)
+    {
+        ready = 1;
+        length = snprintf(head, sizeof(head),
+                          "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n"
+                          "Content-Length: %zu\r\n\r\n%s",
+                          sizeof(buckets) - 1, buckets);
+        return sendAll(fd, head, length);
+    }
+
+    switch (request->fate)
+    {
+    case FATE_DROP_AFTER:
+        storeLines(request->body, request->length);
+        // fall through
+    case FATE_DROP_BEFORE:
+        return 0;
+    case FATE_ERROR:
+        length = snprintf(head, sizeof(head),
+                          "HTTP/1.1 %s\r\nContent-Type: application/json\r\n"
+                          "Retry-After: 1\r\nContent-Length: %zu\r\n\r\n%s",
+                          rand() & 1 ? "429 Too Many Requests" : "503 Service Unavailable",
+                          sizeof(busy) - 1, busy);
+        return sendAll(fd, head, length);
+    default:
+        storeLines(request->body, request->length);
+        return sendAll(fd, "HTTP/1.1 204 No Content\r\n\r\n", 27);
+    }
+}
+
+/**
+ * parseRequest takes one complete request from the buffer
+ * @returns the bytes consumed, 0 when incomplete, -1 when it isn't HTTP
+ */
+static int parseRequest(char *buffer, int length, struct lt_request **request)
+{
+    char *end = memmem(buffer, length, "\r\n\r\n", 4);
+    if (end == NULL)
+        return 0;
+    int headLength = end - buffer + 4;
+
+    int contentLength = 0;
+    for (char *line = buffer; line < end;)
+    {
+        if (!strncasecmp(line, "Content-Length:", 15))
+            contentLength = atoi(line + 15);
+        char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+            break;
+        line = newline + 1;
+    }
+    if (headLength + contentLength > length)
+        return 0;
+
+    int write = !strncmp(buffer, "POST /api/v2/write", 18);
+    if (!write && strncmp(buffer, "GET /api/v2/buckets", 19))
+        return -1;
+
+    *request = calloc(1, sizeof(struct lt_request) + contentLength);
+    if (*request == NULL)
+        return -1;
+    (*request)->write = write;
+    (*request)->due = seconds() + latencyMs / 1000;
+    (*request)->body = (char *)(*request + 1);
+    (*request)->length = contentLength;
+    memcpy((*request)->body, buffer + headLength, contentLength);
+
+    if (write)
+    {
+        double dice = rand() % 10000 / 100.0;
+        if (dice < dropPercent)
+            (*request)->fate = rand() & 1 ? FATE_DROP_AFTER : FATE_DROP_BEFORE;
+        else if (dice < dropPercent + errorPercent)
+            (*request)->fate = FATE_ERROR;
+
+        pthread_mutex_lock(&lock);
+        writes++;
+        dropsInjected += (*request)->fate >= FATE_DROP_BEFORE;
+        errorsInjected += (*request)->fate == FATE_ERROR;
+        pthread_mutex_unlock(&lock);
+    }
+    return headLength + contentLength;
+}
+
+/**
+ * serveConnection reads pipelined requests and answers every one of them
+ * latency after it arrived, in order
+ */
+static void *serveConnection(void *arg)
+{
+    int fd = (int)(long)arg;
+    int capacity = 128 * 1024;
+    int length = 0;
+    char *buffer = malloc(capacity);
+    struct lt_request *head = NULL, **tail = &head;
+    int open = buffer != NULL;
+
+    while (open)
+    {
+        int timeout = -1;
+        while (head != NULL)
+        {
+            double wait = head->due - seconds();
+            if (wait > 0)
+            {
+                timeout = wait * 1000 + 1;
+                break;
+            }
+
+            struct lt_request *request = head;
+            head = request->next;
+            if (head == NULL)
+                tail = &head;
+            open = answer(fd, request);
+            free(request);
+            if (!open)
+                break;
+        }
+        if (!open)
+            break;
+
+        struct pollfd pfd = {.fd = fd, .events = POLLIN};
+        if (poll(&pfd, 1, timeout) <= 0)
+            continue;
+
+        if (length == capacity)
+        {
+            char *grown = realloc(buffer, capacity * 2);
+            if (grown == NULL)
+                break;
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer + length, capacity - length);
+        if (n <= 0)
+            break; // The daemon closed the connection
+        length += n;
+
+        int consumed, offset = 0;
+        struct lt_request *request;
+        while ((consumed = parseRequest(buffer + offset, length - offset, &request)) > 0)
+        {
+            *tail = request;
+            tail = &request->next;
+            offset += consumed;
+        }
+        if (consumed == -1)
+        {
+            printError(__func__, "Unexpected request '%.*s'", length - offset < 64 ? length - offset : 64,
+                       buffer + offset);
+            break;
+        }
+        length -= offset;
+        memmove(buffer, buffer + offset, length);
+    }
+
+    while (head != NULL)
+    {
+        struct lt_request *request = head;
+        head = request->next;
+        free(request);
+    }
+    free(buffer);
+    close(fd);
+    return NULL;
+}
+
+static void *acceptConnections(void *arg)
+{
+    int listenfd = (int)(long)arg;
+    for (;;)
+    {
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd == -1)
+        {
+            if (errno != EINTR)
+                printErrno(__func__, "accept failed");
+            continue;
+        }
+
+        pthread_mutex_lock(&lock);
+        connections++;
+        pthread_mutex_unlock(&lock);
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serveConnection, (void *)(long)fd) != 0)
+        {
+            printError(__func__, "Couldn't start a connection thread");
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+/**
+ * listenLocal binds a TCP socket on 127.0.0.1 to a free port
+ * @returns the socket or -1, sets *port
+ */
+static int listenLocal(unsigned short *port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addressLength = sizeof(address);
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+        listen(fd, 64) == -1 || getsockname(fd, (struct sockaddr *)&address, &addressLength) == -1)
+    {
+        printErrno(__func__, "Couldn't listen on 127.0.0.1");
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    *port = ntohs(address.sin_port);
+    return fd;
+}
+
+/**
+ * startDaemon runs the daemon with the stand-in as its only Influx
+ * @returns the pid or -1
+ */
+static pid_t startDaemon(const char *daemon, unsigned short influxPort,
+                         const char *listenAddress, const char *tty, const char *logPath)
+{
+    pid_t pid = fork();
+    if (pid != 0)
+    {
+        if (pid == -1)
+            printErrno(__func__, "fork failed");
+        return pid;
+    }
+
+    char port[8];
+    snprintf(port, sizeof(port), "%u", influxPort);
+    setenv("INFLUX_HOST", "127.0.0.1", 1);
+    setenv("INFLUX_PORT", port, 1);
+    setenv("INFLUX_ORG", "loadtest", 1);
+    setenv("INFLUX_TOKEN", "loadtest", 1);
+    setenv("INFLUX_BUCKET", "loadtest", 1);
+    setenv("INFLUX_MEASUREMENT", LOADTEST_MEASUREMENT, 1);
+    setenv("INFLUX_TAGS", "", 1);
+    unsetenv("INFLUX_HOSTS");
+    setenv("DSMR_SHM", "", 1);
+    setenv("DSMR_LOG_JOURNAL", "0", 1);
+    setenv("CAPACITY_INTERVAL", "0", 1);
+    setenv("DSMR_RULES", "/dev/null", 1);
+    setenv("DSMR_LISTEN", listenAddress != NULL ? listenAddress : "", 1);
+    setenv("DSMR_TTY", tty != NULL ? tty : "", 1);
+    setenv("DSMR_TTY_MODE", "115200", 1); // The pty has no serial setting to detect
+
+    int logfd = open(logPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (logfd != -1)
+    {
+        dup2(logfd, STDOUT_FILENO);
+        dup2(logfd, STDERR_FILENO);
+    }
+    execl(daemon, daemon, (char *)NULL);
+    _exit(127);
+}
+
+/**
+ * memoryHighWater reads VmHWM of the daemon
+ * @returns kB or -1
+ */
+static long memoryHighWater(pid_t pid)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    long kB = -1;
+    char line[256];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        if (sscanf(line, "VmHWM: %ld", &kB) == 1)
+            break;
+    }
+    fclose(file);
+    return kB;
+}
+
+static int daemonAlive(pid_t pid)
+{
+    int status;
+    if (waitpid(pid, &status, WNOHANG) != pid)
+        return 1;
+    printError(__func__, "Daemon exited with %d, see its log (-L)",
+               WIFEXITED(status) ? WEXITSTATUS(status) : -WTERMSIG(status));
+    return 0;
+}
+
+/**
+ * connectMeters opens one connection per meter, retrying while the
+ * daemon is still setting up its listener
+ * @returns 1 on success, 0 on error
+ */
+static int connectMeters(int *fds, int count, unsigned short port, pid_t pid)
+{
+    struct sockaddr_in address = {
+        .sin_family = AF_INET,
+        .sin_port = htons(port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    double deadline = seconds() + LOADTEST_START_TIMEOUT;
+
+    for (int i = 0; i < count; i++)
+    {
+        for (;;)
+        {
+            fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fds[i] == -1)
+            {
+                printErrno(__func__, "Couldn't create socket %d", i);
+                return 0;
+            }
+            if (connect(fds[i], (struct sockaddr *)&address, sizeof(address)) == 0)
+                break;
+            close(fds[i]);
+            if (seconds() > deadline || !daemonAlive(pid))
+            {
+                printErrno(__func__, "Couldn't connect meter %d", i);
+                return 0;
+            }
+            usleep(10000);
+        }
+    }
+    return 1;
+}
+
+static int compareFloats(const void *a, const void *b)
+{
+    float x = *(const float *)a, y = *(const float *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(double start, double sendEnd, long highWater)
+{
+    double sendTime = sendEnd - start;
+    double storeTime = lastReceived - start;
+
+    float *sorted = malloc((received + 1) * sizeof(float));
+    long count = 0;
+    for (long i = 0; sorted != NULL && i < sent; i++)
+    {
+        if (stored[i])
+            sorted[count++] = latency[i];
+    }
+    if (sorted != NULL)
+        qsort(sorted, count, sizeof(float), compareFloats);
+
+    printf("Telegrams sent      %ld in %.1fs, %.0f/s\n", sent, sendTime, sendTime > 0 ? sent / sendTime : 0);
+    printf("Telegrams stored    %ld, %.0f/s sustained\n", received, storeTime > 0 ? received / storeTime : 0);
+    printf("Lost                %ld (%.3f%%)\n", sent - received, sent ? 100.0 * (sent - received) / sent : 0);
+    printf("Duplicated          %ld\n", duplicates);
+    if (foreign)
+        printf("Unexpected lines    %ld\n", foreign);
+    if (count)
+    {
+        double percentiles[] = {50, 90, 99, 99.9};
+        printf("Latency ms         ");
+        for (int i = 0; i < 4; i++)
+            printf(" p%g %.1f", percentiles[i], 1000 * sorted[(long)(percentiles[i] / 100 * (count - 1))]);
+        printf(" max %.1f\n", 1000 * sorted[count - 1]);
+    }
+    printf("Writes              %ld, %ld answered 429/503, %ld dropped, %ld connections\n",
+           writes, errorsInjected, dropsInjected, connections);
+    if (highWater >= 0)
+        printf("Daemon VmHWM        %ld kB\n", highWater);
+    free(sorted);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *daemon = "./DSMR";
+    const char *input = "tcp";
+    const char *capture = NULL;
+    const char *logPath = "/dev/null";
+    int meters = 100;
+    double rate = 1000;
+    double duration = 30;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:i:m:r:t:f:l:e:x:L:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd':
+            daemon = optarg;
+            break;
+        case 'i':
+            input = optarg;
+            break;
+        case 'm':
+            meters = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 't':
+            duration = atof(optarg);
+            break;
+        case 'f':
+            capture = optarg;
+            break;
+        case 'l':
+            latencyMs = atof(optarg);
+            break;
+        case 'e':
+            errorPercent = atof(optarg);
+            break;
+        case 'x':
+            dropPercent = atof(optarg);
+            break;
+        case 'L':
+            logPath = optarg;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d daemon] [-i tcp|pty] [-m meters] [-r rate] [-t seconds]\n"
+                            "       [-f capture] [-l latency] [-e errors] [-x drops] [-L log]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    int pty = !strcmp(input, "pty");
+    if (pty || meters < 1)
+        meters = 1;
+
+    // The daemon inherits this, telegram timestamps map 1:1 to seconds
+    setenv("TZ", "UTC", 1);
+    tzset();
+    setupLogs();
+    signal(SIGPIPE, SIG_IGN);
+
+    if (capture != NULL ? !loadCapture(capture) : !addTemplate(builtinTelegram, sizeof(builtinTelegram) - 1))
+        return EXIT_FAILURE;
+
+    slots = rate > 0 ? rate * duration * 1.1 + 1000 : LOADTEST_MAX_TELEGRAMS;
+    if (slots > LOADTEST_MAX_TELEGRAMS)
+        slots = LOADTEST_MAX_TELEGRAMS;
+    sentAt = calloc(slots, sizeof(double));
+    latency = calloc(slots, sizeof(float));
+    stored = calloc(slots, 1);
+    int *fds = calloc(meters, sizeof(int));
+    if (sentAt == NULL || latency == NULL || stored == NULL || fds == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate %ld telegrams", slots);
+        return EXIT_FAILURE;
+    }
+
+    char telegram[LOADTEST_TELEGRAM_SIZE];
+    putTimestamp(telegram, 0);
+    telegram[13] = 0;
+    firstTimestamp = convertTimestamp(telegram);
+
+    // A socket per meter, the soft limit is often 1024
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    unsigned short influxPort;
+    int influxfd = listenLocal(&influxPort);
+    if (influxfd == -1)
+        return EXIT_FAILURE;
+    pthread_t acceptor;
+    if (pthread_create(&acceptor, NULL, acceptConnections, (void *)(long)influxfd) != 0)
+    {
+        printError(__func__, "Couldn't start the stand-in Influx");
+        return EXIT_FAILURE;
+    }
+
+    // Input side: a free port for the ingest server or a pseudo terminal
+    char listenAddress[32];
+    unsigned short listenPort = 0;
+    const char *ttyPath = NULL;
+    int ptyfd = -1;
+    if (pty)
+    {
+        ptyfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (ptyfd == -1 || grantpt(ptyfd) == -1 || unlockpt(ptyfd) == -1)
+        {
+            printErrno(__func__, "Couldn't create a pseudo terminal");
+            return EXIT_FAILURE;
+        }
+        ttyPath = ptsname(ptyfd);
+    }
+    else
+    {
+        int probe = listenLocal(&listenPort);
+        if (probe == -1)
+            return EXIT_FAILURE;
+        close(probe);
+        snprintf(listenAddress, sizeof(listenAddress), "127.0.0.1:%u", listenPort);
+    }
+
+    pid_t pid = startDaemon(daemon, influxPort, pty ? NULL : listenAddress, ttyPath, logPath);
+    if (pid == -1)
+        return EXIT_FAILURE;
+
+    // The daemon authenticates once its input is set up
+    double deadline = seconds() + LOADTEST_START_TIMEOUT;
+    while (!ready)
+    {
+        if (seconds() > deadline || !daemonAlive(pid))
+        {
+            printError(__func__, "Daemon didn't reach the stand-in Influx");
+            kill(pid, SIGTERM);
+            return EXIT_FAILURE;
+        }
+        usleep(10000);
+    }
+    if (pty)
+        fds[0] = ptyfd;
+    else if (!connectMeters(fds, meters, listenPort, pid))
+    {
+        kill(pid, SIGTERM);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stderr, "Load: %d meters over %s, %.0f telegrams/s for %.0fs, %d telegram(s) from %s\n",
+            meters, input, rate, duration, templateCount, capture != NULL ? capture : "the built in one");
+    fprintf(stderr, "Influx: %.0fms latency, %.1f%% 429/503, %.1f%% dropped connections\n",
+            latencyMs, errorPercent, dropPercent);
+
+    double start = seconds();
+    double lastProgress = start;
+    double now = start;
+    while (now - start < duration && sent < slots)
+    {
+        int length = render(telegram, sent, sent % meters);
+        sentAt[sent] = seconds();
+        ssize_t n;
+        int fd = fds[sent % meters];
+        for (int offset = 0; offset < length; offset += n)
+        {
+            n = write(fd, telegram + offset, length - offset);
+            if (n == -1 && errno == EINTR)
+                n = 0;
+            else if (n == -1)
+                break;
+        }
+        if (n == -1)
+        {
+            printErrno(__func__, "Writing to the daemon failed");
+            break;
+        }
+        sent++;
+
+        // Pace against the wall clock, never build up a burst after a stall
+        now = seconds();
+        if (rate > 0)
+        {
+            double ahead = sent / rate - (now - start);
+            if (ahead > 0.001)
+                usleep(ahead * 1e6);
+            else if (ahead < -1)
+                start = now - sent / rate;
+        }
+
+        if (now - lastProgress >= LOADTEST_PROGRESS_INTERVAL)
+        {
+            pthread_mutex_lock(&lock);
+            fprintf(stderr, "%ld telegrams sent, %ld stored\n", sent, received);
+            pthread_mutex_unlock(&lock);
+            lastProgress = now;
+            if (!daemonAlive(pid))
+                break;
+        }
+    }
+    double sendEnd = seconds();
+    start = sentAt[0];
+
+    // Let the daemon flush its queue, retries included
+    double lastProgressAt = seconds();
+    long lastCount = -1;
+    for (;;)
+    {
+        pthread_mutex_lock(&lock);
+        long count = received;
+        pthread_mutex_unlock(&lock);
+        if (count >= sent)
+            break;
+        if (count != lastCount)
+        {
+            lastCount = count;
+            lastProgressAt = seconds();
+        }
+        if (seconds() - lastProgressAt > LOADTEST_DRAIN_TIMEOUT || !daemonAlive(pid))
+            break;
+        usleep(10000);
+    }
+
+    long highWater = memoryHighWater(pid);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+
+    pthread_mutex_lock(&lock);
+    report(start, sendEnd, highWater);
+    int lost = received < sent;
+    pthread_mutex_unlock(&lock);
+    return lost ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -2,142 +2,773 @@
 #include <stdlib.h> // For exit
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "common.h"
 #include "tty.h"
 #include "DSMR.h"
+#include "dsmr_internal.h"
 #include "http.h"
 #include "influx.h"
+#include "lineprotocol.h"
+#include "shm.h"
+#include "capacity.h"
+#include "rules.h"
+#include "server.h"
+#include "shard.h"
+#include "ws.h"
+#include "profile.h"
+#include "archive.h"
+#include "mbus.h"
+#include "derived.h"
+#include "udp.h"
+#include "ioloop.h"
+#include "settings.h"
 
-void clearBuffer(char *buf, int n);
 int run(int ttyfd, struct influx_config *iconfig);
+static int setupShards(struct influx_config *shards, char *hosts);
+static int setupInflux(struct influx_config *config, struct settings *settings);
 
 int main(const int argc, char *argv[])
 {
     setupLogs();
 
+    // A closed Influx connection must surface as a write error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!dsmr_init())
+        exit(EXIT_FAILURE);
+
+    // --profile N [capture]: decode N telegrams with hardware counters and exit
+    int profileTelegrams = 0;
+    if (argc > 2 && !strcmp(argv[1], "--profile"))
+    {
+        profileTelegrams = atoi(argv[2]);
+        if (argc > 3)
+            return profile_run(profileTelegrams, -1, argv[3]) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Server mode ingests remote P1 streams instead of the local TTY
+    char *listenAddress = getenv("DSMR_LISTEN");
+    int ttyfd = -1;
+
     /**
      * TTY Setup
      */
-    printLog(__func__, "Finding available TTY");
-    int ttyfd = findAndOpenTTYUSB();
-    if (ttyfd == -1)
-        exit(EXIT_FAILURE);
+    if (profileTelegrams > 0 || listenAddress == NULL || !*listenAddress)
+    {
+        // One io_uring_enter() per line carries the serial read, the Influx
+        // traffic and the archive writes; epoll when the kernel can't
+        char *ioBackend = getenv("DSMR_IO_BACKEND");
+        io_init(ioBackend != NULL && !strcmp(ioBackend, "epoll") ? IO_BACKEND_EPOLL : IO_BACKEND_URING);
 
-    // At this point, we found a suitable TTYUSB* and opened it
-    // Now setup termios attributes
-    printLog(__func__, "Setting up TTY");
-    ttyfd = setupTTY(ttyfd);
-    if (ttyfd == -1)
-        exit(EXIT_FAILURE);
+        printLog(__func__, "Finding available TTY");
+        ttyfd = findAndOpenTTYUSB();
+        if (ttyfd == -1)
+            exit(EXIT_FAILURE);
+
+        // At this point, we found a suitable TTYUSB* and opened it
+        // Now setup termios attributes
+        printLog(__func__, "Setting up TTY");
+        char *ttyMode = getenv("DSMR_TTY_MODE");
+        if (ttyMode != NULL && !strcmp(ttyMode, "9600"))
+            setTTYMode(TTY_9600_7E1);
+        ttyfd = setupTTY(ttyfd);
+        if (ttyfd == -1)
+            exit(EXIT_FAILURE);
+
+        // DSMR 2.2 and 3 meters talk 9600 7E1, the rest 115200 8N1:
+        // readTTY() picks it from the first identification line
+        if (ttyMode == NULL || !*ttyMode || !strcmp(ttyMode, "auto"))
+            detectTTY();
+
+        if (profileTelegrams > 0)
+        {
+            int profiled = profile_run(profileTelegrams, ttyfd, NULL);
+            closeTTY(ttyfd);
+            return profiled ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        // Reseating the cable must not cost a restart
+        watchTTY();
+    }
+
+    // Server mode can spread the meters over several Influx endpoints
+    char *hosts = getenv("INFLUX_HOSTS");
+    char *threads = getenv("DSMR_SERVER_THREADS");
+    if (ttyfd == -1 && hosts != NULL && *hosts)
+    {
+        static struct influx_config shards[SHARD_MAX];
+        int count = setupShards(shards, hosts);
+        if (count > 0)
+            server_run(listenAddress, threads != NULL ? atoi(threads) : 0, shards, count);
+        return EXIT_FAILURE;
+    }
 
     /**
      * InfluxDB connection setup
      */
+    struct influx_config iconfig;
+    if (!setupInflux(&iconfig, NULL))
+        goto cleanup;
+
+    if (ttyfd == -1)
+        server_run(listenAddress, threads != NULL ? atoi(threads) : 0, &iconfig, 1);
+    else
+    {
+        run(ttyfd, &iconfig);
+    }
+
+cleanup:
+    // Cleanup
+    if (ttyfd != -1)
+        closeTTY(ttyfd);
+
+    return EXIT_FAILURE;
+}
+
+/**
+ * setupInflux connects to the Influx target of settings, NULL for the
+ * environment: an Influx v1 or Telegraf UDP listener or the HTTP API
+ * @returns 1 on success, 0 on error
+ */
+static int setupInflux(struct influx_config *config, struct settings *settings)
+{
+    // An Influx v1 or Telegraf UDP listener takes the place of the HTTP API
+    char *udpTarget = settings_get(settings, "INFLUX_UDP");
+    if (udpTarget != NULL && *udpTarget)
+    {
+        // udp keeps a pointer to the host
+        char *udpHost = strdup(udpTarget);
+        struct udp_config *udp = malloc(sizeof(*udp));
+        if (udpHost == NULL || udp == NULL)
+            goto udpFailed;
+        unsigned short udpPort = splitHostPort(udpHost, 8089);
+
+        if (!udp_init(udp, udpHost, udpPort))
+            goto udpFailed;
+        *config = influx_init_udp(udp);
+        return 1;
+
+    udpFailed:
+        free(udpHost);
+        free(udp);
+        return 0;
+    }
+
     // HTTP setup
     printLog(__func__, "Setting up Influx HTTP connection");
-    char *host = getenv("INFLUX_HOST");
+    char *host = settings_get(settings, "INFLUX_HOST");
     if (host == NULL)
-        goto cleanup;
+        return 0;
 
-    struct http_config hconfig = http_init(host, 8086);
+    char *port = settings_get(settings, "INFLUX_PORT");
+    struct http_config hconfig = http_init(host, port != NULL && *port ? atoi(port) : 8086);
     int ret = http_connect(&hconfig);
     if (ret == -1)
     {
         printError(__func__, "HTTP connection to Influx failed");
-        goto cleanup;
+        return 0;
     }
 
     printLog(__func__, "Connection established");
 
     // At this point we've got an established HTTP connection
+    char *token = settings_get(settings, "INFLUX_TOKEN");
+    char *organisation = settings_get(settings, "INFLUX_ORG");
+    char *bucket = settings_get(settings, "INFLUX_BUCKET");
+    if (token == NULL || organisation == NULL || bucket == NULL)
+    {
+        http_close(&hconfig);
+        return 0;
+    }
+
+    *config = influx_init(&hconfig, organisation, bucket, token);
+
+    // Number of pipelined write requests on the connection
+    char *window = settings_get(settings, "INFLUX_WINDOW");
+    if (window != NULL && *window)
+        influx_set_window(config, atoi(window));
+
+    // Now validate connection
+    if (!influx_authenticate(config))
+    {
+        printError(__func__, "Couldn't authenticate Influx connection");
+        influx_close(config);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * closeInflux closes what setupInflux() set up
+ */
+static void closeInflux(struct influx_config *config)
+{
+    influx_close(config);
+    if (config->udp != NULL)
+    {
+        free(config->udp->host);
+        free(config->udp);
+        config->udp = NULL;
+    }
+}
+
+/**
+ * setupShards sets up one Influx connection per "host[:port]" or
+ * "[address]:port" in hosts
+ * An endpoint that's down at startup is retried by influx_pump().
+ * @returns the number of endpoints or 0 on error
+ */
+static int setupShards(struct influx_config *shards, char *hosts)
+{
     char *token = getenv("INFLUX_TOKEN");
     char *organisation = getenv("INFLUX_ORG");
     char *bucket = getenv("INFLUX_BUCKET");
+    char *window = getenv("INFLUX_WINDOW");
+    char *defaultPort = getenv("INFLUX_PORT");
     if (token == NULL || organisation == NULL || bucket == NULL)
-        goto cleanup;
+        return 0;
 
-    struct influx_config iconfig = influx_init(&hconfig, organisation, bucket, token);
-    // Now validate connection
-    if (!influx_connect(&iconfig))
+    // The http_configs keep pointers into this copy
+    char *list = strdup(hosts);
+    if (list == NULL)
+        return 0;
+
+    int count = 0;
+    char *save;
+    for (char *host = strtok_r(list, ", ", &save); host != NULL; host = strtok_r(NULL, ", ", &save))
     {
-        printError(__func__, "Couldn't connect to server");
-        goto cleanup;
+        if (count == SHARD_MAX)
+        {
+            printError(__func__, "Only the first %d Influx endpoints are used", SHARD_MAX);
+            break;
+        }
+
+        unsigned short port = splitHostPort(
+            host, defaultPort != NULL && *defaultPort ? atoi(defaultPort) : 8086);
+
+        struct http_config hconfig = http_init(host, port);
+        struct influx_config *shard = shards + count++;
+        *shard = influx_init(&hconfig, organisation, bucket, token);
+        if (window != NULL && *window)
+            influx_set_window(shard, atoi(window));
+
+        if (!influx_connect(shard))
+            printError(__func__, "Couldn't connect to %s:%u, retrying in the background", host, port);
+        else if (!influx_authenticate(shard))
+            printError(__func__, "Couldn't authenticate to %s:%u", host, port);
+        else
+            printLog(__func__, "Connected to %s:%u", host, port);
     }
+    return count;
+}
+
+// line-protocol arena
+#define LINE_BUFFER_SIZE 2048
 
-    if (!influx_authenticate(&iconfig))
+/**
+ * Everything run() sets up from the settings, reload() swaps the parts
+ * that changed
+ */
+struct pipeline
+{
+    struct settings *settings;       // Applied, NULL for the environment
+    struct settings *influxSettings; // The one the Influx strings point into
+    struct influx_config *influx;
+    struct lp_encoder encoder;
+    char *shmName; // "" when publishing is disabled
+    struct shm_config shm;
+    int capacityInterval; // 0 when disabled
+    int capacityReady;
+    struct capacity_state capacity;
+    int mbusEnabled;
+    struct mbus_state mbus;
+    struct archive_config archive;
+
+    // A new Influx target connects on its own thread, the serial loop keeps
+    // going and applies staged once connectState leaves CONNECT_BUSY
+    struct settings *staged;
+    pthread_t connector;
+    struct influx_config stagedInflux;
+    int connectState;
+};
+
+enum
+{
+    CONNECT_BUSY,
+    CONNECT_DONE,
+    CONNECT_FAILED,
+};
+
+static volatile sig_atomic_t reloadRequested;
+
+static void onHangup(int signal)
+{
+    (void)signal;
+    reloadRequested = 1;
+}
+
+/**
+ * settingOr looks key up in settings
+ * @returns its value or fallback when it's unset or empty
+ */
+static char *settingOr(struct settings *settings, const char *key, char *fallback)
+{
+    char *value = settings_get(settings, key);
+    return value != NULL && *value ? value : fallback;
+}
+
+/**
+ * selectFields turns INFLUX_FIELDS, comma separated field names, into a
+ * dsmr_select_fields() mask; unset or empty selects every field
+ * @returns 1 on success, 0 for an unknown field
+ */
+static int selectFields(const char *list, unsigned int *mask)
+{
+    *mask = ~0u;
+    if (list == NULL || !*list)
+        return 1;
+
+    char names[1024];
+    if (snprintf(names, sizeof(names), "%s", list) >= (int)sizeof(names))
     {
-        printError(__func__, "Couldn't authenticate Influx connection");
-        goto cleanup;
+        printError(__func__, "INFLUX_FIELDS is too long");
+        return 0;
     }
 
-    run(ttyfd, &iconfig);
+    *mask = 0;
+    char *save;
+    for (char *name = strtok_r(names, ", ", &save); name != NULL; name = strtok_r(NULL, ", ", &save))
+    {
+        int index = dsmr_field_index(name);
+        if (index == -1)
+        {
+            printError(__func__, "INFLUX_FIELDS: unknown field '%s'", name);
+            return 0;
+        }
+        *mask |= 1u << index;
+    }
+    return 1;
+}
 
-cleanup:
-    // Cleanup
-    closeTTY(ttyfd);
+/**
+ * apply swaps in what changed between the running settings and next
+ * What changed is set up next to the running pipeline and swapped in only
+ * when all of it worked, otherwise nothing changes. The TTY stays open, a
+ * new Influx target (influx, NULL when it's the same) takes over the queue
+ * of the old one and queued lines move to the new tags.
+ */
+static void apply(struct pipeline *p, struct settings *next, struct influx_config *influx)
+{
+    struct settings *current = p->settings;
+    int retag = settings_changed(current, next, "INFLUX_MEASUREMENT") ||
+                settings_changed(current, next, "INFLUX_TAGS");
+    int rearchive = settings_changed(current, next, "DSMR_ARCHIVE") ||
+                    settings_changed(current, next, "DSMR_ARCHIVE_COMPRESS");
+    char *tags = settings_get(next, "INFLUX_TAGS");
 
-    return EXIT_FAILURE;
+    // Set up the new parts next to the running ones
+    struct lp_encoder encoder = {0}, capacityEncoder = {0}, mbusEncoder = {0};
+    struct archive_config archive = {0};
+    char *shmName = NULL;
+
+    unsigned int fields;
+    if (!selectFields(settings_get(next, "INFLUX_FIELDS"), &fields))
+        goto reject;
+
+    if (retag &&
+        (!lp_init(&encoder, settingOr(next, "INFLUX_MEASUREMENT", "meter"), tags, LINE_BUFFER_SIZE) ||
+         (p->capacityReady && !lp_init(&capacityEncoder, "capacity", tags, p->capacity.encoder.capacity)) ||
+         (p->mbusEnabled && !lp_init(&mbusEncoder, "mbus", tags, p->mbus.encoder.capacity))))
+        goto reject;
+
+    char *archiveDir = settings_get(next, "DSMR_ARCHIVE");
+    char *compress = settings_get(next, "DSMR_ARCHIVE_COMPRESS");
+    if (rearchive && !archive_init(&archive, archiveDir, compress == NULL || atoi(compress)) &&
+        archiveDir != NULL && *archiveDir)
+        goto reject;
+
+    if (settings_changed(current, next, "DSMR_SHM"))
+    {
+        char *name = settings_get(next, "DSMR_SHM");
+        shmName = strdup(name != NULL ? name : DSMR_SHM_NAME);
+        if (shmName == NULL)
+            goto reject;
+    }
+
+    // Swap, nothing fails from here on
+    dsmr_select_fields(fields);
+
+    // Queued lines carry the series key they were rendered with
+    struct influx_rename renames[3];
+    int renameCount = 0;
+    if (retag)
+    {
+        struct lp_encoder *pairs[][2] = {
+            {&p->encoder, &encoder},
+            {&p->capacity.encoder, p->capacityReady ? &capacityEncoder : NULL},
+            {&p->mbus.encoder, p->mbusEnabled ? &mbusEncoder : NULL},
+        };
+        for (int i = 0; i < 3; i++)
+        {
+            if (pairs[i][1] == NULL)
+                continue;
+            renames[renameCount++] = (struct influx_rename){
+                pairs[i][0]->prefix, pairs[i][0]->prefixLength - 1,
+                pairs[i][1]->prefix, pairs[i][1]->prefixLength - 1};
+        }
+    }
+
+    if (influx != NULL)
+    {
+        influx_handover(p->influx, influx, renames, renameCount);
+        closeInflux(p->influx);
+        *p->influx = *influx;
+    }
+    else
+    {
+        if (retag)
+            influx_handover(p->influx, p->influx, renames, renameCount);
+        if (settings_changed(current, next, "INFLUX_WINDOW"))
+            influx_set_window(p->influx, atoi(settingOr(next, "INFLUX_WINDOW", "4")));
+    }
+
+    if (retag)
+    {
+        lp_free(&p->encoder);
+        p->encoder = encoder;
+        lp_begin(&p->encoder);
+        if (p->capacityReady)
+        {
+            lp_free(&p->capacity.encoder);
+            p->capacity.encoder = capacityEncoder;
+        }
+        if (p->mbusEnabled)
+        {
+            lp_free(&p->mbus.encoder);
+            p->mbus.encoder = mbusEncoder;
+        }
+    }
+
+    // The running quarter is kept, a capacity series that was off starts fresh
+    int interval = atoi(settingOr(next, "CAPACITY_INTERVAL", "60"));
+    if (interval > 0 && !p->capacityReady)
+        p->capacityReady = capacity_init(&p->capacity, "capacity", tags, interval);
+    if (p->capacityReady)
+        p->capacity.interval = interval;
+    p->capacityInterval = p->capacityReady ? interval : 0;
+
+    if (rearchive)
+    {
+        archive_close(&p->archive);
+        p->archive = archive;
+    }
+
+    if (shmName != NULL)
+    {
+        shm_close(&p->shm, p->shmName);
+        free(p->shmName);
+        p->shmName = shmName;
+        if (*shmName)
+            shm_init(&p->shm, shmName);
+    }
+
+    // Metrics that compile the same keep their integrals
+    char *derivedPath = settingOr(next, "DSMR_DERIVED", "/etc/DSMR/derived.conf");
+    if (derived_load(derivedPath) == -1)
+        printErrno(__func__, "Can't read %s, keeping its metrics", derivedPath);
+
+    // A snapshot is freed once nothing points into it anymore
+    p->settings = next;
+    if (influx != NULL)
+    {
+        if (p->influxSettings != current)
+            settings_free(p->influxSettings);
+        p->influxSettings = next;
+    }
+    if (current != p->influxSettings)
+        settings_free(current);
+
+    printLog(__func__, "Configuration reloaded");
+    return;
+
+reject:
+    if (influx != NULL)
+        closeInflux(influx);
+    lp_free(&encoder);
+    lp_free(&capacityEncoder);
+    lp_free(&mbusEncoder);
+    archive_close(&archive);
+    settings_free(next);
+    printError(__func__, "Keeping the running configuration");
 }
 
-int run(int ttyfd, struct influx_config *iconfig)
+/**
+ * connectStaged sets up the Influx target of the staged settings, the
+ * blocking connect and authentication stay off the serial loop
+ */
+static void *connectStaged(void *arg)
+{
+    struct pipeline *p = arg;
+    int state = setupInflux(&p->stagedInflux, p->staged) ? CONNECT_DONE : CONNECT_FAILED;
+    __atomic_store_n(&p->connectState, state, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * reload applies DSMR_CONFIG (default SETTINGS_PATH), between two telegrams
+ * A new Influx target is connected in the background first, run() calls
+ * this again until that's done. A SIGHUP in between is handled after it.
+ */
+static void reload(struct pipeline *p)
 {
-    int ret = 0;
+    if (p->staged != NULL)
+    {
+        int state = __atomic_load_n(&p->connectState, __ATOMIC_ACQUIRE);
+        if (state == CONNECT_BUSY)
+            return;
+
+        pthread_join(p->connector, NULL);
+        struct settings *next = p->staged;
+        p->staged = NULL;
+        if (state == CONNECT_DONE)
+        {
+            apply(p, next, &p->stagedInflux);
+            return;
+        }
+        settings_free(next);
+        printError(__func__, "Couldn't set up the new Influx target, keeping the running configuration");
+        return;
+    }
+
+    reloadRequested = 0;
+    char *path = settingOr(NULL, "DSMR_CONFIG", SETTINGS_PATH);
+    printLog(__func__, "Reloading %s", path);
 
+    struct settings *next = settings_load(path);
+    if (next == NULL)
+    {
+        printError(__func__, "Keeping the running configuration");
+        return;
+    }
+
+    // Set up once before the loop
+    static const char *const fixed[] = {
+        "DSMR_TTY", "DSMR_TTY_MODE", "DSMR_IO_BACKEND", "DSMR_WS_LISTEN", "DSMR_RULES",
+        "DSMR_LOG_LEVEL", "DSMR_LOG_JOURNAL", "DSMR_LISTEN", "DSMR_SERVER_THREADS", "INFLUX_HOSTS",
+    };
+    for (size_t i = 0; i < sizeof(fixed) / sizeof(*fixed); i++)
+    {
+        if (settings_changed(p->settings, next, fixed[i]))
+            printWarning(__func__, "%s only changes on a restart", fixed[i]);
+    }
+
+    static const char *const target[] = {
+        "INFLUX_UDP", "INFLUX_HOST", "INFLUX_PORT", "INFLUX_ORG", "INFLUX_TOKEN", "INFLUX_BUCKET",
+    };
+    int retarget = 0;
+    for (size_t i = 0; i < sizeof(target) / sizeof(*target); i++)
+        retarget |= settings_changed(p->settings, next, target[i]);
+    if (!retarget)
+    {
+        apply(p, next, NULL);
+        return;
+    }
+
+    // SIGHUP stays with the serial loop, the connector inherits the mask
+    p->staged = next;
+    p->connectState = CONNECT_BUSY;
+    sigset_t hangup, previous;
+    sigemptyset(&hangup);
+    sigaddset(&hangup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hangup, &previous);
+    int failed = pthread_create(&p->connector, NULL, connectStaged, p);
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+    if (failed)
+    {
+        p->staged = NULL;
+        settings_free(next);
+        printError(__func__, "Couldn't start connecting, keeping the running configuration");
+    }
+}
+
+/**
+ * reloadPending tells whether run() has to call reload()
+ */
+static int reloadPending(const struct pipeline *p)
+{
+    return reloadRequested || p->staged != NULL;
+}
+
+int run(int ttyfd, struct influx_config *iconfig)
+{
     /**
      * Line protocol handling
      */
-    size_t bufferLength = 128;
+    // Canonical mode delivers whole lines up to 4095 bytes, 0-0:98.1.0
+    // and 0-0:96.13.0 are far longer than the other lines
+    size_t bufferLength = 4096;
     char lineBuffer[bufferLength];
 
     int readBytes;
 
-// line-protocol buffer
-#define LINE_BUFFER_SIZE 2048
-    char *influxBuffer = malloc(LINE_BUFFER_SIZE);
-    char *bufferOffset = influxBuffer;
+    // Set up from the environment, SIGHUP reloads config.env
+    struct pipeline p = {.influx = iconfig};
+    struct sigaction hangup = {.sa_handler = onHangup};
+    sigaction(SIGHUP, &hangup, NULL);
+
+    // Measurement and tag set are rendered once into the encoder
+    char *measurement = settingOr(p.settings, "INFLUX_MEASUREMENT", "meter");
+    if (!lp_init(&p.encoder, measurement, settings_get(p.settings, "INFLUX_TAGS"), LINE_BUFFER_SIZE))
+        return -1;
+
+    // Fields written to Influx, all of them when INFLUX_FIELDS is empty
+    unsigned int fields;
+    if (!selectFields(settings_get(p.settings, "INFLUX_FIELDS"), &fields))
+        return -1;
+    dsmr_select_fields(fields);
+
+    // Latest values for local consumers, DSMR_SHM="" disables publishing
+    char *shmName = settings_get(p.settings, "DSMR_SHM");
+    p.shmName = strdup(shmName != NULL ? shmName : DSMR_SHM_NAME);
+    if (p.shmName == NULL)
+        return -1;
+    if (*p.shmName)
+        shm_init(&p.shm, p.shmName);
+
+    // Capacity tariff series, CAPACITY_INTERVAL="0" disables it
+    p.capacityInterval = atoi(settingOr(p.settings, "CAPACITY_INTERVAL", "60"));
+    p.capacityReady = p.capacityInterval > 0 &&
+                      capacity_init(&p.capacity, "capacity", settings_get(p.settings, "INFLUX_TAGS"),
+                                    p.capacityInterval);
+    if (!p.capacityReady)
+        p.capacityInterval = 0;
+
+    // Gas, water and heat sub-meters, only when their reading changes
+    p.mbusEnabled = mbus_init(&p.mbus, "mbus", settings_get(p.settings, "INFLUX_TAGS"));
 
-    // clear influxBuffer
-    clearBuffer(influxBuffer, LINE_BUFFER_SIZE);
+    // Live stream for dashboards, DSMR_WS_LISTEN="" disables it
+    char *wsAddress = settings_get(p.settings, "DSMR_WS_LISTEN");
+    if (wsAddress != NULL && *wsAddress)
+        ws_start(wsAddress);
 
-    int totalOffset = 0, offset = 0;
+    // Threshold alerting, a missing rules file means no rules
+    rules_load(settingOr(p.settings, "DSMR_RULES", "/etc/DSMR/rules.conf"));
+
+    // Computed fields, a missing file means none
+    derived_load(settingOr(p.settings, "DSMR_DERIVED", "/etc/DSMR/derived.conf"));
+
+    // Raw telegrams for disputes, DSMR_ARCHIVE="" disables it
+    char *compress = settings_get(p.settings, "DSMR_ARCHIVE_COMPRESS");
+    archive_init(&p.archive, settings_get(p.settings, "DSMR_ARCHIVE"), compress == NULL || atoi(compress));
+
+    struct dsmr_telegram telegram;
+    dsmr_telegram_reset(&telegram);
+    lp_begin(&p.encoder);
+
+    // Picked from the identification line of every telegram
+    enum dsmr_version version = DSMR_VERSION_GENERIC;
+    dsmr_decoder decode = decodeLine;
+
+    // Between the identification line and the !CRC, a reload waits for it
+    int receiving = 0;
 
     for (;;)
     {
         readBytes = readTTY(ttyfd, lineBuffer, bufferLength);
         if (readBytes < 0)
         {
-            printErrno(__func__, "readTTY returned a fatal response!");
-            // Fatal
-            return -1;
+            // Cable reseated or meter rebooted: wait for the port in-process,
+            // the Influx connection and the queued batches are kept
+            printErrno(__func__, "Serial port lost, waiting for it to come back");
+            closeTTY(ttyfd);
+            archive_commit(&p.archive);
+            while ((ttyfd = reopenTTY(TTY_REOPEN_POLL_MS)) == -1)
+            {
+                if (reloadPending(&p))
+                    reload(&p);
+                influx_pump(p.influx);
+            }
+
+            // The telegram in progress is incomplete
+            dsmr_telegram_reset(&telegram);
+            lp_reset(&p.encoder);
+            lp_begin(&p.encoder);
+            receiving = 0;
+            continue;
+        }
+
+        // Match responses and keep the write window full
+        influx_pump(p.influx);
+
+        if (readBytes == 0)
+        {
+            // Timeout or a signal, lineBuffer holds nothing new
+            archive_tick(&p.archive, time(NULL));
+            if (reloadPending(&p) && !receiving)
+                reload(&p);
+            continue;
         }
-        // TODO:  Maybe a function that resets the DSMR if detecting '/FLU5'
+
+        archive_line(&p.archive, lineBuffer, strnlen(lineBuffer, readBytes));
+
+        if (lineBuffer[0] == '/')
+        {
+            // Identification header: start of a new telegram, drop any partial one
+            dsmr_telegram_reset(&telegram);
+            lp_begin(&p.encoder);
+            receiving = 1;
+
+            enum dsmr_version detected = dsmr_detect_version(
+                lineBuffer, strnlen(lineBuffer, readBytes), getTTYMode() == TTY_9600_7E1);
+            if (detected != version)
+            {
+                printLog(__func__, "Meter identifies as %s", dsmr_version_name(detected));
+                version = detected;
+                decode = dsmr_decoder_for(version);
+            }
+            continue;
+        }
+
         // If it's not the !CRC, decode line
-        offset = decodeLine(influxBuffer + totalOffset, lineBuffer, readBytes);
-        totalOffset += offset;
+        decode(&p.encoder, &telegram, lineBuffer, readBytes);
 
         if (lineBuffer[0] == '!')
         {
-            // If line contains the !CRC -> send to Influx
-            // Remove last comma
-            influxBuffer[totalOffset - 1] = 0;
+            // Alerting first, it's the most latency sensitive
+            rules_evaluate(&telegram);
+
+            archive_end(&p.archive, telegram.timestamp);
+
+            shm_publish(&p.shm, &telegram);
+            ws_publish(&telegram);
 
-            // printLog(__func__, "Encoded DSMR: '%s'", influxBuffer);
+            if (p.capacityInterval > 0 && capacity_update(&p.capacity, &telegram))
+                influx_enqueue(p.influx, p.capacity.encoder.buffer, p.capacity.encoder.length);
 
-            ret = influx_write_DSMR(iconfig, influxBuffer, totalOffset);
-            if (!ret)
-                printError(__func__, "Writing data to InfluxDB failed: (%dbytes) '%s'", totalOffset, influxBuffer);
-            // TODO: After x amount of failures, exit with failure?
+            if (p.mbusEnabled && mbus_update(&p.mbus, &telegram))
+                influx_enqueue(p.influx, p.mbus.encoder.buffer, p.mbus.encoder.length);
 
-            // clear influxBuffer
-            clearBuffer(influxBuffer, LINE_BUFFER_SIZE);
-            totalOffset = 0;
+            derived_evaluate(&p.encoder, &telegram);
+
+            // If line contains the !CRC -> queue for Influx
+            if (!lp_end(&p.encoder, telegram.timestamp))
+                printError(__func__, "Dropping telegram, nothing decoded or arena full");
+            else if (!influx_enqueue(p.influx, p.encoder.buffer, p.encoder.length))
+                printError(__func__, "Queueing data for InfluxDB failed: (%dbytes) '%.*s'",
+                           p.encoder.length, p.encoder.length, p.encoder.buffer);
+            influx_pump(p.influx);
+
+            // Reuse the arena for the next telegram
+            lp_reset(&p.encoder);
+            dsmr_telegram_reset(&telegram);
+            lp_begin(&p.encoder);
+            receiving = 0;
+
+            if (reloadPending(&p))
+                reload(&p);
         }
     }
 }
-
-void clearBuffer(char *buf, int n)
-{
-    for (int i = 0; i < n; i++)
-        buf[i] = 0;
-}
\ No newline at end of file
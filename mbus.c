@@ -0,0 +1,71 @@
+/**
+ * mbus.c - Change driven series of the M-Bus sub-meters, see mbus.h
+ *
+ * Usage:
+ * struct mbus_state state;
+ * mbus_init(&state, "mbus", tags);
+ * if (mbus_update(&state, &telegram))
+ *     influx_enqueue(iconfig, state.encoder.buffer, state.encoder.length);
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "lineprotocol.h"
+#include "mbus.h"
+
+#define MBUS_BUFFER_SIZE 1024
+
+// Rendered once by mbus_init()
+static char channelKey[LP_KEY_SIZE];
+static int channelKeyLength;
+
+/**
+ * mbus_init renders the channel tag key once
+ * @returns 1 on success, 0 on error
+ */
+int mbus_init(struct mbus_state *state, const char *measurement, const char *tags)
+{
+    memset(state, 0, sizeof(*state));
+
+    channelKeyLength = lp_render_key(channelKey, LP_KEY_SIZE, "channel", 7);
+    if (channelKeyLength == -1)
+        return 0;
+    return lp_init(&state->encoder, measurement, tags, MBUS_BUFFER_SIZE);
+}
+
+/**
+ * mbus_update feeds one decoded telegram
+ * @returns 1 when lines were rendered into state->encoder, they stay
+ *  there until the next call
+ */
+int mbus_update(struct mbus_state *state, struct dsmr_telegram *telegram)
+{
+    lp_reset(&state->encoder);
+
+    int lines = 0;
+    for (int i = 0; i < DSMR_MBUS_CHANNELS; i++)
+    {
+        struct dsmr_mbus *mbus = telegram->mbus + i;
+        if (!mbus->reading || !mbus->value.present || mbus->captured <= state->captured[i])
+            continue;
+
+        // Once per capture, every few minutes
+        char name[32];
+        char key[LP_KEY_SIZE];
+        int nameLength = snprintf(name, sizeof(name), "%s_delivered", dsmr_mbus_medium(mbus->deviceType));
+        int keyLength = lp_render_key(key, sizeof(key), name, nameLength);
+        char channel = '1' + i;
+
+        lp_begin_tag(&state->encoder, channelKey, channelKeyLength, &channel, 1);
+        lp_field_fixed(&state->encoder, key, keyLength, mbus->value.value, mbus->value.decimals);
+        if (lp_end(&state->encoder, mbus->captured))
+            lines++;
+        else
+            printError(__func__, "Dropping the reading of channel %d", i + 1);
+        state->captured[i] = mbus->captured;
+    }
+    return lines > 0;
+}
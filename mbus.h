@@ -0,0 +1,28 @@
+#ifndef MBUS_H
+#define MBUS_H
+
+#include <time.h>
+
+#include "DSMR.h"
+#include "lineprotocol.h"
+
+/**
+ * Change driven series of the M-Bus sub-meters (gas, water, heat)
+ *
+ * A sub-meter is read every few minutes, the telegrams in between repeat
+ * the same value and capture time. One line per channel is rendered only
+ * when its capture time advances, timestamped with that capture time:
+ *  mbus,<tags>,channel=1 gas_delivered=2115.001 1792387500
+ * The field is named after the 0-n:24.1.0 device type, "mbus_delivered"
+ * for an unknown one, in the unit the meter sends.
+ */
+struct mbus_state
+{
+    struct lp_encoder encoder;
+    time_t captured[DSMR_MBUS_CHANNELS]; // Of the last line per channel
+};
+
+int mbus_init(struct mbus_state *state, const char *measurement, const char *tags);
+int mbus_update(struct mbus_state *state, struct dsmr_telegram *telegram);
+
+#endif
@@ -0,0 +1,382 @@
+/**
+ * p1parser.c - Incremental P1 parser
+ *
+ * A state machine that never looks back: every byte moves it forward and
+ * nothing before the current value is kept. See p1parser.h.
+ */
+#include <string.h>
+
+#include "crc16.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "p1parser.h"
+
+enum p1_state
+{
+    P1_IDLE,    // Waiting for the '/' of a telegram
+    P1_HEADER,  // Identification line
+    P1_KEY,     // OBIS key up to the '('
+    P1_VALUE,   // Inside a group that's decoded
+    P1_UNIT,    // Behind the '*' of a value
+    P1_BETWEEN, // After a ')' with another group expected
+    P1_SKIP,    // Rest of the line isn't needed
+    P1_CRC,     // Behind the '!'
+};
+
+// Groups of 0-0:98.1.0 in front of the months: (n)(OBIS)(OBIS)
+#define P1_HISTORY_GROUPS 3
+
+void p1_init(struct p1_parser *parser, struct dsmr_telegram *telegram,
+             p1_callback callback, void *context)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->telegram = telegram;
+    parser->callback = callback;
+    parser->context = context;
+    parser->state = P1_IDLE;
+}
+
+static int hexDigit(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * startLine prepares for the OBIS key of the next line
+ */
+static inline void startLine(struct p1_parser *parser)
+{
+    parser->state = P1_KEY;
+    parser->position = 0;
+    parser->hash = 0;
+}
+
+/**
+ * openGroup starts collecting the value of the current field
+ */
+static void openGroup(struct p1_parser *parser)
+{
+    parser->state = P1_VALUE;
+    parser->length = 0;
+    parser->overflow = 0;
+
+    if (!parser->mbus && dsmr_field(parser->index)->type == OCTET_STRING)
+    {
+        parser->telegram->equipmentId[0] = 0;
+        parser->telegram->equipmentIdLength = 0;
+    }
+}
+
+/**
+ * isHistoryValue
+ * @returns 1 when the current group is the F5(3,3) of a 0-0:98.1.0 month
+ */
+static inline int isHistoryValue(struct p1_parser *parser)
+{
+    return parser->group >= P1_HISTORY_GROUPS &&
+           (parser->group - P1_HISTORY_GROUPS) % 3 == 2;
+}
+
+/**
+ * octetDigit decodes the hex encoded equipment identifier while it
+ * comes in, two digits at a time, like storeOctetString()
+ */
+static void octetDigit(struct p1_parser *parser, char h)
+{
+    int nibble = h >= 'A' ? (h | 0x20) - 'a' + 10 : h - '0';
+    parser->length ^= 1;
+    if (parser->length)
+    {
+        parser->value[0] = nibble;
+        return;
+    }
+
+    struct dsmr_telegram *telegram = parser->telegram;
+    int c = parser->value[0] * 16 + nibble;
+    // Only printable characters end up in a tag
+    if (c > ' ' && c < 0x7f && telegram->equipmentIdLength < DSMR_EQUIPMENT_ID_SIZE - 1)
+    {
+        telegram->equipmentId[telegram->equipmentIdLength++] = c;
+        telegram->equipmentId[telegram->equipmentIdLength] = 0;
+    }
+}
+
+/**
+ * closeHistoryGroup handles one group of 0-0:98.1.0
+ * (n)(1-0:1.6.0)(1-0:1.6.0)(TST)(TST)(F5(3,3)*kW) ... n times
+ * @returns 1 when more groups are expected
+ */
+static int closeHistoryGroup(struct p1_parser *parser)
+{
+    struct dsmr_telegram *telegram = parser->telegram;
+    int group = parser->group++;
+
+    if (group == 0)
+    {
+        int count = 0;
+        for (int i = 0; i < parser->length; i++)
+            count = count * 10 + (parser->value[i] - '0');
+        parser->count = count > DSMR_DEMAND_HISTORY_SIZE ? DSMR_DEMAND_HISTORY_SIZE : count;
+        telegram->demandHistoryCount = 0;
+        return parser->count > 0;
+    }
+    // The two captured object definitions
+    if (group < P1_HISTORY_GROUPS)
+        return 1;
+
+    int months = (group - P1_HISTORY_GROUPS) / 3;
+    struct dsmr_demand_month *month = telegram->demandHistory + months;
+    switch ((group - P1_HISTORY_GROUPS) % 3)
+    {
+    case 0:
+        if (parser->length < 12)
+            return 0;
+        month->period = convertTimestamp(parser->value);
+        return 1;
+    case 1:
+        if (parser->length < 12)
+            return 0;
+        month->peak = convertTimestamp(parser->value);
+        return 1;
+    default:
+    {
+        struct dsmr_value value;
+        dsmr_store_value(&value, DOUBLE_LONG, parser->value, parser->length);
+        // Always 3 decimals, but scale to be sure
+        for (int d = value.decimals; d < 3; d++)
+            value.value *= 10;
+        month->value = value.value;
+        telegram->demandHistoryCount = months + 1;
+        return months + 1 < parser->count;
+    }
+    }
+}
+
+/**
+ * closeGroup stores the value at its ')' and sends it to the callback
+ * @returns 1 when another group of the line is decoded
+ */
+static int closeGroup(struct p1_parser *parser)
+{
+    if (parser->overflow)
+        return 0;
+    parser->value[parser->length] = 0;
+    if (parser->mbus)
+        return dsmr_store_mbus(parser->telegram, parser->mbus - 1, parser->group++,
+                               parser->value, parser->length);
+
+    const struct hashkeyval *kv = dsmr_field(parser->index);
+
+    int length = parser->length;
+    switch (kv->type)
+    {
+    case DEMAND_HISTORY:
+        return closeHistoryGroup(parser);
+    case OCTET_STRING:
+        return 0;
+    case TIMESTAMP:
+    {
+        // Digits up to the S(ummer) or W(inter) flag
+        char *flag = memchr(parser->value, 'S', length);
+        if (flag == NULL)
+            flag = memchr(parser->value, 'W', length);
+        if (flag != NULL)
+            length = flag - parser->value;
+        break;
+    }
+    default:
+        break;
+    }
+    if (length == 0)
+        return 0;
+
+    if (kv->hash == DATE_TIME_STAMP)
+    {
+        parser->telegram->timestamp = convertTimestamp(parser->value);
+    }
+    else
+    {
+        dsmr_store_value(parser->telegram->values + parser->index, kv->type, parser->value, length);
+        if (parser->callback != NULL)
+            parser->callback(parser, P1_FIELD, parser->index, parser->value, length);
+    }
+
+    if (!kv->next)
+        return 0;
+    parser->index = kv->next;
+    return 1;
+}
+
+/**
+ * valueByte takes one character inside a decoded group
+ */
+static void valueByte(struct p1_parser *parser, char c)
+{
+    // M-Bus values keep their unit, dsmr_store_mbus() splits it off
+    if (!parser->mbus)
+    {
+        COSEMType type = dsmr_field(parser->index)->type;
+        if (c == '*' && (type == DOUBLE_LONG || (type == DEMAND_HISTORY && isHistoryValue(parser))))
+        {
+            parser->state = P1_UNIT;
+            return;
+        }
+        if (type == OCTET_STRING)
+        {
+            octetDigit(parser, c);
+            return;
+        }
+    }
+
+    if (parser->length < P1_VALUE_SIZE - 1)
+        parser->value[parser->length++] = c;
+    else
+        parser->overflow = 1;
+}
+
+/**
+ * endTelegram checks the CRC behind the '!'
+ * DSMR 2.2 meters send a bare '!', those telegrams are accepted
+ */
+static void endTelegram(struct p1_parser *parser)
+{
+    // In the CRC state length counts the characters and overflow marks
+    // anything that isn't a hex digit among the first 4
+    int ok = parser->length == 0 ||
+             (parser->length >= 4 && !parser->overflow && parser->sentCRC == parser->crc);
+
+    parser->state = P1_IDLE;
+    parser->position = 0;
+    if (parser->callback != NULL)
+        parser->callback(parser, ok ? P1_END : P1_CRC_ERROR, -1, NULL, 0);
+}
+
+/**
+ * p1_feed parses data, any amount at a time
+ * @returns the number of bytes used, less than length when a telegram
+ *  ended inside data
+ */
+size_t p1_feed(struct p1_parser *parser, const char *data, size_t length)
+{
+    const char *end = data + length;
+    // Start of what the CRC doesn't cover yet, NULL outside a telegram
+    const char *span = parser->state == P1_IDLE || parser->state == P1_CRC ? NULL : data;
+
+    for (const char *p = data; p < end; p++)
+    {
+        char c = *p;
+
+        // A '/' at the start of a line is always a new telegram
+        if (c == '/' && parser->position == 0 &&
+            (parser->state == P1_IDLE || parser->state == P1_KEY))
+        {
+            span = p;
+            parser->crc = 0;
+            parser->state = P1_HEADER;
+            parser->position = 1;
+            dsmr_telegram_reset(parser->telegram);
+            if (parser->callback != NULL)
+                parser->callback(parser, P1_TELEGRAM, -1, NULL, 0);
+            continue;
+        }
+
+        switch (parser->state)
+        {
+        case P1_IDLE:
+            parser->position = c != '\n';
+            break;
+
+        case P1_HEADER:
+            if (c == '\n')
+                startLine(parser);
+            break;
+
+        case P1_KEY:
+            if (c == '!' && parser->position == 0)
+            {
+                parser->crc = crc16(parser->crc, span, p + 1 - span);
+                span = NULL;
+                parser->state = P1_CRC;
+                parser->sentCRC = 0;
+                parser->length = 0;
+                parser->overflow = 0;
+            }
+            else if (c == '(')
+            {
+                int index = parser->position ? findOBISOIDByHash(parser->hash) : -1;
+                int mbus = index == -1 && parser->position ? dsmr_mbus_key(parser->hash) : -1;
+                if (index == -1 && mbus == -1)
+                {
+                    parser->state = P1_SKIP;
+                    break;
+                }
+                parser->index = index;
+                parser->mbus = mbus + 1;
+                parser->group = 0;
+                openGroup(parser);
+            }
+            else if (c == '\n')
+            {
+                startLine(parser);
+            }
+            else
+            {
+                parser->hash = c - parser->hash * parser->position;
+                parser->position++;
+            }
+            break;
+
+        case P1_VALUE:
+        case P1_UNIT:
+            if (c == '\n')
+                startLine(parser);
+            else if (c == ')')
+                parser->state = closeGroup(parser) ? P1_BETWEEN : P1_SKIP;
+            else if (parser->state == P1_VALUE)
+                valueByte(parser, c);
+            break;
+
+        case P1_BETWEEN:
+            if (c == '\n')
+                startLine(parser);
+            else if (c == '(')
+                openGroup(parser);
+            break;
+
+        case P1_SKIP:
+            if (c == '\n')
+                startLine(parser);
+            break;
+
+        case P1_CRC:
+            if (c == '\n')
+            {
+                // Stop so the caller sees the telegram before the next '/'
+                endTelegram(parser);
+                return p + 1 - data;
+            }
+            if (c != '\r')
+            {
+                int digit = hexDigit(c);
+                if (parser->length < 4)
+                {
+                    parser->overflow |= digit == -1;
+                    parser->sentCRC = parser->sentCRC << 4 | (digit & 0xf);
+                }
+                if (parser->length < 255)
+                    parser->length++;
+            }
+            break;
+        }
+    }
+
+    if (span != NULL)
+        parser->crc = crc16(parser->crc, span, end - span);
+    return length;
+}
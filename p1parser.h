@@ -0,0 +1,72 @@
+#ifndef P1PARSER_H
+#define P1PARSER_H
+
+#include <stddef.h>
+
+#include "DSMR.h"
+
+#define P1_VALUE_SIZE 24 // Longest value kept, numbers and timestamps are shorter
+
+enum p1_event
+{
+    P1_TELEGRAM,  // Identification header, the telegram was reset
+    P1_FIELD,     // A value was stored in the telegram
+    P1_END,       // '!' line complete, CRC matched or the meter sends none
+    P1_CRC_ERROR, // '!' line complete, CRC mismatch
+};
+
+struct p1_parser;
+
+/**
+ * For P1_FIELD index is the OIDMap entry (dsmr_field()) and value/length
+ * are exactly what decodeLine() hands to lp_field(), value is only valid
+ * during the call. The other events have no index and no value.
+ */
+typedef void (*p1_callback)(struct p1_parser *parser, enum p1_event event,
+                            int index, const char *value, int length);
+
+/**
+ * Push parser for the P1 stream, for a UART interrupt or DMA chunks
+ *
+ * Bytes go in one at a time or in chunks of any size, no line is ever
+ * buffered: the OBIS key is hashed while it comes in, a value is kept
+ * until its ')' and the CRC16 runs over the telegram on the fly.
+ * The result is the same as decodeLine() on whole lines, including the
+ * telegram's timestamp, equipment identifier, 0-0:98.1.0 history and
+ * M-Bus channels.
+ *
+ * Usage:
+ * struct p1_parser parser;
+ * p1_init(&parser, &telegram, onEvent, context);
+ * while (length > 0)
+ * {
+ *     size_t used = p1_feed(&parser, dma, length);
+ *     dma += used;
+ *     length -= used;
+ * }
+ */
+struct p1_parser
+{
+    struct dsmr_telegram *telegram;
+    p1_callback callback;
+    void *context;
+
+    unsigned short hash;     // OBIS key hash so far
+    unsigned short position; // Characters into the line
+    unsigned short crc;      // CRC16 up to where the last chunk ended
+    unsigned short sentCRC;  // Digits behind the '!'
+    signed char index;       // OIDMap entry of the current group, -1 for none
+    unsigned char state;
+    unsigned char group; // Groups done on the line
+    unsigned char count; // 0-0:98.1.0 months announced
+    unsigned char length;
+    unsigned char overflow;
+    unsigned char mbus; // M-Bus key + 1 of an M-Bus line, else 0
+    char value[P1_VALUE_SIZE];
+};
+
+void p1_init(struct p1_parser *parser, struct dsmr_telegram *telegram,
+             p1_callback callback, void *context);
+size_t p1_feed(struct p1_parser *parser, const char *data, size_t length);
+
+#endif
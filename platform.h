@@ -0,0 +1,29 @@
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+#include <stddef.h>
+
+/**
+ * Platform layer, everything the core needs from the system
+ *
+ * platform_posix.c implements it on Linux. A microcontroller port (lwIP
+ * sockets and a UART) implements the same functions and nothing else.
+ * Connection handles are small non-negative integers, -1 is none.
+ * Timeouts are in seconds unless the name says otherwise.
+ */
+int platform_connect(const char *host, unsigned short port, int timeout);
+int platform_send(int handle, const char *head, size_t headLength,
+                  const char *body, size_t bodyLength);
+int platform_recv(int handle, char *buffer, size_t size, int timeout);
+void platform_close(int handle);
+
+#ifdef DSMR_EMBEDDED
+/**
+ * Only used by the embedded profile, the daemon has getenv() and a TTY
+ */
+int platform_serial_read(char *buffer, int size, int timeoutMs);
+const char *platform_setting(const char *name);
+void platform_log(int level, const char *prefix, const char *message, int length);
+#endif
+
+#endif
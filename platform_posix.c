@@ -0,0 +1,216 @@
+/**
+ * platform_posix.c - Platform layer on Linux
+ *
+ * Sockets for the HTTP client and, in the embedded profile, the P1 input,
+ * settings from the environment and logs on stdout/stderr. See platform.h.
+ * Sends and receives go through ioloop.h, on io_uring when it's set up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h> // getaddrinfo()
+#include <arpa/inet.h>
+#include <unistd.h> // for close
+#include <fcntl.h>
+
+#include <sys/select.h>
+#include <time.h> // select
+
+#include "common.h"
+#include "platform.h"
+#include "ioloop.h"
+
+#define PLATFORM_SEND_TIMEOUT 2
+
+/**
+ * connectTimeout connects without waiting longer than timeout seconds
+ * for an unreachable host, the socket is left blocking
+ * @returns 0 on success, -1 on error with errno set
+ */
+static int connectTimeout(int sockfd, struct sockaddr *addr, socklen_t addrlen, int timeout)
+{
+    int flags = fcntl(sockfd, F_GETFL);
+    fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+
+    int ret = connect(sockfd, addr, addrlen);
+    if (ret == -1 && errno == EINPROGRESS)
+    {
+        fd_set set;
+        FD_ZERO(&set);
+        FD_SET(sockfd, &set);
+        struct timeval tv = {.tv_sec = timeout};
+
+        ret = select(sockfd + 1, NULL, &set, NULL, &tv);
+        if (ret == 0)
+        {
+            errno = ETIMEDOUT;
+            ret = -1;
+        }
+        else if (ret > 0)
+        {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len);
+            errno = err;
+            ret = err ? -1 : 0;
+        }
+    }
+
+    fcntl(sockfd, F_SETFL, flags);
+    return ret;
+}
+
+/**
+ * platform_connect connects with the first possible address of host
+ * @returns the socket fd of the connection or -1
+ */
+int platform_connect(const char *host, unsigned short port, int timeout)
+{
+    // Find suitable socket
+    char service[6];
+    sprintf(service, "%d", port); // I hate this
+
+    struct addrinfo hints = {
+                        .ai_family = AF_UNSPEC, // IPv4 or IPv6, whatever
+                        .ai_socktype = SOCK_STREAM},
+                    *servinfo, *sip;
+
+    int ret;
+    if ((ret = getaddrinfo(host, service, &hints, &servinfo)) != 0)
+    {
+        printError(__func__, "getaddrinfo failed: %s", gai_strerror(ret));
+        return -1;
+    }
+
+    // Fetch first possible socket from servinfo
+    int sockfd = -1;
+    for (sip = servinfo; sip != NULL; sip = sip->ai_next)
+    {
+        if ((sockfd = socket(sip->ai_family, sip->ai_socktype, sip->ai_protocol)) == -1)
+        {
+            sockfd = -1;
+            continue;
+        }
+
+        // Now try to connect
+        if (connectTimeout(sockfd, sip->ai_addr, sip->ai_addrlen, timeout) == -1)
+        {
+            // Convert for debug
+            char ip[INET6_ADDRSTRLEN];
+            struct sockaddr_in *adr4 = (struct sockaddr_in *)sip->ai_addr;
+            void *adr = &(adr4->sin_addr);
+            inet_ntop(sip->ai_family, adr, ip, INET6_ADDRSTRLEN);
+
+            printErrno(__func__, "Connection failed to %s:%d\n", ip, ntohs(adr4->sin_port));
+            close(sockfd);
+            sockfd = -1;
+            continue;
+        }
+        break;
+    }
+
+    freeaddrinfo(servinfo);
+
+    if (sockfd == -1)
+    {
+        printErrno(__func__, "couldn't connect to server");
+        return -1;
+    }
+
+    // A stalled server must not block the serial loop forever
+    struct timeval tv = {.tv_sec = PLATFORM_SEND_TIMEOUT};
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    return sockfd;
+}
+
+/**
+ * platform_send writes the head and the body, see io_send()
+ * @returns 1 on success, 0 on error or closed connection
+ */
+int platform_send(int handle, const char *head, size_t headLength,
+                  const char *body, size_t bodyLength)
+{
+    return io_send(handle, head, headLength, body, bodyLength);
+}
+
+/**
+ * platform_recv waits up to timeout seconds for data
+ * @returns bytes read, 0 on timeout, -1 on error or closed connection
+ */
+int platform_recv(int handle, char *buffer, size_t size, int timeout)
+{
+    return io_read(handle, buffer, size, timeout * 1000);
+}
+
+void platform_close(int handle)
+{
+    if (handle == -1)
+        return;
+    io_forget(handle);
+    close(handle);
+}
+
+#ifdef DSMR_EMBEDDED
+#include <signal.h>
+
+#include "tty.h"
+#include "embedded.h"
+
+static int serialfd = STDIN_FILENO;
+
+/**
+ * platform_serial_read reads the P1 stream from DSMR_TTY or stdin
+ * @returns bytes read, 0 on timeout, -1 at the end of the input
+ */
+int platform_serial_read(char *buffer, int size, int timeoutMs)
+{
+    fd_set set;
+    FD_ZERO(&set);
+    FD_SET(serialfd, &set);
+    struct timeval tv = {.tv_sec = timeoutMs / 1000, .tv_usec = timeoutMs % 1000 * 1000};
+
+    int ret = select(serialfd + 1, &set, NULL, NULL, &tv);
+    if (ret <= 0)
+        return ret == -1 && errno != EINTR ? -1 : 0;
+
+    int nread = read(serialfd, buffer, size);
+    return nread > 0 ? nread : -1;
+}
+
+const char *platform_setting(const char *name)
+{
+    return getenv(name);
+}
+
+void platform_log(int level, const char *prefix, const char *message, int length)
+{
+    fprintf(level <= LOG_LEVEL_WARNING ? stderr : stdout, "%s:\t%.*s\n", prefix, length, message);
+}
+
+/**
+ * Host build of the embedded profile, reads a serial port or a pipe:
+ * dsmr-generate -r 10 | DSMR-embedded
+ */
+int main(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    char *tty = getenv("DSMR_TTY");
+    if (tty != NULL && *tty)
+    {
+        serialfd = findAndOpenTTYUSB();
+        if (serialfd == -1 || (serialfd = setupTTY(serialfd)) == -1)
+            return EXIT_FAILURE;
+    }
+
+    if (!embedded_init())
+        return EXIT_FAILURE;
+    embedded_run();
+    return EXIT_SUCCESS;
+}
+#endif
@@ -0,0 +1,357 @@
+/**
+ * profile.c - perf_event_open() counters per decode stage, see profile.h
+ *
+ * One counter group per stage, created disabled. The stage hook enables
+ * the group when the decoder enters the stage and disables it when it
+ * leaves, the totals are only read at the end. Counting is user space
+ * only, so the ioctl()s themselves cost just their libc wrapper; that and
+ * the hook are measured on an empty bracket and subtracted. The task
+ * clock can't leave the kernel out, its column is only a rough hint when
+ * the CPU has no counters (VMs).
+ */
+#define _GNU_SOURCE // syscall
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "lineprotocol.h"
+#include "tty.h"
+#include "profile.h"
+
+#define PROFILE_LINE_SIZE 4096
+#define PROFILE_CALIBRATION 100000 // Empty brackets measured for the overhead
+
+enum profileCounter
+{
+    COUNTER_TIME,
+    COUNTER_CYCLES,
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CACHE_MISSES,
+    COUNTER_BRANCH_MISSES,
+    COUNTERS,
+};
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} counters[COUNTERS] = {
+    // The task clock leads: it always exists, hardware counters may not
+    [COUNTER_TIME] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock"},
+    [COUNTER_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+    [COUNTER_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+    [COUNTER_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+    [COUNTER_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+};
+
+static const char *stageNames[DSMR_STAGES] = {
+    [DSMR_STAGE_KEY] = "key",
+    [DSMR_STAGE_LOOKUP] = "lookup",
+    [DSMR_STAGE_VALUE] = "value",
+    [DSMR_STAGE_ENCODE] = "encode",
+};
+
+struct profileGroup
+{
+    int fd[COUNTERS]; // -1 for counters the CPU doesn't have
+    long calls;
+    double total[COUNTERS];
+};
+
+// One group per stage and one to measure the bracket itself
+static struct profileGroup groups[DSMR_STAGES + 1];
+static struct profileGroup *calibration = groups + DSMR_STAGES;
+
+static int perfEventOpen(struct perf_event_attr *attr, int groupfd)
+{
+    return syscall(SYS_perf_event_open, attr, 0, -1, groupfd, 0);
+}
+
+/**
+ * openGroup opens the counters of group, disabled, user space only
+ * @returns 1 on success, 0 when not even the task clock can be opened
+ */
+static int openGroup(struct profileGroup *group)
+{
+    group->calls = 0;
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[c].type;
+        attr.config = counters[c].config;
+        attr.disabled = c == COUNTER_TIME;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        group->fd[c] = perfEventOpen(&attr, c == COUNTER_TIME ? -1 : group->fd[COUNTER_TIME]);
+        if (group->fd[c] == -1 && c == COUNTER_TIME)
+        {
+            printErrno(__func__, "perf_event_open failed, check /proc/sys/kernel/perf_event_paranoid");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * readGroup adds what group counted to group->total, scaled up when the
+ * kernel had to multiplex the counters
+ */
+static void readGroup(struct profileGroup *group)
+{
+    uint64_t data[3 + COUNTERS];
+    if (read(group->fd[COUNTER_TIME], data, sizeof(data)) < 24)
+        return;
+
+    uint64_t enabled = data[1];
+    uint64_t running = data[2];
+    double scale = running > 0 && running < enabled ? (double)enabled / running : 1;
+
+    int value = 3;
+    for (int c = 0; c < COUNTERS && value < 3 + (int)data[0]; c++)
+    {
+        if (group->fd[c] != -1)
+            group->total[c] += data[value++] * scale;
+    }
+}
+
+static void closeGroup(struct profileGroup *group)
+{
+    for (int c = COUNTERS - 1; c >= 0; c--)
+    {
+        if (group->fd[c] != -1)
+            close(group->fd[c]);
+    }
+}
+
+static inline void bracket(struct profileGroup *group, int done)
+{
+    if (done)
+    {
+        ioctl(group->fd[COUNTER_TIME], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    else
+    {
+        group->calls++;
+        ioctl(group->fd[COUNTER_TIME], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void onStage(enum dsmr_stage stage, int done)
+{
+    bracket(groups + stage, done);
+}
+
+/**
+ * nextLine reads one line of the capture, from the start again at its end
+ * @param wrapped set when it started over
+ * @returns the length without the line ending or -1 on error
+ */
+static int nextLine(FILE *capture, char **line, size_t *size, int *wrapped)
+{
+    ssize_t length = getline(line, size, capture);
+    if (length == -1)
+    {
+        *wrapped = 1;
+        rewind(capture);
+        length = getline(line, size, capture);
+        if (length == -1)
+            return -1;
+    }
+    while (length && ((*line)[length - 1] == '\n' || (*line)[length - 1] == '\r'))
+        length--;
+    (*line)[length] = 0;
+    return length;
+}
+
+static void printRow(const char *name, double calls, const double *value, long telegrams)
+{
+    printf("%-8s %9.1f", name, calls / telegrams);
+    for (int c = 0; c < COUNTERS; c++)
+    {
+        if (groups[0].fd[c] == -1)
+            printf(" %13s", "-");
+        else
+            printf(" %13.1f", value[c] / telegrams);
+    }
+    if (groups[0].fd[COUNTER_CYCLES] != -1 && groups[0].fd[COUNTER_INSTRUCTIONS] != -1 &&
+        value[COUNTER_CYCLES] > 0)
+        printf(" %6.2f\n", value[COUNTER_INSTRUCTIONS] / value[COUNTER_CYCLES]);
+    else
+        printf(" %6s\n", "-");
+}
+
+/**
+ * printReport prints the per telegram averages of every stage, less the
+ * cost of the brackets around it
+ */
+static void printReport(long telegrams)
+{
+    double overhead[COUNTERS];
+    for (int c = 0; c < COUNTERS; c++)
+        overhead[c] = calibration->calls ? calibration->total[c] / calibration->calls : 0;
+
+    printf("%ld telegrams, per telegram:\n", telegrams);
+    printf("%-8s %9s", "stage", "calls");
+    for (int c = 0; c < COUNTERS; c++)
+        printf(" %13s", c == COUNTER_TIME ? "ns" : counters[c].name);
+    printf(" %6s\n", "IPC");
+
+    double sum[COUNTERS] = {0};
+    long calls = 0;
+    for (int s = 0; s < DSMR_STAGES; s++)
+    {
+        double value[COUNTERS];
+        for (int c = 0; c < COUNTERS; c++)
+        {
+            value[c] = groups[s].total[c] - overhead[c] * groups[s].calls;
+            if (value[c] < 0)
+                value[c] = 0;
+            sum[c] += value[c];
+        }
+        calls += groups[s].calls;
+        printRow(stageNames[s], groups[s].calls, value, telegrams);
+    }
+    printRow("total", calls, sum, telegrams);
+}
+
+/**
+ * profile_run decodes telegrams with the stage counters running
+ * @returns 1 on success, 0 when the counters or the input failed
+ */
+int profile_run(int telegrams, int ttyfd, const char *capture)
+{
+    if (telegrams <= 0)
+        return 0;
+
+    FILE *file = NULL;
+    if (capture != NULL && (file = fopen(capture, "r")) == NULL)
+    {
+        printErrno(__func__, "Can't open %s", capture);
+        return 0;
+    }
+
+    int ret = 0;
+    int opened = 0;
+    for (; opened < DSMR_STAGES + 1; opened++)
+    {
+        if (!openGroup(groups + opened))
+            goto cleanup;
+    }
+    for (int c = COUNTER_CYCLES; c < COUNTERS; c++)
+    {
+        if (groups[0].fd[c] == -1)
+            printWarning(__func__, "No %s counter on this CPU", counters[c].name);
+    }
+
+    // Cost of an empty bracket, with the hook call around it
+    dsmr_set_stage_hook(onStage);
+    for (int i = 0; i < PROFILE_CALIBRATION; i++)
+    {
+        bracket(calibration, 0);
+        bracket(calibration, 1);
+    }
+
+    char *measurement = getenv("INFLUX_MEASUREMENT");
+    if (measurement == NULL || !*measurement)
+        measurement = "meter";
+    struct lp_encoder encoder;
+    if (!lp_init(&encoder, measurement, getenv("INFLUX_TAGS"), PROFILE_LINE_SIZE))
+        goto cleanup;
+
+    printLog(__func__, "Profiling %d telegrams", telegrams);
+
+    struct dsmr_telegram telegram;
+    dsmr_telegram_reset(&telegram);
+    char buffer[PROFILE_LINE_SIZE];
+    char *line = file != NULL ? NULL : buffer;
+    size_t size = 0;
+    long decoded = 0, decodedBefore = 0;
+    int inTelegram = 0;
+    dsmr_decoder decode = decodeLine;
+    while (decoded < telegrams)
+    {
+        int wrapped = 0;
+        int length = file != NULL ? nextLine(file, &line, &size, &wrapped) : readTTY(ttyfd, buffer, sizeof(buffer));
+        if (wrapped)
+        {
+            // A whole pass without a telegram won't find one on the next
+            if (decoded == decodedBefore)
+            {
+                printError(__func__, "No complete telegram in %s", capture);
+                break;
+            }
+            decodedBefore = decoded;
+            inTelegram = 0; // The last telegram was cut off
+        }
+        if (length < 0)
+        {
+            printErrno(__func__, "Reading telegrams failed");
+            break;
+        }
+        if (length == 0)
+            continue;
+
+        if (line[0] == '/')
+        {
+            // Identification header: start of a new telegram, drop any partial one
+            dsmr_telegram_reset(&telegram);
+            lp_reset(&encoder);
+            lp_begin(&encoder);
+            inTelegram = 1;
+
+            // The decoder of the meter family, as run() picks it
+            decode = dsmr_decoder_for(dsmr_detect_version(
+                line, length, file == NULL && getTTYMode() == TTY_9600_7E1));
+            continue;
+        }
+        if (!inTelegram)
+            continue;
+
+        decode(&encoder, &telegram, line, length);
+
+        if (line[0] == '!')
+        {
+            onStage(DSMR_STAGE_ENCODE, 0);
+            lp_end(&encoder, telegram.timestamp);
+            onStage(DSMR_STAGE_ENCODE, 1);
+            inTelegram = 0;
+            decoded++;
+        }
+    }
+    dsmr_set_stage_hook(NULL);
+
+    for (int g = 0; g < DSMR_STAGES + 1; g++)
+        readGroup(groups + g);
+    if (decoded > 0)
+    {
+        printReport(decoded);
+        ret = 1;
+    }
+
+    lp_free(&encoder);
+    if (file != NULL)
+        free(line);
+
+cleanup:
+    dsmr_set_stage_hook(NULL);
+    while (opened-- > 0)
+        closeGroup(groups + opened);
+    if (file != NULL)
+        fclose(file);
+    return ret;
+}
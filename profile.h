@@ -0,0 +1,20 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/**
+ * Hardware counter profile of the decoder, `DSMR --profile N [capture]`
+ *
+ * Decodes N telegrams from capture, replayed as often as needed, or from
+ * the TTY when there's no capture, with the decoder of the meter family
+ * each header names. A capture without a complete telegram ends the run
+ * after one pass. Every stage of the decoder gets its
+ * own perf_event_open() group that only counts while that stage runs, in
+ * user space: cycles, instructions, cache misses, branch misses and the
+ * task clock. Afterwards the per telegram averages and IPC are printed.
+ *
+ * Needs perf_event_paranoid <= 2 (or CAP_PERFMON) and a PMU the kernel
+ * exposes, counters the CPU lacks are left out.
+ */
+int profile_run(int telegrams, int ttyfd, const char *capture);
+
+#endif
@@ -0,0 +1,538 @@
+/**
+ * rules.c - Threshold alerting evaluated on every decoded telegram
+ *
+ * Rules are read once at startup from DSMR_RULES (default
+ * /etc/DSMR/rules.conf), one per line:
+ *
+ *  name: field > value [for 3s] [hysteresis 0.5] -> webhook http://127.0.0.1:8080/shed
+ *  name: field < value [for 500ms] -> command /usr/local/bin/restore-load
+ *  name: field > value -> mqtt 127.0.0.1:1883 home/dsmr/alert
+ *
+ * Values use the unit of the field (kW, kWh). A rule fires when the
+ * condition held for the given time and clears when the value is back
+ * past value -/+ hysteresis. Both transitions run the action.
+ *
+ * Rules are compiled into a small array; per telegram there are only
+ * integer compares. Actions run on a worker thread fed through a
+ * single producer ring, so the serial path never waits on them.
+ */
+#define _GNU_SOURCE // sem_clockwait
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "http.h"
+#include "rules.h"
+
+#define RULE_EVENTS 64 // Power of two
+#define RULE_COMMANDS 16 // Commands running at once
+#define MQTT_KEEPALIVE 60
+#define MQTT_TIMEOUT 1 // Seconds per read of the CONNACK
+#define RULE_REAP_INTERVAL 1 // Seconds between looks at running commands
+
+extern char **environ;
+
+struct rule_event
+{
+    int rule;
+    int active;
+    long long value;
+    time_t timestamp;
+};
+
+static struct rule rules[RULES_MAX];
+static int ruleCount;
+
+// Single producer (serial loop), single consumer (worker)
+static struct rule_event events[RULE_EVENTS];
+static unsigned int eventHead, eventTail;
+static sem_t eventSignal;
+
+// Children of runCommand(), only the worker touches them
+static pid_t commands[RULE_COMMANDS];
+static int commandCount;
+
+static long long monotonicMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/**
+ * parseMilli parses a decimal number into 3 decimals fixed point
+ * @returns 1 on success
+ */
+static int parseMilli(const char *s, long long *value)
+{
+    char *end;
+    double d = strtod(s, &end);
+    if (end == s || *end)
+        return 0;
+    *value = (long long)(d * 1000 + (d < 0 ? -0.5 : 0.5));
+    return 1;
+}
+
+/**
+ * parseDuration parses 3s, 500ms or 2m
+ * @returns 1 on success
+ */
+static int parseDuration(const char *s, long long *ms)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    if (end == s || n < 0)
+        return 0;
+    if (!strcmp(end, "ms"))
+        *ms = n;
+    else if (!strcmp(end, "s") || !*end)
+        *ms = n * 1000;
+    else if (!strcmp(end, "m"))
+        *ms = n * 60000;
+    else
+        return 0;
+    return 1;
+}
+
+/**
+ * compileRule parses one rule line into r
+ * @returns 1 on success
+ */
+static int compileRule(char *line, struct rule *r)
+{
+    memset(r, 0, sizeof(*r));
+
+    char *colon = strchr(line, ':');
+    char *arrow = strstr(line, "->");
+    if (colon == NULL || arrow == NULL || arrow < colon)
+        return 0;
+    *colon = 0;
+    *arrow = 0;
+    snprintf(r->name, RULE_NAME_SIZE, "%s", line);
+
+    // Condition
+    char *save;
+    char *field = strtok_r(colon + 1, " \t", &save);
+    char *op = strtok_r(NULL, " \t", &save);
+    char *value = strtok_r(NULL, " \t", &save);
+    if (field == NULL || op == NULL || value == NULL)
+        return 0;
+
+    r->field = dsmr_field_index(field);
+    if (r->field == -1)
+    {
+        printError(__func__, "Rule '%s': unknown field '%s'", r->name, field);
+        return 0;
+    }
+    if (!strcmp(op, ">"))
+        r->op = RULE_GREATER;
+    else if (!strcmp(op, "<"))
+        r->op = RULE_LESS;
+    else
+        return 0;
+    if (!parseMilli(value, &r->threshold))
+        return 0;
+
+    long long hysteresis = 0;
+    for (char *word; (word = strtok_r(NULL, " \t", &save)) != NULL;)
+    {
+        char *argument = strtok_r(NULL, " \t", &save);
+        if (argument == NULL)
+            return 0;
+        if (!strcmp(word, "for"))
+        {
+            if (!parseDuration(argument, &r->holdMs))
+                return 0;
+        }
+        else if (!strcmp(word, "hysteresis"))
+        {
+            if (!parseMilli(argument, &hysteresis) || hysteresis < 0)
+                return 0;
+        }
+        else
+            return 0;
+    }
+    r->clear = r->op == RULE_GREATER ? r->threshold - hysteresis : r->threshold + hysteresis;
+
+    // Action
+    char *action = strtok_r(arrow + 2, " \t", &save);
+    char *target = strtok_r(NULL, "", &save);
+    if (action == NULL || target == NULL)
+        return 0;
+    while (*target == ' ' || *target == '\t')
+        target++;
+
+    if (!strcmp(action, "webhook") && !strncmp(target, "http://", 7))
+        r->action = ACTION_WEBHOOK;
+    else if (!strcmp(action, "command"))
+        r->action = ACTION_COMMAND;
+    else if (!strcmp(action, "mqtt") && strchr(target, ' ') != NULL)
+        r->action = ACTION_MQTT;
+    else
+        return 0;
+    snprintf(r->target, RULE_TARGET_SIZE, "%s", target);
+    return 1;
+}
+
+static int formatEvent(char *dst, int size, struct rule *r, struct rule_event *event)
+{
+    long long v = event->value < 0 ? -event->value : event->value;
+    return snprintf(dst, size,
+                    "{\"rule\":\"%s\",\"state\":\"%s\",\"field\":\"%s\","
+                    "\"value\":%s%lld.%03lld,\"timestamp\":%ld}",
+                    r->name, event->active ? "fire" : "clear", dsmr_field_name(r->field),
+                    event->value < 0 ? "-" : "", v / 1000, v % 1000, (long)event->timestamp);
+}
+
+static void runWebhook(struct rule *r, struct rule_event *event)
+{
+    // http://host[:port]/path
+    char url[RULE_TARGET_SIZE];
+    snprintf(url, sizeof(url), "%s", r->target + 7);
+    char *path = strchr(url, '/');
+    char pathBuffer[RULE_TARGET_SIZE];
+    snprintf(pathBuffer, sizeof(pathBuffer), "%s", path ? path : "/");
+    if (path)
+        *path = 0;
+    unsigned short port = splitHostPort(url, 80);
+
+    char body[512];
+    int length = formatEvent(body, sizeof(body), r, event);
+
+    struct http_config hconfig = http_init(url, port);
+    if (http_connect(&hconfig) == -1)
+        return;
+
+    struct http_request request;
+    int status = 0;
+    if (http_request_init(&request, &hconfig, "POST", pathBuffer, NULL, NULL))
+        status = http_post(&hconfig, &request, body, length);
+    http_close(&hconfig);
+
+    if (status < 200 || status >= 300)
+        printError(__func__, "Rule '%s': webhook answered %d", r->name, status);
+}
+
+/**
+ * reapCommands collects the commands that finished, other children of
+ * the process are left to whoever started them
+ */
+static void reapCommands(void)
+{
+    for (int i = 0; i < commandCount;)
+    {
+        if (waitpid(commands[i], NULL, WNOHANG) == 0)
+        {
+            i++;
+            continue;
+        }
+        // Done, or not ours anymore (ECHILD)
+        commands[i] = commands[--commandCount];
+    }
+}
+
+static void runCommand(struct rule *r, struct rule_event *event)
+{
+    reapCommands();
+    if (commandCount == RULE_COMMANDS)
+    {
+        printError(__func__, "Rule '%s': %d commands still running, not starting another",
+                   r->name, RULE_COMMANDS);
+        return;
+    }
+
+    // Current environment plus the event
+    int n = 0;
+    while (environ[n])
+        n++;
+    char **envp = calloc(n + 4, sizeof(char *));
+    if (envp == NULL)
+        return;
+    memcpy(envp, environ, n * sizeof(char *));
+
+    char rule[RULE_NAME_SIZE + 16], state[32], value[64];
+    long long v = event->value < 0 ? -event->value : event->value;
+    snprintf(rule, sizeof(rule), "DSMR_RULE=%s", r->name);
+    snprintf(state, sizeof(state), "DSMR_STATE=%s", event->active ? "fire" : "clear");
+    snprintf(value, sizeof(value), "DSMR_VALUE=%s%lld.%03lld", event->value < 0 ? "-" : "",
+             v / 1000, v % 1000);
+    envp[n++] = rule;
+    envp[n++] = state;
+    envp[n++] = value;
+
+    pid_t pid;
+    char *argv[] = {"/bin/sh", "-c", r->target, NULL};
+    errno = posix_spawn(&pid, "/bin/sh", NULL, NULL, argv, envp);
+    if (errno)
+        printErrno(__func__, "Rule '%s': couldn't run '%s'", r->name, r->target);
+    else
+        commands[commandCount++] = pid;
+    free(envp);
+}
+
+/**
+ * mqttString appends a length prefixed MQTT string
+ */
+static int mqttString(unsigned char *dst, const char *s, int length)
+{
+    dst[0] = length >> 8;
+    dst[1] = length & 0xff;
+    memcpy(dst + 2, s, length);
+    return length + 2;
+}
+
+/**
+ * mqttPacket writes the fixed header with the variable remaining length
+ * @returns the header length
+ */
+static int mqttHeader(unsigned char *dst, unsigned char type, int remaining)
+{
+    int n = 0;
+    dst[n++] = type;
+    do
+    {
+        unsigned char byte = remaining % 128;
+        remaining /= 128;
+        dst[n++] = byte | (remaining ? 0x80 : 0);
+    } while (remaining);
+    return n;
+}
+
+static void runMqtt(struct rule *r, struct rule_event *event)
+{
+    // host:port topic
+    char hostport[RULE_TARGET_SIZE];
+    snprintf(hostport, sizeof(hostport), "%s", r->target);
+    char *topic = strchr(hostport, ' ');
+    *topic++ = 0;
+    unsigned short port = splitHostPort(hostport, 1883);
+
+    struct http_config tcp = http_init(hostport, port);
+    if (http_connect(&tcp) == -1)
+        return;
+
+    unsigned char packet[1024];
+    unsigned char variable[512];
+
+    // CONNECT: protocol MQTT level 4, clean session
+    char clientId[32];
+    int clientIdLength = snprintf(clientId, sizeof(clientId), "dsmr-%d", (int)getpid());
+    int v = mqttString(variable, "MQTT", 4);
+    variable[v++] = 4;
+    variable[v++] = 0x02;
+    variable[v++] = 0;
+    variable[v++] = MQTT_KEEPALIVE;
+    v += mqttString(variable + v, clientId, clientIdLength);
+    int n = mqttHeader(packet, 0x10, v);
+    memcpy(packet + n, variable, v);
+    n += v;
+    if (write(tcp.sockfd, packet, n) != n)
+        goto close;
+
+    // CONNACK, TCP may hand it over in pieces
+    unsigned char connack[4];
+    int received = 0;
+    while (received < 4)
+    {
+        int got = sread(tcp.sockfd, connack + received, 4 - received, MQTT_TIMEOUT);
+        if (got <= 0)
+            break;
+        received += got;
+    }
+    if (received != 4 || connack[0] != 0x20 || connack[3] != 0)
+    {
+        printError(__func__, "Rule '%s': MQTT broker refused the connection", r->name);
+        goto close;
+    }
+
+    // PUBLISH QoS 0
+    char payload[512];
+    int payloadLength = formatEvent(payload, sizeof(payload), r, event);
+    int topicLength = strlen(topic);
+    if (topicLength + payloadLength + 2 > (int)sizeof(variable))
+        goto close;
+    v = mqttString(variable, topic, topicLength);
+    memcpy(variable + v, payload, payloadLength);
+    v += payloadLength;
+    n = mqttHeader(packet, 0x30, v);
+    memcpy(packet + n, variable, v);
+    n += v;
+
+    // DISCONNECT
+    packet[n++] = 0xe0;
+    packet[n++] = 0;
+    if (write(tcp.sockfd, packet, n) != n)
+        printErrno(__func__, "Rule '%s': MQTT publish failed", r->name);
+
+close:
+    http_close(&tcp);
+}
+
+static void *ruleWorker(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        // Idle without commands, otherwise back in time to reap them
+        if (commandCount == 0)
+            sem_wait(&eventSignal);
+        else
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += RULE_REAP_INTERVAL;
+            sem_clockwait(&eventSignal, CLOCK_MONOTONIC, &deadline);
+        }
+
+        while (eventTail != __atomic_load_n(&eventHead, __ATOMIC_ACQUIRE))
+        {
+            struct rule_event event = events[eventTail & (RULE_EVENTS - 1)];
+            __atomic_store_n(&eventTail, eventTail + 1, __ATOMIC_RELEASE);
+
+            struct rule *r = rules + event.rule;
+            printLog(__func__, "Rule '%s' %s", r->name, event.active ? "fired" : "cleared");
+            if (r->action == ACTION_WEBHOOK)
+                runWebhook(r, &event);
+            else if (r->action == ACTION_COMMAND)
+                runCommand(r, &event);
+            else
+                runMqtt(r, &event);
+        }
+
+        // Reap finished commands
+        reapCommands();
+    }
+    return NULL;
+}
+
+/**
+ * rules_load compiles the rules file and starts the action worker
+ * A missing file means no rules.
+ * @returns the number of rules loaded, -1 on error
+ */
+int rules_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    char line[512];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        lineNumber++;
+        line[strcspn(line, "\r\n")] = 0;
+        char *start = line + strspn(line, " \t");
+        if (*start == 0 || *start == '#')
+            continue;
+
+        if (ruleCount == RULES_MAX)
+        {
+            printError(__func__, "%s: only %d rules are supported", path, RULES_MAX);
+            break;
+        }
+        if (!compileRule(start, rules + ruleCount))
+        {
+            printError(__func__, "%s:%d: invalid rule, ignored", path, lineNumber);
+            continue;
+        }
+        ruleCount++;
+    }
+    fclose(f);
+
+    if (ruleCount == 0)
+        return 0;
+
+    pthread_t worker;
+    if (sem_init(&eventSignal, 0, 0) == -1 ||
+        pthread_create(&worker, NULL, ruleWorker, NULL) != 0)
+    {
+        printErrno(__func__, "Couldn't start the rule worker");
+        ruleCount = 0;
+        return -1;
+    }
+    pthread_detach(worker);
+
+    printLog(__func__, "Loaded %d rules from %s", ruleCount, path);
+    return ruleCount;
+}
+
+int rules_count(void)
+{
+    return ruleCount;
+}
+
+/**
+ * queueEvent hands a transition to the worker, dropped if it's behind
+ */
+static void queueEvent(int rule, int active, long long value, time_t timestamp)
+{
+    if (eventHead - __atomic_load_n(&eventTail, __ATOMIC_ACQUIRE) == RULE_EVENTS)
+    {
+        printError(__func__, "Rule worker is behind, dropping event of '%s'", rules[rule].name);
+        return;
+    }
+    events[eventHead & (RULE_EVENTS - 1)] = (struct rule_event){
+        .rule = rule,
+        .active = active,
+        .value = value,
+        .timestamp = timestamp,
+    };
+    __atomic_store_n(&eventHead, eventHead + 1, __ATOMIC_RELEASE);
+    sem_post(&eventSignal);
+}
+
+/**
+ * rules_evaluate checks every rule against the telegram
+ */
+void rules_evaluate(struct dsmr_telegram *telegram)
+{
+    if (ruleCount == 0)
+        return;
+
+    long long now = monotonicMs();
+    for (int i = 0; i < ruleCount; i++)
+    {
+        struct rule *r = rules + i;
+        struct dsmr_value *v = telegram->values + r->field;
+        if (!v->present)
+            continue;
+
+        long long value = dsmr_milli(v);
+        if (!r->active)
+        {
+            int holds = r->op == RULE_GREATER ? value > r->threshold : value < r->threshold;
+            if (!holds)
+            {
+                r->since = 0;
+                continue;
+            }
+            if (r->since == 0)
+                r->since = now;
+            if (now - r->since >= r->holdMs)
+            {
+                r->active = 1;
+                queueEvent(i, 1, value, telegram->timestamp);
+            }
+        }
+        else
+        {
+            int cleared = r->op == RULE_GREATER ? value < r->clear : value > r->clear;
+            if (cleared)
+            {
+                r->active = 0;
+                r->since = 0;
+                queueEvent(i, 0, value, telegram->timestamp);
+            }
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef RULES_H
+#define RULES_H
+
+#include "DSMR.h"
+
+#define RULES_MAX 32
+#define RULE_NAME_SIZE 32
+#define RULE_TARGET_SIZE 192
+
+enum rule_op
+{
+    RULE_GREATER,
+    RULE_LESS,
+};
+
+enum rule_action
+{
+    ACTION_WEBHOOK, // HTTP POST of a JSON event to http://host:port/path
+    ACTION_COMMAND, // Executed with DSMR_RULE, DSMR_STATE and DSMR_VALUE set
+    ACTION_MQTT,    // MQTT 3.1.1 QoS 0 publish: host:port topic
+};
+
+/**
+ * Compiled rule, evaluated on every telegram with integer compares only
+ * Values are in milli units like dsmr_milli()
+ */
+struct rule
+{
+    int field; // Index into dsmr_telegram.values
+    enum rule_op op;
+    long long threshold;
+    long long clear; // Threshold to go back to normal (hysteresis)
+    long long holdMs; // How long the condition must hold ("for 3s")
+
+    long long since; // Monotonic ms the condition started to hold, 0 if it doesn't
+    int active;
+
+    enum rule_action action;
+    char name[RULE_NAME_SIZE];
+    char target[RULE_TARGET_SIZE];
+};
+
+int rules_load(const char *path);
+void rules_evaluate(struct dsmr_telegram *telegram);
+int rules_count(void);
+
+#endif
@@ -0,0 +1,637 @@
+/**
+ * server.c - Ingest server for many remote P1 streams
+ *
+ * Usage:
+ * server_run("2000", 0, shards, 2); // Never returns unless setup failed
+ *
+ * One acceptor hands every connection to a worker round robin. A worker
+ * owns an epoll instance with its connections, frames complete telegrams
+ * ('/' up to the "!CRC" line) and queues them on its own deque. Workers
+ * decode their own telegrams oldest first and steal the oldest telegrams
+ * of the others when they run out, so a few busy gateways don't pin one
+ * core. Every meter is routed to an Influx endpoint by consistent hashing
+ * of its equipment identifier. Decoded lines collect in a per worker,
+ * per endpoint encoder and are merged into that endpoint's batches; the
+ * acceptor keeps the write windows of all endpoints going. An endpoint
+ * whose queue is full spools to disk (DSMR_SPOOL, see spool.h) and the
+ * acceptor feeds the spool back once it takes batches again.
+ *
+ * Nothing is shared on the decode path: OIDMap is read-only after
+ * dsmr_init() and every worker has its own encoder.
+ */
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "dsmr_internal.h"
+#include "influx.h"
+#include "lineprotocol.h"
+#include "server.h"
+#include "shard.h"
+#include "spool.h"
+
+#define SERVER_EVENTS 64
+#define SERVER_IDLE_MS 5      // epoll wait when there is nothing to decode
+#define SERVER_STEAL_BATCH 16 // Telegrams stolen before checking our own sockets
+#define SERVER_REPLAY_WINDOW (INFLUX_QUEUE_SIZE / 2) // Spooled batches queued at a time
+
+/**
+ * A complete telegram waiting to be decoded
+ * Tasks are recycled through the free list of the worker that made them
+ */
+struct server_task
+{
+    struct server_task *next;
+    struct server_worker *owner;
+    int length;
+    char data[SERVER_BUFFER_SIZE];
+};
+
+struct server_conn
+{
+    int fd;
+    int length; // Bytes of the partial telegram in buffer
+    char buffer[SERVER_BUFFER_SIZE];
+};
+
+struct server_worker
+{
+    pthread_t thread;
+    int index;
+    int epfd;
+
+    // FIFO: the owner pushes at tail, the owner and thieves take from head
+    // so a meter's telegrams leave in the order they arrived
+    pthread_mutex_t lock; // Guards the deque and the free list
+    struct server_task *deque[SERVER_QUEUE_SIZE];
+    unsigned int head, tail;
+    struct server_task *freeList;
+
+    struct lp_encoder encoders[SHARD_MAX]; // One per Influx endpoint
+    long long lastFlush;
+
+    // Written by this worker only
+    unsigned long long telegrams, stolen, dropped;
+} __attribute__((aligned(64)));
+
+static struct server_worker workers[SERVER_MAX_WORKERS];
+static int workerCount;
+static int connections;
+
+static struct influx_config *influx; // One per endpoint
+static pthread_mutex_t influxLocks[SHARD_MAX];
+static struct spool spools[SHARD_MAX]; // Under the lock of the endpoint
+static struct shard_ring ring;
+
+// Pre-rendered "equipment_id="
+static char tagKey[LP_KEY_SIZE];
+static int tagKeyLength;
+
+static long long monotonicMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static struct server_task *getTask(struct server_worker *worker)
+{
+    pthread_mutex_lock(&worker->lock);
+    struct server_task *task = worker->freeList;
+    if (task != NULL)
+        worker->freeList = task->next;
+    pthread_mutex_unlock(&worker->lock);
+
+    if (task == NULL)
+    {
+        // Only grows until the deques stop filling up
+        task = malloc(sizeof(struct server_task));
+        if (task == NULL)
+            return NULL;
+        task->owner = worker;
+    }
+    return task;
+}
+
+static void putTask(struct server_task *task)
+{
+    struct server_worker *owner = task->owner;
+    pthread_mutex_lock(&owner->lock);
+    task->next = owner->freeList;
+    owner->freeList = task;
+    pthread_mutex_unlock(&owner->lock);
+}
+
+/**
+ * push queues a task on the worker's own deque
+ * @returns 1 on success, 0 if the deque is full
+ */
+static int push(struct server_worker *worker, struct server_task *task)
+{
+    int ret = 0;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail - worker->head < SERVER_QUEUE_SIZE)
+    {
+        worker->deque[worker->tail++ % SERVER_QUEUE_SIZE] = task;
+        ret = 1;
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return ret;
+}
+
+/**
+ * pop takes the oldest task of the worker's own deque
+ */
+static struct server_task *pop(struct server_worker *worker)
+{
+    struct server_task *task = NULL;
+    pthread_mutex_lock(&worker->lock);
+    if (worker->tail != worker->head)
+        task = worker->deque[worker->head++ % SERVER_QUEUE_SIZE];
+    pthread_mutex_unlock(&worker->lock);
+    return task;
+}
+
+/**
+ * steal takes the oldest task of the first other worker that has one
+ */
+static struct server_task *steal(struct server_worker *thief)
+{
+    for (int i = 1; i < workerCount; i++)
+    {
+        struct server_worker *victim = workers + (thief->index + i) % workerCount;
+
+        // Racy peek, the lock is only taken when there is something
+        if (__atomic_load_n(&victim->tail, __ATOMIC_RELAXED) ==
+            __atomic_load_n(&victim->head, __ATOMIC_RELAXED))
+            continue;
+
+        struct server_task *task = NULL;
+        pthread_mutex_lock(&victim->lock);
+        if (victim->tail != victim->head)
+            task = victim->deque[victim->head++ % SERVER_QUEUE_SIZE];
+        pthread_mutex_unlock(&victim->lock);
+        if (task != NULL)
+            return task;
+    }
+    return NULL;
+}
+
+/**
+ * flush merges the worker's lines into the batches of one endpoint
+ * Unless wait is set it gives up when the acceptor holds the lock,
+ * the lines then wait for the next flush.
+ */
+static void flush(struct server_worker *worker, int shard, int wait)
+{
+    struct lp_encoder *enc = worker->encoders + shard;
+    if (enc->length == 0)
+        return;
+
+    if (wait)
+        pthread_mutex_lock(influxLocks + shard);
+    else if (pthread_mutex_trylock(influxLocks + shard) != 0)
+        return;
+
+    // Behind what's spooled already, or in place of pushing out a batch
+    int ret;
+    struct spool *spool = spools + shard;
+    if (spool_pending(spool) || (spool->fd != -1 && !influx_has_room(influx + shard, enc->length)))
+        ret = spool_write(spool, enc->buffer, enc->length);
+    else
+        ret = influx_enqueue(influx + shard, enc->buffer, enc->length);
+    pthread_mutex_unlock(influxLocks + shard);
+    if (!ret)
+        printError(__func__, "Dropped %d bytes, queue of %s is full",
+                   enc->length, influx[shard].httpConfig.remote_host);
+
+    lp_reset(enc);
+}
+
+/**
+ * process decodes one telegram and renders it into the worker's encoder
+ */
+static void process(struct server_worker *worker, struct server_task *task)
+{
+    struct dsmr_telegram telegram;
+    dsmr_telegram_reset(&telegram);
+
+    char *line = task->data;
+    char *end = task->data + task->length;
+    while (line < end)
+    {
+        char *newline = memchr(line, '\n', end - line);
+        if (newline == NULL)
+            newline = end;
+
+        int length = newline - line;
+        if (length && line[length - 1] == '\r')
+            length--;
+        if (length && line[0] != '/' && line[0] != '!')
+            decodeLine(NULL, &telegram, line, length);
+
+        line = newline + 1;
+    }
+    putTask(task);
+
+    int shard = shard_lookup(&ring, telegram.equipmentId, telegram.equipmentIdLength);
+
+    // Room for at least one more telegram
+    struct lp_encoder *enc = worker->encoders + shard;
+    if (enc->capacity - enc->length < SERVER_BUFFER_SIZE)
+        flush(worker, shard, 1);
+
+    if (telegram.equipmentIdLength)
+        lp_begin_tag(enc, tagKey, tagKeyLength, telegram.equipmentId, telegram.equipmentIdLength);
+    else
+        lp_begin(enc);
+    dsmr_encode(enc, &telegram);
+
+    if (lp_end(enc, telegram.timestamp))
+        __atomic_fetch_add(&worker->telegrams, 1, __ATOMIC_RELAXED);
+    else
+        __atomic_fetch_add(&worker->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void closeConn(struct server_worker *worker, struct server_conn *conn)
+{
+    epoll_ctl(worker->epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn);
+    __atomic_fetch_sub(&connections, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * frame queues every complete telegram in the connection buffer and
+ * keeps the partial one
+ */
+static void frame(struct server_worker *worker, struct server_conn *conn)
+{
+    char *buffer = conn->buffer;
+    char *end = buffer + conn->length;
+    char *offset = buffer;
+
+    for (;;)
+    {
+        char *begin = memchr(offset, '/', end - offset);
+        if (begin == NULL)
+        {
+            offset = end; // Noise before the first header
+            break;
+        }
+        offset = begin;
+
+        char *crc = memchr(begin, '!', end - begin);
+        char *newline = crc != NULL ? memchr(crc, '\n', end - crc) : NULL;
+        if (newline == NULL)
+            break;
+        newline++;
+
+        struct server_task *task = getTask(worker);
+        if (task == NULL)
+        {
+            printErrno(__func__, "Couldn't allocate task, dropping telegram");
+        }
+        else
+        {
+            task->length = newline - begin;
+            memcpy(task->data, begin, task->length);
+            // Deque full, we're the bottleneck anyway: make room in order
+            while (!push(worker, task))
+            {
+                struct server_task *oldest = pop(worker);
+                if (oldest != NULL)
+                    process(worker, oldest);
+            }
+        }
+        offset = newline;
+    }
+
+    conn->length = end - offset;
+    memmove(buffer, offset, conn->length);
+
+    if (conn->length == SERVER_BUFFER_SIZE)
+    {
+        printWarning(__func__, "Dropping %d bytes without a complete telegram", conn->length);
+        conn->length = 0;
+    }
+}
+
+static void readConn(struct server_worker *worker, struct server_conn *conn)
+{
+    ssize_t n = read(conn->fd, conn->buffer + conn->length, SERVER_BUFFER_SIZE - conn->length);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0)
+    {
+        closeConn(worker, conn);
+        return;
+    }
+
+    conn->length += n;
+    frame(worker, conn);
+}
+
+static void *workerMain(void *arg)
+{
+    struct server_worker *worker = arg;
+    struct epoll_event events[SERVER_EVENTS];
+    int busy = 0;
+
+    for (;;)
+    {
+        int n = epoll_wait(worker->epfd, events, SERVER_EVENTS, busy ? 0 : SERVER_IDLE_MS);
+        for (int i = 0; i < n; i++)
+            readConn(worker, events[i].data.ptr);
+
+        struct server_task *task;
+        while ((task = pop(worker)) != NULL)
+            process(worker, task);
+
+        // Out of own work: help the others
+        busy = 0;
+        while (busy < SERVER_STEAL_BATCH && (task = steal(worker)) != NULL)
+        {
+            process(worker, task);
+            busy++;
+        }
+        if (busy)
+            __atomic_fetch_add(&worker->stolen, busy, __ATOMIC_RELAXED);
+
+        long long now = monotonicMs();
+        if (now - worker->lastFlush >= SERVER_FLUSH_MS)
+        {
+            for (int i = 0; i < ring.shards; i++)
+                flush(worker, i, 0);
+            worker->lastFlush = now;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * server_listen binds a non-blocking listening socket to "[host:]port"
+ * @returns the socket or -1 on error
+ */
+int server_listen(const char *address)
+{
+    char host[256] = "";
+    const char *port = strrchr(address, ':');
+    if (port == NULL)
+    {
+        port = address;
+    }
+    else
+    {
+        int length = port - address;
+        if (length >= (int)sizeof(host))
+            length = sizeof(host) - 1;
+        memcpy(host, address, length);
+        host[length] = 0;
+        port++;
+    }
+
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *res;
+    int ret = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+    if (ret != 0)
+    {
+        printError(__func__, "Couldn't resolve '%s': %s", address, gai_strerror(ret));
+        return -1;
+    }
+
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        printErrno(__func__, "socket failed");
+        freeaddrinfo(res);
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) == -1 || listen(fd, SOMAXCONN) == -1)
+    {
+        printErrno(__func__, "Couldn't listen on '%s'", address);
+        freeaddrinfo(res);
+        close(fd);
+        return -1;
+    }
+
+    freeaddrinfo(res);
+    return fd;
+}
+
+/**
+ * raiseFileLimit allows a socket per meter, the soft limit is often 1024
+ */
+static void raiseFileLimit(void)
+{
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static void acceptConnections(int listenfd)
+{
+    static int next;
+
+    for (;;)
+    {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                printErrno(__func__, "accept failed");
+            return;
+        }
+
+        // Detect gateways that vanished without closing
+        int on = 1;
+        setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+
+        struct server_conn *conn = malloc(sizeof(struct server_conn));
+        if (conn == NULL)
+        {
+            printErrno(__func__, "Couldn't allocate connection");
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->length = 0;
+
+        struct server_worker *worker = workers + next++ % workerCount;
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = conn};
+        if (epoll_ctl(worker->epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            printErrno(__func__, "epoll_ctl failed");
+            close(fd);
+            free(conn);
+            continue;
+        }
+        __atomic_fetch_add(&connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void printStats(long long elapsedMs)
+{
+    static unsigned long long lastTelegrams, lastStolen, lastDropped;
+    unsigned long long telegrams = 0, stolen = 0, dropped = 0;
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        telegrams += __atomic_load_n(&workers[i].telegrams, __ATOMIC_RELAXED);
+        stolen += __atomic_load_n(&workers[i].stolen, __ATOMIC_RELAXED);
+        dropped += __atomic_load_n(&workers[i].dropped, __ATOMIC_RELAXED);
+    }
+
+    printLog(__func__, "%d connections, %.0f telegrams/s, %llu stolen, %llu dropped",
+             __atomic_load_n(&connections, __ATOMIC_RELAXED),
+             (telegrams - lastTelegrams) * 1000.0 / elapsedMs,
+             stolen - lastStolen, dropped - lastDropped);
+
+    lastTelegrams = telegrams;
+    lastStolen = stolen;
+    lastDropped = dropped;
+}
+
+/**
+ * server_run accepts P1 streams on address and ingests them with threads
+ * workers, 0 uses one per online CPU. Meters are spread over the count
+ * Influx endpoints in shards.
+ * @returns -1 if setup failed, doesn't return otherwise
+ */
+int server_run(const char *address, int threads, struct influx_config *shards, int count)
+{
+    influx = shards;
+
+    // Ring points are named after the endpoint, not its position in the list
+    char names[SHARD_MAX][272];
+    const char *namePointers[SHARD_MAX];
+    for (int i = 0; i < count && i < SHARD_MAX; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "%s:%u",
+                 shards[i].httpConfig.remote_host, shards[i].httpConfig.remote_port);
+        namePointers[i] = names[i];
+        pthread_mutex_init(influxLocks + i, NULL);
+    }
+    if (!shard_ring_init(&ring, namePointers, count))
+        return -1;
+
+    // Overflow of endpoints that are down, DSMR_SPOOL="" disables it
+    char *spoolDir = getenv("DSMR_SPOOL");
+    for (int i = 0; i < count; i++)
+        spool_init(spools + i, spoolDir, names[i]);
+
+    if (threads <= 0)
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > SERVER_MAX_WORKERS)
+        threads = SERVER_MAX_WORKERS;
+    if (threads <= 0)
+        threads = 1;
+
+    tagKeyLength = lp_render_key(tagKey, LP_KEY_SIZE, "equipment_id", 12);
+
+    char *measurement = getenv("INFLUX_MEASUREMENT");
+    if (measurement == NULL || !*measurement)
+        measurement = "meter";
+
+    raiseFileLimit();
+    int listenfd = server_listen(address);
+    if (listenfd == -1)
+        return -1;
+
+    for (int i = 0; i < threads; i++)
+    {
+        struct server_worker *worker = workers + i;
+        worker->index = i;
+        worker->lastFlush = monotonicMs();
+        pthread_mutex_init(&worker->lock, NULL);
+
+        // Half a batch, so flushes of two workers share a write request
+        for (int j = 0; j < count; j++)
+        {
+            if (!lp_init(worker->encoders + j, measurement, getenv("INFLUX_TAGS"),
+                         INFLUX_BATCH_SIZE / 2))
+                return -1;
+        }
+
+        worker->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (worker->epfd == -1)
+        {
+            printErrno(__func__, "epoll_create1 failed");
+            return -1;
+        }
+    }
+
+    // Workers steal from workers, they all have to exist first
+    workerCount = threads;
+    for (int i = 0; i < threads; i++)
+    {
+        if (pthread_create(&workers[i].thread, NULL, workerMain, workers + i) != 0)
+        {
+            printError(__func__, "Couldn't start worker %d", i);
+            return -1;
+        }
+    }
+
+    printLog(__func__, "Accepting P1 streams on %s with %d workers, %d Influx endpoints",
+             address, threads, count);
+
+    static char replay[INFLUX_BATCH_SIZE]; // Spooled lines on their way back
+    long long lastStats = monotonicMs();
+    struct pollfd pfd = {.fd = listenfd, .events = POLLIN};
+    for (;;)
+    {
+        if (poll(&pfd, 1, 10) > 0)
+            acceptConnections(listenfd);
+
+        for (int i = 0; i < count; i++)
+        {
+            pthread_mutex_lock(influxLocks + i);
+            influx_pump(influx + i);
+
+            // The spool goes back a window at a time once the endpoint keeps
+            // up again, the next one when Influx has answered for all of it
+            struct spool *spool = spools + i;
+            if (spool_pending(spool) && influx_drained(influx + i))
+            {
+                spool_acked(spool);
+                for (int n = 0; n < SERVER_REPLAY_WINDOW && influx_has_room(influx + i, INFLUX_BATCH_SIZE); n++)
+                {
+                    int length = spool_read(spool, replay, INFLUX_BATCH_SIZE);
+                    if (length <= 0 || !influx_enqueue(influx + i, replay, length))
+                        break;
+                    spool_sent(spool, length);
+                }
+            }
+            pthread_mutex_unlock(influxLocks + i);
+        }
+
+        long long now = monotonicMs();
+        if (now - lastStats >= SERVER_STATS_INTERVAL * 1000)
+        {
+            printStats(now - lastStats);
+            lastStats = now;
+        }
+    }
+}
@@ -0,0 +1,23 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "influx.h"
+
+#define SERVER_MAX_WORKERS 64
+#define SERVER_BUFFER_SIZE 4096 // Per connection, fits the longest telegram
+#define SERVER_QUEUE_SIZE 1024  // Telegrams waiting per worker
+#define SERVER_FLUSH_MS 100     // Longest time decoded lines wait for a batch
+#define SERVER_STATS_INTERVAL 60
+
+/**
+ * Ingest server for remote P1 streams (ser2net style gateways)
+ *
+ * DSMR_LISTEN="[host:]port" replaces the TTY by a TCP listener. Every
+ * connection carries the raw P1 stream of one meter. Lines of all meters
+ * are tagged with equipment_id and merged into the batches of the Influx
+ * endpoint their equipment_id hashes to.
+ */
+int server_run(const char *address, int threads, struct influx_config *shards, int count);
+int server_listen(const char *address);
+
+#endif
@@ -0,0 +1,146 @@
+/**
+ * settings.c - Reads config.env for a reload, see settings.h
+ *
+ * The syntax is the part of systemd's EnvironmentFile= that config.env
+ * uses: KEY=value or KEY="value" per line, '#' starts a comment line and
+ * \" or \\ escape inside double quotes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "common.h"
+#include "settings.h"
+
+/**
+ * parseValue unquotes the value at s in place
+ * @returns the value or NULL when a quote isn't closed
+ */
+static char *parseValue(char *s)
+{
+    if (*s == '"' || *s == '\'')
+    {
+        char quote = *s++;
+        char *value = s;
+        char *out = s;
+        for (; *s != quote; s++)
+        {
+            if (*s == 0)
+                return NULL;
+            if (quote == '"' && *s == '\\' && (s[1] == '"' || s[1] == '\\'))
+                s++;
+            *out++ = *s;
+        }
+        *out = 0;
+        return value;
+    }
+
+    // Unquoted: up to the end of the line without trailing blanks
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        end--;
+    *end = 0;
+    return s;
+}
+
+/**
+ * settings_load reads the KEY=value lines of path into a new snapshot
+ * A malformed line is skipped.
+ * @returns the snapshot or NULL when path can't be read
+ */
+struct settings *settings_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+    {
+        printErrno(__func__, "Can't open %s", path);
+        return NULL;
+    }
+
+    struct settings *settings = calloc(1, sizeof(*settings));
+    if (settings == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate settings");
+        fclose(f);
+        return NULL;
+    }
+    size_t length = fread(settings->text, 1, SETTINGS_FILE_SIZE, f);
+    int failed = ferror(f) || length == SETTINGS_FILE_SIZE;
+    fclose(f);
+    if (failed)
+    {
+        printError(__func__, "Can't read %s, or it's over %d bytes", path, SETTINGS_FILE_SIZE - 1);
+        free(settings);
+        return NULL;
+    }
+    settings->text[length] = 0;
+
+    int lineNumber = 0;
+    char *next;
+    for (char *line = settings->text; line != NULL; line = next)
+    {
+        lineNumber++;
+        next = strchr(line, '\n');
+        if (next != NULL)
+            *next++ = 0;
+        line[strcspn(line, "\r")] = 0;
+        line += strspn(line, " \t");
+        if (*line == 0 || *line == '#')
+            continue;
+
+        size_t keyLength = strspn(line, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+        char *value = line[keyLength] == '=' && keyLength > 0 ? parseValue(line + keyLength + 1) : NULL;
+        if (value == NULL)
+        {
+            printWarning(__func__, "%s:%d: not KEY=value, ignored", path, lineNumber);
+            continue;
+        }
+        if (settings->count == SETTINGS_MAX)
+        {
+            printError(__func__, "%s: only %d settings are supported", path, SETTINGS_MAX);
+            break;
+        }
+        line[keyLength] = 0;
+        settings->keys[settings->count] = line;
+        settings->values[settings->count] = value;
+        settings->count++;
+    }
+    return settings;
+}
+
+void settings_free(struct settings *settings)
+{
+    free(settings);
+}
+
+/**
+ * settings_get looks key up in the snapshot, NULL for the environment
+ * @returns the value or NULL when it isn't set
+ */
+char *settings_get(const struct settings *settings, const char *key)
+{
+    if (settings == NULL)
+        return getenv(key);
+
+    // The last assignment wins, as in the shell
+    for (int i = settings->count - 1; i >= 0; i--)
+    {
+        if (!strcmp(settings->keys[i], key))
+            return settings->values[i];
+    }
+    return NULL;
+}
+
+/**
+ * settings_changed compares the value of key in two snapshots
+ * @returns 1 when it differs, unset and "" are different
+ */
+int settings_changed(const struct settings *a, const struct settings *b, const char *key)
+{
+    const char *before = settings_get(a, key);
+    const char *after = settings_get(b, key);
+    if (before == NULL || after == NULL)
+        return before != after;
+    return strcmp(before, after) != 0;
+}
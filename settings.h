@@ -0,0 +1,36 @@
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#define SETTINGS_PATH "/etc/DSMR/config.env"
+#define SETTINGS_MAX 64            // KEY="value" lines
+#define SETTINGS_FILE_SIZE (8 * 1024)
+
+/**
+ * Snapshot of config.env
+ *
+ * At startup systemd hands the file over as the environment, NULL stands
+ * for that snapshot. On SIGHUP the file itself (DSMR_CONFIG, default
+ * SETTINGS_PATH) is read into a new one. A snapshot never changes, the
+ * strings it hands out stay valid until settings_free(). A key the file
+ * doesn't set is unset, the environment only counts at startup: deleting
+ * a line returns the setting to its default.
+ *
+ * Usage:
+ * struct settings *next = settings_load(path);
+ * if (settings_changed(current, next, "INFLUX_HOST")) ...
+ * char *host = settings_get(next, "INFLUX_HOST");
+ */
+struct settings
+{
+    int count;
+    char *keys[SETTINGS_MAX]; // Into text
+    char *values[SETTINGS_MAX];
+    char text[SETTINGS_FILE_SIZE];
+};
+
+struct settings *settings_load(const char *path);
+void settings_free(struct settings *settings);
+char *settings_get(const struct settings *settings, const char *key);
+int settings_changed(const struct settings *a, const struct settings *b, const char *key);
+
+#endif
@@ -0,0 +1,99 @@
+/**
+ * shard.c - Routes meters to Influx endpoints by consistent hashing
+ *
+ * Usage:
+ * const char *names[] = {"influx1:8086", "influx2:8086"};
+ * struct shard_ring ring;
+ * shard_ring_init(&ring, names, 2);
+ * int shard = shard_lookup(&ring, telegram.equipmentId, telegram.equipmentIdLength);
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "shard.h"
+
+/**
+ * hash is FNV-1a with a final avalanche, plain FNV clusters similar
+ * keys like "host#1" and "host#2" on the ring
+ */
+static unsigned int hash(const char *key, int length)
+{
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int comparePoints(const void *a, const void *b)
+{
+    const struct shard_point *x = a, *y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->shard - y->shard; // Ties resolve the same way every time
+}
+
+/**
+ * shard_ring_init places SHARD_VNODES points per endpoint name
+ * @returns 1 on success, 0 if there are too many or no endpoints
+ */
+int shard_ring_init(struct shard_ring *ring, const char *names[], int count)
+{
+    if (count < 1 || count > SHARD_MAX)
+    {
+        printError(__func__, "Need 1 to %d Influx endpoints, got %d", SHARD_MAX, count);
+        return 0;
+    }
+
+    ring->count = 0;
+    ring->shards = count;
+    for (int shard = 0; shard < count; shard++)
+    {
+        for (int i = 0; i < SHARD_VNODES; i++)
+        {
+            char point[320];
+            int length = snprintf(point, sizeof(point), "%s#%d", names[shard], i);
+            if (length >= (int)sizeof(point))
+                length = sizeof(point) - 1;
+
+            ring->points[ring->count++] = (struct shard_point){
+                .hash = hash(point, length),
+                .shard = shard,
+            };
+        }
+    }
+    qsort(ring->points, ring->count, sizeof(struct shard_point), comparePoints);
+    return 1;
+}
+
+/**
+ * shard_lookup
+ * @returns the shard owning key, the first point at or after its hash
+ */
+int shard_lookup(const struct shard_ring *ring, const char *key, int length)
+{
+    if (ring->shards == 1)
+        return 0;
+
+    unsigned int h = hash(key, length);
+    int low = 0, high = ring->count;
+    while (low < high)
+    {
+        int middle = (low + high) / 2;
+        if (ring->points[middle].hash < h)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    // Past the last point wraps around to the first
+    return ring->points[low == ring->count ? 0 : low].shard;
+}
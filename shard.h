@@ -0,0 +1,31 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#define SHARD_MAX 16     // Influx endpoints
+#define SHARD_VNODES 160 // Points per endpoint, keeps the spread within a few %
+
+struct shard_point
+{
+    unsigned int hash;
+    int shard;
+};
+
+/**
+ * Consistent hash ring over the Influx endpoints
+ *
+ * Every endpoint owns SHARD_VNODES points derived from its name only, a
+ * meter belongs to the first point at or after the hash of its equipment
+ * identifier. Adding or removing an endpoint only moves the meters of
+ * the points that appear or disappear, about 1/n of them.
+ */
+struct shard_ring
+{
+    struct shard_point points[SHARD_MAX * SHARD_VNODES];
+    int count;
+    int shards;
+};
+
+int shard_ring_init(struct shard_ring *ring, const char *names[], int count);
+int shard_lookup(const struct shard_ring *ring, const char *key, int length);
+
+#endif
@@ -0,0 +1,160 @@
+/**
+ * shm.c - Publishes the latest decoded telegram in shared memory
+ *
+ * See dsmr_shm.h for the layout and the reader side.
+ *
+ * Usage:
+ * struct shm_config config;
+ * shm_init(&config, DSMR_SHM_NAME);
+ * shm_publish(&config, &telegram);
+ */
+#include <stddef.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "dsmr_shm.h"
+#include "shm.h"
+
+/**
+ * Published values and where they go in struct dsmr_shm_values
+ */
+static const struct
+{
+    const char *name;
+    size_t offset;
+    unsigned int bit;
+    int timestamp; // Copied as Unix time instead of scaled
+} shmFields[] = {
+    {"meter_electricity_delivered_to_client_tariff_1",
+     offsetof(struct dsmr_shm_values, energy_delivered_tariff_1), DSMR_SHM_ENERGY_DELIVERED_TARIFF_1, 0},
+    {"meter_electricity_delivered_to_client_tariff_2",
+     offsetof(struct dsmr_shm_values, energy_delivered_tariff_2), DSMR_SHM_ENERGY_DELIVERED_TARIFF_2, 0},
+    {"meter_electricity_delivered_by_client_tariff_1",
+     offsetof(struct dsmr_shm_values, energy_received_tariff_1), DSMR_SHM_ENERGY_RECEIVED_TARIFF_1, 0},
+    {"meter_electricity_delivered_by_client_tariff_2",
+     offsetof(struct dsmr_shm_values, energy_received_tariff_2), DSMR_SHM_ENERGY_RECEIVED_TARIFF_2, 0},
+    {"actual_electricity_power_delivered",
+     offsetof(struct dsmr_shm_values, power_delivered), DSMR_SHM_POWER_DELIVERED, 0},
+    {"actual_electricity_power_received",
+     offsetof(struct dsmr_shm_values, power_received), DSMR_SHM_POWER_RECEIVED, 0},
+    {"instantaneous_active_positive_power_L1",
+     offsetof(struct dsmr_shm_values, power_delivered_l1), DSMR_SHM_POWER_DELIVERED_L1, 0},
+    {"instantaneous_active_positive_power_L2",
+     offsetof(struct dsmr_shm_values, power_delivered_l2), DSMR_SHM_POWER_DELIVERED_L2, 0},
+    {"instantaneous_active_positive_power_L3",
+     offsetof(struct dsmr_shm_values, power_delivered_l3), DSMR_SHM_POWER_DELIVERED_L3, 0},
+    {"instantaneous_active_negative_power_L1",
+     offsetof(struct dsmr_shm_values, power_received_l1), DSMR_SHM_POWER_RECEIVED_L1, 0},
+    {"instantaneous_active_negative_power_L2",
+     offsetof(struct dsmr_shm_values, power_received_l2), DSMR_SHM_POWER_RECEIVED_L2, 0},
+    {"instantaneous_active_negative_power_L3",
+     offsetof(struct dsmr_shm_values, power_received_l3), DSMR_SHM_POWER_RECEIVED_L3, 0},
+    {"maximum_demand_running_month_value",
+     offsetof(struct dsmr_shm_values, max_demand_month), DSMR_SHM_MAX_DEMAND_MONTH, 0},
+    {"maximum_demand_running_month_timestamp",
+     offsetof(struct dsmr_shm_values, max_demand_month_timestamp), DSMR_SHM_MAX_DEMAND_MONTH, 1},
+};
+#define shmFieldsLen (int)(sizeof(shmFields) / sizeof(shmFields[0]))
+
+/**
+ * shm_init creates and maps the shared memory segment
+ * @returns 1 on success, 0 on error (publishing is then disabled)
+ */
+int shm_init(struct shm_config *config, const char *name)
+{
+    config->shm = NULL;
+
+    for (int i = 0; i < shmFieldsLen; i++)
+    {
+        config->index[i] = dsmr_field_index(shmFields[i].name);
+        if (config->index[i] == -1)
+            printError(__func__, "Field '%s' isn't decoded, it won't be published", shmFields[i].name);
+    }
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd == -1)
+    {
+        printErrno(__func__, "Couldn't open shared memory %s", name);
+        return 0;
+    }
+
+    if (ftruncate(fd, sizeof(struct dsmr_shm)) == -1)
+    {
+        printErrno(__func__, "Couldn't size shared memory %s", name);
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, sizeof(struct dsmr_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        printErrno(__func__, "Couldn't map shared memory %s", name);
+        return 0;
+    }
+
+    // Readers check the header before trusting the values
+    struct dsmr_shm *shm = map;
+    __atomic_store_n(&shm->sequence, 0, __ATOMIC_RELAXED);
+    memset(&shm->values, 0, sizeof(shm->values));
+    shm->size = sizeof(struct dsmr_shm_values);
+    shm->version = DSMR_SHM_VERSION;
+    __atomic_store_n(&shm->magic, DSMR_SHM_MAGIC, __ATOMIC_RELEASE);
+
+    config->shm = shm;
+    printLog(__func__, "Publishing latest values in /dev/shm%s", name);
+    return 1;
+}
+
+/**
+ * shm_publish copies the telegram into the segment under the seqlock
+ * Never waits for readers.
+ */
+void shm_publish(struct shm_config *config, struct dsmr_telegram *telegram)
+{
+    struct dsmr_shm *shm = config->shm;
+    if (shm == NULL)
+        return;
+
+    uint64_t sequence = shm->sequence;
+    __atomic_store_n(&shm->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    struct dsmr_shm_values *values = &shm->values;
+    values->timestamp = telegram->timestamp;
+    values->telegrams++;
+    values->present = 0;
+    for (int i = 0; i < shmFieldsLen; i++)
+    {
+        if (config->index[i] == -1)
+            continue;
+
+        struct dsmr_value *v = telegram->values + config->index[i];
+        if (!v->present)
+            continue;
+
+        int64_t *dst = (int64_t *)((char *)values + shmFields[i].offset);
+        *dst = shmFields[i].timestamp ? v->value : dsmr_milli(v);
+        values->present |= shmFields[i].bit;
+    }
+
+    __atomic_store_n(&shm->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * shm_close unmaps and removes the segment
+ */
+void shm_close(struct shm_config *config, const char *name)
+{
+    if (config->shm == NULL)
+        return;
+    munmap(config->shm, sizeof(struct dsmr_shm));
+    shm_unlink(name);
+    config->shm = NULL;
+}
@@ -0,0 +1,17 @@
+#ifndef SHM_H
+#define SHM_H
+
+#include "DSMR.h"
+#include "dsmr_shm.h"
+
+struct shm_config
+{
+    struct dsmr_shm *shm; // NULL when publishing is disabled
+    int index[DSMR_MAX_VALUES]; // Field index per shmFields entry
+};
+
+int shm_init(struct shm_config *config, const char *name);
+void shm_publish(struct shm_config *config, struct dsmr_telegram *telegram);
+void shm_close(struct shm_config *config, const char *name);
+
+#endif
@@ -0,0 +1,152 @@
+/**
+ * spool.c - Overflow file of an Influx endpoint, see spool.h
+ *
+ * Plain line protocol, appended with write() and read back with pread()
+ * from sentOffset. Nothing before readOffset is dropped until Influx has
+ * answered for it. The caller serializes access, server.c holds the lock
+ * of the endpoint.
+ */
+#define _GNU_SOURCE // memrchr
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "spool.h"
+
+/**
+ * spool_init opens the spool of the endpoint name ("host:port") in dir
+ * A NULL or empty dir disables spooling.
+ * @returns 1 on success, 0 on error or when disabled
+ */
+int spool_init(struct spool *spool, const char *dir, const char *name)
+{
+    memset(spool, 0, sizeof(*spool));
+    spool->fd = -1;
+    if (dir == NULL || !*dir)
+        return 0;
+
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        printErrno(__func__, "Can't create %s", dir);
+        return 0;
+    }
+
+    // "[::1]:8086" and "influx1:8086" become file names
+    int length = snprintf(spool->path, sizeof(spool->path), "%s/", dir);
+    for (const char *c = name; *c && length < (int)sizeof(spool->path) - 4; c++)
+        spool->path[length++] = isalnum((unsigned char)*c) || *c == '.' || *c == '-' ? *c : '_';
+    memcpy(spool->path + length, ".lp", 4);
+
+    spool->fd = open(spool->path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (spool->fd == -1)
+    {
+        printErrno(__func__, "Can't open %s", spool->path);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(spool->fd, &st) == -1)
+    {
+        printErrno(__func__, "Can't stat %s", spool->path);
+        spool_close(spool);
+        return 0;
+    }
+    spool->size = st.st_size;
+    if (spool->size > 0)
+        printLog(__func__, "%s holds %lld bytes from before, sending them first",
+                 spool->path, (long long)spool->size);
+    return 1;
+}
+
+/**
+ * spool_write appends complete lines
+ * @returns 1 on success, 0 if the lines were dropped
+ */
+int spool_write(struct spool *spool, const char *lines, int length)
+{
+    if (spool->fd == -1)
+        return 0;
+
+    for (int written = 0; written < length;)
+    {
+        ssize_t n = write(spool->fd, lines + written, length - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            // Cut back to the last complete line
+            printErrno(__func__, "Can't write %s, dropping %d bytes", spool->path, length);
+            if (ftruncate(spool->fd, spool->size) == -1)
+                printErrno(__func__, "Can't truncate %s", spool->path);
+            return 0;
+        }
+        written += n;
+    }
+    spool->size += length;
+    return 1;
+}
+
+/**
+ * spool_read takes the oldest complete lines that haven't been sent and fit
+ * in size bytes, spool_sent() moves on past them once they're queued
+ * @returns the number of bytes in buffer, 0 when there is nothing (more)
+ */
+int spool_read(struct spool *spool, char *buffer, int size)
+{
+    if (spool->fd == -1 || spool->sentOffset == spool->size)
+        return 0;
+
+    off_t left = spool->size - spool->sentOffset;
+    ssize_t n = pread(spool->fd, buffer, left < size ? left : size, spool->sentOffset);
+    if (n == -1 && errno == EINTR)
+        return 0;
+
+    char *end = n > 0 ? memrchr(buffer, '\n', n) : NULL;
+    if (end == NULL)
+    {
+        // Unreadable, or a line no batch can take: give up on the rest
+        printError(__func__, "Can't read %s at %lld, dropping %lld bytes", spool->path,
+                   (long long)spool->sentOffset, (long long)left);
+        spool->sentOffset = spool->size;
+        return 0;
+    }
+    return end - buffer + 1;
+}
+
+/**
+ * spool_sent marks the length bytes spool_read() returned as queued
+ */
+void spool_sent(struct spool *spool, int length)
+{
+    spool->sentOffset += length;
+}
+
+/**
+ * spool_acked releases what has been sent, once Influx has answered for all
+ * of it, and truncates the file when nothing else is left
+ */
+void spool_acked(struct spool *spool)
+{
+    spool->readOffset = spool->sentOffset;
+    if (spool->fd == -1 || spool->readOffset < spool->size)
+        return;
+
+    // Appends go on at size when the file can't be emptied
+    if (ftruncate(spool->fd, 0) == -1)
+        printErrno(__func__, "Can't truncate %s", spool->path);
+    else
+        spool->readOffset = spool->sentOffset = spool->size = 0;
+}
+
+void spool_close(struct spool *spool)
+{
+    if (spool->fd != -1)
+        close(spool->fd);
+    spool->fd = -1;
+}
@@ -0,0 +1,54 @@
+#ifndef SPOOL_H
+#define SPOOL_H
+
+#include <sys/types.h>
+
+#define SPOOL_PATH_SIZE 512
+
+/**
+ * Overflow file of one Influx endpoint in server mode
+ *
+ * DSMR_SPOOL="/var/spool/DSMR" enables it. When the write queue of an
+ * endpoint is full, lines go to <dir>/<host>_<port>.lp instead of pushing
+ * out its oldest batch, and everything after them follows until the file
+ * has been read back, so the order holds. Once the endpoint takes batches
+ * again the file is replayed a few batches at a time. Each part stays in
+ * the file until Influx has answered for it, and the file is truncated
+ * when all of it is through. Lines left over from a previous run are sent
+ * first; a replay that was cut short sends some lines twice, Influx keeps
+ * one point per series and timestamp.
+ *
+ * Usage:
+ * struct spool spool;
+ * spool_init(&spool, "/var/spool/DSMR", "influx1:8086");
+ * if (spool_pending(&spool) || queueFull) spool_write(&spool, lines, length);
+ * int length = spool_read(&spool, buffer, sizeof(buffer)); // Whole lines
+ * if (influx_enqueue(&influx, buffer, length)) spool_sent(&spool, length);
+ * if (influx_drained(&influx)) spool_acked(&spool);
+ */
+struct spool
+{
+    int fd; // -1 when spooling is disabled
+    char path[SPOOL_PATH_SIZE];
+    off_t readOffset; // Answered by Influx up to here
+    off_t sentOffset; // Queued up to here
+    off_t size;       // Written up to here
+};
+
+int spool_init(struct spool *spool, const char *dir, const char *name);
+int spool_write(struct spool *spool, const char *lines, int length);
+int spool_read(struct spool *spool, char *buffer, int size);
+void spool_sent(struct spool *spool, int length);
+void spool_acked(struct spool *spool);
+void spool_close(struct spool *spool);
+
+/**
+ * spool_pending tells whether lines are waiting in the file, new lines
+ * have to go behind them
+ */
+static inline int spool_pending(const struct spool *spool)
+{
+    return spool->fd != -1 && spool->readOffset < spool->size;
+}
+
+#endif
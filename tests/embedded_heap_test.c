@@ -0,0 +1,190 @@
+/**
+ * embedded_heap_test.c - The embedded profile runs without the heap
+ *
+ * Usage:
+ * embedded-heap-test capture.txt
+ *
+ * embedded_run() reads the capture a few times over as its serial port,
+ * against a platform layer that answers every request with a 204. The
+ * malloc() family of the whole process is interposed and counted from the
+ * second pass on, when everything is warm. The test fails when anything
+ * was allocated or when no telegram made it to the stand-in Influx.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "embedded.h"
+#include "platform.h"
+
+#define TEST_CAPTURE_SIZE (256 * 1024)
+#define TEST_PASSES 20
+#define TEST_HANDLE 3
+
+static const char response[] = "HTTP/1.1 204 No Content\r\n\r\n";
+
+static char capture[TEST_CAPTURE_SIZE];
+static int captureLength;
+static int captureOffset;
+static int passes;
+
+static int counting;
+static unsigned long allocations;
+static int pendingResponses;
+static unsigned long writes; // POST requests while counting
+
+/**
+ * The allocator of the process, counted while counting is set
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations += counting;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    allocations += counting && ptr != NULL;
+    __libc_free(ptr);
+}
+
+/**
+ * Platform layer: the capture is the serial port, Influx answers at once
+ */
+int platform_connect(const char *host, unsigned short port, int timeout)
+{
+    (void)host;
+    (void)port;
+    (void)timeout;
+    return TEST_HANDLE;
+}
+
+int platform_send(int handle, const char *head, size_t headLength,
+                  const char *body, size_t bodyLength)
+{
+    (void)handle;
+    (void)body;
+    (void)bodyLength;
+    if (counting && headLength > 4 && !memcmp(head, "POST", 4))
+        writes++;
+    pendingResponses++;
+    return 1;
+}
+
+int platform_recv(int handle, char *buffer, size_t size, int timeout)
+{
+    (void)handle;
+    (void)timeout;
+    int length = 0;
+    while (pendingResponses > 0 && length + sizeof(response) - 1 <= size)
+    {
+        memcpy(buffer + length, response, sizeof(response) - 1);
+        length += sizeof(response) - 1;
+        pendingResponses--;
+    }
+    return length;
+}
+
+void platform_close(int handle)
+{
+    (void)handle;
+}
+
+int platform_serial_read(char *buffer, int size, int timeoutMs)
+{
+    (void)timeoutMs;
+    if (captureOffset == captureLength)
+    {
+        captureOffset = 0;
+        passes++;
+        counting = passes < TEST_PASSES;
+        if (!counting)
+            return -1;
+    }
+
+    int n = captureLength - captureOffset < size ? captureLength - captureOffset : size;
+    memcpy(buffer, capture + captureOffset, n);
+    captureOffset += n;
+    return n;
+}
+
+const char *platform_setting(const char *name)
+{
+    static const char *const settings[][2] = {
+        {"INFLUX_HOST", "influx"},
+        {"INFLUX_TOKEN", "token"},
+        {"INFLUX_ORG", "org"},
+        {"INFLUX_BUCKET", "bucket"},
+        {"DSMR_LOG_LEVEL", "warning"},
+    };
+    for (size_t i = 0; i < sizeof(settings) / sizeof(settings[0]); i++)
+    {
+        if (!strcmp(name, settings[i][0]))
+            return settings[i][1];
+    }
+    return NULL;
+}
+
+void platform_log(int level, const char *prefix, const char *message, int length)
+{
+    (void)level;
+    struct iovec iov[] = {
+        {.iov_base = (char *)prefix, .iov_len = strlen(prefix)},
+        {.iov_base = ":\t", .iov_len = 2},
+        {.iov_base = (char *)message, .iov_len = length},
+        {.iov_base = "\n", .iov_len = 1},
+    };
+    writev(STDERR_FILENO, iov, 4);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s capture.txt\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    int fd = open(argv[1], O_RDONLY);
+    if (fd == -1)
+    {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    captureLength = read(fd, capture, sizeof(capture));
+    close(fd);
+    if (captureLength <= 0 || captureLength == sizeof(capture))
+    {
+        fprintf(stderr, "%s: empty or bigger than %d bytes\n", argv[1], TEST_CAPTURE_SIZE);
+        return EXIT_FAILURE;
+    }
+
+    if (!embedded_init())
+        return EXIT_FAILURE;
+    embedded_run();
+    counting = 0;
+
+    printf("%d passes over %s: %lu write requests, %lu heap calls\n",
+           TEST_PASSES - 1, argv[1], writes, allocations);
+    return allocations == 0 && writes > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,288 @@
+/**
+ * p1parser_test.c - p1_feed() against decodeLine() on the telegram corpus
+ *
+ * Usage:
+ * p1parser-test telegrams.txt ...
+ *
+ * Every capture is decoded line by line with decodeLine() for reference,
+ * then fed to the incremental parser in one buffer, a byte at a time and
+ * in random chunks. For every telegram the line protocol of the
+ * lp_field() calls and the decoded dsmr_telegram have to match the
+ * reference.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DSMR.h"
+#include "lineprotocol.h"
+#include "p1parser.h"
+
+#define TEST_CAPTURE_SIZE (64 * 1024)
+#define TEST_TELEGRAMS 16        // Per capture
+#define TEST_LINE_SIZE 4096      // Line protocol of one telegram
+#define TEST_RANDOM_SEEDS 16     // Runs with random chunk sizes
+#define TEST_RANDOM_CHUNK 64     // Largest random chunk
+
+struct decoded
+{
+    char line[TEST_LINE_SIZE];
+    int length;
+    struct dsmr_telegram telegram;
+};
+
+/**
+ * Output of one run over a capture
+ */
+struct run
+{
+    struct decoded telegrams[TEST_TELEGRAMS];
+    int count;
+    int crcErrors;
+
+    struct lp_encoder encoder;
+    char arena[TEST_LINE_SIZE];
+    struct dsmr_telegram telegram;
+};
+
+static struct run reference, parsed;
+
+static void beginRun(struct run *run)
+{
+    run->count = run->crcErrors = 0;
+    lp_init_buffer(&run->encoder, "meter", "meter=test", run->arena, sizeof(run->arena));
+    dsmr_telegram_reset(&run->telegram);
+}
+
+/**
+ * endTelegram keeps the line protocol and the telegram that just ended
+ */
+static void endTelegram(struct run *run)
+{
+    struct lp_encoder *enc = &run->encoder;
+    if (run->count == TEST_TELEGRAMS || !lp_end(enc, run->telegram.timestamp))
+        return;
+
+    struct decoded *d = run->telegrams + run->count++;
+    d->length = enc->length;
+    memcpy(d->line, enc->buffer, enc->length);
+    d->telegram = run->telegram;
+}
+
+/**
+ * decodeReference runs decodeLine() over the lines of the capture, the
+ * way run() does
+ */
+static void decodeReference(const char *capture, int length)
+{
+    beginRun(&reference);
+    struct lp_encoder *enc = &reference.encoder;
+    char line[TEST_CAPTURE_SIZE];
+    int inTelegram = 0;
+
+    for (const char *start = capture, *end = capture + length; start < end;)
+    {
+        const char *newline = memchr(start, '\n', end - start);
+        int lineLength = (newline != NULL ? newline : end) - start;
+        memcpy(line, start, lineLength);
+        start += lineLength + 1;
+        if (lineLength && line[lineLength - 1] == '\r')
+            lineLength--;
+        line[lineLength] = 0;
+        if (lineLength == 0)
+            continue;
+
+        if (line[0] == '/')
+        {
+            dsmr_telegram_reset(&reference.telegram);
+            lp_reset(enc);
+            lp_begin(enc);
+            inTelegram = 1;
+            continue;
+        }
+        if (!inTelegram)
+            continue;
+
+        decodeLine(enc, &reference.telegram, line, lineLength);
+        if (line[0] == '!')
+        {
+            endTelegram(&reference);
+            inTelegram = 0;
+        }
+    }
+}
+
+/**
+ * onP1 encodes the fields like the embedded profile does
+ */
+static void onP1(struct p1_parser *parser, enum p1_event event, int index,
+                 const char *value, int length)
+{
+    struct run *run = parser->context;
+    struct lp_encoder *enc = &run->encoder;
+    switch (event)
+    {
+    case P1_TELEGRAM:
+        lp_reset(enc);
+        lp_begin(enc);
+        break;
+    case P1_FIELD:
+    {
+        const struct hashkeyval *kv = dsmr_field(index);
+        lp_field(enc, kv->key, kv->keylen, value, length);
+        break;
+    }
+    case P1_END:
+        endTelegram(run);
+        break;
+    case P1_CRC_ERROR:
+        run->crcErrors++;
+        break;
+    }
+}
+
+/**
+ * feed runs the parser over the capture in chunks of chunk bytes, 0 for
+ * random sizes from seed
+ */
+static void feed(const char *capture, int length, int chunk, unsigned int seed)
+{
+    beginRun(&parsed);
+    struct p1_parser parser;
+    p1_init(&parser, &parsed.telegram, onP1, &parsed);
+
+    for (int offset = 0; offset < length;)
+    {
+        int size = chunk ? chunk : 1 + rand_r(&seed) % TEST_RANDOM_CHUNK;
+        if (size > length - offset)
+            size = length - offset;
+        for (const char *data = capture + offset, *end = data + size; data < end;)
+            data += p1_feed(&parser, data, end - data);
+        offset += size;
+    }
+}
+
+static int sameValue(const struct dsmr_value *a, const struct dsmr_value *b)
+{
+    return a->present == b->present &&
+           (!a->present || (a->value == b->value && a->decimals == b->decimals));
+}
+
+/**
+ * differs compares what the decoders store in a telegram
+ * @returns the first field that differs or NULL
+ */
+static const char *differs(const struct dsmr_telegram *a, const struct dsmr_telegram *b)
+{
+    if (a->timestamp != b->timestamp)
+        return "timestamp";
+    for (int i = 0; i < DSMR_MAX_VALUES; i++)
+    {
+        if (!sameValue(a->values + i, b->values + i))
+            return dsmr_field_name(i) != NULL ? dsmr_field_name(i) : "values";
+    }
+
+    if (a->equipmentIdLength != b->equipmentIdLength ||
+        memcmp(a->equipmentId, b->equipmentId, a->equipmentIdLength))
+        return "equipmentId";
+
+    if (a->demandHistoryCount != b->demandHistoryCount)
+        return "demandHistoryCount";
+    for (int i = 0; i < a->demandHistoryCount; i++)
+    {
+        const struct dsmr_demand_month *x = a->demandHistory + i, *y = b->demandHistory + i;
+        if (x->period != y->period || x->peak != y->peak || x->value != y->value)
+            return "demandHistory";
+    }
+
+    for (int i = 0; i < DSMR_MBUS_CHANNELS; i++)
+    {
+        const struct dsmr_mbus *x = a->mbus + i, *y = b->mbus + i;
+        if (x->deviceType != y->deviceType || x->reading != y->reading ||
+            x->captured != y->captured || !sameValue(&x->value, &y->value) ||
+            strcmp(x->unit, y->unit))
+            return "mbus";
+    }
+    return NULL;
+}
+
+/**
+ * check compares the parser's run with the reference
+ * @returns 1 when they match
+ */
+static int check(const char *path, const char *how)
+{
+    if (parsed.crcErrors || parsed.count != reference.count)
+    {
+        printf("%s, %s: %d telegrams (%d CRC errors), decodeLine() found %d\n",
+               path, how, parsed.count, parsed.crcErrors, reference.count);
+        return 0;
+    }
+
+    for (int i = 0; i < reference.count; i++)
+    {
+        struct decoded *want = reference.telegrams + i, *got = parsed.telegrams + i;
+        if (got->length != want->length || memcmp(got->line, want->line, want->length))
+        {
+            printf("%s, %s: telegram %d\n  p1_feed:    %.*s  decodeLine: %.*s", path, how, i,
+                   got->length, got->line, want->length, want->line);
+            return 0;
+        }
+        const char *field = differs(&got->telegram, &want->telegram);
+        if (field != NULL)
+        {
+            printf("%s, %s: telegram %d differs in %s\n", path, how, i, field);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s telegrams.txt ...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!dsmr_init())
+        return EXIT_FAILURE;
+
+    static char capture[TEST_CAPTURE_SIZE];
+    int failed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        FILE *file = fopen(argv[i], "rb");
+        if (file == NULL)
+        {
+            perror(argv[i]);
+            return EXIT_FAILURE;
+        }
+        int length = fread(capture, 1, sizeof(capture), file);
+        fclose(file);
+
+        decodeReference(capture, length);
+        if (reference.count == 0)
+        {
+            printf("%s: no complete telegram\n", argv[i]);
+            failed++;
+            continue;
+        }
+
+        feed(capture, length, length, 0);
+        int ok = check(argv[i], "whole buffer");
+        feed(capture, length, 1, 0);
+        ok &= check(argv[i], "1 byte chunks");
+        for (unsigned int seed = 1; seed <= TEST_RANDOM_SEEDS; seed++)
+        {
+            char how[32];
+            snprintf(how, sizeof(how), "random chunks, seed %u", seed);
+            feed(capture, length, 0, seed);
+            ok &= check(argv[i], how);
+        }
+
+        printf("%s: %d telegrams %s\n", argv[i], reference.count, ok ? "match" : "differ");
+        failed += !ok;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
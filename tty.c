@@ -19,10 +19,32 @@
 #include <termios.h> // for terminal attributes
 // #include <sys/ioctl.h> // ioctl for exclusive access
 
-#include <sys/select.h>
 #include <time.h>
 
+#include <sys/inotify.h>
+#include <poll.h>
+#include <errno.h>
+
 #include "common.h"
+#include "tty.h"
+#include "ioloop.h"
+
+// Rescan without an inotify event, in case udev renamed instead of created
+#define TTY_RESCAN_SECONDS 30
+#define TTY_BY_ID "/dev/serial/by-id"
+
+// Listen this long per serial setting, DSMR 2.2 to 4 send every 10s
+#define TTY_DETECT_SECONDS 12
+
+// Serial setting of setupTTY(), kept for reopenTTY()
+static enum tty_mode ttyMode = TTY_115200_8N1;
+
+static void detectStep(int ttyfd, const char *line, int length);
+
+// Autodetection armed by detectTTY(), stepped by readTTY()
+static int detecting;
+static int detectTried;      // Settings that gave up
+static time_t detectDeadline; // 0 until the first read
 
 /**
  * findAndOpenTTYUSB finds the first available ttyUSB in /dev
@@ -30,6 +52,17 @@
  */
 int findAndOpenTTYUSB(void)
 {
+    // A fixed device, or the pty of dsmr-generate or dsmr-loadtest, skips the search
+    char *fixedPath = getenv("DSMR_TTY");
+    if (fixedPath != NULL && *fixedPath)
+    {
+        printLog(__func__, "Using %s", fixedPath);
+        int ttyfd = open(fixedPath, O_RDONLY | O_NOCTTY);
+        if (ttyfd == -1)
+            printErrno(__func__, "Could not open '%s'", fixedPath);
+        return ttyfd;
+    }
+
     /**
      * Find first available ttyUSB*
      */
@@ -127,9 +160,16 @@ int setupTTY(int ttyfd)
      * - no output processing
      * - force 8 bit input
      */
-    config.c_cflag &= ~(CSIZE | PARENB);
+    config.c_cflag &= ~(CSIZE | PARENB | PARODD);
     config.c_cflag |= CS8;
 
+    // DSMR 2.2 and 3: 7 data bits, even parity
+    if (ttyMode == TTY_9600_7E1)
+    {
+        config.c_cflag &= ~CSIZE;
+        config.c_cflag |= CS7 | PARENB;
+    }
+
     /**
      * Ine input byte is enough to return from read()
      * Inter-character timer off
@@ -140,13 +180,14 @@ int setupTTY(int ttyfd)
     /**
      * Communication speed
      */
-    if (cfsetospeed(&config, B115200) == -1)
+    speed_t speed = ttyMode == TTY_9600_7E1 ? B9600 : B115200;
+    if (cfsetospeed(&config, speed) == -1)
     {
         printErrno(__func__, "Couldn't set output speed of TTY");
         return -1;
     }
     // set ispeed to 0, which matches the ospeed
-    if (cfsetispeed(&config, B115200) == -1)
+    if (cfsetispeed(&config, speed) == -1)
     {
         printErrno(__func__, "Couldn't set input speed of TTY");
         return -1;
@@ -176,6 +217,7 @@ int setupTTY(int ttyfd)
  */
 int closeTTY(int ttyfd)
 {
+    io_forget(ttyfd);
     return close(ttyfd);
 }
 
@@ -185,32 +227,215 @@ int closeTTY(int ttyfd)
  */
 int readTTY(int ttyfd, char *buffer, size_t bufferlength)
 {
+    int n = io_read(ttyfd, buffer, bufferlength, 2000);
+    if (n == 0)
+    {
+        printDebug(__func__, "Timeout");
+        if (detecting)
+            detectStep(ttyfd, buffer, 0);
+        return n;
+    }
+    if (n < 0)
+    {
+        // EOF or EIO: the USB adapter is gone
+        if (errno == 0)
+            errno = ENODEV;
+        return -1;
+    }
+    // Set 0 to last character to remove the '\n'
+    buffer[n > 1 ? n - 2 : 0] = 0;
+    if (detecting)
+        detectStep(ttyfd, buffer, n - 1);
+    return n - 1;
+}
 
-    struct timeval tv =
-        {
-            .tv_sec = 2,
-        };
-    // Init FD set
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(ttyfd, &fds);
+/**
+ * isHeader
+ * @returns 1 when line is an identification line, /XXX5...
+ */
+static int isHeader(const char *line, int length)
+{
+    if (length < 5 || line[0] != '/')
+        return 0;
+    for (int i = 1; i < 4; i++)
+    {
+        char c = line[i];
+        if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')))
+            return 0;
+    }
+    return line[4] >= '0' && line[4] <= '9';
+}
 
-    int f;
+/**
+ * detectTTY finds the serial setting the meter talks from the lines
+ * readTTY() returns, trying each setting until an identification line
+ * comes through. Nothing waits for it and nothing read is thrown away.
+ * Without one the port is left at 115200 8N1, the meter may just not be
+ * sending yet.
+ */
+void detectTTY(void)
+{
+    detecting = 1;
+    detectTried = 0;
+    detectDeadline = 0;
+}
 
-    int ret = select(ttyfd + 1, &fds, NULL, NULL, &tv);
-    if (ret < 0)
+/**
+ * detectStep looks at one line, length 0 after a timeout, and moves on to
+ * the next setting when the current one had its TTY_DETECT_SECONDS
+ */
+static void detectStep(int ttyfd, const char *line, int length)
+{
+    if (length > 0 && isHeader(line, strnlen(line, length)))
+    {
+        printLog(__func__, "Meter talks %s", ttyMode == TTY_9600_7E1 ? "9600 7E1" : "115200 8N1");
+        detecting = 0;
+        return;
+    }
+
+    time_t now = time(NULL);
+    if (detectDeadline == 0)
+        detectDeadline = now + TTY_DETECT_SECONDS;
+    if (now < detectDeadline)
+        return;
+
+    if (++detectTried == TTY_MODES)
     {
-        printErrno(__func__, "select failed");
-        return ret;
+        printWarning(__func__, "No identification line in %d s, using 115200 8N1",
+                     TTY_MODES * TTY_DETECT_SECONDS);
+        detecting = 0;
+        if (ttyMode == TTY_115200_8N1)
+            return;
+        setTTYMode(TTY_115200_8N1);
     }
-    if (ret == 0)
+    else
     {
-        printLog(__func__, "Timeout");
-        return ret;
+        setTTYMode((ttyMode + 1) % TTY_MODES);
+        detectDeadline = now + TTY_DETECT_SECONDS;
     }
+    io_forget(ttyfd); // A line in flight belongs to the previous setting
+    setupTTY(ttyfd);
+}
 
-    int n = read(ttyfd, buffer, bufferlength);
-    // Set 0 to last character to remove the '\n'
-    buffer[n - 2] = 0;
-    return n - 1;
+void setTTYMode(enum tty_mode mode)
+{
+    ttyMode = mode;
+}
+
+enum tty_mode getTTYMode(void)
+{
+    return ttyMode;
+}
+
+static int inotifyfd = -1;
+static int byIdWatch = -1;
+static time_t lastScan;
+
+/**
+ * addWatches (re)adds the directories a port shows up in, by-id only
+ * exists while a USB serial adapter is plugged in
+ */
+static void addWatches(void)
+{
+    const uint32_t mask = IN_CREATE | IN_ATTRIB | IN_MOVED_TO;
+    inotify_add_watch(inotifyfd, "/dev", mask);
+    byIdWatch = inotify_add_watch(inotifyfd, TTY_BY_ID, mask);
+
+    // A fixed device can live anywhere
+    char *fixedPath = getenv("DSMR_TTY");
+    char *slash = fixedPath != NULL ? strrchr(fixedPath, '/') : NULL;
+    if (slash != NULL && slash != fixedPath)
+    {
+        char dir[256];
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - fixedPath), fixedPath);
+        inotify_add_watch(inotifyfd, dir, mask);
+    }
+}
+
+/**
+ * watchTTY starts watching /dev for the port to come back after a
+ * reseated cable, before it can disappear so no event is missed
+ * @returns 1 on success, 0 when inotify isn't available
+ */
+int watchTTY(void)
+{
+    inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotifyfd == -1)
+    {
+        printErrno(__func__, "inotify_init1 failed, no hot-plug support");
+        return 0;
+    }
+    addWatches();
+    return 1;
+}
+
+/**
+ * isPortEvent
+ * @returns 1 when the inotify event could be our port appearing
+ */
+static int isPortEvent(struct inotify_event *event)
+{
+    if (event->wd == byIdWatch || (event->mask & IN_Q_OVERFLOW))
+        return 1;
+    if (!event->len)
+        return 0;
+    if (!strncmp(event->name, "ttyUSB", 6) || !strcmp(event->name, "serial"))
+        return 1;
+
+    char *fixedPath = getenv("DSMR_TTY");
+    char *name = fixedPath != NULL ? strrchr(fixedPath, '/') : NULL;
+    return name != NULL && !strcmp(event->name, name + 1);
+}
+
+/**
+ * reopenTTY waits up to timeoutMs for the port to reappear and sets it
+ * up again. Call it in a loop and keep the network going in between.
+ * udev creates the node before it fixes its permissions and links it in
+ * by-id, so a failed open is retried on the next event.
+ * @returns the set up file descriptor or -1 when it isn't back yet
+ */
+int reopenTTY(int timeoutMs)
+{
+    int found = 0;
+    if (inotifyfd != -1)
+    {
+        struct pollfd pfd = {.fd = inotifyfd, .events = POLLIN};
+        if (poll(&pfd, 1, timeoutMs) > 0)
+        {
+            char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t n;
+            while ((n = read(inotifyfd, events, sizeof(events))) > 0)
+            {
+                for (char *p = events; p < events + n;)
+                {
+                    struct inotify_event *event = (struct inotify_event *)p;
+                    found |= isPortEvent(event);
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+            // by-id disappears with the last adapter, watch it again
+            if (found)
+                addWatches();
+        }
+    }
+    else
+    {
+        poll(NULL, 0, timeoutMs);
+    }
+
+    time_t now = time(NULL);
+    if (!found && now - lastScan < TTY_RESCAN_SECONDS)
+        return -1;
+    lastScan = now;
+
+    int ttyfd = findAndOpenTTYUSB();
+    if (ttyfd == -1)
+        return -1;
+    if (setupTTY(ttyfd) == -1)
+    {
+        closeTTY(ttyfd);
+        return -1;
+    }
+    printLog(__func__, "Serial port is back");
+    return ttyfd;
 }
\ No newline at end of file
@@ -1,8 +1,22 @@
 #ifndef TTY_H
 #define TTY_H
 
+enum tty_mode
+{
+    TTY_115200_8N1, // DSMR 4, 5 and e-MUCS
+    TTY_9600_7E1,   // DSMR 2.2 and 3
+    TTY_MODES,
+};
+
 int findAndOpenTTYUSB(void);
 int setupTTY(int);
 int closeTTY(int);
 int readTTY(int, char *, size_t);
+int watchTTY(void);
+int reopenTTY(int timeoutMs);
+void detectTTY(void);
+void setTTYMode(enum tty_mode mode);
+enum tty_mode getTTYMode(void);
+
+#define TTY_REOPEN_POLL_MS 100 // Influx is pumped between the waits
 #endif
\ No newline at end of file
@@ -0,0 +1,233 @@
+/**
+ * udp.c - Line protocol to an Influx v1 or Telegraf UDP listener, see udp.h
+ *
+ * Usage:
+ * struct udp_config udp;
+ * udp_init(&udp, "127.0.0.1", 8089);
+ * udp_enqueue(&udp, lines, length); // As often as needed
+ * udp_flush(&udp);                  // After every telegram
+ */
+#define _GNU_SOURCE // sendmmsg
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "common.h"
+#include "udp.h"
+
+#define UDP_DEFAULT_PAYLOAD 1472 // Ethernet MTU - IPv4 and UDP headers
+
+/**
+ * pathPayload asks the kernel for the path MTU of the connected socket
+ * @returns the UDP payload that fits in one packet
+ */
+static int pathPayload(int sockfd, int family)
+{
+    int mtu = 0;
+    socklen_t size = sizeof(mtu);
+    int ret = family == AF_INET6
+                  ? getsockopt(sockfd, IPPROTO_IPV6, IPV6_MTU, &mtu, &size)
+                  : getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &size);
+    if (ret == -1 || mtu <= 0)
+        return UDP_DEFAULT_PAYLOAD;
+
+    int payload = mtu - (family == AF_INET6 ? 40 : 20) - 8;
+    return payload > UDP_MAX_PAYLOAD ? UDP_MAX_PAYLOAD : payload;
+}
+
+/**
+ * udp_init connects a non-blocking UDP socket to host:port
+ * Nothing is sent, a listener that isn't there only shows up later as
+ * dropped datagrams.
+ * @returns 1 on success, 0 on error
+ */
+int udp_init(struct udp_config *config, char *host, unsigned short port)
+{
+    memset(config, 0, sizeof(*config));
+    config->sockfd = -1;
+    config->host = host;
+    config->port = port;
+
+    char service[6];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM};
+    struct addrinfo *servinfo;
+    int ret = getaddrinfo(host, service, &hints, &servinfo);
+    if (ret != 0)
+    {
+        printError(__func__, "getaddrinfo failed: %s", gai_strerror(ret));
+        return 0;
+    }
+
+    int family = AF_UNSPEC;
+    for (struct addrinfo *sip = servinfo; sip != NULL; sip = sip->ai_next)
+    {
+        int sockfd = socket(sip->ai_family, sip->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                            sip->ai_protocol);
+        if (sockfd == -1)
+            continue;
+        if (connect(sockfd, sip->ai_addr, sip->ai_addrlen) == -1)
+        {
+            close(sockfd);
+            continue;
+        }
+        config->sockfd = sockfd;
+        family = sip->ai_family;
+        break;
+    }
+    freeaddrinfo(servinfo);
+    if (config->sockfd == -1)
+    {
+        printErrno(__func__, "Couldn't set up a UDP socket to %s:%u", host, port);
+        return 0;
+    }
+
+    config->buffer = malloc(UDP_BUFFER_SIZE);
+    if (config->buffer == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate the datagram buffer");
+        close(config->sockfd);
+        config->sockfd = -1;
+        return 0;
+    }
+    config->payload = pathPayload(config->sockfd, family);
+
+    printLog(__func__, "Sending line protocol to udp://%s:%u, %d bytes per datagram",
+             host, port, config->payload);
+    return 1;
+}
+
+/**
+ * hasTimestamp checks whether line ends in a timestamp: digits behind an
+ * unescaped space, a field would have its '='
+ */
+static int hasTimestamp(const char *line, int length)
+{
+    int digits = 0;
+    while (digits < length && line[length - 1 - digits] >= '0' && line[length - 1 - digits] <= '9')
+        digits++;
+    int space = length - 1 - digits;
+    return digits > 0 && space > 0 && line[space] == ' ' && line[space - 1] != '\\';
+}
+
+/**
+ * udp_enqueue packs complete lines into datagrams
+ * Timestamps are in seconds, the listeners default to nanoseconds: nine
+ * zeros are appended on the way in.
+ * Flushes first when the buffer or the datagrams run out.
+ * @returns 1 on success, 0 if a line was dropped for not fitting a datagram
+ */
+int udp_enqueue(struct udp_config *config, const char *lines, int length)
+{
+    int ok = 1;
+    while (length > 0)
+    {
+        const char *newline = memchr(lines, '\n', length);
+        int line = newline != NULL ? newline - lines + 1 : length;
+        int body = newline != NULL ? line - 1 : line;
+        int zeros = hasTimestamp(lines, body) ? UDP_NS_DIGITS : 0;
+        int size = line + zeros;
+        if (size > config->payload)
+        {
+            printError(__func__, "Dropping a %d byte line, datagrams hold %d", size, config->payload);
+            ok = 0;
+        }
+        else
+        {
+            if (config->length + size > UDP_BUFFER_SIZE)
+                udp_flush(config);
+            struct iovec *current = config->count > 0 ? config->datagrams + config->count - 1 : NULL;
+            if (current == NULL || current->iov_len + size > (size_t)config->payload)
+            {
+                // A new datagram
+                if (config->count == UDP_DATAGRAMS)
+                    udp_flush(config);
+                current = config->datagrams + config->count++;
+                current->iov_base = config->buffer + config->length;
+                current->iov_len = 0;
+            }
+            char *dst = config->buffer + config->length;
+            memcpy(dst, lines, body);
+            memset(dst + body, '0', zeros);
+            if (newline != NULL)
+                dst[body + zeros] = '\n';
+            config->length += size;
+            current->iov_len += size;
+        }
+        lines += line;
+        length -= line;
+    }
+    return ok;
+}
+
+/**
+ * udp_flush sends every datagram with one sendmmsg() and never waits
+ * What the socket doesn't take right away is dropped.
+ * @returns the number of datagrams sent
+ */
+int udp_flush(struct udp_config *config)
+{
+    int count = config->count;
+    if (count == 0)
+        return 0;
+
+    struct mmsghdr messages[UDP_DATAGRAMS];
+    memset(messages, 0, count * sizeof(*messages));
+    for (int i = 0; i < count; i++)
+    {
+        messages[i].msg_hdr.msg_iov = config->datagrams + i;
+        messages[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int sent = 0;
+    int refused = 0;
+    while (sent < count)
+    {
+        int n = sendmmsg(config->sockfd, messages + sent, count - sent, MSG_DONTWAIT);
+        if (n > 0)
+        {
+            sent += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (errno != config->error)
+            printErrno(__func__, "Dropping datagrams to %s:%u", config->host, config->port);
+        config->error = errno;
+        // The ICMP of an earlier datagram fails one send, not the next
+        if (n == -1 && errno == ECONNREFUSED && !refused++)
+            continue;
+        break;
+    }
+    if (sent == count && !refused && config->error)
+    {
+        printLog(__func__, "Sending to %s:%u again", config->host, config->port);
+        config->error = 0;
+    }
+
+    config->sent += sent;
+    config->dropped += count - sent;
+    config->length = 0;
+    config->count = 0;
+    return sent;
+}
+
+/**
+ * udp_close sends what's queued and closes the socket
+ */
+void udp_close(struct udp_config *config)
+{
+    if (config->sockfd == -1)
+        return;
+    udp_flush(config);
+    close(config->sockfd);
+    config->sockfd = -1;
+    free(config->buffer);
+    config->buffer = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef UDP_H
+#define UDP_H
+
+#include <sys/uio.h>
+
+#define UDP_BUFFER_SIZE (256 * 1024) // Line protocol between two udp_flush()
+#define UDP_DATAGRAMS 64             // Datagrams per sendmmsg()
+#define UDP_MAX_PAYLOAD 65507        // IPv4 limit, the path MTU is usually lower
+#define UDP_NS_DIGITS 9              // Seconds to the listeners' default nanoseconds
+
+/**
+ * Fire-and-forget line protocol for an Influx v1 or Telegraf UDP listener
+ *
+ * Lines are packed into datagrams of up to the path MTU, a line is never
+ * split over two. udp_flush() hands all of them to the kernel with one
+ * sendmmsg() and never waits: whatever the socket can't take is dropped,
+ * nothing is acknowledged. Timestamps go out in nanoseconds, the default
+ * precision of the Influx v1 [[udp]] and Telegraf socket listeners.
+ */
+struct udp_config
+{
+    int sockfd;
+    char *host;
+    unsigned short port;
+    int payload; // Bytes per datagram
+
+    char *buffer; // UDP_BUFFER_SIZE, allocated by udp_init()
+    int length;
+    struct iovec datagrams[UDP_DATAGRAMS]; // Into buffer, the last one is being filled
+    int count;
+
+    unsigned long long sent, dropped; // Datagrams
+    int error;                        // errno of the last failed send, logged once
+};
+
+int udp_init(struct udp_config *config, char *host, unsigned short port);
+int udp_enqueue(struct udp_config *config, const char *lines, int length);
+int udp_flush(struct udp_config *config);
+void udp_close(struct udp_config *config);
+
+#endif
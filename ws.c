@@ -0,0 +1,804 @@
+/**
+ * ws.c - WebSocket live stream of decoded telegrams
+ *
+ * Usage:
+ * ws_start("8080");
+ * ws_publish(&telegram); // After every telegram, from the serial loop
+ *
+ * ws_publish() serializes the telegram once per format into a frame with
+ * its header in front; server frames aren't masked, so the same bytes go
+ * to every client. The frame is handed over to the stream thread, which
+ * queues a reference on each client and writes without blocking. Frame
+ * references are only counted on the stream thread. A frame the thread
+ * didn't pick up yet is replaced by the next telegram, viewers only want
+ * the latest one.
+ */
+#define _GNU_SOURCE // accept4, memmem
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "DSMR.h"
+#include "lineprotocol.h"
+#include "server.h"
+#include "ws.h"
+
+#define WS_EVENTS 64
+#define WS_HEADER_SIZE 10 // Longest server frame header
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+#define WS_OP_TEXT 0x1
+#define WS_OP_BINARY 0x2
+#define WS_OP_CLOSE 0x8
+#define WS_OP_PING 0x9
+#define WS_OP_PONG 0xA
+
+enum ws_format
+{
+    WS_JSON,
+    WS_BINARY,
+    WS_FORMATS,
+};
+
+/**
+ * A complete frame, shared by every client it is queued on
+ */
+struct ws_frame
+{
+    int refs;   // Counted on the stream thread only
+    int offset; // Start of the frame in data, the header is right aligned
+    int length; // Header and payload
+    char data[];
+};
+
+struct ws_client
+{
+    int fd;
+    int slot; // Index in clients
+    int open; // Handshake done
+    enum ws_format format;
+    int waiting; // EPOLLOUT is armed
+
+    // Send queue, sent bytes of the frame at head
+    struct ws_frame *queue[WS_CLIENT_QUEUE];
+    unsigned int head, tail;
+    int sent;
+
+    int inLength;
+    char in[WS_REQUEST_SIZE];
+};
+
+static int epfd = -1;
+static int listenfd = -1;
+static int wakefd = -1;
+static pthread_t thread;
+
+static struct ws_client *clients[WS_MAX_CLIENTS];
+static int clientCount;
+
+// Open clients per format, read by ws_publish() to skip unwatched formats
+static int subscribers[WS_FORMATS];
+// Frames handed from ws_publish() to the stream thread
+static struct ws_frame *pending[WS_FORMATS];
+
+/**
+ * sha1 of a short message, only used for the handshake
+ */
+static void sha1(const unsigned char *message, size_t length, unsigned char digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char block[64];
+    size_t total = (length + 8) / 64 + 1; // Blocks including the padding
+
+    for (size_t b = 0; b < total; b++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            size_t at = b * 64 + i;
+            block[i] = at < length ? message[at] : at == length ? 0x80 : 0;
+        }
+        if (b == total - 1)
+        {
+            unsigned long long bits = (unsigned long long)length * 8;
+            for (int i = 0; i < 8; i++)
+                block[63 - i] = bits >> (8 * i);
+        }
+
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++)
+            w[i] = (uint32_t)block[i * 4] << 24 | block[i * 4 + 1] << 16 | block[i * 4 + 2] << 8 | block[i * 4 + 3];
+        for (int i = 16; i < 80; i++)
+        {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+
+        uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (bb & c) | (~bb & d), k = 0x5A827999;
+            else if (i < 40)
+                f = bb ^ c ^ d, k = 0x6ED9EBA1;
+            else if (i < 60)
+                f = (bb & c) | (bb & d) | (c & d), k = 0x8F1BBCDC;
+            else
+                f = bb ^ c ^ d, k = 0xCA62C1D6;
+
+            uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = bb << 30 | bb >> 2;
+            bb = a;
+            a = t;
+        }
+        h[0] += a;
+        h[1] += bb;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    for (int i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/**
+ * base64 encodes src into dst, which is terminated
+ * @returns the encoded length
+ */
+static int base64(char *dst, const unsigned char *src, int length)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int n = 0;
+    for (int i = 0; i < length; i += 3)
+    {
+        uint32_t v = src[i] << 16 | (i + 1 < length ? src[i + 1] << 8 : 0) | (i + 2 < length ? src[i + 2] : 0);
+        dst[n++] = alphabet[v >> 18 & 63];
+        dst[n++] = alphabet[v >> 12 & 63];
+        dst[n++] = i + 1 < length ? alphabet[v >> 6 & 63] : '=';
+        dst[n++] = i + 2 < length ? alphabet[v & 63] : '=';
+    }
+    dst[n] = 0;
+    return n;
+}
+
+/**
+ * newFrame
+ * @returns a frame with room for capacity bytes of payload or NULL
+ */
+static struct ws_frame *newFrame(int capacity)
+{
+    struct ws_frame *frame = malloc(sizeof(struct ws_frame) + WS_HEADER_SIZE + capacity);
+    if (frame == NULL)
+    {
+        printErrno(__func__, "Couldn't allocate a frame");
+        return NULL;
+    }
+    frame->refs = 1;
+    return frame;
+}
+
+static inline char *payload(struct ws_frame *frame)
+{
+    return frame->data + WS_HEADER_SIZE;
+}
+
+/**
+ * sealFrame writes the header right in front of the payload
+ */
+static void sealFrame(struct ws_frame *frame, int opcode, int length)
+{
+    unsigned char header[WS_HEADER_SIZE];
+    int n = 0;
+    header[n++] = 0x80 | opcode; // Final fragment
+    if (length < 126)
+    {
+        header[n++] = length;
+    }
+    else if (length < 65536)
+    {
+        header[n++] = 126;
+        header[n++] = length >> 8;
+        header[n++] = length;
+    }
+    else
+    {
+        header[n++] = 127;
+        for (int i = 7; i >= 0; i--)
+            header[n++] = (unsigned long long)length >> (8 * i);
+    }
+
+    frame->offset = WS_HEADER_SIZE - n;
+    memcpy(frame->data + frame->offset, header, n);
+    frame->length = n + length;
+}
+
+static void release(struct ws_frame *frame)
+{
+    if (--frame->refs == 0)
+        free(frame);
+}
+
+/**
+ * renderJSON renders the values present in telegram as a JSON object
+ * @returns the length or -1 when it doesn't fit
+ */
+static int renderJSON(char *dst, int size, struct dsmr_telegram *telegram)
+{
+    int n = snprintf(dst, size, "{\"timestamp\":%lld", (long long)telegram->timestamp);
+
+    if (telegram->equipmentIdLength && n < size)
+    {
+        // Only printable characters are decoded, escape the JSON ones
+        n += snprintf(dst + n, size - n, ",\"equipment_id\":\"");
+        for (int i = 0; i < telegram->equipmentIdLength && n < size - 2; i++)
+        {
+            char c = telegram->equipmentId[i];
+            if (c == '"' || c == '\\')
+                dst[n++] = '\\';
+            dst[n++] = c;
+        }
+        if (n < size)
+            dst[n++] = '"';
+    }
+
+    for (int i = 0; i < dsmr_field_count() && n < size; i++)
+    {
+        struct dsmr_value *v = telegram->values + i;
+        if (!v->present)
+            continue;
+
+        char value[LP_FIXED_SIZE];
+        int length = lp_render_fixed(value, v->value, v->decimals);
+        n += snprintf(dst + n, size - n, ",\"%s\":%.*s", dsmr_field_name(i), length, value);
+    }
+
+    if (n + 1 > size)
+        return -1;
+    dst[n++] = '}';
+    return n;
+}
+
+static void putInt64(char *dst, long long value)
+{
+    for (int i = 0; i < 8; i++)
+        dst[i] = (unsigned long long)value >> (8 * i);
+}
+
+/**
+ * renderBinary renders the values present in telegram, see ws.h
+ * @returns the length or -1 when it doesn't fit
+ */
+static int renderBinary(char *dst, int size, struct dsmr_telegram *telegram)
+{
+    putInt64(dst, telegram->timestamp);
+    int n = 8;
+    for (int i = 0; i < dsmr_field_count(); i++)
+    {
+        struct dsmr_value *v = telegram->values + i;
+        if (!v->present)
+            continue;
+        if (n + 10 > size)
+            return -1;
+        dst[n++] = i;
+        dst[n++] = v->decimals;
+        putInt64(dst + n, v->value);
+        n += 8;
+    }
+    return n;
+}
+
+/**
+ * schemaFrame lists the field names by index for binary clients
+ * @returns the frame or NULL
+ */
+static struct ws_frame *schemaFrame(void)
+{
+    struct ws_frame *frame = newFrame(WS_FRAME_SIZE);
+    if (frame == NULL)
+        return NULL;
+
+    char *dst = payload(frame);
+    int n = 0;
+    for (int i = 0; i < dsmr_field_count() && n < WS_FRAME_SIZE; i++)
+        n += snprintf(dst + n, WS_FRAME_SIZE - n, "%c\"%s\"", i ? ',' : '[', dsmr_field_name(i));
+    if (n + 1 > WS_FRAME_SIZE)
+    {
+        free(frame);
+        return NULL;
+    }
+    dst[n++] = ']';
+    sealFrame(frame, WS_OP_TEXT, n);
+    return frame;
+}
+
+/**
+ * dropClient closes the connection and releases its queued frames
+ */
+static void dropClient(struct ws_client *client)
+{
+    epoll_ctl(epfd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    while (client->head != client->tail)
+        release(client->queue[client->head++ % WS_CLIENT_QUEUE]);
+    if (client->open)
+        __atomic_fetch_sub(subscribers + client->format, 1, __ATOMIC_RELAXED);
+
+    clients[client->slot] = clients[--clientCount];
+    clients[client->slot]->slot = client->slot;
+    free(client);
+}
+
+/**
+ * queueFrame adds a reference to frame on the send queue of client
+ * @returns 1 on success, 0 when the queue is full
+ */
+static int queueFrame(struct ws_client *client, struct ws_frame *frame)
+{
+    if (client->tail - client->head == WS_CLIENT_QUEUE)
+        return 0;
+    frame->refs++;
+    client->queue[client->tail++ % WS_CLIENT_QUEUE] = frame;
+    return 1;
+}
+
+/**
+ * flushClient writes queued frames until the socket is full
+ * @returns 1 when the client is still there, 0 when it was dropped
+ */
+static int flushClient(struct ws_client *client)
+{
+    while (client->head != client->tail)
+    {
+        struct ws_frame *frame = client->queue[client->head % WS_CLIENT_QUEUE];
+        ssize_t n = send(client->fd, frame->data + frame->offset + client->sent,
+                         frame->length - client->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+            {
+                dropClient(client);
+                return 0;
+            }
+
+            // Continue when the client read some
+            if (!client->waiting)
+            {
+                struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = client};
+                epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &event);
+                client->waiting = 1;
+            }
+            return 1;
+        }
+
+        client->sent += n;
+        if (client->sent < frame->length)
+            continue;
+        client->sent = 0;
+        client->head++;
+        release(frame);
+    }
+
+    if (client->waiting)
+    {
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        epoll_ctl(epfd, EPOLL_CTL_MOD, client->fd, &event);
+        client->waiting = 0;
+    }
+    return 1;
+}
+
+/**
+ * handshake answers the HTTP upgrade request once it's complete
+ * @returns 1 when the client is still there, 0 when it was dropped
+ */
+static int handshake(struct ws_client *client)
+{
+    char *end = memmem(client->in, client->inLength, "\r\n\r\n", 4);
+    if (end == NULL)
+        return 1;
+    *end = 0;
+
+    // Sec-WebSocket-Key of a GET request
+    char *key = NULL;
+    int keyLength = 0;
+    if (!strncmp(client->in, "GET ", 4))
+    {
+        for (char *line = strstr(client->in, "\r\n"); line != NULL; line = strstr(line, "\r\n"))
+        {
+            line += 2;
+            if (strncasecmp(line, "Sec-WebSocket-Key:", 18))
+                continue;
+            key = line + 18;
+            while (*key == ' ')
+                key++;
+            while (key[keyLength] && key[keyLength] != '\r' && key[keyLength] != ' ')
+                keyLength++;
+            break;
+        }
+    }
+    if (key == NULL || keyLength == 0 || keyLength > 64)
+    {
+        static const char refused[] = "HTTP/1.1 400 Bad Request\r\nConnection: close\r\n\r\n";
+        send(client->fd, refused, sizeof(refused) - 1, MSG_NOSIGNAL | MSG_DONTWAIT);
+        dropClient(client);
+        return 0;
+    }
+
+    char challenge[64 + sizeof(WS_GUID)];
+    int length = snprintf(challenge, sizeof(challenge), "%.*s%s", keyLength, key, WS_GUID);
+    unsigned char digest[20];
+    sha1((unsigned char *)challenge, length, digest);
+    char accept[32];
+    base64(accept, digest, sizeof(digest));
+
+    char response[256];
+    length = snprintf(response, sizeof(response),
+                      "HTTP/1.1 101 Switching Protocols\r\n"
+                      "Upgrade: websocket\r\n"
+                      "Connection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: %s\r\n\r\n",
+                      accept);
+    // A fresh socket always has room for this
+    if (send(client->fd, response, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length)
+    {
+        dropClient(client);
+        return 0;
+    }
+
+    client->format = !strncmp(client->in + 4, "/binary", 7) ? WS_BINARY : WS_JSON;
+    client->open = 1;
+    __atomic_fetch_add(subscribers + client->format, 1, __ATOMIC_RELAXED);
+    printLog(__func__, "Live stream client connected (%s), %d connected",
+             client->format == WS_BINARY ? "binary" : "json", clientCount);
+
+    // Keep what the client sent behind the request
+    int used = end + 4 - client->in;
+    client->inLength -= used;
+    memmove(client->in, client->in + used, client->inLength);
+
+    if (client->format == WS_BINARY)
+    {
+        struct ws_frame *schema = schemaFrame();
+        if (schema != NULL)
+        {
+            queueFrame(client, schema);
+            release(schema);
+            return flushClient(client);
+        }
+    }
+    return 1;
+}
+
+/**
+ * readFrames handles the frames of an open client: close and ping,
+ * anything else a viewer sends is ignored
+ * @returns 1 when the client is still there, 0 when it was dropped
+ */
+static int readFrames(struct ws_client *client)
+{
+    unsigned char *in = (unsigned char *)client->in;
+    while (client->inLength >= 2)
+    {
+        int opcode = in[0] & 0x0f;
+        long long length = in[1] & 0x7f;
+        int header = 2;
+        if (length == 126)
+        {
+            if (client->inLength < 4)
+                break;
+            length = in[2] << 8 | in[3];
+            header = 4;
+        }
+        else if (length == 127)
+        {
+            if (client->inLength < 10)
+                break;
+            length = 0;
+            for (int i = 2; i < 10; i++)
+                length = length << 8 | in[i];
+            header = 10;
+        }
+        int masked = in[1] & 0x80;
+        if (masked)
+            header += 4;
+
+        // Only short control frames are expected
+        if (length < 0 || header + length > WS_REQUEST_SIZE)
+        {
+            dropClient(client);
+            return 0;
+        }
+        if (client->inLength < header + length)
+            break;
+
+        unsigned char *data = in + header;
+        if (masked)
+        {
+            for (int i = 0; i < length; i++)
+                data[i] ^= in[header - 4 + i % 4];
+        }
+
+        if (opcode == WS_OP_CLOSE)
+        {
+            static const char closing[] = {(char)(0x80 | WS_OP_CLOSE), 0};
+            send(client->fd, closing, sizeof(closing), MSG_NOSIGNAL | MSG_DONTWAIT);
+            dropClient(client);
+            return 0;
+        }
+        if (opcode == WS_OP_PING && length <= 125)
+        {
+            struct ws_frame *pong = newFrame(length);
+            if (pong != NULL)
+            {
+                memcpy(payload(pong), data, length);
+                sealFrame(pong, WS_OP_PONG, length);
+                int queued = queueFrame(client, pong);
+                release(pong);
+                if (queued && !flushClient(client))
+                    return 0;
+            }
+        }
+
+        int used = header + length;
+        client->inLength -= used;
+        memmove(in, in + used, client->inLength);
+    }
+    return 1;
+}
+
+/**
+ * readClient reads what the client sent
+ * @returns 1 when the client is still there, 0 when it was dropped
+ */
+static int readClient(struct ws_client *client)
+{
+    for (;;)
+    {
+        int room = WS_REQUEST_SIZE - client->inLength;
+        if (room == 0)
+        {
+            printWarning(__func__, "Request longer than %d bytes, dropping the client", WS_REQUEST_SIZE);
+            dropClient(client);
+            return 0;
+        }
+
+        ssize_t n = recv(client->fd, client->in + client->inLength, room, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+        {
+            dropClient(client);
+            return 0;
+        }
+        client->inLength += n;
+    }
+    return client->open ? readFrames(client) : handshake(client);
+}
+
+static void acceptClients(void)
+{
+    for (;;)
+    {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+                printErrno(__func__, "accept failed");
+            return;
+        }
+        if (clientCount == WS_MAX_CLIENTS)
+        {
+            printWarning(__func__, "Already %d live stream clients, refusing", WS_MAX_CLIENTS);
+            close(fd);
+            continue;
+        }
+
+        struct ws_client *client = calloc(1, sizeof(struct ws_client));
+        if (client == NULL)
+        {
+            printErrno(__func__, "Couldn't allocate client");
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+
+        // Autotuning would let a stalled viewer buffer megabytes in the
+        // kernel before its queue fills up and it's evicted
+        int sendBuffer = WS_SEND_BUFFER;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sendBuffer, sizeof(sendBuffer));
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) == -1)
+        {
+            printErrno(__func__, "epoll_ctl failed");
+            close(fd);
+            free(client);
+            continue;
+        }
+        client->slot = clientCount;
+        clients[clientCount++] = client;
+    }
+}
+
+/**
+ * fanOut queues the frames ws_publish() handed over on every client of
+ * their format, a client whose queue is full is evicted
+ */
+static void fanOut(void)
+{
+    for (int format = 0; format < WS_FORMATS; format++)
+    {
+        struct ws_frame *frame = __atomic_exchange_n(pending + format, NULL, __ATOMIC_ACQ_REL);
+        if (frame == NULL)
+            continue;
+
+        for (int i = 0; i < clientCount;)
+        {
+            struct ws_client *client = clients[i];
+            if (!client->open || client->format != (enum ws_format)format)
+            {
+                i++;
+                continue;
+            }
+            if (!queueFrame(client, frame))
+            {
+                printWarning(__func__, "Evicting a live stream client %d telegrams behind", WS_CLIENT_QUEUE);
+                dropClient(client);
+                continue; // Slot i holds another client now
+            }
+            if (flushClient(client))
+                i++;
+        }
+        release(frame);
+    }
+}
+
+static void *streamMain(void *arg)
+{
+    (void)arg;
+    struct epoll_event events[WS_EVENTS];
+    for (;;)
+    {
+        int n = epoll_wait(epfd, events, WS_EVENTS, -1);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printErrno(__func__, "epoll_wait failed, live stream stopped");
+            return NULL;
+        }
+
+        // Evictions free clients, so fan out after the events of this round
+        int published = 0;
+        for (int i = 0; i < n; i++)
+        {
+            void *ptr = events[i].data.ptr;
+            if (ptr == &listenfd)
+            {
+                acceptClients();
+            }
+            else if (ptr == &wakefd)
+            {
+                uint64_t count;
+                if (read(wakefd, &count, sizeof(count)) == sizeof(count))
+                    published = 1;
+            }
+            else
+            {
+                struct ws_client *client = ptr;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    dropClient(client);
+                    continue;
+                }
+                if ((events[i].events & EPOLLIN) && !readClient(client))
+                    continue;
+                if (events[i].events & EPOLLOUT)
+                    flushClient(client);
+            }
+        }
+        if (published)
+            fanOut();
+    }
+}
+
+/**
+ * ws_start listens on "[host:]port" and starts the stream thread
+ * @returns 1 on success, 0 on error (the stream is then disabled)
+ */
+int ws_start(const char *address)
+{
+    listenfd = server_listen(address);
+    if (listenfd == -1)
+        return 0;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    int wake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event listenEvent = {.events = EPOLLIN, .data.ptr = &listenfd};
+    struct epoll_event wakeEvent = {.events = EPOLLIN, .data.ptr = &wakefd};
+    if (epfd == -1 || wake == -1 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &listenEvent) == -1 ||
+        epoll_ctl(epfd, EPOLL_CTL_ADD, wake, &wakeEvent) == -1)
+    {
+        printErrno(__func__, "Couldn't set up the live stream");
+        goto fail;
+    }
+
+    wakefd = wake;
+    if (pthread_create(&thread, NULL, streamMain, NULL) != 0)
+    {
+        printError(__func__, "Couldn't start the live stream thread");
+        wakefd = -1;
+        goto fail;
+    }
+
+    printLog(__func__, "Live stream listening on %s, / for JSON and /binary", address);
+    return 1;
+
+fail:
+    if (wake != -1)
+        close(wake);
+    if (epfd != -1)
+        close(epfd);
+    close(listenfd);
+    listenfd = -1;
+    return 0;
+}
+
+/**
+ * ws_publish serializes telegram for the formats that have clients and
+ * wakes the stream thread, it never blocks
+ */
+void ws_publish(struct dsmr_telegram *telegram)
+{
+    if (wakefd == -1)
+        return;
+
+    int published = 0;
+    for (int format = 0; format < WS_FORMATS; format++)
+    {
+        if (!__atomic_load_n(subscribers + format, __ATOMIC_RELAXED))
+            continue;
+
+        struct ws_frame *frame = newFrame(WS_FRAME_SIZE);
+        if (frame == NULL)
+            continue;
+        int length = format == WS_JSON ? renderJSON(payload(frame), WS_FRAME_SIZE, telegram)
+                                       : renderBinary(payload(frame), WS_FRAME_SIZE, telegram);
+        if (length == -1)
+        {
+            printError(__func__, "Telegram doesn't fit in %d bytes", WS_FRAME_SIZE);
+            free(frame);
+            continue;
+        }
+        sealFrame(frame, format == WS_JSON ? WS_OP_TEXT : WS_OP_BINARY, length);
+
+        // Not picked up yet means the thread is behind, the new one replaces it
+        struct ws_frame *old = __atomic_exchange_n(pending + format, frame, __ATOMIC_ACQ_REL);
+        free(old);
+        published = 1;
+    }
+
+    if (published)
+    {
+        uint64_t one = 1;
+        if (write(wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            printErrno(__func__, "Couldn't wake the live stream thread");
+    }
+}
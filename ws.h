@@ -0,0 +1,30 @@
+#ifndef WS_H
+#define WS_H
+
+#include "DSMR.h"
+
+#define WS_MAX_CLIENTS 256
+#define WS_CLIENT_QUEUE 8    // Telegrams a client may fall behind before it's evicted
+#define WS_REQUEST_SIZE 2048 // Handshake request, afterwards incoming frames
+#define WS_FRAME_SIZE 4096   // Payload of one telegram
+#define WS_SEND_BUFFER 32768 // Kernel send buffer per client
+
+/**
+ * Live stream of decoded telegrams over WebSocket, for wall displays
+ *
+ * DSMR_WS_LISTEN="[host:]port" starts it on its own thread.
+ * ws://host:port/ sends every telegram as one JSON text frame:
+ *  {"timestamp":1700000000,"equipment_id":"1SAG...","actual_electricity_power_delivered":0.117,...}
+ * ws://host:port/binary first sends a text frame with the JSON array of
+ * field names, then every telegram as a binary frame, little endian:
+ *  int64 timestamp, per value: uint8 field, uint8 decimals, int64 value
+ * Values are value / 10^decimals, timestamps are Unix time.
+ *
+ * A telegram is serialized once per format that has clients, into a
+ * refcounted frame that every client's send queue shares. A client
+ * WS_CLIENT_QUEUE telegrams behind is disconnected.
+ */
+int ws_start(const char *address);
+void ws_publish(struct dsmr_telegram *telegram);
+
+#endif